@@ -3,6 +3,7 @@
 
 #include "types.h"
 #include "expression.h"
+#include "expression_image.h"
 
 enum TranslatorStatusType {
 	BTRST_OK = 0,
@@ -19,6 +20,16 @@ typedef struct TranslatorStatus {
 
 #define TRANSLATOR_STATUS(status_) ((status_).status)
 
+/**
+ * Translates the tree of expr, laid out as an image first.
+ */
 TranslatorStatus backend_translator(struct expression *expr, FILE *asm_output);
 
+/**
+ * Walks the image where it lies, a mapped file is translated without
+ * loading it.
+ */
+TranslatorStatus backend_translate_image(const struct expression_image *image,
+					 FILE *asm_output);
+
 #endif /* BACKEND_H */
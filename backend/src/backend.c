@@ -1,7 +1,9 @@
 #include <string.h>
 
 #include "pvector.h"
+#include "typed_vector.h"
 #include "expression.h"
+#include "expression_image.h"
 #include "backend.h"
 
 
@@ -9,11 +11,13 @@
 
 struct variable {
 	const char *var_name;
+	uint32_t name_id;
 	size_t var_pointer;
 };
 
 struct function {
 	const char *func_name;
+	uint32_t name_id;
 	size_t func_pointer;
 	size_t n_args;
 };
@@ -22,7 +26,8 @@ struct function {
 	((struct TranslatorStatus) {.status = status_})
 
 struct translation_context {
-	struct expression *expr;
+	// Variable and function names point into the image
+	const struct expression_image *image;
 	FILE *asm_output;
 
 	// of struct variable
@@ -32,24 +37,22 @@ struct translation_context {
 	// Internal jump tracking index
 	// Helps to escape name overlaps
 	size_t jmp_idx;
+
+	// of struct translator_task
+	struct tree_stack tasks;
+	int tasks_overflow;
 };
 
-static TranslatorStatus translate_statement(struct tree_node *tnode,
-				     struct translation_context *ctx);
+
 
 static struct variable *find_variable(struct translation_context *ctx,
-				      const char *varname) {
+				      uint32_t name_id) {
 	assert (ctx);
-	assert (varname);
 
 	for (size_t i = 0; i < ctx->variables.len; i++) {
-      		struct variable *var = NULL;
-		if (pvector_get(&ctx->variables, i, (void **)&var)) {
-			log_error("pvector_get error (normally unreachable)");
-			return NULL;
-		}
+		struct variable *var = PVECTOR_AT(&ctx->variables, struct variable, i);
 
-		if (!strcmp(varname, var->var_name)) {
+		if (var->name_id == name_id) {
 			return var;
 		}
 	}
@@ -57,20 +60,25 @@ static struct variable *find_variable(struct translation_context *ctx,
 	return NULL;
 }
 
-static TranslatorStatus push_variable(struct translation_context *ctx, const char *varname,
-			       struct variable **nvar) {
+static TranslatorStatus push_variable(struct translation_context *ctx,
+				      const struct expression_image_node *name,
+				      struct variable **nvar) {
 	assert (ctx);
-	assert (varname);
+	assert (name);
+	assert (EXPR_INODE_IS_VARIABLE(name));
+
+	const char *var_name = expr_image_name(ctx->image, name->arg);
 
-	if (find_variable(ctx, varname)) {
-		log_error("Already declared variable: %s", varname);
+	if (find_variable(ctx, name->arg)) {
+		log_error("Already declared variable: %s", var_name);
 		return TRANSLATOR_STATUS_GEN(BTRST_ALREADY_DECLARED_VAR);
 	}
 
 	size_t var_idx = ctx->variables.len;
 
 	struct variable var = {
-		.var_name = varname,
+		.var_name = var_name,
+		.name_id = name->arg,
 		.var_pointer = var_idx,
 	};
 
@@ -79,33 +87,21 @@ static TranslatorStatus push_variable(struct translation_context *ctx, const cha
 		return TRANSLATOR_STATUS_GEN(BTRST_ALLOCATION);
 	}
 
-	struct variable *rvar = NULL;
-	if (pvector_get(&ctx->variables, var_idx, (void **)&rvar)
-		|| rvar->var_pointer != var.var_pointer) {
-		log_error("pvector_get error (normally unreachable)");
-		return TRANSLATOR_STATUS_GEN(BTRST_INTERNAL_FAILURE);
-	}
-
 	if (nvar) {
-		*nvar = rvar;
+		*nvar = PVECTOR_AT(&ctx->variables, struct variable, var_idx);
 	}
 
 	return TRANSLATOR_STATUS_GEN(BTRST_OK);
 }
 
 static struct function *find_function(struct translation_context *ctx,
-				      const char *funcname) {
+				      uint32_t name_id) {
 	assert (ctx);
-	assert (funcname);
 
 	for (size_t i = 0; i < ctx->functions.len; i++) {
-      		struct function *func = NULL;	
-		if (pvector_get(&ctx->functions, i, (void **)&func)) {
-			log_error("pvector_get error (normally unreachable)");
-			return NULL;
-		}
+		struct function *func = PVECTOR_AT(&ctx->functions, struct function, i);
 
-		if (!strcmp(funcname, func->func_name)) {
+		if (func->name_id == name_id) {
 			return func;
 		}
 	}
@@ -114,20 +110,24 @@ static struct function *find_function(struct translation_context *ctx,
 }
 
 static TranslatorStatus push_function(struct translation_context *ctx,
-				      const char *funcname, size_t n_args,
-				      struct function **nvar) {
+				      const struct expression_image_node *name,
+				      size_t n_args, struct function **nvar) {
 	assert (ctx);
-	assert (funcname);
+	assert (name);
+	assert (EXPR_INODE_IS_VARIABLE(name));
+
+	const char *func_name = expr_image_name(ctx->image, name->arg);
 
-	if (find_function(ctx, funcname)) {
-		log_error("Already declared function: %s", funcname);
+	if (find_function(ctx, name->arg)) {
+		log_error("Already declared function: %s", func_name);
 		return TRANSLATOR_STATUS_GEN(BTRST_ALREADY_DECLARED_VAR);
 	}
 
 	size_t func_idx = ctx->functions.len;
 
 	struct function var = {
-		.func_name = funcname,
+		.func_name = func_name,
+		.name_id = name->arg,
 		.func_pointer = func_idx,
 		.n_args = n_args,
 	};
@@ -137,47 +137,98 @@ static TranslatorStatus push_function(struct translation_context *ctx,
 		return TRANSLATOR_STATUS_GEN(BTRST_ALLOCATION);
 	}
 
-	struct function *rvar = NULL;
-	if (pvector_get(&ctx->functions, func_idx, (void **)&rvar)
-		|| rvar->func_pointer != var.func_pointer) {
-		log_error("pvector_get error (normally unreachable)");
-		return TRANSLATOR_STATUS_GEN(BTRST_INTERNAL_FAILURE);
-	}
-
 	if (nvar) {
-		*nvar = rvar;
+		*nvar = PVECTOR_AT(&ctx->functions, struct function, func_idx);
 	}
 
 	return TRANSLATOR_STATUS_GEN(BTRST_OK);
 }
 
-static TranslatorStatus tpush_expression(struct tree_node *tnode,
-					   struct translation_context *ctx);
+/*
+ * Code is generated over an explicit stack of tasks instead of recursion:
+ * expressions, blocks and statement lists are as deep as the program is.
+ * A node schedules the code of its children and the code that follows
+ * them, the tasks run in the reverse order of scheduling.
+ */
+
+enum translator_task_type {
+	TRTASK_STATEMENT,
+	TRTASK_EXPRESSION,
+	// The operands are already pushed
+	TRTASK_OPERATOR,
+	TRTASK_CALL_ARGUMENTS,
+	TRTASK_CALL,
+	TRTASK_FUNCTION_ARGUMENTS,
+	TRTASK_FUNCTION_BODY,
+	// The condition is already pushed
+	TRTASK_CONDITIONAL,
+	TRTASK_BRANCH,
+	TRTASK_JUMP,
+	TRTASK_LABEL,
+	TRTASK_STORE,
+	TRTASK_DROP,
+	TRTASK_RET,
+};
+
+struct translator_task {
+	enum translator_task_type type;
+	const struct expression_image_node *node;
+	// Jump index, variable pointer or the task counting the arguments
+	size_t idx;
+	size_t n_args;
+};
+
+static void translator_schedule(struct translation_context *ctx,
+				enum translator_task_type type,
+				const struct expression_image_node *node, size_t idx) {
+	assert (ctx);
+
+	struct translator_task *task = tree_stack_push(&ctx->tasks);
+	if (!task) {
+		ctx->tasks_overflow = 1;
+		return;
+	}
+
+	*task = (struct translator_task) {
+		.type = type,
+		.node = node,
+		.idx = idx,
+	};
+}
+
+static struct translator_task *translator_task_at(struct translation_context *ctx,
+						  size_t idx) {
+	assert (ctx);
+	assert (idx < ctx->tasks.len);
+
+	return (struct translator_task *)(void *)(ctx->tasks.frames +
+						   idx * ctx->tasks.frame_size);
+}
 
-static TranslatorStatus tpush_number(struct tree_node *tnode,
+static TranslatorStatus tpush_number(const struct expression_image_node *tnode,
 					struct translation_context *ctx) {
 
 	assert (tnode);
 	assert (ctx);
-	assert (EXPR_TNODE_IS_NUMBER(tnode));
+	assert (EXPR_INODE_IS_NUMBER(tnode));
 
 	fprintf(ctx->asm_output,
 		"ldc r0 $%ld\n"
 		"push r0\n",
-		tnode->value.snum);
+		tnode->snum);
 	return TRANSLATOR_STATUS_GEN(BTRST_OK);
 }
 
-static TranslatorStatus tpush_variable(struct tree_node *tnode,
+static TranslatorStatus tpush_variable(const struct expression_image_node *tnode,
 					struct translation_context *ctx) {
 
 	assert (tnode);
 	assert (ctx);
-	assert (EXPR_TNODE_IS_VARIABLE(tnode));
+	assert (EXPR_INODE_IS_VARIABLE(tnode));
 
-	struct variable *var = find_variable(ctx, tnode->value.varname);
+	struct variable *var = find_variable(ctx, tnode->arg);
 	if (!var) {
-		log_error("Undeclared variable: %s", tnode->value.varname);
+		log_error("Undeclared variable: %s", expr_image_name(ctx->image, tnode->arg));
 		return TRANSLATOR_STATUS_GEN(BTRST_UNDECLARED_VARIABLE);
 	}
 	
@@ -193,13 +244,13 @@ static TranslatorStatus tpush_variable(struct tree_node *tnode,
 // tpush_cmp.
 // left and right nodes are loaded in r0 and r1.
 // Pushes the 1 or 0 on stack.
-static TranslatorStatus tpush_cmp_r01(struct tree_node *tnode,
+static TranslatorStatus tpush_cmp_r01(const struct expression_image_node *tnode,
 				      struct translation_context *ctx) {
 	assert (tnode);
 	assert (ctx);
-	assert (EXPR_TNODE_IS_OPERATOR(tnode));
+	assert (EXPR_INODE_IS_OPERATOR(tnode));
 
-	struct expression_operator *op = tnode->value.ptr;
+	const struct expression_operator *op = expr_image_op(tnode);
 
 	fprintf(ctx->asm_output, "cmp r0 r1\n");
 	size_t jmp_idx = ctx->jmp_idx++;
@@ -236,64 +287,57 @@ static TranslatorStatus tpush_cmp_r01(struct tree_node *tnode,
 	return TRANSLATOR_STATUS_GEN(BTRST_OK);
 }
 
-static TranslatorStatus translate_function_call_arguments(struct tree_node *tnode,
-				     struct translation_context *ctx, size_t *n_args) {
+/*
+ * Schedules the arguments of a call, counted by the call task at call_idx.
+ */
+static TranslatorStatus translate_function_call_arguments(
+				     const struct expression_image_node *tnode,
+				     struct translation_context *ctx, size_t call_idx) {
 	assert (ctx);
 
-	TranslatorStatus ret = TRANSLATOR_STATUS_GEN(BTRST_OK);
 	if (!tnode) {
-		return ret;
+		return TRANSLATOR_STATUS_GEN(BTRST_OK);
 	}
 
-	struct expression_operator *op = tnode->value.ptr;
-	
-	if (EXPR_TNODE_IS_OPERATOR(tnode) && op->idx == EXPR_IDX_COMMA) {
-		// Reverse order to push normally
+	int is_comma = EXPR_INODE_IS_OPERATOR(tnode) && expr_image_op(tnode)->idx == EXPR_IDX_COMMA;
 
-		ret = translate_function_call_arguments(tnode->right, ctx, n_args);
-		if (TRANSLATOR_STATUS(ret)) {
-			return ret;
-		}
-
-		ret = translate_function_call_arguments(tnode->left, ctx, n_args);
-		if (TRANSLATOR_STATUS(ret)) {
-			return ret;
+	// Reverse order to push normally
+	if (is_comma && EXPR_INODE_IS_SEQUENCE(tnode)) {
+		for (size_t i = 0; i < expr_image_n_children(tnode); i++) {
+			translator_schedule(ctx, TRTASK_CALL_ARGUMENTS,
+					    expr_image_child(ctx->image, tnode, i), call_idx);
 		}
+	} else if (is_comma) {
+		translator_schedule(ctx, TRTASK_CALL_ARGUMENTS,
+				    expr_image_left(ctx->image, tnode), call_idx);
+		translator_schedule(ctx, TRTASK_CALL_ARGUMENTS,
+				    expr_image_right(ctx->image, tnode), call_idx);
 	} else {
-		(*n_args)++;
-
-		tpush_expression(tnode, ctx);
+		translator_task_at(ctx, call_idx)->n_args++;
 
-		return TRANSLATOR_STATUS_GEN(BTRST_OK);
+		translator_schedule(ctx, TRTASK_EXPRESSION, tnode, 0);
 	}
 
 	return TRANSLATOR_STATUS_GEN(BTRST_OK);
 }
 
-static TranslatorStatus tpush_func_call(struct tree_node *tnode,
-					struct translation_context *ctx) {
+static TranslatorStatus tpush_func_call(const struct expression_image_node *tnode,
+					struct translation_context *ctx, size_t n_args) {
 	assert (ctx);
 	assert (tnode);
-	assert (EXPR_TNODE_IS_OPERATOR(tnode));
+	assert (EXPR_INODE_IS_OPERATOR(tnode));
 
-	struct expression_operator *op = tnode->value.ptr;
+	const struct expression_operator *op = expr_image_op(tnode);
 	assert (op->idx == EXPR_IDX_CALL);
 
-	if (!tnode->left || !EXPR_TNODE_IS_VARIABLE(tnode->left)) {
-		return TRANSLATOR_STATUS_GEN(BTRST_TREE_INVALID);
-	}
-	struct tree_node *func_name = tnode->left;
-	struct tree_node *func_args = tnode->right;
-	size_t n_args = 0;
-	TranslatorStatus ret = translate_function_call_arguments(func_args, ctx, &n_args);
+	const struct expression_image_node *func_name = expr_image_left(ctx->image, tnode);
+	assert (func_name && EXPR_INODE_IS_VARIABLE(func_name));
 
-	if (TRANSLATOR_STATUS(ret)) {
-		return ret;
-	}
+	TranslatorStatus ret = TRANSLATOR_STATUS_GEN(BTRST_OK);
 
-	struct function *func = find_function(ctx, func_name->value.varname); 
+	struct function *func = find_function(ctx, func_name->arg); 
 	if (!func) {
-		ret = push_function(ctx, func_name->value.varname,
+		ret = push_function(ctx, func_name,
 					n_args, &func);
 		if (TRANSLATOR_STATUS(ret)) {
 			return ret;
@@ -309,50 +353,24 @@ static TranslatorStatus tpush_func_call(struct tree_node *tnode,
 	return TRANSLATOR_STATUS_GEN(BTRST_OK);
 }
 
-static TranslatorStatus tpush_operator(struct tree_node *tnode,
+/*
+ * Emits the operator once its operands are pushed.
+ */
+static TranslatorStatus tpush_operator(const struct expression_image_node *tnode,
 					struct translation_context *ctx) {
 
 	assert (tnode);
 	assert (ctx);
-	assert (EXPR_TNODE_IS_OPERATOR(tnode));
+	assert (EXPR_INODE_IS_OPERATOR(tnode));
 
-	struct expression_operator *op = tnode->value.ptr;
-
-	if (op->type != EXPR_OP_T_UNARY
-		&& op->type != EXPR_OP_T_BINARY) {
-	}
-
-	TranslatorStatus ret = TRANSLATOR_STATUS_GEN(BTRST_OK);
+	const struct expression_operator *op = expr_image_op(tnode);
 
 	if (op->type == EXPR_OP_T_UNARY) {
-		ret = tpush_expression(tnode->left, ctx);
-
-		if (TRANSLATOR_STATUS(ret)) {
-			return ret;
-		}
-
 		fprintf(ctx->asm_output, "pop r0\n");
 	} else if (op->type == EXPR_OP_T_BINARY) {
-		ret = tpush_expression(tnode->left, ctx);
-
-		if (TRANSLATOR_STATUS(ret)) {
-			return ret;
-		}
-
-		ret = tpush_expression(tnode->right, ctx);
-		if (TRANSLATOR_STATUS(ret)) {
-			return ret;
-		}
 		// Inversion because of stack
 		fprintf(ctx->asm_output, "pop r1\n"
 	  				 "pop r0\n");
-	} else if (op->type == EXPR_OP_T_NOARG) {
-		// Nothing here :) !!
-	} else if (op->idx == EXPR_IDX_CALL) {
-		return tpush_func_call(tnode, ctx);
-	} else {
-		log_error("Attempt to evaluate non-evaluateable");
-		return TRANSLATOR_STATUS_GEN(BTRST_TREE_INVALID);
 	}
 
 	switch ((int)op->idx) {
@@ -423,78 +441,105 @@ static TranslatorStatus tpush_operator(struct tree_node *tnode,
 	return TRANSLATOR_STATUS_GEN(BTRST_OK);
 }
 
-static TranslatorStatus tpush_expression(struct tree_node *tnode,
+static TranslatorStatus tpush_expression(const struct expression_image_node *tnode,
 					   struct translation_context *ctx) {
 	assert (ctx);
 
-	if (!tnode) {
+	if (!tnode || EXPR_INODE_IS_INVALID(tnode)) {
 		log_error("Tree is corrupted!");
 		return TRANSLATOR_STATUS_GEN(BTRST_TREE_INVALID);
 	}
 
-	if (EXPR_TNODE_IS_NUMBER(tnode)) {
+	if (EXPR_INODE_IS_NUMBER(tnode)) {
 		return tpush_number(tnode, ctx);
 	}
 
-	if (EXPR_TNODE_IS_VARIABLE(tnode)) {
+	if (EXPR_INODE_IS_VARIABLE(tnode)) {
 		return tpush_variable(tnode, ctx);
 	}
 
-	if (EXPR_TNODE_IS_OPERATOR(tnode)) {
+	if (!EXPR_INODE_IS_OPERATOR(tnode)) {
+		log_error("Not implemented :(");
+		return TRANSLATOR_STATUS_GEN(BTRST_INTERNAL_FAILURE);
+	}
+
+	const struct expression_operator *op = expr_image_op(tnode);
+
+	if (op->type == EXPR_OP_T_UNARY) {
+		translator_schedule(ctx, TRTASK_OPERATOR, tnode, 0);
+		translator_schedule(ctx, TRTASK_EXPRESSION,
+				    expr_image_left(ctx->image, tnode), 0);
+	} else if (op->type == EXPR_OP_T_BINARY) {
+		translator_schedule(ctx, TRTASK_OPERATOR, tnode, 0);
+		translator_schedule(ctx, TRTASK_EXPRESSION,
+				    expr_image_right(ctx->image, tnode), 0);
+		translator_schedule(ctx, TRTASK_EXPRESSION,
+				    expr_image_left(ctx->image, tnode), 0);
+	} else if (op->type == EXPR_OP_T_NOARG) {
 		return tpush_operator(tnode, ctx);
-	}	
+	} else if (op->idx == EXPR_IDX_CALL) {
+		const struct expression_image_node *func_name = expr_image_left(ctx->image, tnode);
+		if (!func_name || !EXPR_INODE_IS_VARIABLE(func_name)) {
+			return TRANSLATOR_STATUS_GEN(BTRST_TREE_INVALID);
+		}
+
+		translator_schedule(ctx, TRTASK_CALL, tnode, 0);
+		if (ctx->tasks_overflow) {
+			return TRANSLATOR_STATUS_GEN(BTRST_ALLOCATION);
+		}
 
-	log_error("Not implemented :(");
-	return TRANSLATOR_STATUS_GEN(BTRST_INTERNAL_FAILURE);
+		return translate_function_call_arguments(expr_image_right(ctx->image, tnode),
+							 ctx, ctx->tasks.len - 1);
+	} else {
+		log_error("Attempt to evaluate non-evaluateable");
+		return TRANSLATOR_STATUS_GEN(BTRST_TREE_INVALID);
+	}
+
+	return TRANSLATOR_STATUS_GEN(BTRST_OK);
 }
 
-static TranslatorStatus translate_assignment(struct tree_node *tnode,
+static TranslatorStatus translate_assignment(const struct expression_image_node *tnode,
 				     struct translation_context *ctx) {
 	assert (ctx);
 	assert (tnode);
-	assert (EXPR_TNODE_IS_OPERATOR(tnode));
+	assert (EXPR_INODE_IS_OPERATOR(tnode));
 
-	struct expression_operator *op = tnode->value.ptr;
+	const struct expression_operator *op = expr_image_op(tnode);
 	assert (op->idx == EXPR_IDX_ASSIGN || op->idx == EXPR_IDX_DECL_ASSIGN);
 
-	if (!tnode->left || !EXPR_TNODE_IS_VARIABLE(tnode->left)) {
+	const struct expression_image_node *var_node = expr_image_left(ctx->image, tnode);
+	if (!var_node || !EXPR_INODE_IS_VARIABLE(var_node)) {
 		log_error("Tree is corrupted!");
 		return TRANSLATOR_STATUS_GEN(BTRST_TREE_INVALID);
 	}
 
-	struct variable *var = find_variable(ctx, tnode->left->value.varname);
+	struct variable *var = find_variable(ctx, var_node->arg);
 	if (!var) {
-		log_error("Undeclared variable: %s", tnode->left->value.varname);
+		log_error("Undeclared variable: %s", expr_image_name(ctx->image, var_node->arg));
 		return TRANSLATOR_STATUS_GEN(BTRST_UNDECLARED_VARIABLE);
 	};
 
-	TranslatorStatus ret = tpush_expression(tnode->right, ctx);
-	if (TRANSLATOR_STATUS(ret)) {
-		return ret;
-	}
-
-	fprintf(ctx->asm_output,"pop r0\n"
-	 			"ldc r1 $%zu\n"
-	 			"stm r1 r0\n",
-	 			var->var_pointer);
+	translator_schedule(ctx, TRTASK_STORE, NULL, var->var_pointer);
+	translator_schedule(ctx, TRTASK_EXPRESSION, expr_image_right(ctx->image, tnode), 0);
 
 	return TRANSLATOR_STATUS_GEN(BTRST_OK);
 }
 
-static TranslatorStatus translate_declaration(struct tree_node *tnode,
+static TranslatorStatus translate_declaration(const struct expression_image_node *tnode,
 				     struct translation_context *ctx) {
 	assert (ctx);
 	assert (tnode);
-	assert (EXPR_TNODE_IS_OPERATOR(tnode));
+	assert (EXPR_INODE_IS_OPERATOR(tnode));
 
-	struct expression_operator *op = tnode->value.ptr;
+	const struct expression_operator *op = expr_image_op(tnode);
 	assert (op->idx == EXPR_IDX_DECL_ASSIGN);
 
-	if (!tnode->left || !EXPR_TNODE_IS_VARIABLE(tnode->left)) {
+	const struct expression_image_node *var_node = expr_image_left(ctx->image, tnode);
+	if (!var_node || !EXPR_INODE_IS_VARIABLE(var_node)) {
 		return TRANSLATOR_STATUS_GEN(BTRST_TREE_INVALID);
 	}
 
-	TranslatorStatus ret = push_variable(ctx, tnode->left->value.varname, NULL); 
+	TranslatorStatus ret = push_variable(ctx, var_node, NULL); 
 	if (TRANSLATOR_STATUS(ret)) {
 		return ret;
 	};
@@ -502,95 +547,91 @@ static TranslatorStatus translate_declaration(struct tree_node *tnode,
 	return translate_assignment(tnode, ctx);
 }
 
-static TranslatorStatus translate_conditional(struct tree_node *tnode,
+// Pops the condition and jumps to the label if it is zero
+static void translate_branch(struct translation_context *ctx, size_t jmp_idx) {
+	assert (ctx);
+
+	fprintf(ctx->asm_output, "pop r0\n" "ldc r1 $0\n" "cmp r0 r1\n");
+	fprintf(ctx->asm_output, "jmp.eq ._jmp_tps__%zu\n", jmp_idx);
+}
+
+/*
+ * Schedules the branches once the condition is pushed.
+ */
+static TranslatorStatus translate_conditional(const struct expression_image_node *tnode,
 				     struct translation_context *ctx) {
 	assert (ctx);
 	assert (tnode);
-	assert (EXPR_TNODE_IS_OPERATOR(tnode));
+	assert (EXPR_INODE_IS_OPERATOR(tnode));
 
-	struct expression_operator *op = tnode->value.ptr;
+	const struct expression_operator *op = expr_image_op(tnode);
 	assert (op->idx == EXPR_IDX_IF);
 
-	if (!tnode->left) {
-		return TRANSLATOR_STATUS_GEN(BTRST_TREE_INVALID);
-	}
-
-	TranslatorStatus ret = tpush_expression(tnode->left, ctx); 
-	if (TRANSLATOR_STATUS(ret)) {
-		return ret;
-	};
-
-	struct tree_node *if_positive_node = NULL;
-	struct tree_node *if_negative_node = NULL;
+	const struct expression_image_node *if_positive_node = NULL;
+	const struct expression_image_node *if_negative_node = NULL;
 
-	if (tnode->right && EXPR_TNODE_IS_OPERATOR(tnode->right) && 
-		((struct expression_operator *)tnode->right->value.ptr)->idx == EXPR_IDX_ELSE) {
+	const struct expression_image_node *branches = expr_image_right(ctx->image, tnode);
+	if (branches && EXPR_INODE_IS_OPERATOR(branches) && 
+		expr_image_op(branches)->idx == EXPR_IDX_ELSE) {
 
-		if_positive_node = tnode->right->left;
-		if_negative_node = tnode->right->right;
+		if_positive_node = expr_image_left(ctx->image, branches);
+		if_negative_node = expr_image_right(ctx->image, branches);
 	} else {
-		if_positive_node = tnode->right;
+		if_positive_node = branches;
 	}
 
-	fprintf(ctx->asm_output, "pop r0\n" "ldc r1 $0\n" "cmp r0 r1\n");
 	size_t out_jmp_idx = ctx->jmp_idx++;
 	size_t else_jmp_idx = if_negative_node ? ctx->jmp_idx++ : out_jmp_idx;
 
-	fprintf(ctx->asm_output, "jmp.eq ._jmp_tps__%zu\n", else_jmp_idx);
+	translate_branch(ctx, else_jmp_idx);
 
-	translate_statement(if_positive_node, ctx);
-	
+	translator_schedule(ctx, TRTASK_LABEL, NULL, out_jmp_idx);
 	if (if_negative_node) {
-		fprintf(ctx->asm_output, "jmp ._jmp_tps__%zu\n", out_jmp_idx);
-		fprintf(ctx->asm_output, "._jmp_tps__%zu:\n", else_jmp_idx);
-		translate_statement(if_negative_node, ctx);
+		translator_schedule(ctx, TRTASK_STATEMENT, if_negative_node, 0);
+		translator_schedule(ctx, TRTASK_LABEL, NULL, else_jmp_idx);
+		translator_schedule(ctx, TRTASK_JUMP, NULL, out_jmp_idx);
 	}
-
-	fprintf(ctx->asm_output, "._jmp_tps__%zu:\n", out_jmp_idx);
+	translator_schedule(ctx, TRTASK_STATEMENT, if_positive_node, 0);
 
 	return TRANSLATOR_STATUS_GEN(BTRST_OK);
 }
 
-static TranslatorStatus translate_cycle(struct tree_node *tnode,
+static TranslatorStatus translate_cycle(const struct expression_image_node *tnode,
 				     struct translation_context *ctx) {
 	assert (ctx);
 	assert (tnode);
-	assert (EXPR_TNODE_IS_OPERATOR(tnode));
+	assert (EXPR_INODE_IS_OPERATOR(tnode));
 
-	struct expression_operator *op = tnode->value.ptr;
+	const struct expression_operator *op = expr_image_op(tnode);
 	assert (op->idx == EXPR_IDX_WHILE);
 
-	if (!tnode->left) {
+	if (!expr_image_left(ctx->image, tnode)) {
 		return TRANSLATOR_STATUS_GEN(BTRST_TREE_INVALID);
 	}
 
-	struct tree_node *if_positive_node = tnode->right;
+	const struct expression_image_node *if_positive_node = expr_image_right(ctx->image, tnode);
 	size_t begin_jmp_idx = ctx->jmp_idx++;
 	size_t out_jmp_idx = ctx->jmp_idx++;
 
 
 	fprintf(ctx->asm_output, "._jmp_tps__%zu:\n", begin_jmp_idx);
 
-	TranslatorStatus ret = tpush_expression(tnode->left, ctx); 
-	if (TRANSLATOR_STATUS(ret)) {
-		return ret;
-	};
-
-
-	fprintf(ctx->asm_output, "pop r0\n" "ldc r1 $0\n" "cmp r0 r1\n");
-
-	fprintf(ctx->asm_output, "jmp.eq ._jmp_tps__%zu\n", out_jmp_idx);
-
-	translate_statement(if_positive_node, ctx);
-	
-	fprintf(ctx->asm_output, "jmp ._jmp_tps__%zu\n", begin_jmp_idx);
-	fprintf(ctx->asm_output, "._jmp_tps__%zu:\n", out_jmp_idx);
+	translator_schedule(ctx, TRTASK_LABEL, NULL, out_jmp_idx);
+	translator_schedule(ctx, TRTASK_JUMP, NULL, begin_jmp_idx);
+	translator_schedule(ctx, TRTASK_STATEMENT, if_positive_node, 0);
+	translator_schedule(ctx, TRTASK_BRANCH, NULL, out_jmp_idx);
+	translator_schedule(ctx, TRTASK_EXPRESSION, expr_image_left(ctx->image, tnode), 0);
 
 	return TRANSLATOR_STATUS_GEN(BTRST_OK);
 }
 
-static TranslatorStatus translate_function_arguments(struct tree_node *tnode,
-				     struct translation_context *ctx, size_t *n_args) {
+/*
+ * Schedules the parameters of a function, counted by the body task at
+ * func_idx.
+ */
+static TranslatorStatus translate_function_arguments(
+				     const struct expression_image_node *tnode,
+				     struct translation_context *ctx, size_t func_idx) {
 	assert (ctx);
 
 	TranslatorStatus ret = TRANSLATOR_STATUS_GEN(BTRST_OK);
@@ -598,22 +639,22 @@ static TranslatorStatus translate_function_arguments(struct tree_node *tnode,
 		return ret;
 	}
 
-	struct expression_operator *op = tnode->value.ptr;
-	if (EXPR_TNODE_IS_OPERATOR(tnode) && op->idx == EXPR_IDX_COMMA) {
-		ret = translate_function_arguments(tnode->left, ctx, n_args);
-		if (TRANSLATOR_STATUS(ret)) {
-			return ret;
+	int is_comma = EXPR_INODE_IS_OPERATOR(tnode) && expr_image_op(tnode)->idx == EXPR_IDX_COMMA;
+	if (is_comma && EXPR_INODE_IS_SEQUENCE(tnode)) {
+		for (size_t i = expr_image_n_children(tnode); i-- > 0;) {
+			translator_schedule(ctx, TRTASK_FUNCTION_ARGUMENTS,
+					    expr_image_child(ctx->image, tnode, i), func_idx);
 		}
-
-		ret = translate_function_arguments(tnode->right, ctx, n_args);
-		if (TRANSLATOR_STATUS(ret)) {
-			return ret;
-		}
-	} else if (EXPR_TNODE_IS_VARIABLE(tnode)) {
-		(*n_args)++;
+	} else if (is_comma) {
+		translator_schedule(ctx, TRTASK_FUNCTION_ARGUMENTS,
+				    expr_image_right(ctx->image, tnode), func_idx);
+		translator_schedule(ctx, TRTASK_FUNCTION_ARGUMENTS,
+				    expr_image_left(ctx->image, tnode), func_idx);
+	} else if (EXPR_INODE_IS_VARIABLE(tnode)) {
+		translator_task_at(ctx, func_idx)->n_args++;
 
 		struct variable *var = NULL;
-		ret = push_variable(ctx, tnode->value.varname, &var);
+		ret = push_variable(ctx, tnode, &var);
 		if (TRANSLATOR_STATUS(ret)) {
 			return ret;
 		}
@@ -630,47 +671,61 @@ static TranslatorStatus translate_function_arguments(struct tree_node *tnode,
 	return TRANSLATOR_STATUS_GEN(BTRST_OK);
 }
 
-static TranslatorStatus translate_function(struct tree_node *tnode,
+static TranslatorStatus translate_function(const struct expression_image_node *tnode,
 				     struct translation_context *ctx) {
 	assert (ctx);
 	assert (tnode);
-	assert (EXPR_TNODE_IS_OPERATOR(tnode));
+	assert (EXPR_INODE_IS_OPERATOR(tnode));
 
-	struct expression_operator *op = tnode->value.ptr;
+	const struct expression_operator *op = expr_image_op(tnode);
 	assert (op->idx == EXPR_IDX_FUNC || op->idx == EXPR_IDX_MAIN);
 
-	if (!tnode->left || !EXPR_TNODE_IS_OPERATOR(tnode->left)) {
+	const struct expression_image_node *func_declaration = expr_image_left(ctx->image, tnode);
+	if (!func_declaration || !EXPR_INODE_IS_OPERATOR(func_declaration)) {
 		return TRANSLATOR_STATUS_GEN(BTRST_TREE_INVALID);
 	}
 
-	struct tree_node *func_declaration = tnode->left;
-	struct expression_operator *decl_op = func_declaration->value.ptr;
-	if (decl_op->idx != EXPR_IDX_COMMA) {
+	const struct expression_operator *decl_op = expr_image_op(func_declaration);
+	if (decl_op->idx != EXPR_IDX_COMMA || EXPR_INODE_IS_SEQUENCE(func_declaration)) {
 		return TRANSLATOR_STATUS_GEN(BTRST_TREE_INVALID);
 	}
 
-	if (!func_declaration->left || !EXPR_TNODE_IS_VARIABLE(func_declaration->left)) {
+	const struct expression_image_node *func_name = expr_image_left(ctx->image, func_declaration);
+	const struct expression_image_node *func_args = expr_image_right(ctx->image, func_declaration);
+	if (!func_name || !EXPR_INODE_IS_VARIABLE(func_name)) {
 		return TRANSLATOR_STATUS_GEN(BTRST_TREE_INVALID);
 	}
-	struct tree_node *func_name = func_declaration->left;
-	struct tree_node *func_args = func_declaration->right;
-	size_t n_args = 0;
 
 	if (op->idx == EXPR_IDX_FUNC) {
-		fprintf(ctx->asm_output, ".func_%s:\n", func_name->value.varname);
+		fprintf(ctx->asm_output, ".func_%s:\n", expr_image_name(ctx->image, func_name->arg));
 	} else if (op->idx == EXPR_IDX_MAIN) {
 		fprintf(ctx->asm_output, "._start:\n");
 	}
 
-	TranslatorStatus ret = TRANSLATOR_STATUS_GEN(BTRST_OK);
-	ret = translate_function_arguments(func_args, ctx, &n_args);
-	if (TRANSLATOR_STATUS(ret)) {
-		return ret;
+	translator_schedule(ctx, TRTASK_FUNCTION_BODY, tnode, 0);
+	if (ctx->tasks_overflow) {
+		return TRANSLATOR_STATUS_GEN(BTRST_ALLOCATION);
 	}
 
-	struct function *func = find_function(ctx, func_name->value.varname); 
+	return translate_function_arguments(func_args, ctx, ctx->tasks.len - 1);
+}
+
+/*
+ * Schedules the body once the parameters are stored.
+ */
+static TranslatorStatus translate_function_body(const struct expression_image_node *tnode,
+				     struct translation_context *ctx, size_t n_args) {
+	assert (ctx);
+	assert (tnode);
+
+	const struct expression_image_node *func_declaration = expr_image_left(ctx->image, tnode);
+	const struct expression_image_node *func_name = expr_image_left(ctx->image, func_declaration);
+
+	TranslatorStatus ret = TRANSLATOR_STATUS_GEN(BTRST_OK);
+
+	struct function *func = find_function(ctx, func_name->arg); 
 	if (!func) {
-		ret = push_function(ctx, func_name->value.varname,
+		ret = push_function(ctx, func_name,
 					n_args, &func);
 		if (TRANSLATOR_STATUS(ret)) {
 			return ret;
@@ -681,16 +736,16 @@ static TranslatorStatus translate_function(struct tree_node *tnode,
 		return TRANSLATOR_STATUS_GEN(BTRST_TREE_INVALID);
 	}
 
-	struct tree_node *func_body = tnode->right;	
-
-	ret = translate_statement(func_body, ctx);
-
-	fprintf(ctx->asm_output, "ret\n");
+	translator_schedule(ctx, TRTASK_RET, NULL, 0);
+	translator_schedule(ctx, TRTASK_STATEMENT, expr_image_right(ctx->image, tnode), 0);
 
-	return ret;
+	return TRANSLATOR_STATUS_GEN(BTRST_OK);
 }
 
-static TranslatorStatus translate_statement(struct tree_node *tnode,
+/*
+ * Translates a statement that is not a ';' sequence.
+ */
+static TranslatorStatus translate_single_statement(const struct expression_image_node *tnode,
 				     struct translation_context *ctx) {
 	assert (ctx);
 
@@ -698,37 +753,30 @@ static TranslatorStatus translate_statement(struct tree_node *tnode,
 		return TRANSLATOR_STATUS_GEN(BTRST_OK);
 	}
 
-	if (EXPR_TNODE_IS_NUMBER(tnode)) {
+	if (EXPR_INODE_IS_INVALID(tnode)) {
+		log_error("Tree is corrupted!");
+		return TRANSLATOR_STATUS_GEN(BTRST_TREE_INVALID);
+	}
+
+	if (EXPR_INODE_IS_NUMBER(tnode)) {
 		return TRANSLATOR_STATUS_GEN(BTRST_OK);
 	}
 
-	if (EXPR_TNODE_IS_VARIABLE(tnode)) {
-		if (!find_variable(ctx, tnode->value.varname)) {
-			log_error("Undeclared variable: %s", tnode->value.varname);
+	if (EXPR_INODE_IS_VARIABLE(tnode)) {
+		if (!find_variable(ctx, tnode->arg)) {
+			log_error("Undeclared variable: %s", expr_image_name(ctx->image, tnode->arg));
 			return TRANSLATOR_STATUS_GEN(BTRST_UNDECLARED_VARIABLE);
 		} else {
 			return TRANSLATOR_STATUS_GEN(BTRST_OK);
 		}
 	}
 
-	if (!EXPR_TNODE_IS_OPERATOR(tnode)) {
+	if (!EXPR_INODE_IS_OPERATOR(tnode)) {
 		log_error("Not implemented :(");
 		return TRANSLATOR_STATUS_GEN(BTRST_INTERNAL_FAILURE);
 	}
 
-	TranslatorStatus ret = TRANSLATOR_STATUS_GEN(BTRST_OK);
-
-	struct expression_operator *op = tnode->value.ptr;
-
-	if (op->idx == EXPR_IDX_SEMICOLON) {
-		ret = translate_statement(tnode->left, ctx);
-		if (TRANSLATOR_STATUS(ret)) {
-			return ret;
-		}
-
-		ret = translate_statement(tnode->right, ctx);
-		return ret;
-	}
+	const struct expression_operator *op = expr_image_op(tnode);
 
 	if (op->idx == EXPR_IDX_DECL_ASSIGN) {
 		return translate_declaration(tnode, ctx);
@@ -739,7 +787,14 @@ static TranslatorStatus translate_statement(struct tree_node *tnode,
 	}
 
 	if (op->idx == EXPR_IDX_IF) {
-		return translate_conditional(tnode, ctx);
+		if (!expr_image_left(ctx->image, tnode)) {
+			return TRANSLATOR_STATUS_GEN(BTRST_TREE_INVALID);
+		}
+
+		translator_schedule(ctx, TRTASK_CONDITIONAL, tnode, 0);
+		translator_schedule(ctx, TRTASK_EXPRESSION, expr_image_left(ctx->image, tnode), 0);
+
+		return TRANSLATOR_STATUS_GEN(BTRST_OK);
 	}
 
 	if (op->idx == EXPR_IDX_WHILE) {
@@ -751,40 +806,153 @@ static TranslatorStatus translate_statement(struct tree_node *tnode,
 	}	
 
 	// Dummy expression
-	ret = tpush_expression(tnode, ctx);
-	fprintf(ctx->asm_output, "pop r0\n");
+	translator_schedule(ctx, TRTASK_DROP, NULL, 0);
+	translator_schedule(ctx, TRTASK_EXPRESSION, tnode, 0);
 
-	return ret;
+	return TRANSLATOR_STATUS_GEN(BTRST_OK);
+}
+
+/*
+ * Statement lists are ';' sequences, or chains of binary ';' in trees
+ * stored before sequences, which are as deep as they are long. The first
+ * statement is translated first.
+ */
+static TranslatorStatus translate_statement(const struct expression_image_node *tnode,
+				     struct translation_context *ctx) {
+	assert (ctx);
+
+	if (!(tnode && EXPR_INODE_IS_OPERATOR(tnode) &&
+		expr_image_op(tnode)->idx == EXPR_IDX_SEMICOLON)) {
+		return translate_single_statement(tnode, ctx);
+	}
+
+	if (EXPR_INODE_IS_SEQUENCE(tnode)) {
+		for (size_t i = expr_image_n_children(tnode); i-- > 0;) {
+			translator_schedule(ctx, TRTASK_STATEMENT,
+					    expr_image_child(ctx->image, tnode, i), 0);
+		}
+	} else {
+		translator_schedule(ctx, TRTASK_STATEMENT, expr_image_right(ctx->image, tnode), 0);
+		translator_schedule(ctx, TRTASK_STATEMENT, expr_image_left(ctx->image, tnode), 0);
+	}
+
+	return TRANSLATOR_STATUS_GEN(BTRST_OK);
 }
 
-static TranslatorStatus translator_tnode(struct tree_node *tnode,
+static TranslatorStatus translate_task(const struct translator_task *task,
+				       struct translation_context *ctx) {
+	assert (task);
+	assert (ctx);
+
+	switch (task->type) {
+		case TRTASK_STATEMENT:
+			return translate_statement(task->node, ctx);
+		case TRTASK_EXPRESSION:
+			return tpush_expression(task->node, ctx);
+		case TRTASK_OPERATOR:
+			return tpush_operator(task->node, ctx);
+		case TRTASK_CALL_ARGUMENTS:
+			return translate_function_call_arguments(task->node, ctx, task->idx);
+		case TRTASK_CALL:
+			return tpush_func_call(task->node, ctx, task->n_args);
+		case TRTASK_FUNCTION_ARGUMENTS:
+			return translate_function_arguments(task->node, ctx, task->idx);
+		case TRTASK_FUNCTION_BODY:
+			return translate_function_body(task->node, ctx, task->n_args);
+		case TRTASK_CONDITIONAL:
+			return translate_conditional(task->node, ctx);
+		case TRTASK_BRANCH:
+			translate_branch(ctx, task->idx);
+			break;
+		case TRTASK_JUMP:
+			fprintf(ctx->asm_output, "jmp ._jmp_tps__%zu\n", task->idx);
+			break;
+		case TRTASK_LABEL:
+			fprintf(ctx->asm_output, "._jmp_tps__%zu:\n", task->idx);
+			break;
+		case TRTASK_STORE:
+			fprintf(ctx->asm_output,"pop r0\n"
+						"ldc r1 $%zu\n"
+						"stm r1 r0\n",
+						task->idx);
+			break;
+		case TRTASK_DROP:
+			fprintf(ctx->asm_output, "pop r0\n");
+			break;
+		case TRTASK_RET:
+			fprintf(ctx->asm_output, "ret\n");
+			break;
+		default:
+			assert (0 && "Unknown translator task");
+			return TRANSLATOR_STATUS_GEN(BTRST_INTERNAL_FAILURE);
+	}
+
+	return TRANSLATOR_STATUS_GEN(BTRST_OK);
+}
+
+static TranslatorStatus translator_tnode(const struct expression_image_node *tnode,
 		     struct translation_context *ctx) {
 	assert (tnode);
 	assert (ctx);
 
 	fprintf(ctx->asm_output, "call ._start\n" "dump\n" "halt\n");
 
-	return translate_statement(tnode, ctx);
+	translator_schedule(ctx, TRTASK_STATEMENT, tnode, 0);
+	TranslatorStatus ret = TRANSLATOR_STATUS_GEN(ctx->tasks_overflow ?
+						     BTRST_ALLOCATION : BTRST_OK);
+
+	struct translator_task *top = NULL;
+	while (!TRANSLATOR_STATUS(ret) && (top = tree_stack_pop(&ctx->tasks))) {
+		// The task schedules over its own frame
+		struct translator_task task = *top;
+
+		ret = translate_task(&task, ctx);
+
+		if (!TRANSLATOR_STATUS(ret) && ctx->tasks_overflow) {
+			ret = TRANSLATOR_STATUS_GEN(BTRST_ALLOCATION);
+		}
+	}
+
+	return ret;
 }
 
-TranslatorStatus backend_translator(struct expression *expr, FILE *asm_output) {
-	assert (expr);
+TranslatorStatus backend_translate_image(const struct expression_image *image,
+					 FILE *asm_output) {
+	assert (image);
 	assert (asm_output);
 
 	struct translation_context ctx = {
+		.image = image,
 		.asm_output = asm_output,
 		.variables = {0},
-		.expr = expr,
 		.jmp_idx = 0,
 	};
 
 	pvector_init(&ctx.variables, sizeof(struct variable));
 	pvector_init(&ctx.functions, sizeof(struct function));
+	tree_stack_ctor(&ctx.tasks, sizeof(struct translator_task));
 
-	TranslatorStatus ret = translator_tnode(expr->tree.root, &ctx);
+	TranslatorStatus ret = translator_tnode(expr_image_root(image), &ctx);
 
+	tree_stack_dtor(&ctx.tasks);
 	pvector_destroy(&ctx.variables);
 	pvector_destroy(&ctx.functions);
 
 	return ret;
 }
+
+TranslatorStatus backend_translator(struct expression *expr, FILE *asm_output) {
+	assert (expr);
+	assert (asm_output);
+
+	struct expression_image image = {0};
+	if (expression_image_build(expr, &image)) {
+		return TRANSLATOR_STATUS_GEN(BTRST_ALLOCATION);
+	}
+
+	TranslatorStatus ret = backend_translate_image(&image, asm_output);
+
+	expression_image_dtor(&image);
+
+	return ret;
+}
@@ -2,6 +2,28 @@
 #include "expression.h"
 #include "backend.h"
 
+/*
+ * Images are translated where they are mapped, other formats are loaded
+ * and laid out as an image.
+ */
+static int load_input(const char *input_file, enum expression_format format,
+		      struct expression_image *image) {
+	if (format == EXPRESSION_FORMAT_IMAGE) {
+		return expression_image_map(image, input_file);
+	}
+
+	struct expression input_expr = {0};
+	if (format == EXPRESSION_FORMAT_BINARY ? expression_load_binary(&input_expr, input_file) :
+						 expression_load(&input_expr, input_file)) {
+		return S_FAIL;
+	}
+
+	int ret = expression_image_build(&input_expr, image);
+	expression_dtor(&input_expr);
+
+	return ret;
+}
+
 int main(int argc, const char *argv[]) {
 	if (argc != 3) {
 		eprintf("Usage: %s <input_file> <output_file>\n", argv[0]);
@@ -11,9 +33,10 @@ int main(int argc, const char *argv[]) {
 	const char *input_file = argv[1];
 	const char *output_file = argv[2];
 
-	struct expression input_expr = {0};
-
-	if (expression_load(&input_expr, input_file)) {
+	enum expression_format format = EXPRESSION_FORMAT_TEXT;
+	struct expression_image input_image = {0};
+	if (expression_file_format(input_file, &format) ||
+		load_input(input_file, format, &input_image)) {
 		log_error("Failed to load expression from file %s", input_file);
 		return 1;
 	}
@@ -21,20 +44,20 @@ int main(int argc, const char *argv[]) {
 	FILE *asm_file = fopen(output_file, "w");
 	if (!asm_file) {
 		log_error("Failed to load destination file %s", output_file);
-		expression_dtor(&input_expr);
+		expression_image_dtor(&input_image);
 		return 1;
 	}
 
-	TranslatorStatus status = backend_translator(&input_expr, asm_file);
+	TranslatorStatus status = backend_translate_image(&input_image, asm_file);
 	if (TRANSLATOR_STATUS(status)) {
 		log_error("Translation failed with status: %u", TRANSLATOR_STATUS(status));
 
-		expression_dtor(&input_expr);
+		expression_image_dtor(&input_image);
 		fclose(asm_file);
 		return 1;
 	}
 
-	expression_dtor(&input_expr);
+	expression_image_dtor(&input_image);
 	fclose(asm_file);
 	return 0;
 }
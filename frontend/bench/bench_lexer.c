@@ -0,0 +1,140 @@
+/*
+ * Lexer throughput benchmark.
+ *
+ * Usage: bench_lexer [file.pg]
+ *
+ * Lexes the file (or a generated program) with every supported scan
+ * kernel set, then on all CPUs with the best one, and reports MB/s.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "types.h"
+#include "lexer.h"
+#include "lexer_simd.h"
+
+#define BENCH_MIN_SECONDS (1.0)
+#define BENCH_GENERATED_SIZE (4 * 1024 * 1024)
+
+static double bench_now(void) {
+	struct timespec ts = {0};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static char *bench_generate(size_t size) {
+	static const char *const lines[] = {
+		"func computeValue(firstArgument, secondArgument) {\n",
+		"\taccumulator := firstArgument * 1234567 + secondArgument;\n",
+		"\t// Long explanatory comment, the kind generated code is full of\n",
+		"\tif (accumulator >= 100000000) { accumulator = accumulator / 10; }\n",
+		"\twhile (counterVariable != 0) { counterVariable = counterVariable - 1; }\n",
+		"\treturn accumulator;\n",
+		"}\n\n",
+	};
+
+	char *text = calloc(size + 1, 1);
+	if (!text) {
+		return NULL;
+	}
+
+	size_t len = 0;
+	for (size_t i = 0; ; i++) {
+		const char *line = lines[i % (sizeof(lines) / sizeof(*lines))];
+		size_t line_len = strlen(line);
+		if (len + line_len > size) {
+			break;
+		}
+
+		memcpy(text + len, line, line_len);
+		len += line_len;
+	}
+
+	return text;
+}
+
+static int bench_run(const char *text, size_t text_len, const char *name,
+		     size_t n_threads) {
+	size_t runs = 0;
+	size_t n_tokens = 0;
+	double start = bench_now();
+	double elapsed = 0;
+
+	do {
+		struct lexer lexer = {0};
+		if (LEXER_STATUS(lexer_ctor(&lexer))) {
+			return S_FAIL;
+		}
+
+		LexerStatus status = n_threads == 1 ?
+			lexer_parse_text(&lexer, text) :
+			lexer_parse_text_parallel(&lexer, text, n_threads);
+		n_tokens = lexer.tokens.len;
+		lexer_dtor(&lexer);
+
+		if (LEXER_STATUS(status)) {
+			log_error("Lexer failed at position %zd", status.text_position);
+			return S_FAIL;
+		}
+
+		runs++;
+		elapsed = bench_now() - start;
+	} while (elapsed < BENCH_MIN_SECONDS);
+
+	printf("%-8s %10.2f MB/s  (%zu tokens, %zu runs)\n", name,
+	       (double)(text_len * runs) / elapsed / 1e6, n_tokens, runs);
+
+	return S_OK;
+}
+
+static int bench_isa(const char *text, size_t text_len, enum lexer_simd_isa isa) {
+	if (lexer_simd_select(isa)) {
+		printf("%-8s unsupported\n", lexer_simd_isa_name(isa));
+		return S_OK;
+	}
+
+	return bench_run(text, text_len, lexer_simd_isa_name(isa), 1);
+}
+
+int main(int argc, const char *argv[]) {
+	char *text = NULL;
+	size_t text_len = 0;
+
+	if (argc > 1) {
+		if (read_file(argv[1], &text, &text_len)) {
+			log_error("Cannot read %s", argv[1]);
+			return 1;
+		}
+	} else {
+		text = bench_generate(BENCH_GENERATED_SIZE);
+		if (!text) {
+			log_error("allocation error");
+			return 1;
+		}
+	}
+
+	text_len = strlen(text);
+	printf("Lexing %zu bytes\n", text_len);
+
+	int err = 0;
+	for (int isa = LEXER_ISA_SCALAR; isa < LEXER_ISA_N && !err; isa++) {
+		err = bench_isa(text, text_len, (enum lexer_simd_isa)isa);
+	}
+
+	for (int isa = LEXER_ISA_N - 1; isa >= LEXER_ISA_SCALAR; isa--) {
+		if (!lexer_simd_select((enum lexer_simd_isa)isa)) {
+			break;
+		}
+	}
+
+	if (!err) {
+		err = bench_run(text, text_len, "parallel", 0);
+	}
+
+	free(text);
+
+	return err;
+}
@@ -9,9 +9,25 @@ extern "C" {
 #endif
 
 int expression_parse_lexer(struct expression *expr, struct lexer *lexer);
+
+/**
+ * expression_parse_lexer() with the functions parsed on n_threads threads,
+ * 0 uses every CPU. The lexer must be filled by lexer_parse_*(). The tree
+ * and variables are the same as with the serial parser, errors are
+ * reported by it.
+ */
+int expression_parse_lexer_parallel(struct expression *expr, struct lexer *lexer,
+				    size_t n_threads);
 int expression_parse_str(const char *str, struct expression *expr);
 int expression_parse_file(const char *filename, struct expression *expr);
 
+/**
+ * expression_parse_file() reusing the functions of cache_filename whose
+ * tokens did not change, the cache is then rewritten for the new text.
+ */
+int expression_parse_file_cached(const char *filename, const char *cache_filename,
+				 struct expression *expr);
+
 #ifdef __cplusplus
 }
 #endif
@@ -2,7 +2,8 @@
 #define LEXER_H
 
 #include "types.h"
-#include "pvector.h"
+#include "intern.h"
+#include "typed_vector.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -48,63 +49,129 @@ enum LexerTokenType {
 	LXTOK_BITOR,		// |
 	LXTOK_MEM_WRITE,	// <-
 	LXTOK_MEM_READ,		// memload
+
+	LXTOK_N_TYPES,
 };
 
-static struct lexer_keyword_tok {
-	const char *tok_name;
-	enum LexerTokenType tok_type;
-} lexer_keyword_table[] = {
-#define LXKW_DEFINE(tok_name_, tok_type_)		\
-	{.tok_name = tok_name_, .tok_type = tok_type_}
-
-	LXKW_DEFINE("input",	LXTOK_INPUT	),
-	LXKW_DEFINE("print",	LXTOK_PRINT	),
-	LXKW_DEFINE("if",	LXTOK_IF	),
-	LXKW_DEFINE("else",	LXTOK_ELSE	),
-	LXKW_DEFINE("sqrt",	LXTOK_SQRT	),
-	LXKW_DEFINE("func",	LXTOK_FUNC	),
-	LXKW_DEFINE("return",	LXTOK_RETURN	),
-	LXKW_DEFINE("while",	LXTOK_WHILE	),
-	LXKW_DEFINE("scrht",	LXTOK_SCRHT	),
-	LXKW_DEFINE("scrwt",	LXTOK_SCRWT	),
-	LXKW_DEFINE("draw",	LXTOK_DRAW	),
-	LXKW_DEFINE("memload",	LXTOK_MEM_READ	),
-	NULL
-
-#undef LXKW_DEFINE
+enum LexerStatusType {
+	LXST_OK = 0,
+	LXST_INTERNAL_FAILURE = 1,
+	LXST_ALLOCATION = 2,
+	LXST_NOT_MATCHED_TOKEN = 3,
+	LXST_VARIABLE_DIGIT_BEGINNING = 4,
+	LXST_OK_NO_TOKEN = 5,
 };
 
+typedef struct LexerStatus {
+	enum LexerStatusType status;
+	ssize_t text_position;
+} LexerStatus;
+
 struct lexer_token {
 	union {
-		char *word;
+		// Points into lexer names, valid while the lexer lives
+		const char *word;
 		int64_t lexer_number;
 	};
 
+	// Interned id of word for LXTOK_VARIABLE
+	uint32_t name_id;
+
 	enum LexerTokenType tok_type;
 	size_t text_position;
 };
 
-struct lexer {
-	struct pvector tokens;
+// Tokens kept behind the newest one in pull mode
+#define LEXER_LOOKAHEAD (16)
 
-	char *words_buf;
-	size_t words_bufidx;
-	size_t words_buflen;
+union lexer_token_payload {
+	int64_t number;
+	uint32_t name_id;
 };
 
-enum LexerStatusType {
-	LXST_OK = 0,
-	LXST_INTERNAL_FAILURE = 1,
-	LXST_ALLOCATION = 2,
-	LXST_NOT_MATCHED_TOKEN = 3,
-	LXST_VARIABLE_DIGIT_BEGINNING = 4,
-	LXST_OK_NO_TOKEN = 5,
+/*
+ * Tokens as parallel arrays: loops dispatching on the type touch one byte
+ * per token. payloads are meaningful for LXTOK_NUMBER and LXTOK_VARIABLE
+ * only, the word of a variable is its name in lexer->intern.
+ */
+struct lexer_tokens {
+	uint8_t *types;
+	uint32_t *positions;
+	union lexer_token_payload *payloads;
+	size_t len;
+	size_t cap;
 };
 
-typedef struct LexerStatus {
-	enum LexerStatusType status;
-	ssize_t text_position;
-} LexerStatus;
+typedef ssize_t (*lexer_read_fn)(void *source, char *buf, size_t size);
+
+/*
+ * Scan position in the source text. Chunked sources read more text into buf
+ * once cur reaches text_end, keeping the unfinished token.
+ */
+struct lexer_source {
+	const char *text;
+	const char *cur;
+	const char *text_end;
+	// Offset of text[0] in the whole source
+	size_t text_offset;
+	// text_end is not the end of the source
+	int more_input;
+	int need_input;
+	int at_end;
+	// enum lexer_state to resume a comment split between chunks in
+	int resume_state;
+
+	lexer_read_fn read_fn;
+	void *read_ctx;
+	// Closed by lexer_dtor() if owned
+	int fd;
+	int owns_fd;
+	char *buf;
+	size_t buf_size;
+
+	// Read-only mapping of the whole file that text points into
+	void *map;
+	size_t map_size;
+};
+
+/*
+ * Offsets of the line starts after the first line, in text order.
+ */
+struct lexer_lines {
+	size_t *starts;
+	size_t len;
+	size_t cap;
+};
+
+struct lexer_location {
+	// Both are 1-based
+	size_t line;
+	size_t column;
+};
+
+struct lexer {
+	struct lexer_tokens tokens;
+	// Line starts of the text lexed so far
+	struct lexer_lines lines;
+
+	// Distinct identifiers of the text
+	struct intern_table names;
+	// Table that new names go to, &names unless redirected by the parser
+	struct intern_table *intern;
+
+	/*
+	 * Pull mode (lexer_pull_*): tokens are lexed on demand, only the
+	 * last LEXER_LOOKAHEAD of them are kept in ring. Otherwise ring holds
+	 * the tokens last returned by lexer_get_token().
+	 */
+	int pull_mode;
+	struct lexer_source source;
+	struct lexer_token ring[LEXER_LOOKAHEAD];
+	// Absolute indices of the oldest token in ring and past the newest one
+	size_t ring_begin;
+	size_t ring_end;
+	LexerStatus pull_status;
+};
 
 #define LEXER_STATUS(status_) ((status_).status)
 
@@ -114,14 +181,137 @@ LexerStatus lexer_dtor(struct lexer *lexer);
 
 LexerStatus lexer_parse_text(struct lexer *lexer, const char *text);
 
+/**
+ * lexer_parse_text() on n_threads threads, 0 uses every CPU. The text is
+ * split at newlines and lexed in segments; tokens, name ids and errors are
+ * the same as with the serial lexer.
+ */
+LexerStatus lexer_parse_text_parallel(struct lexer *lexer, const char *text,
+				      size_t n_threads);
+
+/**
+ * Lexes the source read in chunks of chunk_size bytes (0 selects the
+ * default), without keeping the whole text in memory. Token positions
+ * are offsets from the current stream position.
+ */
+LexerStatus lexer_parse_stream(struct lexer *lexer, FILE *stream,
+			       size_t chunk_size);
+LexerStatus lexer_parse_fd(struct lexer *lexer, int fd, size_t chunk_size);
+
+/**
+ * Switches the lexer to pull mode over text or stream, which must outlive
+ * the lexer. Nothing is lexed until lexer_get_token() asks for it, and
+ * lexer_get_token() returns NULL for tokens more than LEXER_LOOKAHEAD - 1
+ * behind the newest one.
+ */
+LexerStatus lexer_pull_text(struct lexer *lexer, const char *text);
+LexerStatus lexer_pull_stream(struct lexer *lexer, FILE *stream,
+			      size_t chunk_size);
+
+/**
+ * Pulls tokens of a file mapped read-only, the text is never copied. Files
+ * that cannot be mapped (pipes) are read in chunks instead.
+ */
+LexerStatus lexer_pull_file(struct lexer *lexer, const char *filename);
 
-LexerStatus lexer_clone(struct lexer *old, struct lexer *new);
+/**
+ * The whole source text of pull mode if it is in memory (lexer_pull_text,
+ * a mapped file), otherwise NULL.
+ */
+const char *lexer_text(const struct lexer *lexer);
 
-struct lexer_token *lexer_get_token(struct lexer *lexer, size_t tok_idx);
+/**
+ * Error that stopped pulling, LXST_OK if the end of the text was reached
+ * or is not reached yet.
+ */
+LexerStatus lexer_pull_status(const struct lexer *lexer);
+
+
+LexerStatus lexer_clone(struct lexer *old, struct lexer *new_lexer);
+
+/**
+ * Line and column of a text offset, O(log lines). Lines past the text
+ * lexed so far are not known yet.
+ */
+struct lexer_location lexer_locate(const struct lexer *lexer, size_t text_position);
+
+/*
+ * Unchecked accessors of tokens lexed by lexer_parse_*(), indices are
+ * checked in _DEBUG builds only.
+ */
+
+static inline size_t lexer_n_tokens(const struct lexer *lexer) {
+	return lexer->tokens.len;
+}
+
+static inline enum LexerTokenType lexer_token_type(const struct lexer *lexer,
+						   size_t tok_idx) {
+	VECTOR_BOUNDS_CHECK(tok_idx, lexer->tokens.len);
+	return (enum LexerTokenType)lexer->tokens.types[tok_idx];
+}
+
+static inline size_t lexer_token_position(const struct lexer *lexer,
+					  size_t tok_idx) {
+	VECTOR_BOUNDS_CHECK(tok_idx, lexer->tokens.len);
+	return lexer->tokens.positions[tok_idx];
+}
+
+static inline int64_t lexer_token_number(const struct lexer *lexer,
+					 size_t tok_idx) {
+	VECTOR_BOUNDS_CHECK(tok_idx, lexer->tokens.len);
+	return lexer->tokens.payloads[tok_idx].number;
+}
+
+static inline uint32_t lexer_token_name_id(const struct lexer *lexer,
+					   size_t tok_idx) {
+	VECTOR_BOUNDS_CHECK(tok_idx, lexer->tokens.len);
+	return lexer->tokens.payloads[tok_idx].name_id;
+}
+
+static inline const char *lexer_token_word(const struct lexer *lexer,
+					   size_t tok_idx) {
+	VECTOR_BOUNDS_CHECK(tok_idx, lexer->tokens.len);
+	return intern_name(lexer->intern, lexer->tokens.payloads[tok_idx].name_id);
+}
+
+/**
+ * lexer_get_token() of pull mode, lexes tokens until tok_idx is in the ring.
+ */
+struct lexer_token *lexer_pull_token(struct lexer *lexer, size_t tok_idx);
+
+/**
+ * Returns the token or NULL past the end. The token stays valid until
+ * LEXER_LOOKAHEAD more tokens are requested.
+ */
+static inline struct lexer_token *lexer_get_token(struct lexer *lexer, size_t tok_idx) {
+	if (lexer->pull_mode) {
+		return lexer_pull_token(lexer, tok_idx);
+	}
+
+	if (tok_idx >= lexer->tokens.len) {
+		return NULL;
+	}
+
+	struct lexer_token *tok = &lexer->ring[tok_idx % LEXER_LOOKAHEAD];
+
+	tok->tok_type = lexer_token_type(lexer, tok_idx);
+	tok->text_position = lexer_token_position(lexer, tok_idx);
+	tok->name_id = 0;
+	tok->lexer_number = 0;
+
+	if (tok->tok_type == LXTOK_NUMBER) {
+		tok->lexer_number = lexer_token_number(lexer, tok_idx);
+	} else if (tok->tok_type == LXTOK_VARIABLE) {
+		tok->name_id = lexer_token_name_id(lexer, tok_idx);
+		tok->word = lexer_token_word(lexer, tok_idx);
+	}
+
+	return tok;
+}
 
-LexerStatus lexer_copy_token_word(
+LexerStatus lexer_intern_token_word(
 	struct lexer *lexer, const char *token_name, size_t token_size,
-	char **token_copied);
+	struct lexer_token *token);
 
 LexerStatus lexer_parse_var(struct lexer *lexer,
 			const char *text, const char **text_end_ptr,
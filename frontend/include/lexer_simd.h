@@ -0,0 +1,83 @@
+#ifndef LEXER_SIMD_H
+#define LEXER_SIMD_H
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Bulk scans of the lexer. Every kernel returns the first byte of
+ * [text, text_end) outside of its character set, or text_end. Kernels
+ * never read at or past text_end.
+ *
+ * The best instruction set is picked at startup, lexer_simd_select()
+ * overrides it (tests and bench/bench_lexer.c compare them).
+ */
+
+enum lexer_simd_isa {
+	LEXER_ISA_SCALAR,
+	LEXER_ISA_SSE2,
+	LEXER_ISA_AVX2,
+	LEXER_ISA_N,
+};
+
+typedef const char *(*lexer_scan_fn)(const char *text, const char *text_end);
+
+struct lexer_simd_ops {
+	enum lexer_simd_isa isa;
+
+	// ' ', '\t', '\n', '\v', '\f', '\r'
+	lexer_scan_fn skip_spaces;
+	// [0-9A-Za-z]
+	lexer_scan_fn skip_ident;
+	// Anything but '\n' and '\0'
+	lexer_scan_fn skip_comment;
+};
+
+extern struct lexer_simd_ops lexer_simd_ops;
+
+/**
+ * Returns S_FAIL if the CPU does not support isa.
+ */
+int lexer_simd_select(enum lexer_simd_isa isa);
+
+const char *lexer_simd_isa_name(enum lexer_simd_isa isa);
+
+static inline const char *lexer_skip_spaces(const char *text, const char *text_end) {
+	return lexer_simd_ops.skip_spaces(text, text_end);
+}
+
+static inline const char *lexer_skip_ident(const char *text, const char *text_end) {
+	return lexer_simd_ops.skip_ident(text, text_end);
+}
+
+static inline const char *lexer_skip_comment(const char *text, const char *text_end) {
+	return lexer_simd_ops.skip_comment(text, text_end);
+}
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define LEXER_HAS_SWAR (1)
+
+/**
+ * Converts 8 ASCII decimal digits at once (SWAR, little-endian only).
+ */
+static inline uint64_t lexer_swar_parse8(const char *digits) {
+	uint64_t val = 0;
+	memcpy(&val, digits, sizeof(val));
+
+	val = (val & 0x0F0F0F0F0F0F0F0Full) * 2561 >> 8;
+	val = (val & 0x00FF00FF00FF00FFull) * 6553601 >> 16;
+	val = (val & 0x0000FFFF0000FFFFull) * 42949672960001ull >> 32;
+
+	return val;
+}
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LEXER_SIMD_H */
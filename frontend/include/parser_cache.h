@@ -0,0 +1,89 @@
+#ifndef PARSER_CACHE_H
+#define PARSER_CACHE_H
+
+#include "expression.h"
+#include "lexer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Functions parsed by a previous run, keyed by the hash of their tokens.
+ * The cache file holds a version line, the variable names and then the
+ * functions: a 64-bit hash, the tokens and the subtree in preorder, one
+ * tag byte per node (nil, number, variable, sequence, operator index) and
+ * varint payloads. Tokens are a type byte each, numbers and name indexes
+ * follow as varints.
+ * The hash only finds the candidates, a subtree is taken if the tokens of
+ * its entry equal the tokens of the function. Subtrees are decoded only
+ * when taken.
+ */
+
+#define PARSER_CACHE_VERSION "vlvm-parse-cache 4"
+
+struct parser_cache_entry {
+	uint64_t hash;
+	size_t n_tokens;
+	// Encoded tokens and subtree in parser_cache buf, data is NULL once taken
+	const uint8_t *tokens;
+	size_t tokens_size;
+	const uint8_t *data;
+	size_t size;
+};
+
+struct parser_cache {
+	char *buf;
+	size_t buf_len;
+
+	// Name index of the file -> name id of expr, INTERN_ID_NONE if unknown
+	uint32_t *name_ids;
+	size_t n_names;
+
+	// Sorted by hash
+	struct parser_cache_entry *entries;
+	size_t len;
+
+	// Subtrees are allocated for expr->tree
+	struct expression *expr;
+};
+
+int parser_cache_ctor(struct parser_cache *cache, struct expression *expr);
+void parser_cache_dtor(struct parser_cache *cache);
+
+/**
+ * Reads the subtrees of filename. Entries naming variables unknown to
+ * cache->expr cannot match a function of it and are never taken. Returns
+ * S_FAIL if there is no valid cache, the cache is left empty.
+ */
+int parser_cache_load(struct parser_cache *cache, const char *filename);
+
+/**
+ * Writes the functions funcs with token hashes hashes, replacing filename
+ * atomically. Function i spans the tokens [bounds[i], bounds[i + 1]) of
+ * lexer, whose name ids are the ids of expr.
+ */
+int parser_cache_store(const char *filename, struct expression *expr,
+		       const struct lexer *lexer, const size_t *bounds,
+		       const uint64_t *hashes, struct tree_node *const *funcs,
+		       size_t n_funcs);
+
+/**
+ * Hash of the tokens [begin, end) of a lexer filled by lexer_parse_*().
+ * Variables are hashed by name, so the hash does not depend on name ids.
+ */
+uint64_t parser_cache_hash(const struct lexer *lexer, size_t begin, size_t end);
+
+/**
+ * Removes the subtree of the tokens [begin, end) of lexer, hashed to hash,
+ * from the cache and decodes it, NULL if there is none. Name ids of lexer
+ * are the ids of cache->expr.
+ */
+struct tree_node *parser_cache_take(struct parser_cache *cache, const struct lexer *lexer,
+				    size_t begin, size_t end, uint64_t hash);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PARSER_CACHE_H */
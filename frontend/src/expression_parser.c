@@ -1,10 +1,15 @@
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "ctio.h"
 #include "types.h"
 #include "expression.h"
+#include "typed_vector.h"
 #include "expression_parser.h"
+#include "parser_cache.h"
 #include "lexer.h"
 #include <stdbool.h>
 #include <ctype.h>
@@ -14,31 +19,26 @@
 #define S_CONTINUE (-2)
 #define S_EMPTY_EXPRESSION (-3)
 
-#define CALL_PARSER(parserName, expr, lexer, s, node)		\
-({								\
-	int cpret_ = parserName(expr, lexer, s, node);		\
-	cpret_;							\
-})
+// Smaller files are parsed while they are lexed
+#define PARSER_PARALLEL_MIN_TEXT (256 * 1024)
+
+// Set on parser workers, their failures are reported by a serial reparse
+static __thread int parser_quiet = 0;
+
+#define PARSER_LOG(...)						\
+do {								\
+	if (!parser_quiet)					\
+		eprintf(__VA_ARGS__);				\
+} while (0)
 
 #define PARSER_RET_STATUS(status)				\
 ({								\
 	typeof(status) prs_status_ = status;			\
 	if ((int)prs_status_ && (int)prs_status_ != S_CONTINUE)	\
-		eprintf("%s: ", __func__);			\
+		PARSER_LOG("%s: ", __func__);			\
 	(int)prs_status_;					\
 })
 
-static int getPrimaryExpression(struct expression *expr, struct lexer *lexer,
-				size_t *lexer_idx, struct tree_node **node);
-static int getRoundBracketsExpression(struct expression *expr, struct lexer *lexer,
-			 size_t *lexer_idx, struct tree_node **node);
-static int getComprasion(struct expression *expr, struct lexer *lexer,
-			 size_t *lexer_idx, struct tree_node **node);
-static int getCodeBlock(struct expression *expr, struct lexer *lexer,
-				  size_t *lexer_idx, struct tree_node **node);
-static int getCommaSeparatedList(struct expression *expr, struct lexer *lexer,
-			 size_t *lexer_idx, struct tree_node **node);
-
 static int getNumber(struct expression *expr, struct lexer *lexer,
 			 size_t *lexer_idx, struct tree_node **node) {
 	assert (expr);
@@ -54,7 +54,7 @@ static int getNumber(struct expression *expr, struct lexer *lexer,
 
 	(*lexer_idx)++;
 
-	*node = expr_create_number_tnode(tok->lexer_number);
+	*node = expr_create_number_tnode(expr, tok->lexer_number);
 
 	if (!(*node)) {
 		return PARSER_RET_STATUS(S_FAIL);
@@ -76,16 +76,16 @@ static int getVariable(struct expression *expr, struct lexer *lexer,
 		return S_CONTINUE;
 	}
 
-	struct expression_variable *var = expr_find_variable(expr, tok->word);
+	struct expression_variable *var = expr_find_variable(expr, tok->name_id);
 	if (!var) {
-		if (expr_push_variable(expr, tok->word, &var)) {
+		if (expr_push_variable(expr, tok->name_id, &var)) {
 			return PARSER_RET_STATUS(S_FAIL);
 		}
 	}
 
 	(*lexer_idx)++;
 
-	*node = expr_create_variable_tnode(var->var_name);
+	*node = expr_create_variable_tnode(expr, var->var_name, var->name_id);
 
 	if (!(*node)) {
 		return PARSER_RET_STATUS(S_FAIL);
@@ -94,174 +94,491 @@ static int getVariable(struct expression *expr, struct lexer *lexer,
 	return PARSER_RET_STATUS(S_OK);
 }
 
-static int getFunctionCall(struct expression *expr, struct lexer *lexer,
-			 size_t *lexer_idx, struct tree_node **node) {
+/**
+ * Appends item to the list *list of *len elements: a single element is the
+ * list itself, from the second one on the list is a sequence of op_idx.
+ */
+static int parser_list_append(struct expression *expr, size_t op_idx,
+			      struct tree_node **list, size_t *len,
+			      struct tree_node *item) {
 	assert (expr);
-	assert (lexer);
-	assert (lexer_idx);
-	assert (node);
+	assert (list);
+	assert (len);
+
+	if (*len == 0) {
+		*list = item;
+	} else if (*len == 1) {
+		struct tree_node *items[] = {*list, item};
+		struct tree_node *seq = expr_create_sequence_tnode(expr,
+			expression_operators[op_idx], items, 2);
+		if (!seq) {
+			return S_FAIL;
+		}
 
-	struct lexer_token *tok = NULL;
-	if (!((tok = lexer_get_token(lexer, *lexer_idx)) &&
-		tok->tok_type == LXTOK_VARIABLE)) {
-		return S_CONTINUE;
+		*list = seq;
+	} else if (expr_sequence_push(expr, *list, item)) {
+		return S_FAIL;
 	}
-	(*lexer_idx)++;
 
-	struct expression_variable *var = expr_find_variable(expr, tok->word);
-	if (!var) {
-		if (expr_push_variable(expr, tok->word, &var)) {
-			return PARSER_RET_STATUS(S_FAIL);
+	(*len)++;
+
+	return S_OK;
+}
+
+/*
+ * Expressions are parsed by precedence climbing over explicit stacks: a
+ * binary operator waits on the stack until an operator it cannot take as
+ * its right operand or a closing bracket reduces it. A lower priority binds
+ * tighter. Brackets, calls and keyword operators open a group on the same
+ * stack, so nesting is bounded by memory rather than by the call stack.
+ */
+
+struct parser_infix_op {
+	int is_infix;
+	enum expression_op_indexes op_idx;
+	int right_assoc;
+};
+
+static const struct parser_infix_op parser_infix_ops[LXTOK_N_TYPES] = {
+	[LXTOK_POW]		= {1, EXPR_IDX_POW,		1},
+	[LXTOK_MULTIPLY]	= {1, EXPR_IDX_MULTIPLY,	0},
+	[LXTOK_DIVIDE]		= {1, EXPR_IDX_DIVIDE,		0},
+	[LXTOK_PLUS]		= {1, EXPR_IDX_PLUS,		0},
+	[LXTOK_MINUS]		= {1, EXPR_IDX_MINUS,		0},
+	[LXTOK_EQUALS_CMP]	= {1, EXPR_IDX_EQUALS_CMP,	0},
+	[LXTOK_GREATER_CMP]	= {1, EXPR_IDX_GREATER_CMP,	0},
+	[LXTOK_LESS_CMP]	= {1, EXPR_IDX_LESS_CMP,	0},
+	[LXTOK_NOT_EQUALS_CMP]	= {1, EXPR_IDX_NOT_EQUALS_CMP,	0},
+	[LXTOK_GREATER_EQ_CMP]	= {1, EXPR_IDX_GREATER_EQ_CMP,	0},
+	[LXTOK_LESS_EQ_CMP]	= {1, EXPR_IDX_LESS_EQ_CMP,	0},
+	[LXTOK_SHL]		= {1, EXPR_IDX_SHL,		0},
+	[LXTOK_SHR]		= {1, EXPR_IDX_SHR,		0},
+	[LXTOK_BITAND]		= {1, EXPR_IDX_BITAND,		0},
+	[LXTOK_BITOR]		= {1, EXPR_IDX_BITOR,		0},
+};
+
+struct parser_keyword_op {
+	int is_keyword;
+	enum expression_op_indexes op_idx;
+	int is_no_arg;
+};
+
+static const struct parser_keyword_op parser_keyword_ops[LXTOK_N_TYPES] = {
+	[LXTOK_PRINT]		= {1, EXPR_IDX_PRINT,		0},
+	[LXTOK_INPUT]		= {1, EXPR_IDX_INPUT,		1},
+	[LXTOK_SQRT]		= {1, EXPR_IDX_SQRT,		0},
+	[LXTOK_RETURN]		= {1, EXPR_IDX_RETURN,		0},
+	[LXTOK_SCRHT]		= {1, EXPR_IDX_SCRHT,		1},
+	[LXTOK_SCRWT]		= {1, EXPR_IDX_SCRWT,		1},
+	[LXTOK_DRAW]		= {1, EXPR_IDX_DRAW,		0},
+	[LXTOK_MEM_READ]	= {1, EXPR_IDX_MEM_READ,	0},
+};
+
+// Comparisons are the loosest operators inside of an expression
+#define PARSER_EXPR_MAX_PRIORITY (expr_operator_equals_cmp.priority)
+// Reduces every operator of the innermost group
+#define PARSER_EXPR_REDUCE_ALL (INT_MAX)
+
+enum parser_expr_item_type {
+	PARSER_EXPR_BINARY,
+	PARSER_EXPR_BRACKETS,
+	PARSER_EXPR_CALL,
+	PARSER_EXPR_KEYWORD,
+};
+
+struct parser_expr_item {
+	enum parser_expr_item_type type;
+	enum expression_op_indexes op_idx;
+	// Binary operators take operators of this priority or tighter
+	int rhs_priority;
+	// Calls keep the callee and the arguments closed so far
+	const char *var_name;
+	uint32_t name_id;
+	struct tree_node *args;
+	size_t n_args;
+};
+
+struct parser_expr_state {
+	struct tree_stack items;
+	struct tree_stack operands;
+	size_t n_groups;
+	bool expect_operand;
+};
+
+static void parser_expr_state_dtor(struct expression *expr,
+				   struct parser_expr_state *state) {
+	assert (expr);
+	assert (state);
+
+	struct tree_node **operand = NULL;
+	while ((operand = tree_stack_pop(&state->operands))) {
+		tree_subtree_dtor(&expr->tree, *operand);
+	}
+
+	struct parser_expr_item *item = NULL;
+	while ((item = tree_stack_pop(&state->items))) {
+		if (item->type == PARSER_EXPR_CALL) {
+			tree_subtree_dtor(&expr->tree, item->args);
 		}
 	}
 
-	if (!((tok = lexer_get_token(lexer, *lexer_idx)) &&
-		tok->tok_type == LXTOK_BROUND_OPEN)) {
-		(*lexer_idx)--;
-		return S_CONTINUE;
+	tree_stack_dtor(&state->operands);
+	tree_stack_dtor(&state->items);
+}
+
+static int parser_expr_push_operand(struct expression *expr,
+				    struct parser_expr_state *state,
+				    struct tree_node *node) {
+	assert (expr);
+	assert (state);
+
+	if (!node) {
+		return S_FAIL;
 	}
-	(*lexer_idx)++;
 
-	struct tree_node *call_args = NULL;
-	if (!((tok = lexer_get_token(lexer, *lexer_idx)) &&
-		tok->tok_type == LXTOK_BROUND_CLOSE)) {
+	struct tree_node **operand = tree_stack_push(&state->operands);
+	if (!operand) {
+		tree_subtree_dtor(&expr->tree, node);
+		return S_FAIL;
+	}
 
-		int ret = CALL_PARSER(getCommaSeparatedList, expr, lexer,
-					lexer_idx, &call_args);
-		if (ret) {
-			return PARSER_RET_STATUS(ret);
-		}
+	*operand = node;
+	state->expect_operand = false;
+
+	return S_OK;
+}
+
+static int parser_expr_push_item(struct parser_expr_state *state,
+				 struct parser_expr_item item) {
+	assert (state);
+
+	struct parser_expr_item *top = tree_stack_push(&state->items);
+	if (!top) {
+		return S_FAIL;
 	}
-	
 
-	if (!((tok = lexer_get_token(lexer, *lexer_idx)) &&
-		tok->tok_type == LXTOK_BROUND_CLOSE)) {
-		tnode_recursive_dtor(call_args, NULL);
-		return PARSER_RET_STATUS(S_FAIL);
+	*top = item;
+	if (item.type != PARSER_EXPR_BINARY) {
+		state->n_groups++;
+	}
+	state->expect_operand = true;
+
+	return S_OK;
+}
+
+/**
+ * Reduces the binary operators of the innermost group that cannot take an
+ * operator of the given priority as their right operand.
+ */
+static int parser_expr_reduce(struct expression *expr,
+			      struct parser_expr_state *state, int priority) {
+	assert (expr);
+	assert (state);
+
+	struct parser_expr_item *item = NULL;
+	while ((item = tree_stack_top(&state->items)) &&
+		item->type == PARSER_EXPR_BINARY &&
+		priority > item->rhs_priority) {
+		tree_stack_pop(&state->items);
+
+		struct tree_node *rnode = *(struct tree_node **)tree_stack_pop(&state->operands);
+		struct tree_node **lnode = tree_stack_top(&state->operands);
+		assert (lnode);
+
+		struct tree_node *mnode = expr_create_operator_tnode(expr,
+			expression_operators[item->op_idx], *lnode, rnode);
+
+		if (!mnode) {
+			tree_subtree_dtor(&expr->tree, rnode);
+			return S_FAIL;
+		}
+
+		*lnode = mnode;
 	}
-	(*lexer_idx)++;	
 
-	struct tree_node *func_name = expr_create_variable_tnode(var->var_name);
+	return S_OK;
+}
+
+static struct tree_node *parser_expr_call_tnode(struct expression *expr,
+						 const struct parser_expr_item *call) {
+	assert (expr);
+	assert (call);
+	assert (call->type == PARSER_EXPR_CALL);
+
+	struct tree_node *func_name = expr_create_variable_tnode(expr, call->var_name,
+								 call->name_id);
 
 	if (!func_name) {
-		tnode_recursive_dtor(call_args, NULL);
-		return PARSER_RET_STATUS(S_FAIL);
+		tree_subtree_dtor(&expr->tree, call->args);
+		return NULL;
 	}
 
-	*node = expr_create_operator_tnode(expression_operators[EXPR_IDX_CALL],
-						func_name, call_args);
+	struct tree_node *node = expr_create_operator_tnode(expr,
+		expression_operators[EXPR_IDX_CALL], func_name, call->args);
 
-	if (!(*node)) {
-		tnode_recursive_dtor(call_args, NULL);
-		tnode_recursive_dtor(func_name, NULL);
-		return PARSER_RET_STATUS(S_FAIL);
+	if (!node) {
+		tree_subtree_dtor(&expr->tree, call->args);
+		tree_subtree_dtor(&expr->tree, func_name);
 	}
 
-	return PARSER_RET_STATUS(S_OK);
+	return node;
 }
 
-static int getFunKeywordOp(struct expression *expr, struct lexer *lexer,
-			 size_t *lexer_idx, struct tree_node **node) {
+static int parser_expr_open_call(struct expression *expr, struct lexer *lexer,
+				 size_t *lexer_idx, struct parser_expr_state *state) {
 	assert (expr);
 	assert (lexer);
 	assert (lexer_idx);
-	assert (node);
+	assert (state);
 
-	struct lexer_token *tok = NULL;
-	if (!(tok = lexer_get_token(lexer, *lexer_idx))) {
-		return S_CONTINUE;
+	struct lexer_token *tok = lexer_get_token(lexer, *lexer_idx);
+	assert (tok && tok->tok_type == LXTOK_VARIABLE);
+
+	// Registered only once this is known to be a call
+	struct expression_variable *var = expr_find_variable(expr, tok->name_id);
+	if (!var) {
+		if (expr_push_variable(expr, tok->name_id, &var)) {
+			return PARSER_RET_STATUS(S_FAIL);
+		}
+	}
+
+	*lexer_idx += 2;
+
+	struct parser_expr_item call = {
+		.type = PARSER_EXPR_CALL,
+		.var_name = var->var_name,
+		.name_id = var->name_id,
+	};
+
+	if ((tok = lexer_get_token(lexer, *lexer_idx)) &&
+		tok->tok_type == LXTOK_BROUND_CLOSE) {
+		(*lexer_idx)++;
+
+		return PARSER_RET_STATUS(parser_expr_push_operand(expr, state,
+					 parser_expr_call_tnode(expr, &call)));
+	}
+
+	return PARSER_RET_STATUS(parser_expr_push_item(state, call));
+}
+
+static int parser_expr_operand(struct expression *expr, struct lexer *lexer,
+			       size_t *lexer_idx, struct parser_expr_state *state) {
+	assert (expr);
+	assert (lexer);
+	assert (lexer_idx);
+	assert (state);
+
+	struct lexer_token *tok = lexer_get_token(lexer, *lexer_idx);
+	struct lexer_token *next_tok = lexer_get_token(lexer, *lexer_idx + 1);
+	bool is_bracketed = next_tok && next_tok->tok_type == LXTOK_BROUND_OPEN;
+
+	if (tok && parser_keyword_ops[tok->tok_type].is_keyword) {
+		const struct parser_keyword_op *keyword = &parser_keyword_ops[tok->tok_type];
+
+		if (!is_bracketed) {
+			// A keyword without brackets is skipped when a name follows it
+			(*lexer_idx)++;
+			tok = next_tok;
+			next_tok = lexer_get_token(lexer, *lexer_idx + 1);
+			is_bracketed = next_tok && next_tok->tok_type == LXTOK_BROUND_OPEN;
+
+			if (!(tok && tok->tok_type == LXTOK_VARIABLE)) {
+				PARSER_LOG("Expression item is not detected\n");
+				return PARSER_RET_STATUS(S_FAIL);
+			}
+		} else {
+			*lexer_idx += 2;
+
+			tok = lexer_get_token(lexer, *lexer_idx);
+			bool is_empty = tok && tok->tok_type == LXTOK_BROUND_CLOSE;
+			if (is_empty != (bool)keyword->is_no_arg) {
+				return PARSER_RET_STATUS(S_FAIL);
+			}
+
+			if (is_empty) {
+				(*lexer_idx)++;
+
+				return PARSER_RET_STATUS(parser_expr_push_operand(expr, state,
+					expr_create_operator_tnode(expr,
+						expression_operators[keyword->op_idx],
+						NULL, NULL)));
+			}
+
+			return PARSER_RET_STATUS(parser_expr_push_item(state,
+				(struct parser_expr_item) {
+					.type = PARSER_EXPR_KEYWORD,
+					.op_idx = keyword->op_idx,
+				}));
+		}
+	}
+
+	if (!tok) {
+		PARSER_LOG("Expression item is not detected\n");
+		return PARSER_RET_STATUS(S_FAIL);
 	}
 
-	size_t op_idx = 0;
-	int is_no_arg = 0;
+	struct tree_node *node = NULL;
+	int ret = S_OK;
+
 	switch ((int)tok->tok_type) {
-		case LXTOK_PRINT:
-			op_idx = EXPR_IDX_PRINT;
-			break;
-		case LXTOK_INPUT:
-			op_idx = EXPR_IDX_INPUT;
-			is_no_arg = 1;
-			break;
-		case LXTOK_SQRT:
-			op_idx = EXPR_IDX_SQRT;
-			break;
-		case LXTOK_RETURN:
-			op_idx = EXPR_IDX_RETURN;
-			break;
-		case LXTOK_SCRHT:
-			op_idx = EXPR_IDX_SCRHT;
-			is_no_arg = 1;
-			break;
-		case LXTOK_SCRWT:
-			op_idx = EXPR_IDX_SCRWT;
-			is_no_arg = 1;
+		case LXTOK_NUMBER:
+			ret = getNumber(expr, lexer, lexer_idx, &node);
 			break;
-		case LXTOK_DRAW:
-			op_idx = EXPR_IDX_DRAW;
-			break;
-		case LXTOK_MEM_READ:
-			op_idx = EXPR_IDX_MEM_READ;
+		case LXTOK_VARIABLE:
+			if (is_bracketed) {
+				return PARSER_RET_STATUS(parser_expr_open_call(expr, lexer,
+							lexer_idx, state));
+			}
+
+			ret = getVariable(expr, lexer, lexer_idx, &node);
 			break;
+		case LXTOK_BROUND_OPEN:
+			(*lexer_idx)++;
+
+			return PARSER_RET_STATUS(parser_expr_push_item(state,
+				(struct parser_expr_item) {.type = PARSER_EXPR_BRACKETS}));
 		default:
-			return S_CONTINUE;
+			PARSER_LOG("Expression item is not detected\n");
+			return PARSER_RET_STATUS(S_FAIL);
 	}
 
-	(*lexer_idx)++;
+	if (ret) {
+		return PARSER_RET_STATUS(S_FAIL);
+	}
 
-	struct tree_node *lnode = NULL;
+	return PARSER_RET_STATUS(parser_expr_push_operand(expr, state, node));
+}
 
-	int ret = 0;
-	ret = CALL_PARSER(getRoundBracketsExpression, expr,
-					lexer, lexer_idx, &lnode);
-	if (ret != S_OK && ret != S_EMPTY_EXPRESSION) {
-		return PARSER_RET_STATUS(ret);
-	}
+/**
+ * Closes the innermost group on a closing bracket or, for calls, on a comma
+ * that starts the next argument.
+ */
+static int parser_expr_close(struct expression *expr, struct parser_expr_state *state,
+			     bool is_comma) {
+	assert (expr);
+	assert (state);
 
-	if (!is_no_arg && ret == S_EMPTY_EXPRESSION) {
-		return PARSER_RET_STATUS(S_FAIL);
+	if (parser_expr_reduce(expr, state, PARSER_EXPR_REDUCE_ALL)) {
+		return S_FAIL;
 	}
-	if (is_no_arg && ret != S_EMPTY_EXPRESSION) {
-		return PARSER_RET_STATUS(S_FAIL);
+
+	struct parser_expr_item *item = tree_stack_top(&state->items);
+	assert (item && item->type != PARSER_EXPR_BINARY);
+
+	if (is_comma && item->type != PARSER_EXPR_CALL) {
+		PARSER_LOG("Comma outside of an arguments list\n");
+		return S_FAIL;
 	}
 
-	*node = expr_create_operator_tnode(expression_operators[op_idx], lnode, NULL);
+	struct tree_node *operand = *(struct tree_node **)tree_stack_pop(&state->operands);
+	struct tree_node *node = NULL;
 
-	if (!(*node)) {
-		tnode_recursive_dtor(lnode, NULL);
-		return PARSER_RET_STATUS(S_FAIL);
+	switch (item->type) {
+		case PARSER_EXPR_BRACKETS:
+			node = operand;
+			break;
+		case PARSER_EXPR_KEYWORD:
+			node = expr_create_operator_tnode(expr,
+				expression_operators[item->op_idx], operand, NULL);
+
+			if (!node) {
+				tree_subtree_dtor(&expr->tree, operand);
+			}
+			break;
+		case PARSER_EXPR_CALL:
+			if (parser_list_append(expr, EXPR_IDX_COMMA, &item->args,
+					       &item->n_args, operand)) {
+				tree_subtree_dtor(&expr->tree, operand);
+				return S_FAIL;
+			}
+
+			if (is_comma) {
+				state->expect_operand = true;
+				return S_OK;
+			}
+
+			node = parser_expr_call_tnode(expr, item);
+			// The arguments are owned by the call node or freed
+			item->args = NULL;
+			break;
+		case PARSER_EXPR_BINARY:
+		default:
+			assert (0 && "Unexpected group");
+			break;
 	}
 
-	return PARSER_RET_STATUS(S_OK);
+	tree_stack_pop(&state->items);
+	state->n_groups--;
+
+	return parser_expr_push_operand(expr, state, node);
 }
 
-static int getC(struct expression *expr, struct lexer *lexer,
+static int getComprasion(struct expression *expr, struct lexer *lexer,
 			 size_t *lexer_idx, struct tree_node **node) {
 	assert (expr);
 	assert (lexer);
 	assert (lexer_idx);
 	assert (node);
 
-	int ret = 0;
+	struct parser_expr_state state = {.expect_operand = true};
+	tree_stack_ctor(&state.items, sizeof(struct parser_expr_item));
+	tree_stack_ctor(&state.operands, sizeof(struct tree_node *));
 
-	if ((ret = CALL_PARSER(getNumber, expr, lexer, lexer_idx, node)) != S_CONTINUE) {
-		return PARSER_RET_STATUS(ret);
-	}
+	int ret = S_OK;
+	while (!ret) {
+		if (state.expect_operand) {
+			ret = parser_expr_operand(expr, lexer, lexer_idx, &state);
+			continue;
+		}
 
-	if ((ret = CALL_PARSER(getFunKeywordOp, expr, lexer, lexer_idx, node)) != S_CONTINUE) {
-		return PARSER_RET_STATUS(ret);
+		struct lexer_token *tok = lexer_get_token(lexer, *lexer_idx);
+		const struct parser_infix_op *infix = tok ? &parser_infix_ops[tok->tok_type] : NULL;
+		const struct expression_operator *op = infix && infix->is_infix ?
+			expression_operators[infix->op_idx] : NULL;
+
+		if (op && op->priority <= PARSER_EXPR_MAX_PRIORITY) {
+			(*lexer_idx)++;
+
+			if (!(ret = parser_expr_reduce(expr, &state, op->priority))) {
+				ret = parser_expr_push_item(&state, (struct parser_expr_item) {
+					.type = PARSER_EXPR_BINARY,
+					.op_idx = infix->op_idx,
+					.rhs_priority = infix->right_assoc ?
+						op->priority : op->priority - 1,
+				});
+			}
+			continue;
+		}
+
+		// The expression ends at the first token it cannot take
+		if (!state.n_groups) {
+			break;
+		}
+
+		if (tok && (tok->tok_type == LXTOK_BROUND_CLOSE ||
+			    tok->tok_type == LXTOK_COMMA)) {
+			(*lexer_idx)++;
+
+			ret = parser_expr_close(expr, &state, tok->tok_type == LXTOK_COMMA);
+			continue;
+		}
+
+		PARSER_LOG("Unclosed bracket in expression\n");
+		ret = S_FAIL;
 	}
 
-	if ((ret = CALL_PARSER(getFunctionCall, expr, lexer, lexer_idx, node)) != S_CONTINUE) {
-		return PARSER_RET_STATUS(ret);
+	if (!ret) {
+		ret = parser_expr_reduce(expr, &state, PARSER_EXPR_REDUCE_ALL);
 	}
 
-	if ((ret = CALL_PARSER(getVariable, expr, lexer, lexer_idx, node)) != S_CONTINUE) {
-		return PARSER_RET_STATUS(ret);
+	if (!ret) {
+		assert (state.operands.len == 1);
+		*node = *(struct tree_node **)tree_stack_pop(&state.operands);
 	}
 
-	eprintf("Expression item is not detected\n");
+	parser_expr_state_dtor(expr, &state);
 
-	return PARSER_RET_STATUS(S_FAIL);
+	return PARSER_RET_STATUS(ret);
 }
 
 static int getRoundBracketsExpression(struct expression *expr, struct lexer *lexer,
@@ -280,7 +597,7 @@ static int getRoundBracketsExpression(struct expression *expr, struct lexer *lex
 
 		if (!((tok = lexer_get_token(lexer, *lexer_idx)) &&
 			tok->tok_type == LXTOK_BROUND_CLOSE)) {
-			if ((ret = CALL_PARSER(getComprasion, expr, lexer, lexer_idx, node))) {
+			if ((ret = getComprasion(expr, lexer, lexer_idx, node))) {
 				return PARSER_RET_STATUS(ret);
 			}
 
@@ -302,7 +619,7 @@ static int getRoundBracketsExpression(struct expression *expr, struct lexer *lex
 	return S_CONTINUE;
 }
 
-static int getPrimaryExpression(struct expression *expr, struct lexer *lexer,
+static int getDeclarationOrAssignment(struct expression *expr, struct lexer *lexer,
 			 size_t *lexer_idx, struct tree_node **node) {
 	assert (expr);
 	assert (lexer);
@@ -311,72 +628,53 @@ static int getPrimaryExpression(struct expression *expr, struct lexer *lexer,
 
 	int ret = 0;
 
-	struct lexer_token *tok = NULL;
-	if ((tok = lexer_get_token(lexer, *lexer_idx)) && tok->tok_type == LXTOK_BROUND_OPEN) {
-		(*lexer_idx)++;
-
-		if ((ret = CALL_PARSER(getComprasion, expr, lexer, lexer_idx, node))) {
-			return PARSER_RET_STATUS(ret);
-		}
-
-		if (!((tok = lexer_get_token(lexer, *lexer_idx)) &&
-			tok->tok_type == LXTOK_BROUND_CLOSE)) {
-			tnode_recursive_dtor(*node, NULL);
-			*node = NULL;
-			return PARSER_RET_STATUS(S_FAIL);
-		}
-		(*lexer_idx)++;
-
-		return PARSER_RET_STATUS(S_OK);
+	struct tree_node *lnode = NULL;
+	if (getVariable(expr, lexer, lexer_idx, &lnode)) {
+		return S_CONTINUE;
 	}
 
-	ret = CALL_PARSER(getC, expr, lexer, lexer_idx, node);
-	return PARSER_RET_STATUS(ret);
-}
-
-static int getPow(struct expression *expr, struct lexer *lexer,
-			 size_t *lexer_idx, struct tree_node **node) {
-	assert (expr);
-	assert (lexer);
-	assert (lexer_idx);
-	assert (node);
-
-	int ret = 0;
-
-	struct tree_node *lnode = NULL;
-	if ((ret = CALL_PARSER(getPrimaryExpression, expr, lexer, lexer_idx, &lnode))) {
-		return PARSER_RET_STATUS(ret);
+	struct lexer_token *next_tok = lexer_get_token(lexer, *lexer_idx);
+	if (!next_tok) {
+		tree_subtree_dtor(&expr->tree, lnode);
+		(*lexer_idx)--;
+		return S_CONTINUE;
 	}
 
-	struct lexer_token *tok = NULL;
-	if ((tok = lexer_get_token(lexer, *lexer_idx)) && tok->tok_type == LXTOK_POW) {
-		(*lexer_idx)++;
+	enum expression_op_indexes op_idx = 0;
+	if (next_tok->tok_type == LXTOK_DECL_ASSIGN) {
+		op_idx = EXPR_IDX_DECL_ASSIGN;
+	} else if (next_tok->tok_type == LXTOK_ASSIGN) {
+		op_idx = EXPR_IDX_ASSIGN;
+	}  else if (next_tok->tok_type == LXTOK_MEM_WRITE) {
+		op_idx = EXPR_IDX_MEM_WRITE;
+	} else {
+		tree_subtree_dtor(&expr->tree, lnode);
+		(*lexer_idx)--;
+		return S_CONTINUE;
+	}
 
-		struct tree_node *rnode = NULL;
-		if ((ret = CALL_PARSER(getPow, expr, lexer, lexer_idx, &rnode))) {
-			tnode_recursive_dtor(lnode, NULL);
-			return PARSER_RET_STATUS(ret);
-		}
+	(*lexer_idx)++;
 
-		struct tree_node *mnode = expr_create_operator_tnode(
-			expression_operators[EXPR_IDX_POW], lnode, rnode);
+	struct tree_node *rnode = NULL;
+	if ((ret = getComprasion(expr, lexer, lexer_idx, &rnode))) {
+		tree_subtree_dtor(&expr->tree, lnode);
+		return PARSER_RET_STATUS(ret);
+	}	
 
-		if (!mnode) {
-			tnode_recursive_dtor(lnode, NULL);
-			tnode_recursive_dtor(rnode, NULL);
-			return PARSER_RET_STATUS(S_FAIL);
-		}
+	*node = expr_create_operator_tnode(expr,
+		expression_operators[op_idx], lnode, rnode);
 
-		lnode = mnode;
+	if (!(*node)) {
+		tree_subtree_dtor(&expr->tree, lnode);
+		tree_subtree_dtor(&expr->tree, rnode);
+		return PARSER_RET_STATUS(S_FAIL);
 	}
 
-	*node = lnode;
-
 	return PARSER_RET_STATUS(S_OK);
 }
 
-static int getTerm(struct expression *expr, struct lexer *lexer,
-			 size_t *lexer_idx, struct tree_node **node) {
+static int getStatement(struct expression *expr, struct lexer *lexer,
+				  size_t *lexer_idx, struct tree_node **node) {
 	assert (expr);
 	assert (lexer);
 	assert (lexer_idx);
@@ -384,49 +682,247 @@ static int getTerm(struct expression *expr, struct lexer *lexer,
 
 	int ret = 0;
 
-	struct tree_node *lnode = NULL;
-	if ((ret = CALL_PARSER(getPow, expr, lexer, lexer_idx, &lnode))) {
-		return PARSER_RET_STATUS(ret);
-	}
-
 	struct lexer_token *tok = NULL;
-	while ((tok = lexer_get_token(lexer, *lexer_idx)) &&
-		((tok->tok_type == LXTOK_MULTIPLY || tok->tok_type == LXTOK_DIVIDE))) {
+	if (((tok = lexer_get_token(lexer, *lexer_idx)) &&
+		tok->tok_type == LXTOK_SEMICOLON)) {
+		*node = NULL;
 
 		(*lexer_idx)++;
 
-		struct tree_node *rnode = NULL;
-		if ((ret = CALL_PARSER(getPow, expr, lexer, lexer_idx, &rnode))) {
-			tnode_recursive_dtor(lnode, NULL);
+		return PARSER_RET_STATUS(S_OK);
+	}
+
+	if ((ret = getDeclarationOrAssignment(expr, lexer, lexer_idx, node))
+			!= S_CONTINUE) {
+		if (ret) {
 			return PARSER_RET_STATUS(ret);
 		}
+	} else if ((ret = getComprasion(expr, lexer, lexer_idx, node))) {
+		return PARSER_RET_STATUS(ret);
+	}
+
+	if (!((tok = lexer_get_token(lexer, *lexer_idx)) &&
+		tok->tok_type == LXTOK_SEMICOLON)) {
+		tree_subtree_dtor(&expr->tree, *node);
+		*node = NULL;
+		PARSER_LOG("Did you forget semicolon?\n");
+		return PARSER_RET_STATUS(S_FAIL);
+	}
 
-		struct tree_node *mnode = NULL;
+	(*lexer_idx)++;
 
-		if (tok->tok_type == LXTOK_MULTIPLY) {
-			mnode = expr_create_operator_tnode(
-				expression_operators[EXPR_IDX_MULTIPLY], lnode, rnode);
+	return PARSER_RET_STATUS(S_OK);
+}
+
+/*
+ * Code blocks nest through conditionals and cycles, the blocks waiting for
+ * their bodies are kept on an explicit stack.
+ */
+
+enum parser_block_type {
+	PARSER_BLOCK_BRACES,
+	PARSER_BLOCK_IF,
+	PARSER_BLOCK_ELSE,
+	PARSER_BLOCK_WHILE,
+};
+
+struct parser_block {
+	enum parser_block_type type;
+	struct tree_node *cond;
+	struct tree_node *positive;
+	// Statements of braces
+	struct tree_node *list;
+	size_t n_statements;
+};
+
+static void parser_blocks_dtor(struct expression *expr, struct tree_stack *blocks) {
+	assert (expr);
+	assert (blocks);
 
-		} else if (tok->tok_type == LXTOK_DIVIDE) {
-			mnode = expr_create_operator_tnode(
-				expression_operators[EXPR_IDX_DIVIDE], lnode, rnode);
+	struct parser_block *block = NULL;
+	while ((block = tree_stack_pop(blocks))) {
+		tree_subtree_dtor(&expr->tree, block->cond);
+		tree_subtree_dtor(&expr->tree, block->positive);
+		tree_subtree_dtor(&expr->tree, block->list);
+	}
+
+	tree_stack_dtor(blocks);
+}
+
+static struct tree_node *parser_block_tnode(struct expression *expr,
+					    struct parser_block *block,
+					    struct tree_node *body) {
+	assert (expr);
+	assert (block);
+
+	struct tree_node *lnode = block->cond;
+	struct tree_node *positive = block->positive;
+	struct tree_node *rnode = body;
+	size_t op_idx = block->type == PARSER_BLOCK_WHILE ? EXPR_IDX_WHILE : EXPR_IDX_IF;
+
+	*block = (struct parser_block){0};
+
+	if (op_idx == EXPR_IDX_IF) {
+		rnode = expr_create_operator_tnode(expr,
+			expression_operators[EXPR_IDX_ELSE], positive, body);
+
+		if (!rnode) {
+			tree_subtree_dtor(&expr->tree, lnode);
+			tree_subtree_dtor(&expr->tree, positive);
+			tree_subtree_dtor(&expr->tree, body);
+			return NULL;
 		}
+	}
 
-		if (!mnode) {
-			tnode_recursive_dtor(lnode, NULL);
-			tnode_recursive_dtor(rnode, NULL);
-			return PARSER_RET_STATUS(S_FAIL);
+	struct tree_node *node = expr_create_operator_tnode(expr,
+		expression_operators[op_idx], lnode, rnode);
+
+	if (!node) {
+		tree_subtree_dtor(&expr->tree, lnode);
+		tree_subtree_dtor(&expr->tree, rnode);
+	}
+
+	return node;
+}
+
+/**
+ * Hands the parsed statement *item to the innermost waiting block and closes
+ * every block it completes. *item is left to the caller once no block waits
+ * for it. Sets *open_body when the next block body starts.
+ */
+static int parser_blocks_complete(struct expression *expr, struct lexer *lexer,
+				  size_t *lexer_idx, struct tree_stack *blocks,
+				  struct tree_node **item, bool *open_body) {
+	assert (expr);
+	assert (lexer);
+	assert (lexer_idx);
+	assert (blocks);
+	assert (item);
+	assert (open_body);
+
+	*open_body = false;
+
+	struct parser_block *block = NULL;
+	while ((block = tree_stack_top(blocks))) {
+		struct lexer_token *tok = NULL;
+
+		switch (block->type) {
+			case PARSER_BLOCK_BRACES:
+				if (*item && parser_list_append(expr, EXPR_IDX_SEMICOLON,
+						&block->list, &block->n_statements, *item)) {
+					tree_subtree_dtor(&expr->tree, *item);
+					*item = NULL;
+					return S_FAIL;
+				}
+
+				*item = NULL;
+				return S_OK;
+			case PARSER_BLOCK_IF:
+				block->positive = *item;
+				block->type = PARSER_BLOCK_ELSE;
+				*item = NULL;
+
+				if ((tok = lexer_get_token(lexer, *lexer_idx)) &&
+					tok->tok_type == LXTOK_ELSE) {
+					(*lexer_idx)++;
+					*open_body = true;
+					return S_OK;
+				}
+				break;
+			case PARSER_BLOCK_ELSE:
+			case PARSER_BLOCK_WHILE:
+				break;
+			default:
+				assert (0 && "Unexpected block");
+				break;
 		}
 
-		lnode = mnode;
+		*item = parser_block_tnode(expr, block, *item);
+		tree_stack_pop(blocks);
+
+		if (!*item) {
+			return S_FAIL;
+		}
 	}
 
-	*node = lnode;
+	return S_OK;
+}
 
-	return PARSER_RET_STATUS(S_OK);
+static int getCodeBlock(struct expression *expr, struct lexer *lexer,
+				  size_t *lexer_idx, struct tree_node **node) {
+	assert (expr);
+	assert (lexer);
+	assert (lexer_idx);
+	assert (node);
+
+	struct tree_stack blocks = {0};
+	tree_stack_ctor(&blocks, sizeof(struct parser_block));
+
+	int ret = S_OK;
+	bool open_body = true;
+	while (!ret) {
+		struct lexer_token *tok = lexer_get_token(lexer, *lexer_idx);
+		enum LexerTokenType tok_type = tok ? tok->tok_type : LXTOK_N_TYPES;
+		struct parser_block *block = NULL;
+		struct tree_node *item = NULL;
+
+		if (open_body && tok_type == LXTOK_BCURLY_OPEN) {
+			(*lexer_idx)++;
+
+			if (!(block = tree_stack_push(&blocks))) {
+				ret = S_FAIL;
+				continue;
+			}
+
+			*block = (struct parser_block){.type = PARSER_BLOCK_BRACES};
+			open_body = false;
+			continue;
+		}
+
+		if (!open_body && tok_type == LXTOK_BCURLY_CLOSE) {
+			(*lexer_idx)++;
+
+			block = tree_stack_pop(&blocks);
+			assert (block && block->type == PARSER_BLOCK_BRACES);
+			item = block->list;
+		} else if (tok_type == LXTOK_IF || tok_type == LXTOK_WHILE) {
+			(*lexer_idx)++;
+
+			struct tree_node *cond = NULL;
+			if (getRoundBracketsExpression(expr, lexer, lexer_idx, &cond)) {
+				ret = S_FAIL;
+				continue;
+			}
+
+			if (!(block = tree_stack_push(&blocks))) {
+				tree_subtree_dtor(&expr->tree, cond);
+				ret = S_FAIL;
+				continue;
+			}
+
+			*block = (struct parser_block) {
+				.type = tok_type == LXTOK_IF ? PARSER_BLOCK_IF : PARSER_BLOCK_WHILE,
+				.cond = cond,
+			};
+			open_body = true;
+			continue;
+		} else if ((ret = getStatement(expr, lexer, lexer_idx, &item))) {
+			continue;
+		}
+
+		ret = parser_blocks_complete(expr, lexer, lexer_idx, &blocks, &item, &open_body);
+		if (!ret && !blocks.len) {
+			*node = item;
+			break;
+		}
+	}
+
+	parser_blocks_dtor(expr, &blocks);
+
+	return PARSER_RET_STATUS(ret);
 }
 
-static int getExpression(struct expression *expr, struct lexer *lexer,
+static int getCommaSeparatedList(struct expression *expr, struct lexer *lexer,
 			 size_t *lexer_idx, struct tree_node **node) {
 	assert (expr);
 	assert (lexer);
@@ -436,47 +932,36 @@ static int getExpression(struct expression *expr, struct lexer *lexer,
 	int ret = 0;
 
 	struct tree_node *lnode = NULL;
-	if ((ret = CALL_PARSER(getTerm, expr, lexer, lexer_idx, &lnode))) {
+	if ((ret = getComprasion(expr, lexer, lexer_idx, &lnode))) {
 		return PARSER_RET_STATUS(ret);
 	}
+	size_t n_items = 1;
 
 	struct lexer_token *tok = NULL;
 	while ((tok = lexer_get_token(lexer, *lexer_idx)) &&
-		((tok->tok_type == LXTOK_PLUS || tok->tok_type == LXTOK_MINUS))) {
+		tok->tok_type == LXTOK_COMMA) {
 		(*lexer_idx)++;
 
 		struct tree_node *rnode = NULL;
-		if ((ret = CALL_PARSER(getTerm, expr, lexer, lexer_idx, &rnode))) {
-			tnode_recursive_dtor(lnode, NULL);
+		if ((ret = getComprasion(expr, lexer, lexer_idx, &rnode))) {
+			tree_subtree_dtor(&expr->tree, lnode);
 			return PARSER_RET_STATUS(ret);
 		}
 
-		struct tree_node *mnode = NULL;
-
-		if (tok->tok_type == LXTOK_PLUS) {
-			mnode = expr_create_operator_tnode(
-				expression_operators[EXPR_IDX_PLUS], lnode, rnode);
-
-		} else if (tok->tok_type == LXTOK_MINUS) {
-			mnode = expr_create_operator_tnode(
-				expression_operators[EXPR_IDX_MINUS], lnode, rnode);
-		}
-
-		if (!mnode) {
-			tnode_recursive_dtor(lnode, NULL);
-			tnode_recursive_dtor(rnode, NULL);
+		if (parser_list_append(expr, EXPR_IDX_COMMA, &lnode, &n_items, rnode)) {
+			tree_subtree_dtor(&expr->tree, lnode);
+			tree_subtree_dtor(&expr->tree, rnode);
 			return PARSER_RET_STATUS(S_FAIL);
 		}
-
-		lnode = mnode;
 	}
 
 	*node = lnode;
 
 	return PARSER_RET_STATUS(S_OK);
+
 }
 
-static int getComprasion(struct expression *expr, struct lexer *lexer,
+static int getArgumentsList(struct expression *expr, struct lexer *lexer,
 			 size_t *lexer_idx, struct tree_node **node) {
 	assert (expr);
 	assert (lexer);
@@ -485,622 +970,653 @@ static int getComprasion(struct expression *expr, struct lexer *lexer,
 
 	int ret = 0;
 
-	struct tree_node *lnode = NULL;
-	if ((ret = CALL_PARSER(getExpression, expr, lexer, lexer_idx, &lnode))) {
-		return PARSER_RET_STATUS(ret);
-	}
-
 	struct lexer_token *tok = NULL;
-	while ((tok = lexer_get_token(lexer, *lexer_idx)) &&
-		(tok->tok_type == LXTOK_EQUALS_CMP	||
-		 tok->tok_type == LXTOK_GREATER_CMP	||
-		 tok->tok_type == LXTOK_LESS_CMP	||
-		 tok->tok_type == LXTOK_NOT_EQUALS_CMP	||
-		 tok->tok_type == LXTOK_GREATER_EQ_CMP	||
-		 tok->tok_type == LXTOK_LESS_EQ_CMP	||
-		// TODO: MOVE OUT OF COMPRASION
-		 tok->tok_type == LXTOK_SHL		||
-		 tok->tok_type == LXTOK_SHR		||
-		 tok->tok_type == LXTOK_BITAND		||
-		 tok->tok_type == LXTOK_BITOR		)) {	
 
+	if ((tok = lexer_get_token(lexer, *lexer_idx)) &&
+		tok->tok_type == LXTOK_BROUND_OPEN) {
 		(*lexer_idx)++;
 
-		struct tree_node *rnode = NULL;
-		if ((ret = CALL_PARSER(getExpression, expr, lexer, lexer_idx, &rnode))) {
-			tnode_recursive_dtor(lnode, NULL);
-			return PARSER_RET_STATUS(ret);
-		}
+		if (!((tok = lexer_get_token(lexer, *lexer_idx)) &&
+			tok->tok_type == LXTOK_BROUND_CLOSE)) {
+			if ((ret = getCommaSeparatedList(expr, lexer,
+						lexer_idx, node))) {
+				return PARSER_RET_STATUS(ret);
+			}
 
-		struct tree_node *mnode = NULL;
-		size_t op_idx = 0;
-		switch ((int)tok->tok_type) {
-			case LXTOK_EQUALS_CMP:
-				op_idx = EXPR_IDX_EQUALS_CMP;
-				break;
-			case LXTOK_GREATER_CMP:
-				op_idx = EXPR_IDX_GREATER_CMP;
-				break;
-			case LXTOK_LESS_CMP:
-				op_idx = EXPR_IDX_LESS_CMP;
-				break;
-			case LXTOK_NOT_EQUALS_CMP:
-				op_idx = EXPR_IDX_NOT_EQUALS_CMP;
-				break;
-			case LXTOK_GREATER_EQ_CMP:
-				op_idx = EXPR_IDX_GREATER_EQ_CMP;
-				break;
-			case LXTOK_LESS_EQ_CMP:
-				op_idx = EXPR_IDX_LESS_EQ_CMP;
-				break;
-			case LXTOK_SHL:
-				op_idx = EXPR_IDX_SHL;
-				break;
-			case LXTOK_SHR:
-				op_idx = EXPR_IDX_SHR;
-				break;
-			case LXTOK_BITAND:
-				op_idx = EXPR_IDX_BITAND;
-				break;
-			case LXTOK_BITOR:
-				op_idx = EXPR_IDX_BITOR;
-				break;
-			default:
-				assert (0 && "unreachable");
-				break;
+			ret = S_OK;
+		} else {
+			*node = NULL;
+			ret = S_OK;
 		}
 
-		mnode = expr_create_operator_tnode(
-				expression_operators[op_idx], lnode, rnode);
-		
-
-		if (!mnode) {
-			tnode_recursive_dtor(lnode, NULL);
-			tnode_recursive_dtor(rnode, NULL);
+		if (!((tok = lexer_get_token(lexer, *lexer_idx)) &&
+			tok->tok_type == LXTOK_BROUND_CLOSE)) {
 			return PARSER_RET_STATUS(S_FAIL);
 		}
+		(*lexer_idx)++;
 
-		lnode = mnode;
-	}
 
-	*node = lnode;
+		return ret;
+	}
 
-	return PARSER_RET_STATUS(S_OK);
+	return S_CONTINUE;
 }
 
-static int getDeclarationOrAssignment(struct expression *expr, struct lexer *lexer,
-			 size_t *lexer_idx, struct tree_node **node) {
+static int getFunc(struct expression *expr, struct lexer *lexer,
+				size_t *lexer_idx, struct tree_node **node) {
 	assert (expr);
 	assert (lexer);
 	assert (lexer_idx);
 	assert (node);
 
 	int ret = 0;
+	struct lexer_token *tok = NULL;
+	if (!((tok = lexer_get_token(lexer, *lexer_idx)) &&
+		tok->tok_type == LXTOK_FUNC)) {
+		return PARSER_RET_STATUS(S_FAIL);
+	}
 
-	struct tree_node *lnode = NULL;
-	if (CALL_PARSER(getVariable, expr, lexer, lexer_idx, &lnode)) {
-		return S_CONTINUE;
+	(*lexer_idx)++;
+
+	struct tree_node *func_name = NULL;
+	if (getVariable(expr, lexer, lexer_idx, &func_name)) {
+		return PARSER_RET_STATUS(S_FAIL);
 	}
 
-	struct lexer_token *next_tok = lexer_get_token(lexer, *lexer_idx);
-	if (!next_tok) {
-		tnode_recursive_dtor(lnode, NULL);
-		(*lexer_idx)--;
-		return S_CONTINUE;
+	int is_main = 0;
+	if (func_name->value.name_id == intern_find(&expr->names, "main", 4)) {
+		is_main = 1;
 	}
 
-	enum expression_op_indexes op_idx = 0;
-	if (next_tok->tok_type == LXTOK_DECL_ASSIGN) {
-		op_idx = EXPR_IDX_DECL_ASSIGN;
-	} else if (next_tok->tok_type == LXTOK_ASSIGN) {
-		op_idx = EXPR_IDX_ASSIGN;
-	}  else if (next_tok->tok_type == LXTOK_MEM_WRITE) {
-		op_idx = EXPR_IDX_MEM_WRITE;
-	} else {
-		tnode_recursive_dtor(lnode, NULL);
-		(*lexer_idx)--;
-		return S_CONTINUE;
+	struct tree_node *args_list = NULL;
+	if (getArgumentsList(expr, lexer, lexer_idx, &args_list)) {
+		tree_subtree_dtor(&expr->tree, func_name);
+		return PARSER_RET_STATUS(S_FAIL);
 	}
 
-	(*lexer_idx)++;
+	struct tree_node *func_body = NULL;
+	if (getCodeBlock(expr, lexer, lexer_idx, &func_body)) {
+		tree_subtree_dtor(&expr->tree, func_name);
+		tree_subtree_dtor(&expr->tree, args_list);
+		return PARSER_RET_STATUS(S_FAIL);
+	}
 
-	struct tree_node *rnode = NULL;
-	if ((ret = CALL_PARSER(getComprasion, expr, lexer, lexer_idx, &rnode))) {
-		tnode_recursive_dtor(lnode, NULL);
-		return PARSER_RET_STATUS(ret);
-	}	
 
-	*node = expr_create_operator_tnode(
-		expression_operators[op_idx], lnode, rnode);
+	struct tree_node *func_declaration = expr_create_operator_tnode(expr,
+		expression_operators[EXPR_IDX_COMMA], func_name, args_list);
 
-	if (!(*node)) {
-		tnode_recursive_dtor(lnode, NULL);
-		tnode_recursive_dtor(rnode, NULL);
+	if (!func_declaration) {
+		tree_subtree_dtor(&expr->tree, func_name);
+		tree_subtree_dtor(&expr->tree, args_list);
+		tree_subtree_dtor(&expr->tree, func_body);
+		return PARSER_RET_STATUS(S_FAIL);
+	}
+	func_name = NULL;
+	args_list = NULL;
+
+	size_t func_idx = is_main ? EXPR_IDX_MAIN : EXPR_IDX_FUNC;
+
+	struct tree_node *func = expr_create_operator_tnode(expr,
+		expression_operators[func_idx], func_declaration, func_body);
+
+	if (!func) {
+		tree_subtree_dtor(&expr->tree, func_declaration);
+		tree_subtree_dtor(&expr->tree, func_body);
 		return PARSER_RET_STATUS(S_FAIL);
 	}
+	func_declaration = NULL;
+	func_body = NULL;
+
+	*node = func;
 
 	return PARSER_RET_STATUS(S_OK);
 }
 
-static int getStatement(struct expression *expr, struct lexer *lexer,
-				  size_t *lexer_idx, struct tree_node **node) {
+static int getFunctions(struct expression *expr, struct lexer *lexer,
+				size_t *lexer_idx, struct tree_node **node) {
 	assert (expr);
 	assert (lexer);
 	assert (lexer_idx);
 	assert (node);
 
 	int ret = 0;
-
 	struct lexer_token *tok = NULL;
-	if (((tok = lexer_get_token(lexer, *lexer_idx)) &&
-		tok->tok_type == LXTOK_SEMICOLON)) {
-		*node = NULL;
-
-		(*lexer_idx)++;
-
-		return PARSER_RET_STATUS(S_OK);
-	}
+	struct tree_node *lnode = NULL;
+	size_t n_funcs = 0;
+	while (((tok = lexer_get_token(lexer, *lexer_idx)) &&
+		tok->tok_type == LXTOK_FUNC)) {
 
-	if ((ret = CALL_PARSER(getDeclarationOrAssignment, expr, lexer, lexer_idx, node))
-			!= S_CONTINUE) {
-		if (ret) {
+		struct tree_node *rnode = NULL;
+		if ((ret = getFunc(expr, lexer, lexer_idx, &rnode))) {
+			tree_subtree_dtor(&expr->tree, lnode);
 			return PARSER_RET_STATUS(ret);
 		}
-	} else if ((ret = CALL_PARSER(getComprasion, expr, lexer, lexer_idx, node))) {
-		return PARSER_RET_STATUS(ret);
-	}
 
-	if (!((tok = lexer_get_token(lexer, *lexer_idx)) &&
-		tok->tok_type == LXTOK_SEMICOLON)) {
-		tnode_recursive_dtor(*node, NULL);
-		*node = NULL;
-		eprintf("Did you forget semicolon?\n");
-		return PARSER_RET_STATUS(S_FAIL);
+		if (!rnode) {
+			continue;
+		}
+
+		if (parser_list_append(expr, EXPR_IDX_SEMICOLON, &lnode, &n_funcs, rnode)) {
+			tree_subtree_dtor(&expr->tree, lnode);
+			tree_subtree_dtor(&expr->tree, rnode);
+			return PARSER_RET_STATUS(S_FAIL);
+		}
 	}
 
-	(*lexer_idx)++;
+	*node = lnode;
 
 	return PARSER_RET_STATUS(S_OK);
 }
 
-static int getConditionalExpression(struct expression *expr, struct lexer *lexer,
+static int getTerminator(struct expression *expr, struct lexer *lexer,
 			 size_t *lexer_idx, struct tree_node **node) {
 	assert (expr);
 	assert (lexer);
 	assert (lexer_idx);
 	assert (node);
 
-	struct lexer_token *tok = NULL;
-	if (!(tok = lexer_get_token(lexer, *lexer_idx))) {
-		return S_CONTINUE;
-	}
-	if (tok->tok_type != LXTOK_IF) {
-		return S_CONTINUE;
+	if (!lexer_get_token(lexer, *lexer_idx)) {
+		return PARSER_RET_STATUS(S_OK);
 	}
+	
+	return PARSER_RET_STATUS(S_FAIL);
+}
 
-	(*lexer_idx)++;
+static int getG(struct expression *expr, struct lexer *lexer,
+		size_t *lexer_idx, struct tree_node **node) {
+	assert (expr);
+	assert (lexer);
+	assert (lexer_idx);
+	assert (node);
 
 	int ret = 0;
 
-	struct tree_node *if_expr_node = NULL;
-	ret = getRoundBracketsExpression(expr, lexer, lexer_idx, &if_expr_node);
-	if (ret) {
+	if ((ret = getFunctions(expr, lexer, lexer_idx, node))) {
 		return PARSER_RET_STATUS(ret);
 	}
 
-	struct tree_node *if_positive_node = NULL;
-	ret = getCodeBlock(expr, lexer, lexer_idx, &if_positive_node);
-	if (ret) {
-		tnode_recursive_dtor(if_expr_node, NULL);
+	if ((ret = getTerminator(expr, lexer, lexer_idx, node))) {
+		tree_subtree_dtor(&expr->tree, *node);
+		*node = NULL;
 		return PARSER_RET_STATUS(ret);
 	}
 
-	struct tree_node *if_negative_node = NULL;
+	return PARSER_RET_STATUS(S_OK);
+}
 
-	if (((tok = lexer_get_token(lexer, *lexer_idx)) &&
-			tok->tok_type == LXTOK_ELSE)) {
-		(*lexer_idx)++;
 
-		ret = getCodeBlock(expr, lexer, lexer_idx, &if_negative_node);
-		if (ret) {
-			tnode_recursive_dtor(if_expr_node, NULL);
-			tnode_recursive_dtor(if_positive_node, NULL);
-			return PARSER_RET_STATUS(ret);
-		}
-	}
-	
+/*
+ * Parallel parsing: functions are independent once their token ranges are
+ * known, so each worker parses a run of them into an arena and variable
+ * table of its own. The arenas and tables are merged in function order,
+ * which leaves the same tree and variables as getFunctions().
+ */
 
-	struct tree_node *tree_else_node = expr_create_operator_tnode(
-		expression_operators[EXPR_IDX_ELSE], if_positive_node, if_negative_node);
+struct parser_worker {
+	pthread_t thread;
+	// Shares the tokens of the parsed lexer, only the ring is its own
+	struct lexer lexer;
+	// Shares the names of the parsed expression
+	struct expression expr;
 
-	if (!tree_else_node) {
-		tnode_recursive_dtor(if_expr_node, NULL);
-		tnode_recursive_dtor(if_positive_node, NULL);
-		tnode_recursive_dtor(if_negative_node, NULL);
-		return PARSER_RET_STATUS(ret);
-	}
-	
+	const size_t *bounds;
+	struct tree_node **funcs;
+	size_t first_func;
+	size_t end_func;
 
-	*node = expr_create_operator_tnode(expression_operators[EXPR_IDX_IF],
-					if_expr_node, tree_else_node);
+	int status;
+};
 
-	if (!(*node)) {
-		tnode_recursive_dtor(if_expr_node, NULL);
-		return PARSER_RET_STATUS(S_FAIL);
-	}
+static size_t parser_n_cpus(void) {
+	long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
 
-	return PARSER_RET_STATUS(S_OK);
+	return n_cpus > 0 ? (size_t)n_cpus : 1;
 }
 
-static int getCycleExpression(struct expression *expr, struct lexer *lexer,
-			 size_t *lexer_idx, struct tree_node **node) {
-	assert (expr);
+/**
+ * Finds the token ranges of the functions by brace matching, function i
+ * is [bounds[i], bounds[i + 1]). Fails unless the functions cover every
+ * token, the serial parser reports such texts.
+ */
+static int parser_split_functions(const struct lexer *lexer,
+				  size_t **bounds_ptr, size_t *n_funcs_ptr) {
 	assert (lexer);
-	assert (lexer_idx);
-	assert (node);
+	assert (bounds_ptr);
+	assert (n_funcs_ptr);
 
-	struct lexer_token *tok = NULL;
-	if (!(tok = lexer_get_token(lexer, *lexer_idx))) {
-		return S_CONTINUE;
-	}
-	if (tok->tok_type != LXTOK_WHILE) {
-		return S_CONTINUE;
+	size_t n_tokens = lexer_n_tokens(lexer);
+	size_t n_funcs = 0;
+	size_t cap = 16;
+
+	size_t *bounds = calloc(cap, sizeof(*bounds));
+	if (!bounds) {
+		return S_FAIL;
 	}
 
-	(*lexer_idx)++;
+	size_t idx = 0;
+	while (idx < n_tokens && lexer_token_type(lexer, idx) == LXTOK_FUNC) {
+		if (n_funcs + 2 > cap) {
+			size_t *new_bounds = realloc(bounds, 2 * cap * sizeof(*bounds));
+			if (!new_bounds) {
+				free(bounds);
+				return S_FAIL;
+			}
+			bounds = new_bounds;
+			cap *= 2;
+		}
 
-	int ret = 0;
+		bounds[n_funcs++] = idx;
 
-	struct tree_node *if_expr_node = NULL;
-	ret = getRoundBracketsExpression(expr, lexer, lexer_idx, &if_expr_node);
-	if (ret) {
-		return PARSER_RET_STATUS(ret);
+		idx++;
+		while (idx < n_tokens && lexer_token_type(lexer, idx) != LXTOK_BCURLY_OPEN) {
+			idx++;
+		}
+
+		size_t depth = 0;
+		for (; idx < n_tokens; idx++) {
+			enum LexerTokenType type = lexer_token_type(lexer, idx);
+			if (type == LXTOK_BCURLY_OPEN) {
+				depth++;
+			} else if (type == LXTOK_BCURLY_CLOSE && --depth == 0) {
+				break;
+			}
+		}
+
+		if (idx == n_tokens) {
+			free(bounds);
+			return S_FAIL;
+		}
+		idx++;
 	}
 
-	struct tree_node *if_positive_node = NULL;
-	ret = getCodeBlock(expr, lexer, lexer_idx, &if_positive_node);
-	if (ret) {
-		tnode_recursive_dtor(if_expr_node, NULL);
-		return PARSER_RET_STATUS(ret);
+	if (idx != n_tokens) {
+		free(bounds);
+		return S_FAIL;
 	}
 
-	*node = expr_create_operator_tnode(expression_operators[EXPR_IDX_WHILE],
-					if_expr_node, if_positive_node);
+	bounds[n_funcs] = idx;
 
-	if (!(*node)) {
-		tnode_recursive_dtor(if_expr_node, NULL);
-		return PARSER_RET_STATUS(S_FAIL);
-	}
+	*bounds_ptr = bounds;
+	*n_funcs_ptr = n_funcs;
 
-	return PARSER_RET_STATUS(S_OK);
+	return S_OK;
 }
 
-static int getLangPunct(struct expression *expr, struct lexer *lexer,
-				  size_t *lexer_idx, struct tree_node **node) {
-	assert (expr);
-	assert (lexer);
-	assert (lexer_idx);
-	assert (node);
+static void *parser_worker_run(void *arg) {
+	struct parser_worker *worker = (struct parser_worker *)arg;
 
-	int ret = 0;
+	parser_quiet = 1;
 
-	ret = CALL_PARSER(getConditionalExpression, expr, lexer, lexer_idx, node);
-	if (ret != S_CONTINUE) {
-		return PARSER_RET_STATUS(ret);
-	}
+	worker->status = S_OK;
+	for (size_t i = worker->first_func; i < worker->end_func; i++) {
+		size_t lexer_idx = worker->bounds[i];
 
-	ret = CALL_PARSER(getCycleExpression, expr, lexer, lexer_idx, node);
-	if (ret != S_CONTINUE) {
-		return PARSER_RET_STATUS(ret);
+		if (getFunc(&worker->expr, &worker->lexer, &lexer_idx, &worker->funcs[i]) ||
+			lexer_idx != worker->bounds[i + 1]) {
+			worker->status = S_FAIL;
+			break;
+		}
 	}
 
-	return PARSER_RET_STATUS(CALL_PARSER(getStatement, expr, lexer, lexer_idx, node));
+	return NULL;
 }
 
-static int getCodeBlock(struct expression *expr, struct lexer *lexer,
-				  size_t *lexer_idx, struct tree_node **node) {
+static int parser_worker_ctor(struct parser_worker *worker,
+			      struct expression *expr, struct lexer *lexer) {
+	assert (worker);
 	assert (expr);
 	assert (lexer);
-	assert (lexer_idx);
-	assert (node);
 
-	int ret = 0;
-	struct lexer_token *tok = NULL;
-	if ((tok = lexer_get_token(lexer, *lexer_idx)) &&
-		tok->tok_type == LXTOK_BCURLY_OPEN) {
-		(*lexer_idx)++;
+	worker->lexer = *lexer;
+	worker->lexer.intern = &expr->names;
 
-		struct tree_node *lnode = NULL;
-		while (!((tok = lexer_get_token(lexer, *lexer_idx)) &&
-			tok->tok_type == LXTOK_BCURLY_CLOSE)) {
+	worker->expr = (struct expression){0};
+	worker->expr.names = expr->names;
 
-			struct tree_node *rnode = NULL;
-			if ((ret = CALL_PARSER(getLangPunct, expr, lexer, lexer_idx, &rnode))) {
-				tnode_recursive_dtor(lnode, NULL);
-				return PARSER_RET_STATUS(ret);
-			}
+	if (tree_ctor(&worker->expr.tree) || tree_use_arena(&worker->expr.tree)) {
+		return S_FAIL;
+	}
 
-			if (!rnode) {
-				continue;
-			}
+	if (pvector_init(&worker->expr.variables, sizeof(struct expression_variable))) {
+		tree_dtor(&worker->expr.tree);
+		return S_FAIL;
+	}
 
-			if (!lnode) {
-				lnode = rnode;
-				continue;
-			}
+	return S_OK;
+}
 
-			struct tree_node *mnode = NULL;
+static void parser_worker_dtor(struct parser_worker *worker) {
+	assert (worker);
 
-			mnode = expr_create_operator_tnode(
-				expression_operators[EXPR_IDX_SEMICOLON], lnode, rnode);
+	// Names are borrowed from the parsed expression
+	tree_dtor(&worker->expr.tree);
+	expr_variables_dtor(&worker->expr);
+}
 
-			if (!mnode) {
-				tnode_recursive_dtor(lnode, NULL);
-				tnode_recursive_dtor(rnode, NULL);
-				return PARSER_RET_STATUS(S_FAIL);
-			}
+/**
+ * Registers the variables of the worker in the order it met them.
+ */
+static int parser_merge_worker(struct expression *expr,
+			       struct parser_worker *worker) {
+	assert (expr);
+	assert (worker);
 
-			lnode = mnode;
-		}
+	for (size_t i = 0; i < worker->expr.variables.len; i++) {
+		struct expression_variable *var =
+			PVECTOR_AT(&worker->expr.variables, struct expression_variable, i);
 
-		if (!((tok = lexer_get_token(lexer, *lexer_idx)) &&
-			tok->tok_type == LXTOK_BCURLY_CLOSE)) {
-			tnode_recursive_dtor(lnode, NULL);
-			return PARSER_RET_STATUS(S_FAIL);
+		if (!expr_find_variable(expr, var->name_id) &&
+			expr_push_variable(expr, var->name_id, NULL)) {
+			return S_FAIL;
 		}
-		(*lexer_idx)++;
-
-		*node = lnode;
-
-		return PARSER_RET_STATUS(ret);
 	}
 
-	return PARSER_RET_STATUS(CALL_PARSER(getLangPunct, expr, lexer, lexer_idx, node));
+	tree_arena_merge(expr->tree.arena, worker->expr.tree.arena);
+
+	return S_OK;
 }
 
-static int getCommaSeparatedList(struct expression *expr, struct lexer *lexer,
-			 size_t *lexer_idx, struct tree_node **node) {
+static int parser_run_workers(struct expression *expr, struct lexer *lexer,
+			      const size_t *bounds, size_t n_funcs,
+			      struct tree_node **funcs, size_t n_threads) {
 	assert (expr);
 	assert (lexer);
-	assert (lexer_idx);
-	assert (node);
+	assert (bounds);
+	assert (funcs);
 
-	int ret = 0;
-
-	struct tree_node *lnode = NULL;
-	if ((ret = CALL_PARSER(getComprasion, expr, lexer, lexer_idx, &lnode))) {
-		return PARSER_RET_STATUS(ret);
+	struct parser_worker *workers = calloc(n_threads, sizeof(*workers));
+	if (!workers) {
+		return S_FAIL;
 	}
 
-	struct lexer_token *tok = NULL;
-	while ((tok = lexer_get_token(lexer, *lexer_idx)) &&
-		tok->tok_type == LXTOK_COMMA) {
-		(*lexer_idx)++;
+	// Workers get runs of functions with about the same number of tokens
+	size_t n_tokens = bounds[n_funcs] - bounds[0];
+	size_t func_idx = 0;
+	size_t n_started = 0;
+	int ret = S_OK;
 
-		struct tree_node *rnode = NULL;
-		if ((ret = CALL_PARSER(getComprasion, expr, lexer, lexer_idx, &rnode))) {
-			tnode_recursive_dtor(lnode, NULL);
-			return PARSER_RET_STATUS(ret);
+	for (; n_started < n_threads && func_idx < n_funcs; n_started++) {
+		struct parser_worker *worker = &workers[n_started];
+
+		size_t end_token = bounds[0] + n_tokens / n_threads * (n_started + 1);
+		size_t end_func = func_idx + 1;
+		while (end_func < n_funcs && bounds[end_func] < end_token) {
+			end_func++;
+		}
+		if (n_started == n_threads - 1) {
+			end_func = n_funcs;
 		}
 
-		struct tree_node *mnode = NULL;
+		worker->bounds = bounds;
+		worker->funcs = funcs;
+		worker->first_func = func_idx;
+		worker->end_func = end_func;
+		func_idx = end_func;
+
+		if (parser_worker_ctor(worker, expr, lexer)) {
+			ret = S_FAIL;
+			break;
+		}
 
-		mnode = expr_create_operator_tnode(
-			expression_operators[EXPR_IDX_COMMA], lnode, rnode);
+		if (pthread_create(&worker->thread, NULL, parser_worker_run, worker)) {
+			parser_worker_dtor(worker);
+			ret = S_FAIL;
+			break;
+		}
+	}
 
+	for (size_t i = 0; i < n_started; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
 
-		if (!mnode) {
-			tnode_recursive_dtor(lnode, NULL);
-			tnode_recursive_dtor(rnode, NULL);
-			return PARSER_RET_STATUS(S_FAIL);
+	for (size_t i = 0; i < n_started && !ret; i++) {
+		ret = workers[i].status;
+		if (!ret) {
+			ret = parser_merge_worker(expr, &workers[i]);
 		}
+	}
 
-		lnode = mnode;
+	for (size_t i = 0; i < n_started; i++) {
+		parser_worker_dtor(&workers[i]);
 	}
 
-	*node = lnode;
+	free(workers);
 
-	return PARSER_RET_STATUS(S_OK);
+	return ret;
+}
 
+/**
+ * Empty expression with the names of the lexer, like the serial parse
+ * starts with.
+ */
+static int parser_expression_ctor(struct expression *expr, struct lexer *lexer) {
+	assert (expr);
+	assert (lexer);
+
+	*expr = (struct expression){0};
+	if (expression_ctor(expr)) {
+		return S_FAIL;
+	}
+
+	intern_dtor(&expr->names);
+	if (intern_clone(&expr->names, lexer->intern)) {
+		expression_dtor(expr);
+		return S_FAIL;
+	}
+
+	return S_OK;
 }
 
-static int getArgumentsList(struct expression *expr, struct lexer *lexer,
-			 size_t *lexer_idx, struct tree_node **node) {
+/**
+ * Makes the parsed functions the root of expr, chained the way
+ * getFunctions() does, and checks that no tokens follow them.
+ */
+static int parser_chain_functions(struct expression *expr, struct lexer *lexer,
+				  struct tree_node *const *funcs, size_t n_funcs,
+				  size_t end_idx) {
 	assert (expr);
 	assert (lexer);
-	assert (lexer_idx);
-	assert (node);
+	assert (funcs);
+	assert (n_funcs);
 
-	int ret = 0;
+	struct tree_node *root = funcs[0];
+	if (n_funcs > 1) {
+		root = expr_create_sequence_tnode(expr,
+			expression_operators[EXPR_IDX_SEMICOLON], funcs, n_funcs);
 
-	struct lexer_token *tok = NULL;
+		if (!root) {
+			return S_FAIL;
+		}
+	}
 
-	if ((tok = lexer_get_token(lexer, *lexer_idx)) &&
-		tok->tok_type == LXTOK_BROUND_OPEN) {
-		(*lexer_idx)++;
+	expr->tree.root = root;
 
-		if (!((tok = lexer_get_token(lexer, *lexer_idx)) &&
-			tok->tok_type == LXTOK_BROUND_CLOSE)) {
-			if ((ret = CALL_PARSER(getCommaSeparatedList, expr, lexer,
-						lexer_idx, node))) {
-				return PARSER_RET_STATUS(ret);
-			}
+	size_t lexer_idx = end_idx;
+	return getTerminator(expr, lexer, &lexer_idx, &expr->tree.root);
+}
 
-			ret = S_OK;
-		} else {
-			*node = NULL;
-			ret = S_OK;
-		}
+static int parser_parse_functions(struct expression *expr, struct lexer *lexer,
+				  const size_t *bounds, size_t n_funcs,
+				  size_t n_threads) {
+	assert (expr);
+	assert (lexer);
+	assert (bounds);
 
-		if (!((tok = lexer_get_token(lexer, *lexer_idx)) &&
-			tok->tok_type == LXTOK_BROUND_CLOSE)) {
-			return PARSER_RET_STATUS(S_FAIL);
-		}
-		(*lexer_idx)++;
+	if (parser_expression_ctor(expr, lexer)) {
+		return S_FAIL;
+	}
 
+	struct tree_node **funcs = calloc(n_funcs, sizeof(*funcs));
+	if (!funcs) {
+		expression_dtor(expr);
+		return S_FAIL;
+	}
 
-		return ret;
+	if (parser_run_workers(expr, lexer, bounds, n_funcs, funcs, n_threads) ||
+		parser_chain_functions(expr, lexer, funcs, n_funcs, bounds[n_funcs])) {
+		free(funcs);
+		expression_dtor(expr);
+		return S_FAIL;
 	}
 
-	return S_CONTINUE;
+	free(funcs);
+
+	return S_OK;
 }
 
-static int getFunc(struct expression *expr, struct lexer *lexer,
-				size_t *lexer_idx, struct tree_node **node) {
+int expression_parse_lexer_parallel(struct expression *expr, struct lexer *lexer,
+				    size_t n_threads) {
 	assert (expr);
 	assert (lexer);
-	assert (lexer_idx);
-	assert (node);
 
-	int ret = 0;
-	struct lexer_token *tok = NULL;
-	if (!((tok = lexer_get_token(lexer, *lexer_idx)) &&
-		tok->tok_type == LXTOK_FUNC)) {
-		return PARSER_RET_STATUS(S_FAIL);
+	if (!n_threads) {
+		n_threads = parser_n_cpus();
 	}
 
-	(*lexer_idx)++;
+	size_t *bounds = NULL;
+	size_t n_funcs = 0;
 
-	struct tree_node *func_name = NULL;
-	if (CALL_PARSER(getVariable, expr, lexer, lexer_idx, &func_name)) {
-		return PARSER_RET_STATUS(S_FAIL);
+	if (lexer->pull_mode || n_threads == 1 ||
+		parser_split_functions(lexer, &bounds, &n_funcs) || n_funcs < 2) {
+		free(bounds);
+		return expression_parse_lexer(expr, lexer);
 	}
 
-	int is_main = 0;
-	if (!strcmp(func_name->value.varname, "main")) {
-		is_main = 1;
+	if (n_threads > n_funcs) {
+		n_threads = n_funcs;
 	}
 
-	struct tree_node *args_list = NULL;
-	if (CALL_PARSER(getArgumentsList, expr, lexer, lexer_idx, &args_list)) {
-		tnode_recursive_dtor(func_name, NULL);
-		return PARSER_RET_STATUS(S_FAIL);
-	}
+	int ret = parser_parse_functions(expr, lexer, bounds, n_funcs, n_threads);
+	free(bounds);
 
-	struct tree_node *func_body = NULL;
-	if (CALL_PARSER(getCodeBlock, expr, lexer, lexer_idx, &func_body)) {
-		tnode_recursive_dtor(func_name, NULL);
-		tnode_recursive_dtor(args_list, NULL);
-		return PARSER_RET_STATUS(S_FAIL);
+	// The serial parse reports the error
+	if (ret) {
+		return expression_parse_lexer(expr, lexer);
 	}
 
+	return S_OK;
+}
 
-	struct tree_node *func_declaration = expr_create_operator_tnode(
-		expression_operators[EXPR_IDX_COMMA], func_name, args_list);
+/**
+ * Registers the variables of the tokens [begin, end) in the order the
+ * parser would.
+ */
+static int parser_register_variables(struct expression *expr, struct lexer *lexer,
+				     size_t begin, size_t end) {
+	assert (expr);
+	assert (lexer);
 
-	if (!func_declaration) {
-		tnode_recursive_dtor(func_name, NULL);
-		tnode_recursive_dtor(args_list, NULL);
-		tnode_recursive_dtor(func_body, NULL);
-		return PARSER_RET_STATUS(S_FAIL);
+	for (size_t idx = begin; idx < end; idx++) {
+		if (lexer_token_type(lexer, idx) != LXTOK_VARIABLE) {
+			continue;
+		}
+
+		uint32_t name_id = lexer_token_name_id(lexer, idx);
+		if (!expr_find_variable(expr, name_id) &&
+			expr_push_variable(expr, name_id, NULL)) {
+			return S_FAIL;
+		}
 	}
-	func_name = NULL;
-	args_list = NULL;
 
-	size_t func_idx = is_main ? EXPR_IDX_MAIN : EXPR_IDX_FUNC;
+	return S_OK;
+}
 
-	struct tree_node *func = expr_create_operator_tnode(
-		expression_operators[func_idx], func_declaration, func_body);
+/**
+ * Takes the functions whose tokens did not change from the cache and
+ * parses the rest. Returns S_CONTINUE if the text must be parsed from
+ * scratch, which also reports its errors.
+ */
+static int parser_parse_cached(struct expression *expr, struct lexer *lexer,
+			       const char *cache_filename, size_t n_threads) {
+	assert (expr);
+	assert (lexer);
+	assert (cache_filename);
 
-	if (!func) {
-		tnode_recursive_dtor(func_declaration, NULL);
-		tnode_recursive_dtor(func_body, NULL);
-		return PARSER_RET_STATUS(S_FAIL);
+	size_t *bounds = NULL;
+	size_t n_funcs = 0;
+	if (parser_split_functions(lexer, &bounds, &n_funcs) || !n_funcs) {
+		free(bounds);
+		return S_CONTINUE;
 	}
-	func_declaration = NULL;
-	func_body = NULL;
 
-	*node = func;
+	if (parser_expression_ctor(expr, lexer)) {
+		free(bounds);
+		return S_FAIL;
+	}
 
-	return PARSER_RET_STATUS(S_OK);
-}
+	uint64_t *hashes = calloc(n_funcs, sizeof(*hashes));
+	struct tree_node **funcs = calloc(n_funcs, sizeof(*funcs));
+	if (!hashes || !funcs) {
+		free(hashes);
+		free(funcs);
+		free(bounds);
+		expression_dtor(expr);
+		return S_FAIL;
+	}
 
-static int getFunctions(struct expression *expr, struct lexer *lexer,
-				size_t *lexer_idx, struct tree_node **node) {
-	assert (expr);
-	assert (lexer);
-	assert (lexer_idx);
-	assert (node);
+	struct parser_cache cache = {0};
+	parser_cache_ctor(&cache, expr);
+	int has_cache = !parser_cache_load(&cache, cache_filename) && cache.len;
 
-	int ret = 0;
-	struct lexer_token *tok = NULL;
-	struct tree_node *lnode = NULL;
-	while (((tok = lexer_get_token(lexer, *lexer_idx)) &&
-		tok->tok_type == LXTOK_FUNC)) {
+	size_t n_cached = 0;
+	int ret = S_OK;
 
-		struct tree_node *rnode = NULL;
-		if ((ret = CALL_PARSER(getFunc, expr, lexer, lexer_idx, &rnode))) {
-			tnode_recursive_dtor(lnode, NULL);
-			return PARSER_RET_STATUS(ret);
+	if (!has_cache && n_threads > 1 && n_funcs > 1) {
+		if (parser_run_workers(expr, lexer, bounds, n_funcs, funcs,
+				       n_threads < n_funcs ? n_threads : n_funcs)) {
+			ret = S_CONTINUE;
 		}
+	}
 
-		if (!rnode) {
+	parser_quiet = 1;
+
+	for (size_t i = 0; i < n_funcs && !ret; i++) {
+		hashes[i] = parser_cache_hash(lexer, bounds[i], bounds[i + 1]);
+		if (funcs[i]) {
 			continue;
 		}
 
-		if (!lnode) {
-			lnode = rnode;
+		funcs[i] = parser_cache_take(&cache, lexer, bounds[i], bounds[i + 1], hashes[i]);
+		if (funcs[i]) {
+			n_cached++;
+			ret = parser_register_variables(expr, lexer, bounds[i], bounds[i + 1]);
 			continue;
 		}
 
-		struct tree_node *mnode = NULL;
-
-		mnode = expr_create_operator_tnode(
-			expression_operators[EXPR_IDX_SEMICOLON], lnode, rnode);
-
-		if (!mnode) {
-			tnode_recursive_dtor(lnode, NULL);
-			tnode_recursive_dtor(rnode, NULL);
-			return PARSER_RET_STATUS(S_FAIL);
+		size_t lexer_idx = bounds[i];
+		if (getFunc(expr, lexer, &lexer_idx, &funcs[i]) ||
+			lexer_idx != bounds[i + 1]) {
+			ret = S_CONTINUE;
 		}
-
-		lnode = mnode;
 	}
 
-	*node = lnode;
-
-	return PARSER_RET_STATUS(S_OK);
-}
+	parser_quiet = 0;
 
-static int getTerminator(struct expression *expr, struct lexer *lexer,
-			 size_t *lexer_idx, struct tree_node **node) {
-	assert (expr);
-	assert (lexer);
-	assert (lexer_idx);
-	assert (node);
+	// The cache holds exactly these functions if all of them were taken
+	int cache_changed = n_cached != n_funcs || cache.len != n_funcs;
 
-	eprintf("term: %zu %zu\n", *lexer_idx, lexer->tokens.len);
+	parser_cache_dtor(&cache);
 
-	if (lexer->tokens.len == *lexer_idx) {
-		return PARSER_RET_STATUS(S_OK);
+	if (!ret && parser_chain_functions(expr, lexer, funcs, n_funcs, bounds[n_funcs])) {
+		ret = S_FAIL;
 	}
-	
-	return PARSER_RET_STATUS(S_FAIL);
-}
-
-static int getG(struct expression *expr, struct lexer *lexer,
-		size_t *lexer_idx, struct tree_node **node) {
-	assert (expr);
-	assert (lexer);
-	assert (lexer_idx);
-	assert (node);
-
-	int ret = 0;
 
-	if ((ret = CALL_PARSER(getFunctions, expr, lexer, lexer_idx, node))) {
-		return PARSER_RET_STATUS(ret);
+	if (!ret && cache_changed &&
+		parser_cache_store(cache_filename, expr, lexer, bounds, hashes, funcs, n_funcs)) {
+		log_error("Cannot store parse cache %s", cache_filename);
 	}
 
-	if ((ret = CALL_PARSER(getTerminator, expr, lexer, lexer_idx, node))) {
-		tnode_recursive_dtor(*node, NULL);
-		*node = NULL;
-		return PARSER_RET_STATUS(ret);
+	free(hashes);
+	free(funcs);
+	free(bounds);
+
+	if (ret) {
+		expression_dtor(expr);
 	}
 
-	return PARSER_RET_STATUS(S_OK);
+	return ret;
 }
 
-
 int expression_parse_lexer(struct expression *expr, struct lexer *lexer) {
 	assert (lexer);
 	assert (expr);
@@ -1110,14 +1626,35 @@ int expression_parse_lexer(struct expression *expr, struct lexer *lexer) {
 		return S_FAIL;
 	};
 
+	// Name ids of the tokens stay valid in the expression
+	intern_dtor(&expr->names);
+	if (intern_clone(&expr->names, lexer->intern)) {
+		expression_dtor(expr);
+		return S_FAIL;
+	}
+
+	// Names pulled during the parse go straight to the expression
+	struct intern_table *lexer_intern = lexer->intern;
+	lexer->intern = &expr->names;
+
 	size_t lexer_idx_copy = 0;
 	size_t lexer_idx = 0;
 	
-	if (CALL_PARSER(getG, expr, lexer, &lexer_idx_copy, &expr->tree.root)) {
+	int ret = getG(expr, lexer, &lexer_idx_copy, &expr->tree.root);
+
+	lexer->intern = lexer_intern;
+
+	if (ret || LEXER_STATUS(lexer_pull_status(lexer))) {
 		size_t fail_pos = (size_t)(lexer_idx_copy - lexer_idx); 
 
 		eprintf("\nExpression parsing failed in lexer position %zu:\n", fail_pos);
 
+		struct lexer_token *fail_tok = lexer_get_token(lexer, fail_pos);
+		if (fail_tok) {
+			struct lexer_location loc = lexer_locate(lexer, fail_tok->text_position);
+			eprintf("at line %zu, column %zu\n", loc.line, loc.column);
+		}
+
 		expression_dtor(expr);
 
 		return S_FAIL;
@@ -1139,18 +1676,24 @@ int expression_parse_str(const char *str, struct expression *expr) {
 		return S_FAIL;
 	}
 
-	LexerStatus lexerStatus = lexer_parse_text(&lexer, str);
-	if (LEXER_STATUS(lexerStatus)) {
-		eprintf("\nExpression parsing failed in position %zd:\n",
-				lexerStatus.text_position);
-
-		log_str_neighborhood(str, str + lexerStatus.text_position,
-						10, stdout);
-		return S_FAIL;
-	}
-
+	lexer_pull_text(&lexer, str);
 
 	if (expression_parse_lexer(expr, &lexer)) {
+		LexerStatus lexerStatus = lexer_pull_status(&lexer);
+		if (LEXER_STATUS(lexerStatus)) {
+			eprintf("\nExpression parsing failed in position %zd:\n",
+					lexerStatus.text_position);
+
+			if (lexerStatus.text_position >= 0) {
+				struct lexer_location loc = lexer_locate(&lexer,
+						(size_t)lexerStatus.text_position);
+				eprintf("at line %zu, column %zu\n", loc.line, loc.column);
+
+				log_str_neighborhood(str, str + lexerStatus.text_position,
+								10, stdout);
+			}
+		}
+
 		lexer_dtor(&lexer);
 		return S_FAIL;
 	}
@@ -1207,21 +1750,178 @@ int expression_parse_str(char *str, struct expression *expr) {
 }
 */
 
+static int log_file_neighborhood(FILE *file, size_t fail_pos, size_t side_len,
+				 FILE *out_stream) {
+	assert (file);
+	assert (out_stream);
+
+	size_t left_logging = 0;
+	if (fail_pos > side_len) {
+		left_logging = fail_pos - side_len;
+	}
+
+	char window[64] = {0};
+	size_t window_len = fail_pos - left_logging + side_len + 1;
+	if (window_len > sizeof(window) - 1) {
+		return S_FAIL;
+	}
+
+	if (fseek(file, (long)left_logging, SEEK_SET)) {
+		return S_FAIL;
+	}
+
+	size_t read_bytes = fread(window, 1, window_len, file);
+	window[read_bytes] = '\0';
+
+	return log_str_neighborhood(window, window + (fail_pos - left_logging),
+				    side_len, out_stream);
+}
+
+/**
+ * Lexes the whole mapped text up front and parses its functions in
+ * parallel. Returns S_CONTINUE if the text is lexed with errors, the
+ * pulling parser reports them.
+ */
+static int expression_parse_text_parallel(const char *text, struct expression *expr) {
+	assert (text);
+	assert (expr);
+
+	struct lexer lexer = {0};
+	if (LEXER_STATUS(lexer_ctor(&lexer))) {
+		return S_FAIL;
+	}
+
+	if (LEXER_STATUS(lexer_parse_text_parallel(&lexer, text, 0))) {
+		lexer_dtor(&lexer);
+		return S_CONTINUE;
+	}
+
+	int ret = expression_parse_lexer_parallel(expr, &lexer, 0);
+
+	lexer_dtor(&lexer);
+
+	return ret;
+}
+
+/**
+ * Parses the file opened by lexer_pull_file() while the tokens are pulled,
+ * errors of the lexer and of the parser are reported with their location.
+ */
+static int parser_parse_pulled(const char *filename, struct lexer *lexer,
+			       struct expression *expr) {
+	assert (filename);
+	assert (lexer);
+	assert (expr);
+
+	const char *text = lexer_text(lexer);
+
+	if (expression_parse_lexer(expr, lexer)) {
+		LexerStatus lexerStatus = lexer_pull_status(lexer);
+		if (LEXER_STATUS(lexerStatus)) {
+			eprintf("\nExpression parsing failed in position %zd:\n",
+					lexerStatus.text_position);
+		}
+
+		if (LEXER_STATUS(lexerStatus) && lexerStatus.text_position >= 0) {
+			size_t fail_pos = (size_t)lexerStatus.text_position;
+
+			struct lexer_location loc = lexer_locate(lexer, fail_pos);
+			eprintf("at line %zu, column %zu\n", loc.line, loc.column);
+
+			if (text) {
+				log_str_neighborhood(text, text + fail_pos, 10, stdout);
+			} else {
+				FILE *file = fopen(filename, "rb");
+				if (file) {
+					log_file_neighborhood(file, fail_pos, 10, stdout);
+					fclose(file);
+				}
+			}
+		}
+
+		return S_FAIL;
+	}
+
+	return S_OK;
+}
+
+int expression_parse_file_cached(const char *filename, const char *cache_filename,
+				 struct expression *expr) {
+	assert (filename);
+	assert (cache_filename);
+	assert (expr);
+
+	struct lexer pull_lexer = {0};
+	if (LEXER_STATUS(lexer_ctor(&pull_lexer))) {
+		return S_FAIL;
+	}
+
+	if (LEXER_STATUS(lexer_pull_file(&pull_lexer, filename))) {
+		lexer_dtor(&pull_lexer);
+		return S_FAIL;
+	}
+
+	const char *text = lexer_text(&pull_lexer);
+	int ret = S_CONTINUE;
+
+	struct lexer lexer = {0};
+	if (text && !LEXER_STATUS(lexer_ctor(&lexer))) {
+		size_t text_len = (size_t)(pull_lexer.source.text_end - text);
+		size_t n_threads = text_len >= PARSER_PARALLEL_MIN_TEXT ? 0 : 1;
+
+		if (!LEXER_STATUS(lexer_parse_text_parallel(&lexer, text, n_threads))) {
+			if (!n_threads) {
+				n_threads = parser_n_cpus();
+			}
+
+			ret = parser_parse_cached(expr, &lexer, cache_filename, n_threads);
+
+			// Parse errors are reported by a serial parse of the same tokens
+			if (ret == S_CONTINUE) {
+				ret = expression_parse_lexer(expr, &lexer);
+			}
+		}
+
+		lexer_dtor(&lexer);
+	}
+
+	// Lexing errors are reported by the pulling parser
+	if (ret == S_CONTINUE) {
+		ret = parser_parse_pulled(filename, &pull_lexer, expr);
+	}
+
+	lexer_dtor(&pull_lexer);
+
+	return ret;
+}
+
 int expression_parse_file(const char *filename, struct expression *expr) {
 	assert (filename);
 	assert (expr);
 
-	char *bufptr = NULL;
-	size_t read_bytes = 0;
+	struct lexer lexer = {0};
+	if (LEXER_STATUS(lexer_ctor(&lexer))) {
+		return S_FAIL;
+	}
+
+	LexerStatus lexerStatus = lexer_pull_file(&lexer, filename);
+	if (LEXER_STATUS(lexerStatus)) {
+		lexer_dtor(&lexer);
+		return S_FAIL;
+	}
 
-	int ret = 0;
-	if ((ret = read_file(filename, &bufptr, &read_bytes))) {
-		return ret;
+	const char *text = lexer_text(&lexer);
+	int ret = S_CONTINUE;
+	if (text && (size_t)(lexer.source.text_end - text) >= PARSER_PARALLEL_MIN_TEXT) {
+		ret = expression_parse_text_parallel(text, expr);
 	}
 
-	ret = expression_parse_str(bufptr, expr);
+	// The file is lexed while the parser pulls tokens
+	if (ret == S_CONTINUE) {
+		ret = parser_parse_pulled(filename, &lexer, expr);
+	}
 
-	free(bufptr);
+	lexer_dtor(&lexer);
 
 	return ret;
 }
@@ -1234,21 +1934,14 @@ static int log_str_neighborhood(const char *real_str,
 	assert (out_stream);
 
 	size_t fail_pos = (size_t)(e_ptr - real_str);
-	size_t str_len = strlen(real_str);
-
-	if (fail_pos > str_len) {
-		return S_FAIL;
-	}
 
 	size_t left_logging = 0;
 	if (fail_pos > side_len) {
 		left_logging = fail_pos - side_len;
 	}
 
-	size_t right_logging = fail_pos + side_len + 1;
-	if (right_logging > str_len) {
-		right_logging = str_len;
-	}
+	// e_ptr lies inside real_str, only the window right of it is measured
+	size_t right_logging = fail_pos + strnlen(e_ptr, side_len + 1);
 
 	for (size_t i = left_logging; i < right_logging; i++) {
 		fprintf(out_stream, "%c", real_str[i]);
@@ -1,47 +1,278 @@
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 #include "types.h"
 #include "expression.h"
+#include "expression_image.h"
 #include "expression_parser.h"
 
-int main(int argc, const char *argv[]) {
-	if (argc < 2) {
-		log_error("Frontend command syntax: %s [filename]+", argv[0]);
+// Format of the .ast files, -b for binary, -i for images
+static enum expression_format store_format = EXPRESSION_FORMAT_TEXT;
+// -c keeps the parsed functions in <file>.ast.cache for the next run
+static int use_parse_cache = 0;
+
+static int store_ast(struct expression *expr, const char *filename) {
+	switch (store_format) {
+	case EXPRESSION_FORMAT_BINARY:
+		return expression_store_binary(expr, filename);
+	case EXPRESSION_FORMAT_IMAGE:
+		return expression_store_image(expr, filename);
+	case EXPRESSION_FORMAT_TEXT:
+	default:
+		return expression_store(expr, filename);
 	}
+}
 
-	int err = 0;
+static int compile_file(const char *in_file) {
+	struct expression expr = {0};
+
+	size_t in_filename_len = strlen(in_file);
+	char *out_filename = calloc(in_filename_len + 16, 1);
+	if (!out_filename) {
+		log_error("allocation error");
+		return 1;
+	}
+	memcpy(out_filename, in_file, in_filename_len);
+
+	// Functions that did not change since the last run are not reparsed
+	strcpy(out_filename + in_filename_len, ".ast.cache");
+
+	if (use_parse_cache ? expression_parse_file_cached(in_file, out_filename, &expr) :
+			      expression_parse_file(in_file, &expr)) {
+		free(out_filename);
+		log_error("Cannot parse file %s", in_file);
+		return 1;
+	}
+
+	strcpy(out_filename + in_filename_len, ".ast");
+
+	if (store_ast(&expr, out_filename)) {
+		expression_dtor(&expr);
+		free(out_filename);
+		log_error("Tree store error");
+		return 1;
+	}
+
+	expression_dtor(&expr);
+	free(out_filename);
+
+	return 0;
+}
+
+/*
+ * Files are compiled by a pool of worker processes: diagnostics are
+ * written to the process-wide stdout and stderr, which a process can
+ * redirect. Every worker writes them to its own temporary files, and
+ * the output of each input is replayed in the order of the command line,
+ * as if the files were compiled one after another.
+ */
+
+enum compile_job_state {
+	COMPILE_JOB_PENDING,
+	COMPILE_JOB_DONE,
+};
+
+struct compile_job {
+	enum compile_job_state state;
+	int status;
+	size_t worker;
+	// Output ranges in the files of the worker
+	off_t out_begin;
+	off_t out_end;
+	off_t err_begin;
+	off_t err_end;
+};
+
+struct compile_pool {
+	// Shared with the workers
+	size_t next_job;
+	struct compile_job jobs[];
+};
+
+struct compile_worker {
+	pid_t pid;
+	FILE *out;
+	FILE *err;
+};
+
+static void compile_worker_run(struct compile_pool *pool, struct compile_worker *worker,
+			       size_t worker_idx, const char *const *files, size_t n_files) {
+	if (dup2(fileno(worker->out), STDOUT_FILENO) < 0 ||
+		dup2(fileno(worker->err), STDERR_FILENO) < 0) {
+		_exit(1);
+	}
+
+	size_t job_idx = 0;
+	while ((job_idx = __atomic_fetch_add(&pool->next_job, 1, __ATOMIC_RELAXED)) < n_files) {
+		struct compile_job *job = &pool->jobs[job_idx];
+
+		job->worker = worker_idx;
+		job->out_begin = lseek(STDOUT_FILENO, 0, SEEK_END);
+		job->err_begin = lseek(STDERR_FILENO, 0, SEEK_END);
+
+		job->status = compile_file(files[job_idx]);
+
+		fflush(stdout);
+		fflush(stderr);
+		job->out_end = lseek(STDOUT_FILENO, 0, SEEK_END);
+		job->err_end = lseek(STDERR_FILENO, 0, SEEK_END);
+
+		__atomic_store_n(&job->state, COMPILE_JOB_DONE, __ATOMIC_RELEASE);
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+	_exit(0);
+}
+
+static void compile_replay(FILE *from, off_t begin, off_t end, FILE *to) {
+	char buf[4096] = {0};
+
+	while (begin < end) {
+		size_t chunk = (size_t)(end - begin) < sizeof(buf) ?
+				(size_t)(end - begin) : sizeof(buf);
+		ssize_t n_read = pread(fileno(from), buf, chunk, begin);
+		if (n_read <= 0) {
+			break;
+		}
+
+		fwrite(buf, 1, (size_t)n_read, to);
+		begin += n_read;
+	}
+}
 
-	for (int i = 1; i < argc; i++) {
-		const char *in_file = argv[i];
-		struct expression expr = {0};
+static int compile_files_parallel(const char *const *files, size_t n_files,
+				  size_t n_workers) {
+	size_t pool_size = sizeof(struct compile_pool) + n_files * sizeof(struct compile_job);
+	struct compile_pool *pool = mmap(NULL, pool_size, PROT_READ | PROT_WRITE,
+					 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	struct compile_worker *workers = calloc(n_workers, sizeof(*workers));
+	if (pool == MAP_FAILED || !workers) {
+		if (pool != MAP_FAILED) {
+			munmap(pool, pool_size);
+		}
+		free(workers);
+		return -1;
+	}
+
+	// Buffered output must not be written again by the workers
+	fflush(stdout);
+	fflush(stderr);
+
+	size_t n_started = 0;
+	for (; n_started < n_workers; n_started++) {
+		struct compile_worker *worker = &workers[n_started];
+		worker->out = tmpfile();
+		worker->err = tmpfile();
+		if (!worker->out || !worker->err ||
+			(worker->pid = fork()) < 0) {
+			break;
+		}
+
+		if (!worker->pid) {
+			compile_worker_run(pool, worker, n_started, files, n_files);
+		}
+	}
+
+	for (size_t i = 0; i < n_started; i++) {
+		waitpid(workers[i].pid, NULL, 0);
+	}
+
+	// Files no worker got to, if not every worker could be started
+	for (size_t i = pool->next_job; i < n_files; i++) {
+		pool->jobs[i].state = COMPILE_JOB_DONE;
+		pool->jobs[i].status = compile_file(files[i]);
+		pool->jobs[i].worker = n_workers;
+	}
+
+	int err = 0;
+	for (size_t i = 0; i < n_files; i++) {
+		struct compile_job *job = &pool->jobs[i];
 
-		if (expression_parse_file(in_file, &expr)) {
-			log_error("Cannot parse file %s", in_file);
+		if (job->state != COMPILE_JOB_DONE) {
+			log_error("Worker died while compiling %s", files[i]);
 			err = 1;
 			continue;
 		}
 
-		size_t in_filename_len = strlen(in_file);
-		char *out_filename = calloc(in_filename_len + 10, 1);
-		if (!out_filename) {
-			expression_dtor(&expr);
-			log_error("allocation error");
-			err = 1;
+		if (job->worker < n_started) {
+			struct compile_worker *worker = &workers[job->worker];
+			compile_replay(worker->out, job->out_begin, job->out_end, stdout);
+			compile_replay(worker->err, job->err_begin, job->err_end, stderr);
+		}
+
+		err |= job->status;
+	}
+
+	for (size_t i = 0; i < n_workers; i++) {
+		if (workers[i].out) fclose(workers[i].out);
+		if (workers[i].err) fclose(workers[i].err);
+	}
+
+	free(workers);
+	munmap(pool, pool_size);
+
+	return err;
+}
+
+int main(int argc, const char *argv[]) {
+	size_t n_workers = 1;
+	int first_file = 1;
+
+	while (first_file < argc && argv[first_file][0] == '-') {
+		const char *opt = argv[first_file];
+
+		if (!strcmp(opt, "-c")) {
+			use_parse_cache = 1;
+			first_file++;
 			continue;
 		}
-		memcpy(out_filename, in_file, in_filename_len);
-		strcpy(out_filename + in_filename_len, ".ast");
 
-		if (expression_store(&expr, out_filename)) {
-			expression_dtor(&expr);
-			free(out_filename);
-			log_error("Tree store error");
-			err = 1;
+		if (!strcmp(opt, "-b") || !strcmp(opt, "-i")) {
+			store_format = opt[1] == 'b' ? EXPRESSION_FORMAT_BINARY : EXPRESSION_FORMAT_IMAGE;
+			first_file++;
 			continue;
 		}
 
-		expression_dtor(&expr);
-		free(out_filename);
+		if (strncmp(opt, "-j", 2)) {
+			log_error("Unknown option %s", opt);
+			return 1;
+		}
+
+		const char *workers_arg = opt[2] ? opt + 2 : argv[first_file + 1];
+		first_file += opt[2] ? 1 : 2;
+
+		char *workers_end = NULL;
+		long n_workers_arg = workers_arg ? strtol(workers_arg, &workers_end, 10) : 0;
+		if (!workers_arg || *workers_end || n_workers_arg < 1 || first_file > argc) {
+			log_error("Invalid number of jobs");
+			return 1;
+		}
+
+		n_workers = (size_t)n_workers_arg;
+	}
+
+	if (argc - first_file < 1) {
+		log_error("Frontend command syntax: %s [-j N] [-c] [-b | -i] [filename]+", argv[0]);
+	}
+
+	const char *const *files = argv + first_file;
+	size_t n_files = (size_t)(argc - first_file);
+	if (n_workers > n_files) {
+		n_workers = n_files;
+	}
+
+	int err = n_workers > 1 ? compile_files_parallel(files, n_files, n_workers) : -1;
+
+	// Serial, also if the pool cannot be set up
+	if (err < 0) {
+		err = 0;
+		for (size_t i = 0; i < n_files; i++) {
+			err |= compile_file(files[i]);
+		}
 	}
 
 	if (err) {
@@ -1,27 +1,144 @@
 #include <assert.h>
-#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "lexer.h"
+#include "lexer_simd.h"
+#include "lang_names.h"
 
-// TODO: FIX REALLOCATION!
-#define LEXER_INITIAL_BUFLEN (12800)
+#define LEXER_CHUNK_SIZE (64 * 1024)
+#define LEXER_INITIAL_TOKENS (256)
+#define LEXER_INITIAL_LINES (64)
+// Smaller segments are not worth a thread
+#define LEXER_MIN_SEGMENT (64 * 1024)
 
 #define LEXER_STATUS_GEN(status_) \
 	((struct LexerStatus) {.status = status_, .text_position = -1})
 
+static void lexer_tokens_dtor(struct lexer_tokens *tokens) {
+	assert (tokens);
+
+	free(tokens->types);
+	free(tokens->positions);
+	free(tokens->payloads);
+
+	*tokens = (struct lexer_tokens){0};
+}
+
+static int lexer_tokens_reserve(struct lexer_tokens *tokens, size_t cap) {
+	assert (tokens);
+
+	if (cap <= tokens->cap) {
+		return S_OK;
+	}
+
+	uint8_t *new_types = realloc(tokens->types, cap * sizeof(*new_types));
+	if (!new_types) {
+		return S_FAIL;
+	}
+	tokens->types = new_types;
+
+	uint32_t *new_positions = realloc(tokens->positions, cap * sizeof(*new_positions));
+	if (!new_positions) {
+		return S_FAIL;
+	}
+	tokens->positions = new_positions;
+
+	union lexer_token_payload *new_payloads =
+		realloc(tokens->payloads, cap * sizeof(*new_payloads));
+	if (!new_payloads) {
+		return S_FAIL;
+	}
+	tokens->payloads = new_payloads;
+
+	tokens->cap = cap;
+
+	return S_OK;
+}
+
+static int lexer_lines_push(struct lexer_lines *lines, size_t line_start) {
+	assert (lines);
+
+	if (lines->len == lines->cap) {
+		size_t new_cap = lines->cap ? lines->cap * 2 : LEXER_INITIAL_LINES;
+
+		size_t *new_starts = realloc(lines->starts, new_cap * sizeof(*new_starts));
+		if (!new_starts) {
+			return S_FAIL;
+		}
+
+		lines->starts = new_starts;
+		lines->cap = new_cap;
+	}
+
+	lines->starts[lines->len++] = line_start;
+
+	return S_OK;
+}
+
+static int lexer_lines_append(struct lexer_lines *lines, const struct lexer_lines *tail) {
+	assert (lines);
+	assert (tail);
+
+	for (size_t i = 0; i < tail->len; i++) {
+		if (lexer_lines_push(lines, tail->starts[i])) {
+			return S_FAIL;
+		}
+	}
+
+	return S_OK;
+}
+
+struct lexer_location lexer_locate(const struct lexer *lexer, size_t text_position) {
+	assert (lexer);
+
+	const struct lexer_lines *lines = &lexer->lines;
+
+	// Number of line starts at or before text_position
+	size_t lo = 0;
+	size_t hi = lines->len;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (lines->starts[mid] <= text_position) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	size_t line_start = lo ? lines->starts[lo - 1] : 0;
+
+	return (struct lexer_location) {
+		.line = lo + 1,
+		.column = text_position - line_start + 1,
+	};
+}
+
 LexerStatus lexer_ctor(struct lexer *lexer) {
 	assert (lexer);
 
-	DSError_t ret = DS_OK;
+	*lexer = (struct lexer){0};
 
-	if ((ret = pvector_init(&lexer->tokens, sizeof(struct lexer_token)))) {
-		return LEXER_STATUS_GEN(LXST_INTERNAL_FAILURE);
+	if (lexer_tokens_reserve(&lexer->tokens, LEXER_INITIAL_TOKENS)) {
+		lexer_tokens_dtor(&lexer->tokens);
+		return LEXER_STATUS_GEN(LXST_ALLOCATION);
+	}
+
+	if (intern_ctor(&lexer->names)) {
+		lexer_tokens_dtor(&lexer->tokens);
+		return LEXER_STATUS_GEN(LXST_ALLOCATION);
 	}
 
-	lexer->words_buflen = 0;
-	lexer->words_bufidx = 0;
-	lexer->words_buf = NULL;
+	lexer->intern = &lexer->names;
+	lexer->pull_status = LEXER_STATUS_GEN(LXST_OK);
 
 	return LEXER_STATUS_GEN(LXST_OK);
 }
@@ -29,13 +146,18 @@ LexerStatus lexer_ctor(struct lexer *lexer) {
 LexerStatus lexer_dtor(struct lexer *lexer) {
 	assert (lexer);
 
-	pvector_destroy(&lexer->tokens);
-
-	free(lexer->words_buf);
-	lexer->words_buf = NULL;
-
-	lexer->words_buflen = 0;
-	lexer->words_bufidx = 0;
+	lexer_tokens_dtor(&lexer->tokens);
+	free(lexer->lines.starts);
+	lexer->lines = (struct lexer_lines){0};
+	intern_dtor(&lexer->names);
+	free(lexer->source.buf);
+	if (lexer->source.map) {
+		munmap(lexer->source.map, lexer->source.map_size);
+	}
+	if (lexer->source.owns_fd) {
+		close(lexer->source.fd);
+	}
+	lexer->source = (struct lexer_source){0};
 
 	return LEXER_STATUS_GEN(LXST_OK);
 }
@@ -44,60 +166,57 @@ LexerStatus lexer_clone(struct lexer *old, struct lexer *new) {
 	assert (old);
 	assert (new);
 
-	char *wordsbuf_clone = calloc(old->words_buflen, 1);
-	if (!wordsbuf_clone) {
+	// Pulled tokens are not kept
+	if (old->pull_mode) {
+		return LEXER_STATUS_GEN(LXST_INTERNAL_FAILURE);
+	}
+
+	*new = (struct lexer){0};
+	new->intern = &new->names;
+	new->pull_status = LEXER_STATUS_GEN(LXST_OK);
+
+	if (intern_clone(&new->names, &old->names)) {
 		return LEXER_STATUS_GEN(LXST_ALLOCATION);
 	}
 
-	new->words_buflen	= old->words_buflen;
-	new->words_bufidx	= old->words_bufidx;
-	new->words_buf		= wordsbuf_clone;
+	size_t len = old->tokens.len;
+	if (lexer_tokens_reserve(&new->tokens, len ? len : LEXER_INITIAL_TOKENS)) {
+		lexer_tokens_dtor(&new->tokens);
+		intern_dtor(&new->names);
+		return LEXER_STATUS_GEN(LXST_ALLOCATION);
+	}
+
+	memcpy(new->tokens.types, old->tokens.types, len * sizeof(*new->tokens.types));
+	memcpy(new->tokens.positions, old->tokens.positions,
+	       len * sizeof(*new->tokens.positions));
+	memcpy(new->tokens.payloads, old->tokens.payloads,
+	       len * sizeof(*new->tokens.payloads));
+	new->tokens.len = len;
 
-	if (pvector_clone(&new->tokens, &old->tokens)) {
-		free (wordsbuf_clone);
+	if (lexer_lines_append(&new->lines, &old->lines)) {
+		lexer_dtor(new);
 		return LEXER_STATUS_GEN(LXST_ALLOCATION);
 	}
 
 	return LEXER_STATUS_GEN(LXST_OK);
 }
 
-LexerStatus lexer_copy_token_word(
+LexerStatus lexer_intern_token_word(
 	struct lexer *lexer, const char *token_name, size_t token_size,
-	char **token_copied) {
+	struct lexer_token *token) {
 
 	assert (lexer);
 	assert (token_name);
 	assert (token_size > 0);
-	assert (token_copied);
-	
-	if (lexer->words_bufidx + token_size + 1 > lexer->words_buflen) {
-		size_t new_wordsbuf_sz = lexer->words_buflen * 2;
-
-		if (new_wordsbuf_sz < LEXER_INITIAL_BUFLEN) {
-			new_wordsbuf_sz = LEXER_INITIAL_BUFLEN;
-		}
-		if (lexer->words_bufidx + token_size + 1 > new_wordsbuf_sz) {
-			new_wordsbuf_sz = lexer->words_bufidx + token_size + 1;
-		}
-
-		void *new_lexer_buf = realloc(lexer->words_buf, new_wordsbuf_sz);
-		if (!new_lexer_buf) {
-			return LEXER_STATUS_GEN(LXST_ALLOCATION);
-		}
+	assert (token);
 
-		lexer->words_buf = new_lexer_buf;
-		lexer->words_buflen = new_wordsbuf_sz;
+	uint32_t name_id = 0;
+	if (intern_string(lexer->intern, token_name, token_size, &name_id)) {
+		return LEXER_STATUS_GEN(LXST_ALLOCATION);
 	}
 
-	memcpy(lexer->words_buf + lexer->words_bufidx, token_name, token_size);
-	lexer->words_buf[lexer->words_bufidx + token_size] = '\0';
-
-	char *word_ptr = lexer->words_buf + lexer->words_bufidx;
-
-	lexer->words_bufidx += token_size + 1;
-
-	
-	*token_copied = word_ptr;
+	(*token).word = intern_name(lexer->intern, name_id);
+	(*token).name_id = name_id;
 
 	return LEXER_STATUS_GEN(LXST_OK);
 }
@@ -106,44 +225,268 @@ static LexerStatus lexer_add_token(struct lexer *lexer, struct lexer_token *toke
 	assert (lexer);
 	assert (token);
 
-	DSError_t ret = DS_OK;
-	if ((ret = pvector_push_back(&lexer->tokens, token))) {
+	struct lexer_tokens *tokens = &lexer->tokens;
+
+	if (token->text_position > UINT32_MAX) {
+		log_error("Token position %zu does not fit the token table",
+			  token->text_position);
+		return LEXER_STATUS_GEN(LXST_INTERNAL_FAILURE);
+	}
+
+	if (tokens->len == tokens->cap &&
+		lexer_tokens_reserve(tokens, tokens->cap * 2)) {
 		return LEXER_STATUS_GEN(LXST_ALLOCATION);
 	}
 
+	tokens->types[tokens->len] = (uint8_t)token->tok_type;
+	tokens->positions[tokens->len] = (uint32_t)token->text_position;
+
+	if (token->tok_type == LXTOK_NUMBER) {
+		tokens->payloads[tokens->len].number = token->lexer_number;
+	} else {
+		tokens->payloads[tokens->len].name_id = token->name_id;
+	}
+
+	tokens->len++;
+
 	return LEXER_STATUS_GEN(LXST_OK);
 }
 
-static LexerStatus lexer_parse_number(struct lexer *lexer,
-			const char *text, const char **text_end_ptr,
-			struct lexer_token *token) {
-	assert (lexer);
-	assert (text);
-	assert (text_end_ptr);
-	assert (token);
+/*
+ * The lexer is a single table-driven DFA. Every input byte is mapped to a
+ * character class, and the (state, class) pair selects either the next state
+ * or one of the terminal actions below. A token is thus classified and
+ * consumed in one forward scan without retrying the text with different
+ * sub-parsers.
+ */
+
+enum lexer_char_class {
+	LXCC_OTHER,
+	LXCC_NUL,
+	LXCC_SPACE,
+	LXCC_NEWLINE,
+	LXCC_ZERO,	// 0
+	LXCC_OCT,	// 1-7
+	LXCC_DEC,	// 8-9
+	LXCC_HEX,	// a-f A-F
+	LXCC_X,		// x X
+	LXCC_ALPHA,	// the rest of letters
+	LXCC_PUNCT,	// single-char operators: { } ( ) + * ^ ; , & |
+	LXCC_MINUS,	// -
+	LXCC_SLASH,	// /
+	LXCC_LESS,	// <
+	LXCC_GREATER,	// >
+	LXCC_EQUAL,	// =
+	LXCC_BANG,	// !
+	LXCC_COLON,	// :
+
+	LXCC_N_CLASSES,
+};
+
+enum lexer_state {
+	LXS_START,
+	LXS_IDENT,
+	LXS_NUM_ZERO,
+	LXS_NUM_OCT,
+	LXS_NUM_DEC,
+	LXS_NUM_HEX_PREFIX,
+	LXS_NUM_HEX,
+	LXS_SLASH,
+	LXS_COMMENT,
+	LXS_PUNCT,
+	LXS_LESS,
+	LXS_LESS_EQ,
+	LXS_SHL,
+	LXS_MEM_WRITE,
+	LXS_GREATER,
+	LXS_GREATER_EQ,
+	LXS_SHR,
+	LXS_ASSIGN,
+	LXS_EQUALS_CMP,
+	LXS_BANG,
+	LXS_NOT_EQUALS_CMP,
+	LXS_COLON,
+	LXS_DECL_ASSIGN,
+
+	LXS_N_STATES,
+
+	// Terminal actions, the current char is not consumed
+	LXS_ACCEPT = LXS_N_STATES,
+	LXS_END,
+	LXS_ERR_NOT_MATCHED,
+	LXS_ERR_DIGIT_BEGINNING,
+};
+
+static const uint8_t lexer_char_class[256] = {
+	['\0']		= LXCC_NUL,
+	[' ']		= LXCC_SPACE,
+	['\t']		= LXCC_SPACE,
+	['\v']		= LXCC_SPACE,
+	['\f']		= LXCC_SPACE,
+	['\r']		= LXCC_SPACE,
+	['\n']		= LXCC_NEWLINE,
+	['0']		= LXCC_ZERO,
+	['1' ... '7']	= LXCC_OCT,
+	['8' ... '9']	= LXCC_DEC,
+	['a' ... 'f']	= LXCC_HEX,
+	['A' ... 'F']	= LXCC_HEX,
+	['x']		= LXCC_X,
+	['X']		= LXCC_X,
+	['g' ... 'w']	= LXCC_ALPHA,
+	['y' ... 'z']	= LXCC_ALPHA,
+	['G' ... 'W']	= LXCC_ALPHA,
+	['Y' ... 'Z']	= LXCC_ALPHA,
+	['{']		= LXCC_PUNCT,
+	['}']		= LXCC_PUNCT,
+	['(']		= LXCC_PUNCT,
+	[')']		= LXCC_PUNCT,
+	['+']		= LXCC_PUNCT,
+	['*']		= LXCC_PUNCT,
+	['^']		= LXCC_PUNCT,
+	[';']		= LXCC_PUNCT,
+	[',']		= LXCC_PUNCT,
+	['&']		= LXCC_PUNCT,
+	['|']		= LXCC_PUNCT,
+	['-']		= LXCC_MINUS,
+	['/']		= LXCC_SLASH,
+	['<']		= LXCC_LESS,
+	['>']		= LXCC_GREATER,
+	['=']		= LXCC_EQUAL,
+	['!']		= LXCC_BANG,
+	[':']		= LXCC_COLON,
+};
+
+#define A_ LXS_ACCEPT
+#define E_ LXS_ERR_NOT_MATCHED
+#define D_ LXS_ERR_DIGIT_BEGINNING
+
+static const uint8_t lexer_transitions[LXS_N_STATES][LXCC_N_CLASSES] = {
+/*			   OTHER NUL	SPACE	NEWLINE	ZERO		OCT		DEC		HEX		X		ALPHA		PUNCT	  MINUS		SLASH	  LESS	    GREATER	EQUAL		BANG	 COLON */
+[LXS_START]		= {E_, LXS_END,	E_,	E_,	LXS_NUM_ZERO,	LXS_NUM_DEC,	LXS_NUM_DEC,	LXS_IDENT,	LXS_IDENT,	LXS_IDENT,	LXS_PUNCT, LXS_PUNCT,	LXS_SLASH, LXS_LESS, LXS_GREATER, LXS_ASSIGN,	LXS_BANG, LXS_COLON},
+[LXS_IDENT]		= {A_, A_,	A_,	A_,	LXS_IDENT,	LXS_IDENT,	LXS_IDENT,	LXS_IDENT,	LXS_IDENT,	LXS_IDENT,	A_,	  A_,		A_,	  A_,	    A_,		A_,		A_,	 A_},
+[LXS_NUM_ZERO]		= {A_, A_,	A_,	A_,	LXS_NUM_OCT,	LXS_NUM_OCT,	A_,		D_,		LXS_NUM_HEX_PREFIX, D_,		A_,	  A_,		A_,	  A_,	    A_,		A_,		A_,	 A_},
+[LXS_NUM_OCT]		= {A_, A_,	A_,	A_,	LXS_NUM_OCT,	LXS_NUM_OCT,	A_,		D_,		D_,		D_,		A_,	  A_,		A_,	  A_,	    A_,		A_,		A_,	 A_},
+[LXS_NUM_DEC]		= {A_, A_,	A_,	A_,	LXS_NUM_DEC,	LXS_NUM_DEC,	LXS_NUM_DEC,	D_,		D_,		D_,		A_,	  A_,		A_,	  A_,	    A_,		A_,		A_,	 A_},
+[LXS_NUM_HEX_PREFIX]	= {D_, D_,	D_,	D_,	LXS_NUM_HEX,	LXS_NUM_HEX,	LXS_NUM_HEX,	LXS_NUM_HEX,	D_,		D_,		D_,	  D_,		D_,	  D_,	    D_,		D_,		D_,	 D_},
+[LXS_NUM_HEX]		= {A_, A_,	A_,	A_,	LXS_NUM_HEX,	LXS_NUM_HEX,	LXS_NUM_HEX,	LXS_NUM_HEX,	D_,		D_,		A_,	  A_,		A_,	  A_,	    A_,		A_,		A_,	 A_},
+[LXS_SLASH]		= {A_, A_,	A_,	A_,	A_,		A_,		A_,		A_,		A_,		A_,		A_,	  A_,		LXS_COMMENT, A_,    A_,		A_,		A_,	 A_},
+[LXS_COMMENT]		= {LXS_COMMENT, A_, LXS_COMMENT, A_, LXS_COMMENT, LXS_COMMENT, LXS_COMMENT, LXS_COMMENT, LXS_COMMENT, LXS_COMMENT, LXS_COMMENT, LXS_COMMENT, LXS_COMMENT, LXS_COMMENT, LXS_COMMENT, LXS_COMMENT, LXS_COMMENT, LXS_COMMENT},
+[LXS_PUNCT]		= {A_, A_,	A_,	A_,	A_,		A_,		A_,		A_,		A_,		A_,		A_,	  A_,		A_,	  A_,	    A_,		A_,		A_,	 A_},
+[LXS_LESS]		= {A_, A_,	A_,	A_,	A_,		A_,		A_,		A_,		A_,		A_,		A_,	  LXS_MEM_WRITE, A_,	  LXS_SHL,  A_,		LXS_LESS_EQ,	A_,	 A_},
+[LXS_LESS_EQ]		= {A_, A_,	A_,	A_,	A_,		A_,		A_,		A_,		A_,		A_,		A_,	  LXS_MEM_WRITE, A_,	  LXS_SHL,  A_,		A_,		A_,	 A_},
+[LXS_SHL]		= {A_, A_,	A_,	A_,	A_,		A_,		A_,		A_,		A_,		A_,		A_,	  LXS_MEM_WRITE, A_,	  A_,	    A_,		A_,		A_,	 A_},
+[LXS_MEM_WRITE]		= {A_, A_,	A_,	A_,	A_,		A_,		A_,		A_,		A_,		A_,		A_,	  A_,		A_,	  A_,	    A_,		A_,		A_,	 A_},
+[LXS_GREATER]		= {A_, A_,	A_,	A_,	A_,		A_,		A_,		A_,		A_,		A_,		A_,	  A_,		A_,	  A_,	    LXS_SHR,	LXS_GREATER_EQ,	A_,	 A_},
+[LXS_GREATER_EQ]	= {A_, A_,	A_,	A_,	A_,		A_,		A_,		A_,		A_,		A_,		A_,	  A_,		A_,	  A_,	    LXS_SHR,	A_,		A_,	 A_},
+[LXS_SHR]		= {A_, A_,	A_,	A_,	A_,		A_,		A_,		A_,		A_,		A_,		A_,	  A_,		A_,	  A_,	    A_,		A_,		A_,	 A_},
+[LXS_ASSIGN]		= {A_, A_,	A_,	A_,	A_,		A_,		A_,		A_,		A_,		A_,		A_,	  A_,		A_,	  A_,	    A_,		LXS_EQUALS_CMP,	A_,	 A_},
+[LXS_EQUALS_CMP]	= {A_, A_,	A_,	A_,	A_,		A_,		A_,		A_,		A_,		A_,		A_,	  A_,		A_,	  A_,	    A_,		A_,		A_,	 A_},
+[LXS_BANG]		= {E_, E_,	E_,	E_,	E_,		E_,		E_,		E_,		E_,		E_,		E_,	  E_,		E_,	  E_,	    E_,		LXS_NOT_EQUALS_CMP, E_,	 E_},
+[LXS_NOT_EQUALS_CMP]	= {A_, A_,	A_,	A_,	A_,		A_,		A_,		A_,		A_,		A_,		A_,	  A_,		A_,	  A_,	    A_,		A_,		A_,	 A_},
+[LXS_COLON]		= {E_, E_,	E_,	E_,	E_,		E_,		E_,		E_,		E_,		E_,		E_,	  E_,		E_,	  E_,	    E_,		LXS_DECL_ASSIGN, E_,	 E_},
+[LXS_DECL_ASSIGN]	= {A_, A_,	A_,	A_,	A_,		A_,		A_,		A_,		A_,		A_,		A_,	  A_,		A_,	  A_,	    A_,		A_,		A_,	 A_},
+};
+
+#undef A_
+#undef E_
+#undef D_
+
+// Token types of the accepting operator states
+static const uint8_t lexer_state_tokens[LXS_N_STATES] = {
+	[LXS_SLASH]		= LXTOK_DIVIDE,
+	[LXS_LESS]		= LXTOK_LESS_CMP,
+	[LXS_LESS_EQ]		= LXTOK_LESS_EQ_CMP,
+	[LXS_SHL]		= LXTOK_SHL,
+	[LXS_MEM_WRITE]		= LXTOK_MEM_WRITE,
+	[LXS_GREATER]		= LXTOK_GREATER_CMP,
+	[LXS_GREATER_EQ]	= LXTOK_GREATER_EQ_CMP,
+	[LXS_SHR]		= LXTOK_SHR,
+	[LXS_ASSIGN]		= LXTOK_ASSIGN,
+	[LXS_EQUALS_CMP]	= LXTOK_EQUALS_CMP,
+	[LXS_NOT_EQUALS_CMP]	= LXTOK_NOT_EQUALS_CMP,
+	[LXS_DECL_ASSIGN]	= LXTOK_DECL_ASSIGN,
+};
+
+// Token types of LXCC_PUNCT and LXCC_MINUS characters
+static const uint8_t lexer_punct_tokens[256] = {
+	['{'] = LXTOK_BCURLY_OPEN,
+	['}'] = LXTOK_BCURLY_CLOSE,
+	['('] = LXTOK_BROUND_OPEN,
+	[')'] = LXTOK_BROUND_CLOSE,
+	['+'] = LXTOK_PLUS,
+	['-'] = LXTOK_MINUS,
+	['*'] = LXTOK_MULTIPLY,
+	['^'] = LXTOK_POW,
+	[';'] = LXTOK_SEMICOLON,
+	[','] = LXTOK_COMMA,
+	['&'] = LXTOK_BITAND,
+	['|'] = LXTOK_BITOR,
+};
+
+#define LEXER_CHAR_CLASS(c) (lexer_char_class[(uint8_t)(c)])
+
+static int lexer_digit_value(char c) {
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
 
-	const char *text_end = text;
+	return (c | 0x20) - 'a' + 10;
+}
 
-	if (!isdigit(*text_end)) {
-		return LEXER_STATUS_GEN(LXST_NOT_MATCHED_TOKEN);
+/**
+ * Converts the digits accepted by the DFA. Saturates on overflow like strtoll.
+ */
+static int64_t lexer_convert_number(const char *text, const char *text_end,
+				    int base) {
+	assert (text);
+	assert (text_end);
+
+	uint64_t num = 0;
+	const char *digit = text;
+
+#ifdef LEXER_HAS_SWAR
+	// Eight decimal digits at a time while the result cannot overflow
+	if (base == 10) {
+		while (text_end - digit >= 8 &&
+			num <= ((uint64_t)INT64_MAX - 99999999) / 100000000) {
+			num = num * 100000000 + lexer_swar_parse8(digit);
+			digit += 8;
+		}
 	}
+#endif
 
-	char *strte = NULL;
-	long long num = strtoll(text, &strte, 0);
-	text_end = strte;
+	for (; digit < text_end; digit++) {
+		uint64_t dval = (uint64_t)lexer_digit_value(*digit);
 
-	*text_end_ptr = text_end;
+		if (num > ((uint64_t)INT64_MAX - dval) / (uint64_t)base) {
+			return INT64_MAX;
+		}
 
-	if (isalpha(*text_end)) {
-		return LEXER_STATUS_GEN(LXST_VARIABLE_DIGIT_BEGINNING);
+		num = num * (uint64_t)base + dval;
 	}
 
-	(*token).tok_type = LXTOK_NUMBER;
-	(*token).lexer_number = num;
-
-	return LEXER_STATUS_GEN(LXST_OK);
+	return (int64_t)num;
 }
 
+static const enum LexerTokenType lexer_keyword_tokens[] = {
+	[EXPR_IDX_PRINT]	= LXTOK_PRINT,
+	[EXPR_IDX_INPUT]	= LXTOK_INPUT,
+	[EXPR_IDX_IF]		= LXTOK_IF,
+	[EXPR_IDX_ELSE]		= LXTOK_ELSE,
+	[EXPR_IDX_SQRT]		= LXTOK_SQRT,
+	[EXPR_IDX_FUNC]		= LXTOK_FUNC,
+	[EXPR_IDX_RETURN]	= LXTOK_RETURN,
+	[EXPR_IDX_WHILE]	= LXTOK_WHILE,
+	[EXPR_IDX_SCRHT]	= LXTOK_SCRHT,
+	[EXPR_IDX_SCRWT]	= LXTOK_SCRWT,
+	[EXPR_IDX_DRAW]		= LXTOK_DRAW,
+	[EXPR_IDX_MEM_READ]	= LXTOK_MEM_READ,
+};
+
+/**
+ * Keywords are matched by their full length: "i" or "printer" are
+ * ordinary variables.
+ */
 static LexerStatus lexer_parse_keyword(struct lexer *lexer,
 			const char *text, size_t kw_size,
 			struct lexer_token *token) {
@@ -151,20 +494,40 @@ static LexerStatus lexer_parse_keyword(struct lexer *lexer,
 	assert (text);
 	assert (token);
 
-	struct lexer_keyword_tok *kw = lexer_keyword_table;
-	while (kw->tok_name) {
-		if (strncmp(text, kw->tok_name, kw_size)) {
-			kw++;
-			continue;
-		}
+	const struct lang_name *lname = lang_name_lookup(text, kw_size);
+	if (!lname || !(lname->flags & LANG_NAME_F_KEYWORD)) {
+		return LEXER_STATUS_GEN(LXST_NOT_MATCHED_TOKEN);
+	}
+
+	(*token).word = NULL;
+	(*token).tok_type = lexer_keyword_tokens[lname->op_idx];
 
-		(*token).word = NULL;
-		(*token).tok_type = kw->tok_type;
+	return LEXER_STATUS_GEN(LXST_OK);
+}
 
-		return LEXER_STATUS_GEN(LXST_OK);
+static LexerStatus lexer_accept_word(struct lexer *lexer,
+			const char *text, const char *text_end,
+			struct lexer_token *token) {
+	assert (lexer);
+	assert (text);
+	assert (text_end);
+	assert (token);
+
+	struct LexerStatus kw_status = lexer_parse_keyword(lexer, text,
+						(size_t)(text_end - text), token);
+	if (LEXER_STATUS(kw_status) != LXST_NOT_MATCHED_TOKEN) {
+		return kw_status;
+	}
+
+	struct LexerStatus intern_status = lexer_intern_token_word(lexer, text,
+				(size_t) (text_end - text), token);
+	if (LEXER_STATUS(intern_status)) {
+		return intern_status;
 	}
 
-	return LEXER_STATUS_GEN(LXST_NOT_MATCHED_TOKEN);
+	(*token).tok_type = LXTOK_VARIABLE;
+
+	return LEXER_STATUS_GEN(LXST_OK);
 }
 
 LexerStatus lexer_parse_var(struct lexer *lexer,
@@ -175,253 +538,749 @@ LexerStatus lexer_parse_var(struct lexer *lexer,
 	assert (text_end_ptr);
 	assert (token);
 
-	const char *text_end = text;
-
-	if (!isalpha(*text)) {
+	if (lexer_transitions[LXS_START][LEXER_CHAR_CLASS(*text)] != LXS_IDENT) {
 		return LEXER_STATUS_GEN(LXST_NOT_MATCHED_TOKEN);
 	}
 
-	text_end++;
-
-	while (isalpha(*text_end) || isdigit(*text_end)) {
+	const char *text_end = text + 1;
 
+	while (lexer_transitions[LXS_IDENT][LEXER_CHAR_CLASS(*text_end)] == LXS_IDENT) {
 		text_end++;
 	}
 
 	*text_end_ptr = text_end;
 
-	struct LexerStatus kw_status = lexer_parse_keyword(lexer, text,
-						(size_t)(text_end - text), token);
-	if (LEXER_STATUS(kw_status) != LXST_NOT_MATCHED_TOKEN) {
-		return kw_status;
-	}
+	return lexer_accept_word(lexer, text, text_end, token);
+}
 
-	char *copied_word = NULL;
-	struct LexerStatus copy_status = lexer_copy_token_word(lexer, text,
-				(size_t) (text_end - text), &copied_word);
-	if (LEXER_STATUS(copy_status)) {
-		return copy_status;
-	}
+/**
+ * Performs the action of the accepting state the DFA stopped in.
+ * Returns LXST_OK_NO_TOKEN for comments.
+ */
+static LexerStatus lexer_accept_token(struct lexer *lexer, enum lexer_state state,
+			const char *text, const char *text_end,
+			struct lexer_token *token) {
+	assert (lexer);
+	assert (text);
+	assert (text_end);
+	assert (token);
 
-	(*token).tok_type = LXTOK_VARIABLE;
-	(*token).word = copied_word;
+	switch (state) {
+		case LXS_IDENT:
+			return lexer_accept_word(lexer, text, text_end, token);
+		case LXS_NUM_ZERO:
+		case LXS_NUM_OCT:
+			(*token).tok_type = LXTOK_NUMBER;
+			(*token).lexer_number = lexer_convert_number(text, text_end, 8);
+			break;
+		case LXS_NUM_DEC:
+			(*token).tok_type = LXTOK_NUMBER;
+			(*token).lexer_number = lexer_convert_number(text, text_end, 10);
+			break;
+		case LXS_NUM_HEX:
+			(*token).tok_type = LXTOK_NUMBER;
+			(*token).lexer_number = lexer_convert_number(text + 2, text_end, 16);
+			break;
+		case LXS_COMMENT:
+			return LEXER_STATUS_GEN(LXST_OK_NO_TOKEN);
+		case LXS_PUNCT:
+			(*token).word = NULL;
+			(*token).tok_type = lexer_punct_tokens[(uint8_t)*text];
+			break;
+		case LXS_SLASH:
+		case LXS_LESS:
+		case LXS_LESS_EQ:
+		case LXS_SHL:
+		case LXS_MEM_WRITE:
+		case LXS_GREATER:
+		case LXS_GREATER_EQ:
+		case LXS_SHR:
+		case LXS_ASSIGN:
+		case LXS_EQUALS_CMP:
+		case LXS_NOT_EQUALS_CMP:
+		case LXS_DECL_ASSIGN:
+			(*token).word = NULL;
+			(*token).tok_type = lexer_state_tokens[state];
+			break;
+		case LXS_START:
+		case LXS_NUM_HEX_PREFIX:
+		case LXS_BANG:
+		case LXS_COLON:
+		case LXS_N_STATES:
+		case LXS_END:
+		case LXS_ERR_NOT_MATCHED:
+		case LXS_ERR_DIGIT_BEGINNING:
+		default:
+			assert (0 && "unreachable");
+			return LEXER_STATUS_GEN(LXST_INTERNAL_FAILURE);
+	}
 
 	return LEXER_STATUS_GEN(LXST_OK);
 }
 
-static LexerStatus lexer_parse_operator(struct lexer *lexer,
-			const char *text, const char **text_end_ptr,
-			struct lexer_token *token) {
+static int lexer_record_lines(struct lexer *lexer, const struct lexer_source *src,
+			      const char *text, const char *text_end) {
 	assert (lexer);
+	assert (src);
 	assert (text);
-	assert (text_end_ptr);
+	assert (text_end);
+
+	while ((text = memchr(text, '\n', (size_t)(text_end - text)))) {
+		text++;
+
+		if (lexer_lines_push(&lexer->lines,
+				     src->text_offset + (size_t)(text - src->text))) {
+			return S_FAIL;
+		}
+	}
+
+	return S_OK;
+}
+
+/**
+ * Lexes the next token of src into *token. Tokens must not run over
+ * src->text_end: the source ends with a NUL or a newline there.
+ *
+ * Returns LXST_OK_NO_TOKEN when no token is produced: either src->at_end is
+ * set, or src->more_input is set and a token touches text_end, in which case
+ * it may continue in the next chunk. src->need_input is set then and src->cur
+ * is the first byte to keep. Only comments are resumed midway (with
+ * src->resume_state), any other token is rescanned from its beginning.
+ */
+static LexerStatus lexer_scan_token(struct lexer *lexer, struct lexer_source *src,
+				    struct lexer_token *token) {
+	assert (lexer);
+	assert (src);
 	assert (token);
 
-	const char *text_cur_ptr = text;
-
-	enum LexerTokenType token_type = 0;
-
-	switch (*text) {
-#define LXCASE_TOK_TYPE_(op_name, tok_type)	\
-		case op_name:			\
-			token_type = tok_type;	\
-			break;			\
-
-		LXCASE_TOK_TYPE_('{', LXTOK_BCURLY_OPEN);
-		LXCASE_TOK_TYPE_('}', LXTOK_BCURLY_CLOSE);
-		LXCASE_TOK_TYPE_('(', LXTOK_BROUND_OPEN);
-		LXCASE_TOK_TYPE_(')', LXTOK_BROUND_CLOSE);
-		LXCASE_TOK_TYPE_('+', LXTOK_PLUS);
-		LXCASE_TOK_TYPE_('-', LXTOK_MINUS);
-		LXCASE_TOK_TYPE_('*', LXTOK_MULTIPLY);
-		LXCASE_TOK_TYPE_('/', LXTOK_DIVIDE);
-		LXCASE_TOK_TYPE_('^', LXTOK_POW);	
-		LXCASE_TOK_TYPE_(';', LXTOK_SEMICOLON);
-		LXCASE_TOK_TYPE_(',', LXTOK_COMMA);
-		LXCASE_TOK_TYPE_('&', LXTOK_BITAND);
-		LXCASE_TOK_TYPE_('|', LXTOK_BITOR);
-
-		case '<':
-			token_type = LXTOK_LESS_CMP;
-			if (*(text_cur_ptr + 1) == '=') {
-				text_cur_ptr++;
-				token_type = LXTOK_LESS_EQ_CMP;
-			}
-			if (*(text_cur_ptr + 1) == '<') {
-				text_cur_ptr++;
-				token_type = LXTOK_SHL;
-			}
-			if (*(text_cur_ptr + 1) == '-') {
-				text_cur_ptr++;
-				token_type = LXTOK_MEM_WRITE;
-			}
-			break;
-		case '>':
-			token_type = LXTOK_GREATER_CMP;
-			if (*(text_cur_ptr + 1) == '=') {
-				text_cur_ptr++;
-				token_type = LXTOK_GREATER_EQ_CMP;
-			}
-			if (*(text_cur_ptr + 1) == '>') {
-				text_cur_ptr++;
-				token_type = LXTOK_SHR;
+	const char *text_cur_ptr = src->cur;
+
+	for (;;) {
+		enum lexer_state state = LXS_START;
+		uint8_t char_class = LEXER_CHAR_CLASS(*text_cur_ptr);
+
+		if (src->resume_state == LXS_COMMENT) {
+			state = LXS_COMMENT;
+			src->resume_state = LXS_START;
+		} else {
+			const char *spaces = text_cur_ptr;
+			text_cur_ptr = lexer_skip_spaces(text_cur_ptr, src->text_end);
+			char_class = LEXER_CHAR_CLASS(*text_cur_ptr);
+
+			// Newlines are only ever consumed here, a comment stops before one
+			if (lexer_record_lines(lexer, src, spaces, text_cur_ptr)) {
+				return LEXER_STATUS_GEN(LXST_ALLOCATION);
 			}
-			break;
-		case '!':
-			if (*(text_cur_ptr + 1) == '=') {
-				text_cur_ptr++;
-				token_type = LXTOK_NOT_EQUALS_CMP;
-			} else {
-				return LEXER_STATUS_GEN(LXST_NOT_MATCHED_TOKEN);
+
+			// Segments of a larger text do not end with a NUL
+			if (text_cur_ptr == src->text_end && !src->more_input) {
+				src->cur = text_cur_ptr;
+				src->at_end = 1;
+				return LEXER_STATUS_GEN(LXST_OK_NO_TOKEN);
 			}
-			break;
+		}
+
+		const char *token_start = text_cur_ptr;
+		uint8_t next_state = lexer_transitions[state][char_class];
 
-		case '=':
-			token_type = LXTOK_ASSIGN;
-			if (*(text_cur_ptr + 1) == '=') {
-				text_cur_ptr++;
-				token_type = LXTOK_EQUALS_CMP;
+		while (next_state < LXS_N_STATES) {
+			state = next_state;
+			text_cur_ptr++;
+
+			if (state == LXS_IDENT) {
+				text_cur_ptr = lexer_skip_ident(text_cur_ptr, src->text_end);
+			} else if (state == LXS_COMMENT) {
+				text_cur_ptr = lexer_skip_comment(text_cur_ptr, src->text_end);
 			}
-			break;
 
-		case ':':
-			if (*(text_cur_ptr + 1) == '=') {
-				text_cur_ptr++;
-				token_type = LXTOK_DECL_ASSIGN;
+			next_state = lexer_transitions[state][LEXER_CHAR_CLASS(*text_cur_ptr)];
+		}
+
+		if (src->more_input && text_cur_ptr == src->text_end) {
+			if (state == LXS_COMMENT) {
+				src->resume_state = LXS_COMMENT;
+				src->cur = src->text_end;
 			} else {
-				return LEXER_STATUS_GEN(LXST_NOT_MATCHED_TOKEN);
+				src->cur = token_start;
 			}
-			break;
 
-#undef LXCASE_TOK_TYPE_
-		default:
-			return LEXER_STATUS_GEN(LXST_NOT_MATCHED_TOKEN);
+			src->need_input = 1;
+			return LEXER_STATUS_GEN(LXST_OK_NO_TOKEN);
+		}
+
+		size_t token_position = src->text_offset + (size_t) (token_start - src->text);
+
+		LexerStatus parser_status = {0};
+		parser_status.text_position = (ssize_t)token_position;
+
+		switch (next_state) {
+			case LXS_END:
+				src->cur = text_cur_ptr;
+				src->at_end = 1;
+				return LEXER_STATUS_GEN(LXST_OK_NO_TOKEN);
+			case LXS_ERR_NOT_MATCHED:
+				parser_status.status = LXST_NOT_MATCHED_TOKEN;
+				return parser_status;
+			case LXS_ERR_DIGIT_BEGINNING:
+				parser_status.status = LXST_VARIABLE_DIGIT_BEGINNING;
+				return parser_status;
+			default:
+				break;
+		}
+
+		*token = (struct lexer_token){0};
+		token->text_position = token_position;
+
+		LexerStatus accept_status = lexer_accept_token(lexer, state,
+						token_start, text_cur_ptr, token);
+		if (LEXER_STATUS(accept_status) == LXST_OK_NO_TOKEN) {
+			continue;
+		}
+		if (LEXER_STATUS(accept_status)) {
+			parser_status.status = accept_status.status;
+			return parser_status;
+		}
+
+		src->cur = text_cur_ptr;
+
+		return LEXER_STATUS_GEN(LXST_OK);
 	}
+}
 
-	text_cur_ptr++;
+/**
+ * Reads the next chunk of a chunked source. Only the unfinished token at
+ * the end of the previous chunk is carried over, so the buffer grows beyond
+ * the chunk size only for a single token longer than it.
+ */
+static LexerStatus lexer_source_refill(struct lexer_source *src) {
+	assert (src);
+	assert (src->read_fn);
+	assert (src->buf);
+
+	size_t carry = (size_t)(src->text_end - src->cur);
+	src->text_offset += (size_t)(src->cur - src->buf);
+	memmove(src->buf, src->cur, carry);
+
+	if (carry == src->buf_size) {
+		char *new_buf = realloc(src->buf, src->buf_size * 2 + 1);
+		if (!new_buf) {
+			return LEXER_STATUS_GEN(LXST_ALLOCATION);
+		}
 
-	(*token).word = NULL;
-	(*token).tok_type = token_type;
+		src->buf = new_buf;
+		src->buf_size *= 2;
+	}
+
+	ssize_t read_bytes = src->read_fn(src->read_ctx, src->buf + carry,
+					  src->buf_size - carry);
+	if (read_bytes < 0) {
+		return LEXER_STATUS_GEN(LXST_INTERNAL_FAILURE);
+	}
+
+	size_t data_len = carry + (size_t)read_bytes;
+	src->buf[data_len] = '\0';
 
-	*text_end_ptr = text_cur_ptr;
+	src->text = src->buf;
+	src->cur = src->buf;
+	src->text_end = src->buf + data_len;
+	src->more_input = read_bytes != 0;
+	src->need_input = 0;
 
 	return LEXER_STATUS_GEN(LXST_OK);
 }
 
-static LexerStatus lexer_parse_comments(struct lexer *lexer,
-			const char *text, const char **text_end_ptr,
-			struct lexer_token *token) {
+/**
+ * Returns LXST_OK with the next token of src, LXST_OK_NO_TOKEN at the end
+ * of the source or an error.
+ */
+static LexerStatus lexer_source_next(struct lexer *lexer, struct lexer_source *src,
+				     struct lexer_token *token) {
 	assert (lexer);
-	assert (text);
-	assert (text_end_ptr);
+	assert (src);
 	assert (token);
 
-	const char *text_cur_ptr = text;
+	for (;;) {
+		if (src->at_end) {
+			return LEXER_STATUS_GEN(LXST_OK_NO_TOKEN);
+		}
 
-	if (*text_cur_ptr == '/' && *(text_cur_ptr + 1) == '/') {
-		text_cur_ptr += 2;
+		if (src->need_input) {
+			LexerStatus status = lexer_source_refill(src);
+			if (LEXER_STATUS(status)) {
+				return status;
+			}
+		}
 
-		while (*text_cur_ptr != '\n' && *text_cur_ptr != '\0') {
-			text_cur_ptr++;
+		LexerStatus status = lexer_scan_token(lexer, src, token);
+		if (LEXER_STATUS(status) != LXST_OK_NO_TOKEN || src->at_end) {
+			return status;
 		}
+	}
+}
+
+static void lexer_source_text(struct lexer_source *src, const char *text) {
+	assert (src);
+	assert (text);
 
-		*text_end_ptr = text_cur_ptr;
+	*src = (struct lexer_source){0};
+	src->text = text;
+	src->cur = text;
+	src->text_end = text + strlen(text);
+}
+
+static LexerStatus lexer_source_chunked(struct lexer_source *src,
+					lexer_read_fn read_fn, void *read_ctx,
+					size_t chunk_size) {
+	assert (src);
+	assert (read_fn);
+
+	if (!chunk_size) {
+		chunk_size = LEXER_CHUNK_SIZE;
+	}
 
-		return LEXER_STATUS_GEN(LXST_OK_NO_TOKEN);
+	*src = (struct lexer_source){0};
 
+	src->buf = calloc(chunk_size + 1, 1);
+	if (!src->buf) {
+		return LEXER_STATUS_GEN(LXST_ALLOCATION);
 	}
 
-	return LEXER_STATUS_GEN(LXST_NOT_MATCHED_TOKEN);
+	src->buf_size = chunk_size;
+	src->read_fn = read_fn;
+	src->read_ctx = read_ctx;
+	src->text = src->buf;
+	src->cur = src->buf;
+	src->text_end = src->buf;
+	src->need_input = 1;
+
+	return LEXER_STATUS_GEN(LXST_OK);
 }
 
-static LexerStatus lexer_parse_token(struct lexer *lexer,
-			const char *text, const char **text_end_ptr,
-			struct lexer_token *token) {
+static LexerStatus lexer_parse_source(struct lexer *lexer, struct lexer_source *src) {
+	assert (lexer);
+	assert (src);
+
+	for (;;) {
+		struct lexer_token token = {0};
+
+		LexerStatus status = lexer_source_next(lexer, src, &token);
+		if (LEXER_STATUS(status) == LXST_OK_NO_TOKEN) {
+			return LEXER_STATUS_GEN(LXST_OK);
+		}
+		if (LEXER_STATUS(status)) {
+			return status;
+		}
+
+		status = lexer_add_token(lexer, &token);
+		if (LEXER_STATUS(status)) {
+			return status;
+		}
+	}
+}
+
+LexerStatus lexer_parse_text(struct lexer *lexer,
+			const char *text) {
 	assert (lexer);
 	assert (text);
-	assert (text_end_ptr);
-	assert (token);
 
-	LexerStatus parser_status = {0};	
+	struct lexer_source src = {0};
+	lexer_source_text(&src, text);
+
+	return lexer_parse_source(lexer, &src);
+}
+
+struct lexer_segment {
+	pthread_t thread;
+	struct lexer lexer;
+	struct lexer_source src;
+	LexerStatus status;
+};
+
+static void *lexer_segment_worker(void *arg) {
+	struct lexer_segment *seg = arg;
+
+	seg->status = lexer_parse_source(&seg->lexer, &seg->src);
+
+	return NULL;
+}
+
+/**
+ * Appends tokens of a segment lexer. Its names are interned in the order
+ * of their ids, which is the order of first appearance, so ids come out
+ * as the serial lexer assigns them.
+ */
+static LexerStatus lexer_merge_segment(struct lexer *lexer, struct lexer *seg_lexer) {
+	assert (lexer);
+	assert (seg_lexer);
+
+	struct intern_table *seg_names = &seg_lexer->names;
+
+	uint32_t *name_map = calloc(seg_names->n_names + 1, sizeof(*name_map));
+	if (!name_map) {
+		return LEXER_STATUS_GEN(LXST_ALLOCATION);
+	}
+
+	for (size_t id = 0; id < seg_names->n_names; id++) {
+		if (intern_string(lexer->intern, seg_names->names[id],
+				  seg_names->name_lens[id], &name_map[id])) {
+			free(name_map);
+			return LEXER_STATUS_GEN(LXST_ALLOCATION);
+		}
+	}
 
-	parser_status = lexer_parse_comments(lexer, text, text_end_ptr, token);
-	if (LEXER_STATUS(parser_status) != LXST_NOT_MATCHED_TOKEN) {
-		return parser_status;
+	struct lexer_tokens *tokens = &lexer->tokens;
+	const struct lexer_tokens *seg_tokens = &seg_lexer->tokens;
+
+	size_t new_cap = tokens->cap;
+	while (new_cap < tokens->len + seg_tokens->len) {
+		new_cap *= 2;
+	}
+
+	if (lexer_tokens_reserve(tokens, new_cap)) {
+		free(name_map);
+		return LEXER_STATUS_GEN(LXST_ALLOCATION);
 	}
 
-	parser_status = lexer_parse_number(lexer, text, text_end_ptr, token);
-	if (LEXER_STATUS(parser_status) != LXST_NOT_MATCHED_TOKEN) {
-		return parser_status;
-	}	
+	memcpy(tokens->types + tokens->len, seg_tokens->types,
+	       seg_tokens->len * sizeof(*tokens->types));
+	memcpy(tokens->positions + tokens->len, seg_tokens->positions,
+	       seg_tokens->len * sizeof(*tokens->positions));
+
+	for (size_t i = 0; i < seg_tokens->len; i++) {
+		union lexer_token_payload payload = seg_tokens->payloads[i];
+
+		if (seg_tokens->types[i] == LXTOK_VARIABLE) {
+			payload.name_id = name_map[payload.name_id];
+		}
 
-	parser_status = lexer_parse_operator(lexer, text, text_end_ptr, token);
-	if (LEXER_STATUS(parser_status) != LXST_NOT_MATCHED_TOKEN) {
-		return parser_status;
+		tokens->payloads[tokens->len + i] = payload;
 	}
 
-	parser_status = lexer_parse_var(lexer, text, text_end_ptr, token);
-	if (LEXER_STATUS(parser_status) != LXST_NOT_MATCHED_TOKEN) {
-		return parser_status;
+	tokens->len += seg_tokens->len;
+
+	free(name_map);
+
+	if (lexer_lines_append(&lexer->lines, &seg_lexer->lines)) {
+		return LEXER_STATUS_GEN(LXST_ALLOCATION);
 	}
 
-	return LEXER_STATUS_GEN(LXST_NOT_MATCHED_TOKEN);
+	return LEXER_STATUS_GEN(LXST_OK);
 }
 
-LexerStatus lexer_parse_text(struct lexer *lexer,
-			const char *text) {
-	assert (lexer);
+/**
+ * Splits text right after newlines into at most n_segs segments of at
+ * least LEXER_MIN_SEGMENT bytes. No token runs over a newline (a comment
+ * ends at it), so each segment lexes independently. Returns the number
+ * of segments.
+ */
+static size_t lexer_split_text(const char *text, size_t text_len,
+			       struct lexer_segment *segs, size_t n_segs) {
 	assert (text);
+	assert (segs);
+	assert (n_segs > 0);
 
-	const char *text_cur_ptr = text;
+	size_t seg_len = text_len / n_segs;
+	if (seg_len < LEXER_MIN_SEGMENT) {
+		seg_len = LEXER_MIN_SEGMENT;
+	}
 
-	for (;;) {
-		while (isspace(*text_cur_ptr)) {
-			text_cur_ptr++;
-		}
-		if (*text_cur_ptr == '\0') {
-			break;
+	const char *text_end = text + text_len;
+	const char *seg_start = text;
+	size_t n_split = 0;
+
+	while (seg_start < text_end || !n_split) {
+		const char *seg_end = text_end;
+
+		if (n_split + 1 < n_segs && (size_t)(text_end - seg_start) > seg_len) {
+			const char *newline = memchr(seg_start + seg_len, '\n',
+						     (size_t)(text_end - seg_start) - seg_len);
+			if (newline) {
+				seg_end = newline + 1;
+			}
 		}
 
-		const char *text_end_ptr = NULL;
-		struct lexer_token token = {0};
+		struct lexer_source *src = &segs[n_split].src;
+		*src = (struct lexer_source){0};
+		src->text = seg_start;
+		src->cur = seg_start;
+		src->text_end = seg_end;
+		src->text_offset = (size_t)(seg_start - text);
+
+		n_split++;
+		seg_start = seg_end;
+	}
 
-		token.text_position = (size_t) (text_cur_ptr - text);
+	return n_split;
+}
 
-		LexerStatus parser_status = {0};
+LexerStatus lexer_parse_text_parallel(struct lexer *lexer, const char *text,
+				      size_t n_threads) {
+	assert (lexer);
+	assert (text);
 
-		parser_status = lexer_parse_token(lexer, text_cur_ptr,
-							&text_end_ptr, &token);
-		parser_status.text_position = text_cur_ptr - text;
-		if (	LEXER_STATUS(parser_status) != LXST_OK && 
-			LEXER_STATUS(parser_status) != LXST_OK_NO_TOKEN) {
-			return parser_status;
+	if (!n_threads) {
+		long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		n_threads = n_cpus > 0 ? (size_t)n_cpus : 1;
+	}
+
+	size_t text_len = strlen(text);
+	if (n_threads == 1 || text_len < 2 * LEXER_MIN_SEGMENT) {
+		return lexer_parse_text(lexer, text);
+	}
+
+	struct lexer_segment *segs = calloc(n_threads, sizeof(*segs));
+	if (!segs) {
+		return LEXER_STATUS_GEN(LXST_ALLOCATION);
+	}
+
+	size_t n_segs = lexer_split_text(text, text_len, segs, n_threads);
+	size_t n_started = 0;
+
+	LexerStatus status = LEXER_STATUS_GEN(LXST_OK);
+
+	for (; n_started < n_segs; n_started++) {
+		struct lexer_segment *seg = &segs[n_started];
+
+		status = lexer_ctor(&seg->lexer);
+		if (LEXER_STATUS(status)) {
+			break;
 		}
 
-		if (text_end_ptr == text_cur_ptr) {
-			parser_status.status = LXST_NOT_MATCHED_TOKEN;
-			return parser_status;
+		if (pthread_create(&seg->thread, NULL, lexer_segment_worker, seg)) {
+			lexer_dtor(&seg->lexer);
+			status = LEXER_STATUS_GEN(LXST_INTERNAL_FAILURE);
+			break;
 		}
+	}
 
-		if (LEXER_STATUS(parser_status) != LXST_OK_NO_TOKEN) {
-			parser_status = lexer_add_token(lexer, &token);
-			if (LEXER_STATUS(parser_status)) {
-				return parser_status;
-			}
+	for (size_t i = 0; i < n_started; i++) {
+		pthread_join(segs[i].thread, NULL);
+	}
+
+	// The first error in text order is the one the serial lexer stops at
+	for (size_t i = 0; i < n_started && !LEXER_STATUS(status); i++) {
+		status = lexer_merge_segment(lexer, &segs[i].lexer);
+		if (!LEXER_STATUS(status)) {
+			status = segs[i].status;
 		}
+	}
+
+	for (size_t i = 0; i < n_started; i++) {
+		lexer_dtor(&segs[i].lexer);
+	}
+
+	free(segs);
+
+	return status;
+}
+
+static ssize_t lexer_read_stream(void *source, char *buf, size_t size) {
+	FILE *stream = source;
+
+	size_t read_bytes = fread(buf, 1, size, stream);
+	if (!read_bytes && ferror(stream)) {
+		return -1;
+	}
+
+	return (ssize_t)read_bytes;
+}
+
+static ssize_t lexer_read_fd(void *source, char *buf, size_t size) {
+	int fd = *(int *)source;
+
+	ssize_t read_bytes = 0;
+	do {
+		read_bytes = read(fd, buf, size);
+	} while (read_bytes < 0 && errno == EINTR);
+
+	return read_bytes;
+}
+
+static LexerStatus lexer_parse_chunked(struct lexer *lexer, lexer_read_fn read_fn,
+				       void *read_ctx, size_t chunk_size) {
+	assert (lexer);
+	assert (read_fn);
+
+	struct lexer_source src = {0};
+
+	LexerStatus status = lexer_source_chunked(&src, read_fn, read_ctx, chunk_size);
+	if (LEXER_STATUS(status)) {
+		return status;
+	}
+
+	status = lexer_parse_source(lexer, &src);
+
+	free(src.buf);
+
+	return status;
+}
+
+LexerStatus lexer_parse_stream(struct lexer *lexer, FILE *stream,
+			       size_t chunk_size) {
+	assert (lexer);
+	assert (stream);
+
+	return lexer_parse_chunked(lexer, lexer_read_stream, stream, chunk_size);
+}
+
+LexerStatus lexer_parse_fd(struct lexer *lexer, int fd, size_t chunk_size) {
+	assert (lexer);
+
+	return lexer_parse_chunked(lexer, lexer_read_fd, &fd, chunk_size);
+}
+
+LexerStatus lexer_pull_text(struct lexer *lexer, const char *text) {
+	assert (lexer);
+	assert (text);
+	assert (!lexer->pull_mode);
+
+	lexer_source_text(&lexer->source, text);
+	lexer->pull_mode = 1;
+
+	return LEXER_STATUS_GEN(LXST_OK);
+}
+
+LexerStatus lexer_pull_stream(struct lexer *lexer, FILE *stream,
+			      size_t chunk_size) {
+	assert (lexer);
+	assert (stream);
+	assert (!lexer->pull_mode);
+
+	LexerStatus status = lexer_source_chunked(&lexer->source, lexer_read_stream,
+						  stream, chunk_size);
+	if (LEXER_STATUS(status)) {
+		return status;
+	}
+
+	lexer->pull_mode = 1;
+
+	return LEXER_STATUS_GEN(LXST_OK);
+}
+
+/**
+ * Maps a regular file with at least one zero byte after its end: the last
+ * page is either zero-filled past EOF or an anonymous page. The scanner
+ * then finds its NUL terminator as with any other text.
+ */
+static int lexer_source_map(struct lexer_source *src, int fd) {
+	assert (src);
+
+	struct stat file_stat = {0};
+	if (fstat(fd, &file_stat) || !S_ISREG(file_stat.st_mode)) {
+		return S_FAIL;
+	}
+
+	size_t text_len = (size_t)file_stat.st_size;
+	size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+	size_t map_size = (text_len / page_size + 1) * page_size;
+
+	char *map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		return S_FAIL;
+	}
+
+	if (text_len && mmap(map, text_len, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+			     fd, 0) == MAP_FAILED) {
+		munmap(map, map_size);
+		return S_FAIL;
+	}
+
+	madvise(map, map_size, MADV_SEQUENTIAL);
+
+	*src = (struct lexer_source){0};
+	src->text = map;
+	src->cur = map;
+	src->text_end = map + text_len;
+	src->map = map;
+	src->map_size = map_size;
+
+	return S_OK;
+}
+
+LexerStatus lexer_pull_file(struct lexer *lexer, const char *filename) {
+	assert (lexer);
+	assert (filename);
+	assert (!lexer->pull_mode);
+
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		log_error("Cannot open file %s", filename);
+		return LEXER_STATUS_GEN(LXST_INTERNAL_FAILURE);
+	}
+
+	if (!lexer_source_map(&lexer->source, fd)) {
+		close(fd);
+		lexer->pull_mode = 1;
+		return LEXER_STATUS_GEN(LXST_OK);
+	}
 
-		text_cur_ptr = text_end_ptr;
+	LexerStatus status = lexer_source_chunked(&lexer->source, lexer_read_fd,
+						  &lexer->source.fd, 0);
+	if (LEXER_STATUS(status)) {
+		close(fd);
+		return status;
 	}
 
+	lexer->source.fd = fd;
+	lexer->source.owns_fd = 1;
+	lexer->pull_mode = 1;
+
 	return LEXER_STATUS_GEN(LXST_OK);
 }
 
-struct lexer_token *lexer_get_token(struct lexer *lexer, size_t tok_idx) {
+const char *lexer_text(const struct lexer *lexer) {
+	assert (lexer);
+
+	if (!lexer->pull_mode || lexer->source.read_fn) {
+		return NULL;
+	}
+
+	return lexer->source.text;
+}
+
+LexerStatus lexer_pull_status(const struct lexer *lexer) {
+	assert (lexer);
+
+	return lexer->pull_status;
+}
+
+/**
+ * Lexes tokens until tok_idx is in the ring. The oldest token is dropped
+ * once the ring is full.
+ */
+struct lexer_token *lexer_pull_token(struct lexer *lexer, size_t tok_idx) {
 	assert (lexer);
+	assert (lexer->pull_mode);
 
-	struct lexer_token *tok = NULL;
-	if (pvector_get(&lexer->tokens, tok_idx, (void **)&tok)) {
+	if (tok_idx < lexer->ring_begin) {
+		log_error("Token %zu is out of the lookahead window", tok_idx);
 		return NULL;
 	}
 
-	return tok;
+	while (tok_idx >= lexer->ring_end) {
+		if (LEXER_STATUS(lexer->pull_status)) {
+			return NULL;
+		}
+
+		struct lexer_token token = {0};
+
+		LexerStatus status = lexer_source_next(lexer, &lexer->source, &token);
+		if (LEXER_STATUS(status) == LXST_OK_NO_TOKEN) {
+			return NULL;
+		}
+		if (LEXER_STATUS(status)) {
+			lexer->pull_status = status;
+			return NULL;
+		}
+
+		if (lexer->ring_end - lexer->ring_begin == LEXER_LOOKAHEAD) {
+			lexer->ring_begin++;
+		}
+
+		lexer->ring[lexer->ring_end % LEXER_LOOKAHEAD] = token;
+		lexer->ring_end++;
+	}
+
+	return &lexer->ring[tok_idx % LEXER_LOOKAHEAD];
 }
+
@@ -0,0 +1,218 @@
+#include "types.h"
+#include "lexer_simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define LEXER_SIMD_X86 (1)
+#include <immintrin.h>
+#endif
+
+static inline int lexer_is_space(uint8_t c) {
+	return c == ' ' || (uint8_t)(c - '\t') <= '\r' - '\t';
+}
+
+static inline int lexer_is_ident(uint8_t c) {
+	return (uint8_t)(c - '0') <= 9 || (uint8_t)((c | 0x20) - 'a') <= 'z' - 'a';
+}
+
+static const char *skip_spaces_scalar(const char *text, const char *text_end) {
+	while (text < text_end && lexer_is_space((uint8_t)*text)) {
+		text++;
+	}
+
+	return text;
+}
+
+static const char *skip_ident_scalar(const char *text, const char *text_end) {
+	while (text < text_end && lexer_is_ident((uint8_t)*text)) {
+		text++;
+	}
+
+	return text;
+}
+
+static const char *skip_comment_scalar(const char *text, const char *text_end) {
+	while (text < text_end && *text != '\n' && *text != '\0') {
+		text++;
+	}
+
+	return text;
+}
+
+#ifdef LEXER_SIMD_X86
+
+/*
+ * Each kernel builds a mask of bytes that stop the scan. Unsigned range
+ * checks (c - lo) <= (hi - lo) are done with min_epu8: x <= n iff
+ * min(x, n) == x.
+ */
+
+#define LEXER_SSE2 __attribute__((target("sse2")))
+
+#define LEXER_RANGE_SSE2(vec, lo, n)						\
+	_mm_cmpeq_epi8(_mm_min_epu8(_mm_sub_epi8(vec, _mm_set1_epi8((char)(lo))), \
+				    _mm_set1_epi8((char)(n))),			\
+		       _mm_sub_epi8(vec, _mm_set1_epi8((char)(lo))))
+
+LEXER_SSE2 static inline __m128i skip_spaces_stop_sse2(__m128i vec) {
+	__m128i is_space = _mm_or_si128(_mm_cmpeq_epi8(vec, _mm_set1_epi8(' ')),
+					LEXER_RANGE_SSE2(vec, '\t', '\r' - '\t'));
+	return _mm_xor_si128(is_space, _mm_set1_epi8(-1));
+}
+
+LEXER_SSE2 static inline __m128i skip_ident_stop_sse2(__m128i vec) {
+	__m128i lower = _mm_or_si128(vec, _mm_set1_epi8(0x20));
+	__m128i is_ident = _mm_or_si128(LEXER_RANGE_SSE2(vec, '0', 9),
+					LEXER_RANGE_SSE2(lower, 'a', 'z' - 'a'));
+	return _mm_xor_si128(is_ident, _mm_set1_epi8(-1));
+}
+
+LEXER_SSE2 static inline __m128i skip_comment_stop_sse2(__m128i vec) {
+	return _mm_or_si128(_mm_cmpeq_epi8(vec, _mm_set1_epi8('\n')),
+			    _mm_cmpeq_epi8(vec, _mm_setzero_si128()));
+}
+
+#define LEXER_KERNEL_SSE2(name_)						\
+LEXER_SSE2 static const char *name_##_sse2(const char *text, const char *text_end) {	\
+	while (text_end - text >= 16) {						\
+		__m128i vec = _mm_loadu_si128((const __m128i *)text);		\
+		unsigned mask = (unsigned)_mm_movemask_epi8(name_##_stop_sse2(vec)); \
+		if (mask) {							\
+			return text + __builtin_ctz(mask);			\
+		}								\
+		text += 16;							\
+	}									\
+										\
+	return name_##_scalar(text, text_end);				\
+}
+
+LEXER_KERNEL_SSE2(skip_spaces)
+LEXER_KERNEL_SSE2(skip_ident)
+LEXER_KERNEL_SSE2(skip_comment)
+
+#define LEXER_AVX2 __attribute__((target("avx2")))
+
+#define LEXER_RANGE_AVX2(vec, lo, n)						\
+	_mm256_cmpeq_epi8(_mm256_min_epu8(_mm256_sub_epi8(vec, _mm256_set1_epi8((char)(lo))), \
+					  _mm256_set1_epi8((char)(n))),		\
+			  _mm256_sub_epi8(vec, _mm256_set1_epi8((char)(lo))))
+
+LEXER_AVX2 static inline __m256i skip_spaces_stop_avx2(__m256i vec) {
+	__m256i is_space = _mm256_or_si256(_mm256_cmpeq_epi8(vec, _mm256_set1_epi8(' ')),
+					   LEXER_RANGE_AVX2(vec, '\t', '\r' - '\t'));
+	return _mm256_xor_si256(is_space, _mm256_set1_epi8(-1));
+}
+
+LEXER_AVX2 static inline __m256i skip_ident_stop_avx2(__m256i vec) {
+	__m256i lower = _mm256_or_si256(vec, _mm256_set1_epi8(0x20));
+	__m256i is_ident = _mm256_or_si256(LEXER_RANGE_AVX2(vec, '0', 9),
+					   LEXER_RANGE_AVX2(lower, 'a', 'z' - 'a'));
+	return _mm256_xor_si256(is_ident, _mm256_set1_epi8(-1));
+}
+
+LEXER_AVX2 static inline __m256i skip_comment_stop_avx2(__m256i vec) {
+	return _mm256_or_si256(_mm256_cmpeq_epi8(vec, _mm256_set1_epi8('\n')),
+			       _mm256_cmpeq_epi8(vec, _mm256_setzero_si256()));
+}
+
+#define LEXER_KERNEL_AVX2(name_)						\
+LEXER_AVX2 static const char *name_##_avx2(const char *text, const char *text_end) { \
+	while (text_end - text >= 32) {						\
+		__m256i vec = _mm256_loadu_si256((const __m256i *)text);	\
+		unsigned mask = (unsigned)_mm256_movemask_epi8(name_##_stop_avx2(vec)); \
+		if (mask) {							\
+			return text + __builtin_ctz(mask);			\
+		}								\
+		text += 32;							\
+	}									\
+										\
+	return name_##_sse2(text, text_end);					\
+}
+
+LEXER_KERNEL_AVX2(skip_spaces)
+LEXER_KERNEL_AVX2(skip_ident)
+LEXER_KERNEL_AVX2(skip_comment)
+
+#endif /* LEXER_SIMD_X86 */
+
+static const struct lexer_simd_ops lexer_simd_isa_ops[LEXER_ISA_N] = {
+	[LEXER_ISA_SCALAR] = {
+		.isa		= LEXER_ISA_SCALAR,
+		.skip_spaces	= skip_spaces_scalar,
+		.skip_ident	= skip_ident_scalar,
+		.skip_comment	= skip_comment_scalar,
+	},
+#ifdef LEXER_SIMD_X86
+	[LEXER_ISA_SSE2] = {
+		.isa		= LEXER_ISA_SSE2,
+		.skip_spaces	= skip_spaces_sse2,
+		.skip_ident	= skip_ident_sse2,
+		.skip_comment	= skip_comment_sse2,
+	},
+	[LEXER_ISA_AVX2] = {
+		.isa		= LEXER_ISA_AVX2,
+		.skip_spaces	= skip_spaces_avx2,
+		.skip_ident	= skip_ident_avx2,
+		.skip_comment	= skip_comment_avx2,
+	},
+#endif
+};
+
+struct lexer_simd_ops lexer_simd_ops = {
+	.isa		= LEXER_ISA_SCALAR,
+	.skip_spaces	= skip_spaces_scalar,
+	.skip_ident	= skip_ident_scalar,
+	.skip_comment	= skip_comment_scalar,
+};
+
+static int lexer_simd_supported(enum lexer_simd_isa isa) {
+	switch (isa) {
+		case LEXER_ISA_SCALAR:
+			return 1;
+#ifdef LEXER_SIMD_X86
+		case LEXER_ISA_SSE2:
+			return __builtin_cpu_supports("sse2");
+		case LEXER_ISA_AVX2:
+			return __builtin_cpu_supports("avx2");
+#else
+		case LEXER_ISA_SSE2:
+		case LEXER_ISA_AVX2:
+			return 0;
+#endif
+		case LEXER_ISA_N:
+		default:
+			return 0;
+	}
+}
+
+int lexer_simd_select(enum lexer_simd_isa isa) {
+	if (isa >= LEXER_ISA_N || !lexer_simd_supported(isa)) {
+		return S_FAIL;
+	}
+
+	lexer_simd_ops = lexer_simd_isa_ops[isa];
+
+	return S_OK;
+}
+
+const char *lexer_simd_isa_name(enum lexer_simd_isa isa) {
+	switch (isa) {
+		case LEXER_ISA_SCALAR:	return "scalar";
+		case LEXER_ISA_SSE2:	return "sse2";
+		case LEXER_ISA_AVX2:	return "avx2";
+		case LEXER_ISA_N:
+		default:		return "unknown";
+	}
+}
+
+__attribute__((constructor))
+static void lexer_simd_init(void) {
+#ifdef LEXER_SIMD_X86
+	__builtin_cpu_init();
+#endif
+
+	for (int isa = LEXER_ISA_N - 1; isa > LEXER_ISA_SCALAR; isa--) {
+		if (!lexer_simd_select((enum lexer_simd_isa)isa)) {
+			return;
+		}
+	}
+}
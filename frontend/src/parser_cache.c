@@ -0,0 +1,748 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdbool.h>
+#include "types.h"
+#include "parser_cache.h"
+
+#define PARSER_CACHE_INITIAL_BUF (4096)
+
+#define PARSER_CACHE_FNV_OFFSET (0xcbf29ce484222325ull)
+#define PARSER_CACHE_FNV_PRIME (0x100000001b3ull)
+
+enum parser_cache_tag {
+	PARSER_CACHE_TAG_NIL,
+	PARSER_CACHE_TAG_NUMBER,
+	PARSER_CACHE_TAG_VARIABLE,
+	// Followed by the operator index and the number of children
+	PARSER_CACHE_TAG_SEQUENCE,
+	// Followed by the operator index
+	PARSER_CACHE_TAG_OPERATOR,
+};
+
+static inline uint64_t parser_cache_zigzag(int64_t value) {
+	return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t parser_cache_unzigzag(uint64_t value) {
+	return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+int parser_cache_ctor(struct parser_cache *cache, struct expression *expr) {
+	assert (cache);
+	assert (expr);
+
+	*cache = (struct parser_cache){0};
+	cache->expr = expr;
+
+	return S_OK;
+}
+
+void parser_cache_dtor(struct parser_cache *cache) {
+	assert (cache);
+
+	free(cache->buf);
+	free(cache->name_ids);
+	free(cache->entries);
+
+	struct expression *expr = cache->expr;
+	*cache = (struct parser_cache){0};
+	cache->expr = expr;
+}
+
+/*
+ * Reading side: every read checks the bounds, a truncated or corrupted
+ * file fails the entry or the load instead of reading past the buffer.
+ */
+
+struct parser_cache_reader {
+	const uint8_t *cur;
+	const uint8_t *end;
+};
+
+static int parser_cache_read_varint(struct parser_cache_reader *reader, uint64_t *value) {
+	assert (reader);
+	assert (value);
+
+	uint64_t result = 0;
+	for (unsigned shift = 0; shift < 64; shift += 7) {
+		if (reader->cur == reader->end) {
+			return S_FAIL;
+		}
+
+		uint8_t byte = *reader->cur++;
+		result |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			*value = result;
+			return S_OK;
+		}
+	}
+
+	return S_FAIL;
+}
+
+static int parser_cache_read_size(struct parser_cache_reader *reader, size_t *size) {
+	assert (reader);
+	assert (size);
+
+	uint64_t value = 0;
+	if (parser_cache_read_varint(reader, &value) ||
+		value > (uint64_t)(reader->end - reader->cur)) {
+		return S_FAIL;
+	}
+
+	*size = (size_t)value;
+
+	return S_OK;
+}
+
+static int parser_cache_entry_cmp(const void *lhs, const void *rhs) {
+	const struct parser_cache_entry *lentry = lhs;
+	const struct parser_cache_entry *rentry = rhs;
+
+	return (lentry->hash > rentry->hash) - (lentry->hash < rentry->hash);
+}
+
+static int parser_cache_read_names(struct parser_cache *cache,
+				   struct parser_cache_reader *reader) {
+	assert (cache);
+	assert (reader);
+
+	size_t n_names = 0;
+	// Every name takes at least its length byte
+	if (parser_cache_read_size(reader, &n_names)) {
+		return S_FAIL;
+	}
+
+	cache->name_ids = calloc(n_names ? n_names : 1, sizeof(*cache->name_ids));
+	if (!cache->name_ids) {
+		return S_FAIL;
+	}
+	cache->n_names = n_names;
+
+	for (size_t i = 0; i < n_names; i++) {
+		size_t len = 0;
+		if (parser_cache_read_size(reader, &len)) {
+			return S_FAIL;
+		}
+
+		cache->name_ids[i] = intern_find(&cache->expr->names,
+						 (const char *)reader->cur, len);
+		reader->cur += len;
+	}
+
+	return S_OK;
+}
+
+static int parser_cache_read_entries(struct parser_cache *cache,
+				     struct parser_cache_reader *reader) {
+	assert (cache);
+	assert (reader);
+
+	size_t n_entries = 0;
+	if (parser_cache_read_size(reader, &n_entries)) {
+		return S_FAIL;
+	}
+
+	cache->entries = calloc(n_entries ? n_entries : 1, sizeof(*cache->entries));
+	if (!cache->entries) {
+		return S_FAIL;
+	}
+
+	for (size_t i = 0; i < n_entries; i++) {
+		if (reader->end - reader->cur < (ptrdiff_t)sizeof(uint64_t)) {
+			return S_FAIL;
+		}
+
+		uint64_t hash = 0;
+		for (size_t byte = 0; byte < sizeof(hash); byte++) {
+			hash |= (uint64_t)reader->cur[byte] << (8 * byte);
+		}
+		reader->cur += sizeof(hash);
+
+		// Every token takes at least its type byte
+		size_t n_tokens = 0;
+		size_t tokens_size = 0;
+		if (parser_cache_read_size(reader, &n_tokens) ||
+			parser_cache_read_size(reader, &tokens_size) ||
+			n_tokens > tokens_size) {
+			return S_FAIL;
+		}
+		const uint8_t *tokens = reader->cur;
+		reader->cur += tokens_size;
+
+		size_t size = 0;
+		if (parser_cache_read_size(reader, &size)) {
+			return S_FAIL;
+		}
+
+		cache->entries[cache->len++] = (struct parser_cache_entry) {
+			.hash = hash,
+			.n_tokens = n_tokens,
+			.tokens = tokens,
+			.tokens_size = tokens_size,
+			.data = reader->cur,
+			.size = size,
+		};
+		reader->cur += size;
+	}
+
+	return S_OK;
+}
+
+int parser_cache_load(struct parser_cache *cache, const char *filename) {
+	assert (cache);
+	assert (filename);
+
+	if (read_file(filename, &cache->buf, &cache->buf_len)) {
+		cache->buf = NULL;
+		return S_FAIL;
+	}
+
+	size_t version_len = strlen(PARSER_CACHE_VERSION);
+	if (cache->buf_len <= version_len ||
+		memcmp(cache->buf, PARSER_CACHE_VERSION, version_len) ||
+		cache->buf[version_len] != '\n') {
+		parser_cache_dtor(cache);
+		return S_FAIL;
+	}
+
+	struct parser_cache_reader reader = {
+		.cur = (const uint8_t *)cache->buf + version_len + 1,
+		.end = (const uint8_t *)cache->buf + cache->buf_len,
+	};
+
+	if (parser_cache_read_names(cache, &reader) ||
+		parser_cache_read_entries(cache, &reader)) {
+		parser_cache_dtor(cache);
+		return S_FAIL;
+	}
+
+	if (cache->len) {
+		qsort(cache->entries, cache->len, sizeof(*cache->entries),
+		      parser_cache_entry_cmp);
+	}
+
+	return S_OK;
+}
+
+static const struct expression_operator *parser_cache_operator(uint64_t op_idx) {
+	if (op_idx >= sizeof(expression_operators) / sizeof(*expression_operators)) {
+		return NULL;
+	}
+
+	return expression_operators[op_idx];
+}
+
+/*
+ * Decodes a node without its children into *node, NULL for nil.
+ */
+static int parser_cache_decode_node(struct parser_cache *cache,
+				    struct parser_cache_reader *reader,
+				    struct tree_node **node) {
+	assert (cache);
+	assert (reader);
+	assert (node);
+
+	*node = NULL;
+
+	if (reader->cur == reader->end) {
+		return S_FAIL;
+	}
+
+	uint8_t tag = *reader->cur++;
+	uint64_t value = 0;
+
+	switch (tag) {
+	case PARSER_CACHE_TAG_NIL:
+		return S_OK;
+	case PARSER_CACHE_TAG_NUMBER:
+		if (parser_cache_read_varint(reader, &value)) {
+			return S_FAIL;
+		}
+		*node = expr_create_number_tnode(cache->expr, parser_cache_unzigzag(value));
+		return *node ? S_OK : S_FAIL;
+	case PARSER_CACHE_TAG_VARIABLE:
+		if (parser_cache_read_varint(reader, &value) || value >= cache->n_names ||
+			cache->name_ids[value] == INTERN_ID_NONE) {
+			return S_FAIL;
+		}
+		uint32_t name_id = cache->name_ids[value];
+		*node = expr_create_variable_tnode(cache->expr,
+						   intern_name(&cache->expr->names, name_id),
+						   name_id);
+		return *node ? S_OK : S_FAIL;
+	case PARSER_CACHE_TAG_SEQUENCE: {
+		size_t n_children = 0;
+		// Every child takes at least its tag byte
+		if (parser_cache_read_varint(reader, &value) ||
+			!parser_cache_operator(value) ||
+			parser_cache_read_size(reader, &n_children)) {
+			return S_FAIL;
+		}
+
+		*node = expr_create_sequence_tnode(cache->expr, parser_cache_operator(value),
+						   NULL, n_children);
+		return *node ? S_OK : S_FAIL;
+	}
+	default:
+		break;
+	}
+
+	const struct expression_operator *op = parser_cache_operator(tag -
+								     PARSER_CACHE_TAG_OPERATOR);
+	if (!op) {
+		return S_FAIL;
+	}
+
+	*node = expr_create_operator_tnode(cache->expr, op, NULL, NULL);
+
+	return *node ? S_OK : S_FAIL;
+}
+
+/*
+ * Preorder over an explicit stack of the slots to fill, every node read
+ * so far hangs off *node.
+ */
+static int parser_cache_decode(struct parser_cache *cache,
+			       struct parser_cache_reader *reader,
+			       struct tree_node **node) {
+	assert (cache);
+	assert (reader);
+	assert (node);
+
+	*node = NULL;
+
+	struct tree_stack stack = {0};
+	tree_stack_ctor(&stack, sizeof(struct tree_node **));
+
+	struct tree_node ***slot = tree_stack_push(&stack);
+	if (!slot) {
+		return S_FAIL;
+	}
+	*slot = node;
+
+	int ret = S_OK;
+	while (!ret && (slot = tree_stack_pop(&stack))) {
+		struct tree_node **cur = *slot;
+		if ((ret = parser_cache_decode_node(cache, reader, cur)) || !*cur) {
+			continue;
+		}
+
+		struct tree_node *decoded = *cur;
+		if (!EXPR_TNODE_IS_OPERATOR(decoded)) {
+			continue;
+		}
+
+		// Children of a sequence are in place, the array is not grown
+		int is_sequence = TNODE_IS_SEQUENCE(decoded);
+		size_t n_children = is_sequence ? decoded->n_children : 2;
+		for (size_t i = n_children; i-- > 0;) {
+			if (!(slot = tree_stack_push(&stack))) {
+				ret = S_FAIL;
+				break;
+			}
+			*slot = is_sequence ? &decoded->children[i] :
+				i ? &decoded->right : &decoded->left;
+		}
+	}
+
+	tree_stack_dtor(&stack);
+
+	return ret;
+}
+
+/*
+ * Compares the tokens of the entry with the tokens [begin, end) of lexer.
+ */
+static bool parser_cache_tokens_match(const struct parser_cache *cache,
+				      const struct parser_cache_entry *entry,
+				      const struct lexer *lexer, size_t begin, size_t end) {
+	assert (cache);
+	assert (entry);
+	assert (lexer);
+
+	if (entry->n_tokens != end - begin) {
+		return false;
+	}
+
+	struct parser_cache_reader reader = {
+		.cur = entry->tokens,
+		.end = entry->tokens + entry->tokens_size,
+	};
+
+	for (size_t idx = begin; idx < end; idx++) {
+		if (reader.cur == reader.end) {
+			return false;
+		}
+
+		enum LexerTokenType type = lexer_token_type(lexer, idx);
+		if (*reader.cur++ != (uint8_t)type) {
+			return false;
+		}
+
+		uint64_t value = 0;
+		if (type == LXTOK_NUMBER) {
+			if (parser_cache_read_varint(&reader, &value) ||
+				parser_cache_unzigzag(value) != lexer_token_number(lexer, idx)) {
+				return false;
+			}
+		} else if (type == LXTOK_VARIABLE) {
+			if (parser_cache_read_varint(&reader, &value) || value >= cache->n_names ||
+				cache->name_ids[value] != lexer_token_name_id(lexer, idx)) {
+				return false;
+			}
+		}
+	}
+
+	return reader.cur == reader.end;
+}
+
+struct tree_node *parser_cache_take(struct parser_cache *cache, const struct lexer *lexer,
+				    size_t begin, size_t end, uint64_t hash) {
+	assert (cache);
+	assert (lexer);
+	assert (begin <= end && end <= lexer_n_tokens(lexer));
+
+	size_t left = 0;
+	size_t right = cache->len;
+	while (left < right) {
+		size_t mid = left + (right - left) / 2;
+		if (cache->entries[mid].hash < hash) {
+			left = mid + 1;
+		} else {
+			right = mid;
+		}
+	}
+
+	for (; left < cache->len && cache->entries[left].hash == hash; left++) {
+		struct parser_cache_entry *entry = &cache->entries[left];
+		if (!entry->data || !parser_cache_tokens_match(cache, entry, lexer, begin, end)) {
+			continue;
+		}
+
+		struct parser_cache_reader reader = {
+			.cur = entry->data,
+			.end = entry->data + entry->size,
+		};
+		entry->data = NULL;
+
+		struct tree_node *node = NULL;
+		if (!parser_cache_decode(cache, &reader, &node) && node &&
+			reader.cur == reader.end) {
+			return node;
+		}
+
+		if (node) {
+			tree_subtree_dtor(&cache->expr->tree, node);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Writing side: the file is encoded in memory and written at once.
+ */
+
+struct parser_cache_writer {
+	uint8_t *buf;
+	size_t len;
+	size_t cap;
+};
+
+static int parser_cache_reserve(struct parser_cache_writer *writer, size_t size) {
+	assert (writer);
+
+	if (writer->cap - writer->len >= size) {
+		return S_OK;
+	}
+
+	size_t new_cap = writer->cap ? writer->cap : PARSER_CACHE_INITIAL_BUF;
+	while (new_cap - writer->len < size) {
+		new_cap *= 2;
+	}
+
+	uint8_t *new_buf = realloc(writer->buf, new_cap);
+	if (!new_buf) {
+		return S_FAIL;
+	}
+
+	writer->buf = new_buf;
+	writer->cap = new_cap;
+
+	return S_OK;
+}
+
+static int parser_cache_write(struct parser_cache_writer *writer,
+			      const void *data, size_t size) {
+	assert (writer);
+	assert (data || !size);
+
+	if (parser_cache_reserve(writer, size)) {
+		return S_FAIL;
+	}
+
+	if (size) {
+		memcpy(writer->buf + writer->len, data, size);
+	}
+	writer->len += size;
+
+	return S_OK;
+}
+
+static int parser_cache_write_varint(struct parser_cache_writer *writer, uint64_t value) {
+	assert (writer);
+
+	uint8_t bytes[10] = {0};
+	size_t len = 0;
+
+	do {
+		bytes[len] = value & 0x7f;
+		value >>= 7;
+		if (value) {
+			bytes[len] |= 0x80;
+		}
+		len++;
+	} while (value);
+
+	return parser_cache_write(writer, bytes, len);
+}
+
+static int parser_cache_encode_node(struct parser_cache_writer *writer,
+				    const struct tree_node *node) {
+	assert (writer);
+
+	uint8_t tag = PARSER_CACHE_TAG_NIL;
+
+	if (!node) {
+		return parser_cache_write(writer, &tag, sizeof(tag));
+	}
+
+	if (EXPR_TNODE_IS_NUMBER(node)) {
+		tag = PARSER_CACHE_TAG_NUMBER;
+		return (parser_cache_write(writer, &tag, sizeof(tag)) ||
+			parser_cache_write_varint(writer, parser_cache_zigzag(node->value.snum)));
+	}
+
+	if (EXPR_TNODE_IS_VARIABLE(node)) {
+		tag = PARSER_CACHE_TAG_VARIABLE;
+		return (parser_cache_write(writer, &tag, sizeof(tag)) ||
+			parser_cache_write_varint(writer, node->value.name_id));
+	}
+
+	const struct expression_operator *op = node->value.ptr;
+
+	if (TNODE_IS_SEQUENCE(node)) {
+		tag = PARSER_CACHE_TAG_SEQUENCE;
+		return (parser_cache_write(writer, &tag, sizeof(tag)) ||
+			parser_cache_write_varint(writer, op->idx) ||
+			parser_cache_write_varint(writer, node->n_children));
+	}
+
+	tag = (uint8_t)(PARSER_CACHE_TAG_OPERATOR + op->idx);
+
+	return parser_cache_write(writer, &tag, sizeof(tag));
+}
+
+static int parser_cache_encode(struct parser_cache_writer *writer,
+			       struct tree_stack *stack, struct tree_node *node) {
+	assert (writer);
+	assert (stack);
+
+	struct tree_node **top = tree_stack_push(stack);
+	if (!top) {
+		return S_FAIL;
+	}
+	*top = node;
+
+	int ret = S_OK;
+	while (!ret && (top = tree_stack_pop(stack))) {
+		struct tree_node *cur = *top;
+		if ((ret = parser_cache_encode_node(writer, cur)) || !cur ||
+			!EXPR_TNODE_IS_OPERATOR(cur)) {
+			continue;
+		}
+
+		int is_sequence = TNODE_IS_SEQUENCE(cur);
+		size_t n_children = is_sequence ? cur->n_children : 2;
+		for (size_t i = n_children; i-- > 0;) {
+			if (!(top = tree_stack_push(stack))) {
+				ret = S_FAIL;
+				break;
+			}
+			*top = is_sequence ? cur->children[i] : i ? cur->right : cur->left;
+		}
+	}
+
+	// Left over after a failure
+	stack->len = 0;
+
+	return ret;
+}
+
+static int parser_cache_encode_tokens(struct parser_cache_writer *writer,
+				      const struct lexer *lexer, size_t begin, size_t end) {
+	assert (writer);
+	assert (lexer);
+
+	for (size_t idx = begin; idx < end; idx++) {
+		uint8_t type = (uint8_t)lexer_token_type(lexer, idx);
+		if (parser_cache_write(writer, &type, sizeof(type))) {
+			return S_FAIL;
+		}
+
+		// Name ids of the lexer are indexes of the names in the file
+		if ((type == LXTOK_NUMBER &&
+			parser_cache_write_varint(writer,
+				parser_cache_zigzag(lexer_token_number(lexer, idx)))) ||
+			(type == LXTOK_VARIABLE &&
+			parser_cache_write_varint(writer, lexer_token_name_id(lexer, idx)))) {
+			return S_FAIL;
+		}
+	}
+
+	return S_OK;
+}
+
+static int parser_cache_encode_all(struct parser_cache_writer *writer,
+				   struct expression *expr, const struct lexer *lexer,
+				   const size_t *bounds, const uint64_t *hashes,
+				   struct tree_node *const *funcs, size_t n_funcs) {
+	assert (writer);
+	assert (expr);
+	assert (lexer);
+
+	if (parser_cache_write(writer, PARSER_CACHE_VERSION "\n",
+			       sizeof(PARSER_CACHE_VERSION)) ||
+		parser_cache_write_varint(writer, expr->names.n_names)) {
+		return S_FAIL;
+	}
+
+	// Index of a name in the file is its id in expr
+	for (size_t i = 0; i < expr->names.n_names; i++) {
+		if (parser_cache_write_varint(writer, expr->names.name_lens[i]) ||
+			parser_cache_write(writer, expr->names.names[i],
+					   expr->names.name_lens[i])) {
+			return S_FAIL;
+		}
+	}
+
+	if (parser_cache_write_varint(writer, n_funcs)) {
+		return S_FAIL;
+	}
+
+	struct parser_cache_writer tokens = {0};
+	struct parser_cache_writer subtree = {0};
+	struct tree_stack stack = {0};
+	tree_stack_ctor(&stack, sizeof(struct tree_node *));
+	int ret = S_OK;
+
+	for (size_t i = 0; i < n_funcs && !ret; i++) {
+		uint8_t hash[sizeof(hashes[i])] = {0};
+		for (size_t byte = 0; byte < sizeof(hash); byte++) {
+			hash[byte] = (uint8_t)(hashes[i] >> (8 * byte));
+		}
+
+		tokens.len = 0;
+		subtree.len = 0;
+		if (parser_cache_encode_tokens(&tokens, lexer, bounds[i], bounds[i + 1]) ||
+			parser_cache_encode(&subtree, &stack, funcs[i]) ||
+			parser_cache_write(writer, hash, sizeof(hash)) ||
+			parser_cache_write_varint(writer, bounds[i + 1] - bounds[i]) ||
+			parser_cache_write_varint(writer, tokens.len) ||
+			parser_cache_write(writer, tokens.buf, tokens.len) ||
+			parser_cache_write_varint(writer, subtree.len) ||
+			parser_cache_write(writer, subtree.buf, subtree.len)) {
+			ret = S_FAIL;
+		}
+	}
+
+	free(tokens.buf);
+	free(subtree.buf);
+	tree_stack_dtor(&stack);
+
+	return ret;
+}
+
+int parser_cache_store(const char *filename, struct expression *expr,
+		       const struct lexer *lexer, const size_t *bounds,
+		       const uint64_t *hashes, struct tree_node *const *funcs,
+		       size_t n_funcs) {
+	assert (filename);
+	assert (expr);
+	assert (lexer);
+	assert (bounds);
+	assert (hashes || !n_funcs);
+	assert (funcs || !n_funcs);
+
+	struct parser_cache_writer writer = {0};
+	if (parser_cache_encode_all(&writer, expr, lexer, bounds, hashes, funcs, n_funcs)) {
+		free(writer.buf);
+		return S_FAIL;
+	}
+
+	size_t filename_len = strlen(filename);
+	char *tmp_filename = calloc(filename_len + sizeof(".tmp"), 1);
+	if (!tmp_filename) {
+		free(writer.buf);
+		return S_FAIL;
+	}
+	memcpy(tmp_filename, filename, filename_len);
+	strcpy(tmp_filename + filename_len, ".tmp");
+
+	int ret = S_OK;
+
+	FILE *file = fopen(tmp_filename, "wb");
+	if (!file) {
+		ret = S_FAIL;
+	} else {
+		if (fwrite(writer.buf, 1, writer.len, file) != writer.len) {
+			ret = S_FAIL;
+		}
+
+		if (fclose(file) || ret || rename(tmp_filename, filename)) {
+			remove(tmp_filename);
+			ret = S_FAIL;
+		}
+	}
+
+	free(tmp_filename);
+	free(writer.buf);
+
+	return ret;
+}
+
+static uint64_t parser_cache_hash_bytes(uint64_t hash, const void *data, size_t size) {
+	const uint8_t *bytes = data;
+
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= PARSER_CACHE_FNV_PRIME;
+	}
+
+	return hash;
+}
+
+uint64_t parser_cache_hash(const struct lexer *lexer, size_t begin, size_t end) {
+	assert (lexer);
+	assert (begin <= end && end <= lexer_n_tokens(lexer));
+
+	uint64_t hash = PARSER_CACHE_FNV_OFFSET;
+
+	for (size_t idx = begin; idx < end; idx++) {
+		uint8_t type = (uint8_t)lexer_token_type(lexer, idx);
+		hash = parser_cache_hash_bytes(hash, &type, sizeof(type));
+
+		if (type == LXTOK_NUMBER) {
+			int64_t number = lexer_token_number(lexer, idx);
+			hash = parser_cache_hash_bytes(hash, &number, sizeof(number));
+		} else if (type == LXTOK_VARIABLE) {
+			// With the terminating zero, "ab" "c" differs from "a" "bc"
+			const char *word = lexer_token_word(lexer, idx);
+			hash = parser_cache_hash_bytes(hash, word, strlen(word) + 1);
+		}
+	}
+
+	return hash;
+}
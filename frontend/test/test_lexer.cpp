@@ -1,6 +1,12 @@
 #include <gtest/gtest.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
 
 #include "lexer.h"
+#include "lexer_simd.h"
+#include "lang_names.h"
 
 TEST(Lexer, LexerOperates) {
 	const char *lexerText = "mewo 2134 meo1234 m12m m 2 m m m m m 2";
@@ -13,8 +19,8 @@ TEST(Lexer, LexerOperates) {
 
 	ASSERT_EQ(lexer.tokens.len, 12);
 
-	struct lexer_token *ntoken = NULL;
-	ASSERT_EQ(pvector_get(&lexer.tokens, 3, (void **)&ntoken), DS_OK);
+	struct lexer_token *ntoken = lexer_get_token(&lexer, 3);
+	ASSERT_NE(ntoken, nullptr);
 	ASSERT_STREQ(ntoken->word, "m12m");
 
 	lexer_dtor(&lexer);
@@ -56,12 +62,12 @@ TEST(Lexer, LexerPlayground) {
 	LexerStatus status = lexer_parse_text(&lexer, lexerText);
 	ASSERT_EQ(LEXER_STATUS(status), LXST_OK);
 
-	printf("words_buflen: %zu tokens_len: %zu\n",
-		lexer.words_buflen, lexer.tokens.len);
+	printf("names: %zu tokens_len: %zu\n",
+		lexer.names.n_names, lexer.tokens.len);
 
 	for (size_t i = 0; i < lexer.tokens.len; i++) {
-		struct lexer_token *token = NULL;
-		ASSERT_EQ(pvector_get(&lexer.tokens, i, (void **)&token), DS_OK);
+		struct lexer_token *token = lexer_get_token(&lexer, i);
+		ASSERT_NE(token, nullptr);
 
 		printf("token: type: <%d>, pos: <%zu>", token->tok_type, token->text_position);
 
@@ -76,3 +82,550 @@ TEST(Lexer, LexerPlayground) {
 
 	lexer_dtor(&lexer);
 }
+
+TEST(Lexer, LexerNumberBases) {
+	const char *lexerText = "0x1F 017 09 42";
+
+	struct lexer lexer = {{0}};
+	ASSERT_EQ(lexer_ctor(&lexer).status, LXST_OK);
+
+	LexerStatus status = lexer_parse_text(&lexer, lexerText);
+	ASSERT_EQ(LEXER_STATUS(status), LXST_OK);
+
+	const int64_t expected[] = {0x1F, 017, 0, 9, 42};
+	ASSERT_EQ(lexer.tokens.len, sizeof(expected) / sizeof(*expected));
+
+	for (size_t i = 0; i < lexer.tokens.len; i++) {
+		struct lexer_token *token = lexer_get_token(&lexer, i);
+		ASSERT_NE(token, nullptr);
+		ASSERT_EQ(token->tok_type, LXTOK_NUMBER);
+		ASSERT_EQ(token->lexer_number, expected[i]);
+	}
+
+	lexer_dtor(&lexer);
+}
+
+TEST(Lexer, LexerOperators) {
+	const char *lexerText = "xa<=xb<-xc>>xd:=xe!=xf/xg";
+
+	struct lexer lexer = {{0}};
+	ASSERT_EQ(lexer_ctor(&lexer).status, LXST_OK);
+
+	LexerStatus status = lexer_parse_text(&lexer, lexerText);
+	ASSERT_EQ(LEXER_STATUS(status), LXST_OK);
+
+	const enum LexerTokenType expected[] = {
+		LXTOK_VARIABLE, LXTOK_LESS_EQ_CMP, LXTOK_VARIABLE, LXTOK_MEM_WRITE,
+		LXTOK_VARIABLE, LXTOK_SHR, LXTOK_VARIABLE, LXTOK_DECL_ASSIGN,
+		LXTOK_VARIABLE, LXTOK_NOT_EQUALS_CMP, LXTOK_VARIABLE, LXTOK_DIVIDE,
+		LXTOK_VARIABLE,
+	};
+	ASSERT_EQ(lexer.tokens.len, sizeof(expected) / sizeof(*expected));
+
+	for (size_t i = 0; i < lexer.tokens.len; i++) {
+		struct lexer_token *token = lexer_get_token(&lexer, i);
+		ASSERT_NE(token, nullptr);
+		ASSERT_EQ(token->tok_type, expected[i]);
+	}
+
+	lexer_dtor(&lexer);
+}
+
+TEST(Lexer, LexerNotMatched) {
+	const char *lexerText = "mewo :=  !mwm";
+
+	struct lexer lexer = {{0}};
+	ASSERT_EQ(lexer_ctor(&lexer).status, LXST_OK);
+
+	LexerStatus status = lexer_parse_text(&lexer, lexerText);
+	ASSERT_EQ(LEXER_STATUS(status), LXST_NOT_MATCHED_TOKEN);
+	ASSERT_EQ(status.text_position, 9);
+
+	lexer_dtor(&lexer);
+}
+
+TEST(Lexer, LexerKeywordsExactLength) {
+	const char *lexerText = "i if printer print memload memloads";
+
+	struct lexer lexer = {{0}};
+	ASSERT_EQ(lexer_ctor(&lexer).status, LXST_OK);
+
+	LexerStatus status = lexer_parse_text(&lexer, lexerText);
+	ASSERT_EQ(LEXER_STATUS(status), LXST_OK);
+
+	const enum LexerTokenType expected[] = {
+		LXTOK_VARIABLE, LXTOK_IF, LXTOK_VARIABLE, LXTOK_PRINT,
+		LXTOK_MEM_READ, LXTOK_VARIABLE,
+	};
+	ASSERT_EQ(lexer.tokens.len, sizeof(expected) / sizeof(*expected));
+
+	for (size_t i = 0; i < lexer.tokens.len; i++) {
+		struct lexer_token *token = lexer_get_token(&lexer, i);
+		ASSERT_NE(token, nullptr);
+		ASSERT_EQ(token->tok_type, expected[i]);
+	}
+
+	lexer_dtor(&lexer);
+}
+
+TEST(Lexer, LexerLangNamesTable) {
+	// Every operator is found by its name
+	for (size_t i = 0; i < LANG_NAMES_N_OPERATORS; i++) {
+		const char *name = expression_operators[i]->name;
+		const struct lang_name *lname = lang_name_lookup(name, strlen(name));
+
+		ASSERT_NE(lname, nullptr) << name;
+		EXPECT_EQ(lname->op_idx, i) << name;
+		EXPECT_TRUE(lname->flags & LANG_NAME_F_OPERATOR) << name;
+	}
+
+	const struct lang_name *lname = lang_name_lookup("memload", 7);
+	ASSERT_NE(lname, nullptr);
+	EXPECT_EQ(lname->flags, LANG_NAME_F_KEYWORD);
+	EXPECT_EQ(lname->op_idx, EXPR_IDX_MEM_READ);
+
+	EXPECT_EQ(lang_name_lookup("mem", 3), nullptr);
+}
+
+TEST(Lexer, LexerInternedNames) {
+	std::string lexerText;
+	for (int i = 0; i < 300; i++) {
+		lexerText += "v" + std::to_string(i) + " ";
+	}
+	lexerText += "v7 v299";
+
+	struct lexer lexer = {{0}};
+	ASSERT_EQ(lexer_ctor(&lexer).status, LXST_OK);
+
+	LexerStatus status = lexer_parse_text(&lexer, lexerText.c_str());
+	ASSERT_EQ(LEXER_STATUS(status), LXST_OK);
+	ASSERT_EQ(lexer.tokens.len, 302);
+	ASSERT_EQ(lexer.names.n_names, 300);
+
+	struct lexer_token *first = lexer_get_token(&lexer, 7);
+	struct lexer_token *again = lexer_get_token(&lexer, 300);
+	ASSERT_EQ(first->name_id, 7);
+	ASSERT_EQ(again->name_id, first->name_id);
+	ASSERT_EQ(again->word, first->word);
+	ASSERT_STREQ(lexer_get_token(&lexer, 301)->word, "v299");
+
+	ASSERT_EQ(intern_find(&lexer.names, "v42", 3), 42);
+	ASSERT_EQ(intern_find(&lexer.names, "v300", 4), INTERN_ID_NONE);
+
+	lexer_dtor(&lexer);
+}
+
+TEST(Lexer, LexerTokenArrays) {
+	const char *lexerText = "abc := 0x10; abc <- memload abc";
+
+	struct lexer lexer = {{0}};
+	ASSERT_EQ(lexer_ctor(&lexer).status, LXST_OK);
+	ASSERT_EQ(LEXER_STATUS(lexer_parse_text(&lexer, lexerText)), LXST_OK);
+
+	const enum LexerTokenType expected[] = {
+		LXTOK_VARIABLE, LXTOK_DECL_ASSIGN, LXTOK_NUMBER, LXTOK_SEMICOLON,
+		LXTOK_VARIABLE, LXTOK_MEM_WRITE, LXTOK_MEM_READ, LXTOK_VARIABLE,
+	};
+	const size_t positions[] = {0, 4, 7, 11, 13, 17, 20, 28};
+
+	ASSERT_EQ(lexer_n_tokens(&lexer), sizeof(expected) / sizeof(*expected));
+
+	for (size_t i = 0; i < lexer_n_tokens(&lexer); i++) {
+		ASSERT_EQ(lexer_token_type(&lexer, i), expected[i]);
+		ASSERT_EQ(lexer_token_position(&lexer, i), positions[i]);
+	}
+
+	ASSERT_EQ(lexer_token_number(&lexer, 2), 16);
+	ASSERT_EQ(lexer_token_name_id(&lexer, 7), lexer_token_name_id(&lexer, 0));
+	ASSERT_STREQ(lexer_token_word(&lexer, 4), "abc");
+
+	// Tokens of the clone are independent of the original
+	struct lexer clone = {{0}};
+	ASSERT_EQ(LEXER_STATUS(lexer_clone(&lexer, &clone)), LXST_OK);
+	lexer_dtor(&lexer);
+
+	ASSERT_EQ(lexer_n_tokens(&clone), sizeof(expected) / sizeof(*expected));
+	ASSERT_STREQ(lexer_get_token(&clone, 7)->word, "abc");
+	ASSERT_EQ(lexer_get_token(&clone, 2)->lexer_number, 16);
+
+	lexer_dtor(&clone);
+}
+
+TEST(Lexer, LexerStreamChunks) {
+	const char *lexerText = "func main() { // comment spanning chunks\n"
+		"\tvariable := 0x1F + 017 * 12345; x <- memload y >> 2;\n"
+		"\tif (a <= b != c) { print(a); } // tail";
+
+	FILE *stream = tmpfile();
+	ASSERT_NE(stream, nullptr);
+	fputs(lexerText, stream);
+
+	struct lexer text_lexer = {{0}};
+	ASSERT_EQ(lexer_ctor(&text_lexer).status, LXST_OK);
+	ASSERT_EQ(LEXER_STATUS(lexer_parse_text(&text_lexer, lexerText)), LXST_OK);
+
+	for (size_t chunk_size = 1; chunk_size < 20; chunk_size++) {
+		rewind(stream);
+
+		struct lexer lexer = {{0}};
+		ASSERT_EQ(lexer_ctor(&lexer).status, LXST_OK);
+
+		LexerStatus status = lexer_parse_stream(&lexer, stream, chunk_size);
+		ASSERT_EQ(LEXER_STATUS(status), LXST_OK);
+		ASSERT_EQ(lexer.tokens.len, text_lexer.tokens.len);
+
+		for (size_t i = 0; i < lexer.tokens.len; i++) {
+			struct lexer_token *token = lexer_get_token(&lexer, i);
+			struct lexer_token *expected = lexer_get_token(&text_lexer, i);
+
+			ASSERT_EQ(token->tok_type, expected->tok_type);
+			ASSERT_EQ(token->text_position, expected->text_position);
+			if (token->tok_type == LXTOK_VARIABLE) {
+				ASSERT_STREQ(token->word, expected->word);
+			} else if (token->tok_type == LXTOK_NUMBER) {
+				ASSERT_EQ(token->lexer_number, expected->lexer_number);
+			}
+		}
+
+		lexer_dtor(&lexer);
+	}
+
+	lexer_dtor(&text_lexer);
+	fclose(stream);
+}
+
+TEST(Lexer, LexerStreamError) {
+	FILE *stream = tmpfile();
+	ASSERT_NE(stream, nullptr);
+	fputs("abc := 12;\nd := 0x", stream);
+	rewind(stream);
+
+	struct lexer lexer = {{0}};
+	ASSERT_EQ(lexer_ctor(&lexer).status, LXST_OK);
+
+	LexerStatus status = lexer_parse_stream(&lexer, stream, 4);
+	ASSERT_EQ(LEXER_STATUS(status), LXST_VARIABLE_DIGIT_BEGINNING);
+	ASSERT_EQ(status.text_position, 16);
+
+	lexer_dtor(&lexer);
+	fclose(stream);
+}
+
+TEST(Lexer, LexerPullLookahead) {
+	const char *lexerText = "func main() { // comment spanning chunks\n"
+		"\tvariable := 0x1F + 017 * 12345; x <- memload y >> 2;\n"
+		"\tif (a <= b != c) { print(a); } // tail";
+
+	FILE *stream = tmpfile();
+	ASSERT_NE(stream, nullptr);
+	fputs(lexerText, stream);
+
+	struct lexer text_lexer = {{0}};
+	ASSERT_EQ(lexer_ctor(&text_lexer).status, LXST_OK);
+	ASSERT_EQ(LEXER_STATUS(lexer_parse_text(&text_lexer, lexerText)), LXST_OK);
+
+	for (size_t chunk_size = 0; chunk_size < 20; chunk_size++) {
+		rewind(stream);
+
+		struct lexer lexer = {{0}};
+		ASSERT_EQ(lexer_ctor(&lexer).status, LXST_OK);
+
+		// chunk_size 0 pulls from the text itself
+		LexerStatus status = chunk_size ?
+			lexer_pull_stream(&lexer, stream, chunk_size) :
+			lexer_pull_text(&lexer, lexerText);
+		ASSERT_EQ(LEXER_STATUS(status), LXST_OK);
+		ASSERT_EQ(lexer.tokens.len, 0);
+
+		for (size_t i = 0; i < text_lexer.tokens.len; i++) {
+			struct lexer_token *token = lexer_get_token(&lexer, i);
+			struct lexer_token *expected = lexer_get_token(&text_lexer, i);
+			ASSERT_NE(token, nullptr);
+
+			ASSERT_EQ(token->tok_type, expected->tok_type);
+			ASSERT_EQ(token->text_position, expected->text_position);
+			if (token->tok_type == LXTOK_VARIABLE) {
+				ASSERT_STREQ(token->word, expected->word);
+			} else if (token->tok_type == LXTOK_NUMBER) {
+				ASSERT_EQ(token->lexer_number, expected->lexer_number);
+			}
+
+			if (i >= LEXER_LOOKAHEAD) {
+				ASSERT_NE(lexer_get_token(&lexer, i - LEXER_LOOKAHEAD + 1), nullptr);
+				ASSERT_EQ(lexer_get_token(&lexer, i - LEXER_LOOKAHEAD), nullptr);
+			}
+		}
+
+		ASSERT_EQ(lexer_get_token(&lexer, text_lexer.tokens.len), nullptr);
+		ASSERT_EQ(LEXER_STATUS(lexer_pull_status(&lexer)), LXST_OK);
+		ASSERT_EQ(lexer.tokens.len, 0);
+
+		lexer_dtor(&lexer);
+	}
+
+	lexer_dtor(&text_lexer);
+	fclose(stream);
+}
+
+TEST(Lexer, LexerPullError) {
+	const char *lexerText = "a b c d 12ab e";
+
+	struct lexer lexer = {{0}};
+	ASSERT_EQ(lexer_ctor(&lexer).status, LXST_OK);
+	ASSERT_EQ(LEXER_STATUS(lexer_pull_text(&lexer, lexerText)), LXST_OK);
+
+	// Tokens before the error are available
+	ASSERT_NE(lexer_get_token(&lexer, 3), nullptr);
+	ASSERT_EQ(LEXER_STATUS(lexer_pull_status(&lexer)), LXST_OK);
+
+	ASSERT_EQ(lexer_get_token(&lexer, 4), nullptr);
+
+	LexerStatus status = lexer_pull_status(&lexer);
+	ASSERT_EQ(LEXER_STATUS(status), LXST_VARIABLE_DIGIT_BEGINNING);
+	ASSERT_EQ(status.text_position, 8);
+
+	lexer_dtor(&lexer);
+}
+
+static void lexer_expect_same(struct lexer *lexer, struct lexer *expected) {
+	ASSERT_EQ(lexer_n_tokens(lexer), lexer_n_tokens(expected));
+	ASSERT_EQ(lexer->names.n_names, expected->names.n_names);
+
+	for (size_t i = 0; i < lexer_n_tokens(lexer); i++) {
+		ASSERT_EQ(lexer_token_type(lexer, i), lexer_token_type(expected, i));
+		ASSERT_EQ(lexer_token_position(lexer, i), lexer_token_position(expected, i));
+
+		if (lexer_token_type(lexer, i) == LXTOK_NUMBER) {
+			ASSERT_EQ(lexer_token_number(lexer, i), lexer_token_number(expected, i));
+		} else if (lexer_token_type(lexer, i) == LXTOK_VARIABLE) {
+			ASSERT_EQ(lexer_token_name_id(lexer, i), lexer_token_name_id(expected, i));
+		}
+	}
+
+	for (uint32_t id = 0; id < lexer->names.n_names; id++) {
+		ASSERT_STREQ(intern_name(&lexer->names, id), intern_name(&expected->names, id));
+	}
+}
+
+TEST(Lexer, LexerParallel) {
+	std::string lexerText;
+	for (int i = 0; lexerText.size() < 1024 * 1024; i++) {
+		lexerText += "func f" + std::to_string(i % 5000) + "(a, b) { // comment\n";
+		lexerText += "\tv" + std::to_string(i) + " := 0x" + std::to_string(i % 97)
+			+ " + b * 017; // (\n\n";
+		lexerText += "\treturn a <= b;\n}\n";
+	}
+
+	struct lexer serial = {{0}};
+	ASSERT_EQ(lexer_ctor(&serial).status, LXST_OK);
+	ASSERT_EQ(LEXER_STATUS(lexer_parse_text(&serial, lexerText.c_str())), LXST_OK);
+
+	for (size_t n_threads = 0; n_threads <= 8; n_threads += 3) {
+		struct lexer lexer = {{0}};
+		ASSERT_EQ(lexer_ctor(&lexer).status, LXST_OK);
+
+		LexerStatus status = lexer_parse_text_parallel(&lexer, lexerText.c_str(),
+							       n_threads);
+		ASSERT_EQ(LEXER_STATUS(status), LXST_OK);
+		lexer_expect_same(&lexer, &serial);
+
+		lexer_dtor(&lexer);
+	}
+
+	lexer_dtor(&serial);
+
+	// An error late in the text is reported at the serial position
+	lexerText.insert(lexerText.size() * 3 / 4, " 1x ");
+
+	struct lexer serial_err = {{0}};
+	ASSERT_EQ(lexer_ctor(&serial_err).status, LXST_OK);
+	LexerStatus serial_status = lexer_parse_text(&serial_err, lexerText.c_str());
+	ASSERT_EQ(LEXER_STATUS(serial_status), LXST_VARIABLE_DIGIT_BEGINNING);
+
+	struct lexer lexer = {{0}};
+	ASSERT_EQ(lexer_ctor(&lexer).status, LXST_OK);
+
+	LexerStatus status = lexer_parse_text_parallel(&lexer, lexerText.c_str(), 8);
+	ASSERT_EQ(LEXER_STATUS(status), LXST_VARIABLE_DIGIT_BEGINNING);
+	ASSERT_EQ(status.text_position, serial_status.text_position);
+	lexer_expect_same(&lexer, &serial_err);
+
+	lexer_dtor(&lexer);
+	lexer_dtor(&serial_err);
+}
+
+static struct lexer_location lexer_naive_locate(const std::string &text, size_t pos) {
+	struct lexer_location loc = {1, 1};
+	for (size_t i = 0; i < pos; i++) {
+		if (text[i] == '\n') {
+			loc.line++;
+			loc.column = 1;
+		} else {
+			loc.column++;
+		}
+	}
+
+	return loc;
+}
+
+TEST(Lexer, LexerLineIndex) {
+	std::string lexerText = "\n\nfunc main() { // comment\n\ta := 1;\n\n\t\tb := a;\n}\n";
+	for (int i = 0; lexerText.size() < 256 * 1024; i++) {
+		lexerText += "x" + std::to_string(i) + " := " + std::to_string(i) + "; // c\r\n";
+	}
+
+	FILE *stream = tmpfile();
+	ASSERT_NE(stream, nullptr);
+	fputs(lexerText.c_str(), stream);
+	rewind(stream);
+
+	struct lexer lexers[3] = {};
+	for (size_t i = 0; i < 3; i++) {
+		ASSERT_EQ(lexer_ctor(&lexers[i]).status, LXST_OK);
+	}
+
+	ASSERT_EQ(LEXER_STATUS(lexer_parse_text(&lexers[0], lexerText.c_str())), LXST_OK);
+	ASSERT_EQ(LEXER_STATUS(lexer_parse_stream(&lexers[1], stream, 7)), LXST_OK);
+	ASSERT_EQ(LEXER_STATUS(lexer_parse_text_parallel(&lexers[2], lexerText.c_str(), 4)),
+		  LXST_OK);
+
+	for (size_t i = 0; i < 3; i++) {
+		struct lexer *lexer = &lexers[i];
+
+		ASSERT_EQ(lexer->lines.len, (size_t)std::count(lexerText.begin(),
+							       lexerText.end(), '\n'));
+
+		for (size_t tok = 0; tok < lexer_n_tokens(lexer); tok += 7) {
+			size_t pos = lexer_token_position(lexer, tok);
+			struct lexer_location loc = lexer_locate(lexer, pos);
+			struct lexer_location expected = lexer_naive_locate(lexerText, pos);
+
+			ASSERT_EQ(loc.line, expected.line);
+			ASSERT_EQ(loc.column, expected.column);
+		}
+
+		lexer_dtor(lexer);
+	}
+
+	fclose(stream);
+}
+
+TEST(Lexer, LexerPullFile) {
+	// A text filling whole pages ends right at the mapping of the file
+	std::string lexerText;
+	for (int i = 0; lexerText.size() < 4096 * 2; i++) {
+		lexerText += "name" + std::to_string(i % 10) + " := " + std::to_string(i) + ";\n";
+	}
+	lexerText.resize(4096 * 2);
+	lexerText.back() = 'z';
+
+	char filename[] = "/tmp/lexer_pull_file_XXXXXX";
+	int fd = mkstemp(filename);
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(write(fd, lexerText.data(), lexerText.size()), (ssize_t)lexerText.size());
+	close(fd);
+
+	struct lexer text_lexer = {{0}};
+	ASSERT_EQ(lexer_ctor(&text_lexer).status, LXST_OK);
+	ASSERT_EQ(LEXER_STATUS(lexer_parse_text(&text_lexer, lexerText.c_str())), LXST_OK);
+
+	struct lexer lexer = {{0}};
+	ASSERT_EQ(lexer_ctor(&lexer).status, LXST_OK);
+	ASSERT_EQ(LEXER_STATUS(lexer_pull_file(&lexer, filename)), LXST_OK);
+
+	const char *text = lexer_text(&lexer);
+	ASSERT_NE(text, nullptr);
+	ASSERT_EQ(memcmp(text, lexerText.data(), lexerText.size()), 0);
+	ASSERT_EQ(text[lexerText.size()], '\0');
+
+	for (size_t i = 0; i < lexer_n_tokens(&text_lexer); i++) {
+		struct lexer_token *token = lexer_get_token(&lexer, i);
+		ASSERT_NE(token, nullptr);
+
+		ASSERT_EQ(token->tok_type, lexer_token_type(&text_lexer, i));
+		ASSERT_EQ(token->text_position, lexer_token_position(&text_lexer, i));
+		if (token->tok_type == LXTOK_VARIABLE) {
+			ASSERT_STREQ(token->word, lexer_token_word(&text_lexer, i));
+		}
+	}
+
+	ASSERT_EQ(lexer_get_token(&lexer, lexer_n_tokens(&text_lexer)), nullptr);
+	ASSERT_EQ(LEXER_STATUS(lexer_pull_status(&lexer)), LXST_OK);
+
+	lexer_dtor(&lexer);
+	lexer_dtor(&text_lexer);
+
+	// Empty files map too
+	fd = open(filename, O_WRONLY | O_TRUNC);
+	ASSERT_GE(fd, 0);
+	close(fd);
+
+	ASSERT_EQ(lexer_ctor(&lexer).status, LXST_OK);
+	ASSERT_EQ(LEXER_STATUS(lexer_pull_file(&lexer, filename)), LXST_OK);
+	ASSERT_EQ(lexer_get_token(&lexer, 0), nullptr);
+	lexer_dtor(&lexer);
+
+	unlink(filename);
+}
+
+TEST(Lexer, LexerLongNumbers) {
+	const char *lexerText = "1234567890123 9223372036854775807 "
+				"9223372036854775808 123456789012345678901234";
+
+	struct lexer lexer = {{0}};
+	ASSERT_EQ(lexer_ctor(&lexer).status, LXST_OK);
+
+	LexerStatus status = lexer_parse_text(&lexer, lexerText);
+	ASSERT_EQ(LEXER_STATUS(status), LXST_OK);
+
+	const int64_t expected[] = {
+		1234567890123, INT64_MAX, INT64_MAX, INT64_MAX,
+	};
+	ASSERT_EQ(lexer.tokens.len, sizeof(expected) / sizeof(*expected));
+
+	for (size_t i = 0; i < lexer.tokens.len; i++) {
+		struct lexer_token *token = lexer_get_token(&lexer, i);
+		ASSERT_EQ(token->tok_type, LXTOK_NUMBER);
+		ASSERT_EQ(token->lexer_number, expected[i]);
+	}
+
+	lexer_dtor(&lexer);
+}
+
+TEST(Lexer, LexerSimdKernels) {
+	std::string lexerText;
+	for (int i = 0; i < 64; i++) {
+		lexerText += "identifier" + std::to_string(i) + "   \t\n";
+		lexerText += "// a comment long enough to cross vector widths\n";
+		lexerText += std::to_string(i * 7919) + " ";
+	}
+
+	struct lexer scalar_lexer = {{0}};
+	ASSERT_EQ(lexer_ctor(&scalar_lexer).status, LXST_OK);
+	ASSERT_EQ(lexer_simd_select(LEXER_ISA_SCALAR), S_OK);
+	ASSERT_EQ(LEXER_STATUS(lexer_parse_text(&scalar_lexer, lexerText.c_str())), LXST_OK);
+	ASSERT_EQ(scalar_lexer.tokens.len, 128);
+
+	for (int isa = LEXER_ISA_SSE2; isa < LEXER_ISA_N; isa++) {
+		if (lexer_simd_select((enum lexer_simd_isa)isa)) {
+			continue;
+		}
+
+		struct lexer lexer = {{0}};
+		ASSERT_EQ(lexer_ctor(&lexer).status, LXST_OK);
+		ASSERT_EQ(LEXER_STATUS(lexer_parse_text(&lexer, lexerText.c_str())), LXST_OK);
+		ASSERT_EQ(lexer.tokens.len, scalar_lexer.tokens.len);
+
+		for (size_t i = 0; i < lexer.tokens.len; i++) {
+			struct lexer_token *token = lexer_get_token(&lexer, i);
+			struct lexer_token *expected = lexer_get_token(&scalar_lexer, i);
+
+			ASSERT_EQ(token->tok_type, expected->tok_type);
+			ASSERT_EQ(token->text_position, expected->text_position);
+		}
+
+		lexer_dtor(&lexer);
+	}
+
+	lexer_dtor(&scalar_lexer);
+}
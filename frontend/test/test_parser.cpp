@@ -1,6 +1,11 @@
 #include <gtest/gtest.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
 
 #include "expression_parser.h"
+#include "expression_image.h"
+#include "parser_cache.h"
 
 TEST(Parser, ParserDumps) {
 	const char *rawText = ";;;;;2+2;1+21;asdf;a:=b;a=b;a-b;a=a+b;";//"2+2^5^3*2/1+2-2;2;2;2;2;";
@@ -20,3 +25,687 @@ TEST(Parser, ParserDumps) {
 	expression_dtor(&expr);
 }
 
+
+TEST(Parser, ParserOperatorPriority) {
+	const char *rawText = "func main() { x = 1 - 2 - 3 ^ 2 ^ 2 * 4 < 5 & 6; }";
+
+	struct expression expr = {0};
+	ASSERT_EQ(expression_parse_str(rawText, &expr), S_OK);
+	ASSERT_EQ(expression_store(&expr, "parser_priority.ast"), S_OK);
+	expression_dtor(&expr);
+
+	char *stored = NULL;
+	size_t stored_len = 0;
+	ASSERT_EQ(read_file("parser_priority.ast", &stored, &stored_len), S_OK);
+	unlink("parser_priority.ast");
+
+	// Left-associative - and comparisons, right-associative ^
+	EXPECT_NE(strstr(stored, "(= (\"x\" nil nil) (& (< (- (- (1 nil nil) (2 nil nil)) "
+			 "(* (^ (3 nil nil) (^ (2 nil nil) (2 nil nil))) (4 nil nil))) "
+			 "(5 nil nil)) (6 nil nil)))"), nullptr);
+
+	free(stored);
+}
+
+TEST(Parser, ParserArenaNodes) {
+	struct expression expr = {0};
+	ASSERT_EQ(expression_parse_str("func main() { x = 1 + 2 * y; }", &expr), S_OK);
+
+	ASSERT_NE(expr.tree.arena, nullptr);
+	EXPECT_NE(expr.tree.arena->chunks, nullptr);
+	EXPECT_NE(expr.tree.root, nullptr);
+
+	expression_dtor(&expr);
+	EXPECT_EQ(expr.tree.arena, nullptr);
+
+	// Subtrees dropped on errors are released with the arena
+	ASSERT_EQ(expression_parse_str("func main() { x = 1 + (2 * y; }", &expr), S_FAIL);
+}
+
+static std::string parser_stored(struct expression *expr, const char *filename) {
+	EXPECT_EQ(expression_store(expr, filename), S_OK);
+
+	char *stored = NULL;
+	size_t stored_len = 0;
+	EXPECT_EQ(read_file(filename, &stored, &stored_len), S_OK);
+	unlink(filename);
+
+	std::string result = stored ? stored : "";
+	free(stored);
+
+	return result;
+}
+
+TEST(Parser, ParserParallel) {
+	std::string text;
+	for (int i = 0; i < 40; i++) {
+		std::string idx = std::to_string(i);
+		text += "func f" + idx + "(a, b" + idx + ") {\n"
+			"\tif (a < b" + idx + ") { c" + std::to_string(i % 7) + " := a * 2; }\n"
+			"\twhile (a) { a = a - 1; }\n"
+			"\treturn (a + b" + idx + ");\n"
+			"}\n";
+	}
+	text += "func main() { print(f3(1, 2)); }\n";
+
+	struct lexer lexer = {0};
+	ASSERT_EQ(LEXER_STATUS(lexer_ctor(&lexer)), LXST_OK);
+	ASSERT_EQ(LEXER_STATUS(lexer_parse_text(&lexer, text.c_str())), LXST_OK);
+
+	struct expression serial = {0};
+	ASSERT_EQ(expression_parse_lexer(&serial, &lexer), S_OK);
+
+	for (size_t n_threads : {2, 3, 8}) {
+		struct expression parallel = {0};
+		ASSERT_EQ(expression_parse_lexer_parallel(&parallel, &lexer, n_threads), S_OK);
+
+		ASSERT_EQ(parallel.variables.len, serial.variables.len);
+		for (size_t i = 0; i < serial.variables.len; i++) {
+			struct expression_variable *serial_var = NULL, *parallel_var = NULL;
+			ASSERT_EQ(pvector_get(&serial.variables, i, (void **)&serial_var), 0);
+			ASSERT_EQ(pvector_get(&parallel.variables, i, (void **)&parallel_var), 0);
+			EXPECT_EQ(serial_var->name_id, parallel_var->name_id);
+		}
+
+		EXPECT_EQ(parser_stored(&parallel, "parser_parallel.ast"),
+			  parser_stored(&serial, "parser_serial.ast"));
+
+		expression_dtor(&parallel);
+	}
+
+	expression_dtor(&serial);
+	lexer_dtor(&lexer);
+
+	// An error in one of the functions is reported by the serial parser
+	text.insert(text.find("func f20"), "func bad() { a = ; }\n");
+
+	ASSERT_EQ(LEXER_STATUS(lexer_ctor(&lexer)), LXST_OK);
+	ASSERT_EQ(LEXER_STATUS(lexer_parse_text(&lexer, text.c_str())), LXST_OK);
+
+	struct expression failed = {0};
+	EXPECT_EQ(expression_parse_lexer_parallel(&failed, &lexer, 4), S_FAIL);
+
+	lexer_dtor(&lexer);
+}
+
+static void parser_write_file(const char *filename, const std::string &text) {
+	FILE *file = fopen(filename, "w");
+	ASSERT_NE(file, nullptr);
+	fwrite(text.data(), 1, text.size(), file);
+	fclose(file);
+}
+
+TEST(Parser, ParserCache) {
+	const char *filename = "parser_cache.pg";
+	const char *cache_filename = "parser_cache.pg.ast.cache";
+	unlink(cache_filename);
+
+	std::string first = "func f(a) { return (a + 1); }\n";
+	std::string main_func = "func main() { print(f(2)); }\n";
+	parser_write_file(filename, first + main_func);
+
+	struct expression expr = {0};
+	ASSERT_EQ(expression_parse_file_cached(filename, cache_filename, &expr), S_OK);
+	std::string cold = parser_stored(&expr, "parser_cache.ast");
+	expression_dtor(&expr);
+
+	ASSERT_EQ(expression_parse_file(filename, &expr), S_OK);
+	EXPECT_EQ(parser_stored(&expr, "parser_cache.ast"), cold);
+	expression_dtor(&expr);
+
+	// The cached subtree of main is spliced in, not parsed again
+	char *cache = NULL;
+	size_t cache_len = 0;
+	ASSERT_EQ(read_file(cache_filename, &cache, &cache_len), S_OK);
+	std::string cache_data(cache, cache_len);
+	free(cache);
+
+	// Number tag and zigzag 2, main is the last subtree of the file
+	size_t main_pos = cache_data.rfind(std::string("\x01\x04", 2));
+	ASSERT_NE(main_pos, std::string::npos);
+	cache_data[main_pos + 1] = '\x06';
+	parser_write_file(cache_filename, cache_data);
+
+	first = "func f(a) { return (a * 5); }\n";
+	parser_write_file(filename, first + main_func);
+
+	ASSERT_EQ(expression_parse_file_cached(filename, cache_filename, &expr), S_OK);
+	std::string warm = parser_stored(&expr, "parser_cache.ast");
+	expression_dtor(&expr);
+
+	EXPECT_NE(warm.find("(* (\"a\" nil nil) (5 nil nil))"), std::string::npos);
+	EXPECT_NE(warm.find("(3 nil nil)"), std::string::npos);
+
+	// Errors are reported by the parse from scratch
+	parser_write_file(filename, "func f(a) { return (a * ); }\n" + main_func);
+	EXPECT_EQ(expression_parse_file_cached(filename, cache_filename, &expr), S_FAIL);
+
+	unlink(filename);
+	unlink(cache_filename);
+}
+
+static uint64_t parser_text_hash(const char *text) {
+	struct lexer lexer = {};
+	EXPECT_EQ(lexer_ctor(&lexer).status, LXST_OK);
+	EXPECT_EQ(lexer_parse_text(&lexer, text).status, LXST_OK);
+
+	uint64_t hash = parser_cache_hash(&lexer, 0, lexer_n_tokens(&lexer));
+	lexer_dtor(&lexer);
+
+	return hash;
+}
+
+TEST(Parser, ParserCacheCollision) {
+	const char *filename = "parser_collision.pg";
+	const char *cache_filename = "parser_collision.pg.ast.cache";
+	const char *old_text = "func main() { print(1); }\n";
+	const char *new_text = "func main() { print(2); }\n";
+	unlink(cache_filename);
+
+	parser_write_file(filename, old_text);
+	struct expression expr = {0};
+	ASSERT_EQ(expression_parse_file_cached(filename, cache_filename, &expr), S_OK);
+	expression_dtor(&expr);
+
+	// The entry of the old text gets the hash of the new one
+	char *cache = NULL;
+	size_t cache_len = 0;
+	ASSERT_EQ(read_file(cache_filename, &cache, &cache_len), S_OK);
+	std::string cache_data(cache, cache_len);
+	free(cache);
+
+	uint64_t old_hash = parser_text_hash(old_text);
+	uint64_t new_hash = parser_text_hash(new_text);
+	std::string old_bytes, new_bytes;
+	for (size_t byte = 0; byte < sizeof(uint64_t); byte++) {
+		old_bytes += (char)(old_hash >> (8 * byte));
+		new_bytes += (char)(new_hash >> (8 * byte));
+	}
+
+	size_t hash_pos = cache_data.find(old_bytes);
+	ASSERT_NE(hash_pos, std::string::npos);
+	cache_data.replace(hash_pos, old_bytes.size(), new_bytes);
+	parser_write_file(cache_filename, cache_data);
+
+	// The tokens differ, the function is parsed again
+	parser_write_file(filename, new_text);
+	ASSERT_EQ(expression_parse_file_cached(filename, cache_filename, &expr), S_OK);
+	std::string stored = parser_stored(&expr, "parser_collision.ast");
+	expression_dtor(&expr);
+
+	EXPECT_NE(stored.find("(print (2 nil nil) nil)"), std::string::npos);
+	EXPECT_EQ(stored.find("(print (1 nil nil) nil)"), std::string::npos);
+
+	unlink(filename);
+	unlink(cache_filename);
+	unlink("parser_collision.ast");
+}
+
+TEST(Parser, ParserVariableIndex) {
+	struct expression expr = {0};
+	ASSERT_EQ(expression_ctor(&expr), S_OK);
+
+	std::vector<uint32_t> ids;
+	for (int i = 0; i < 1000; i++) {
+		std::string name = "v" + std::to_string(i);
+		uint32_t id = 0;
+		ASSERT_EQ(intern_string(&expr.names, name.c_str(), name.size(), &id), S_OK);
+		ids.push_back(id);
+	}
+
+	for (size_t i = 0; i < ids.size(); i += 2) {
+		struct expression_variable *var = NULL;
+		ASSERT_EQ(expr_push_variable(&expr, ids[i], &var), S_OK);
+		EXPECT_EQ(var->var_pointer, i / 2);
+	}
+
+	for (size_t i = 0; i < ids.size(); i++) {
+		struct expression_variable *var = expr_find_variable(&expr, ids[i]);
+		if (i % 2) {
+			EXPECT_EQ(var, nullptr);
+		} else {
+			ASSERT_NE(var, nullptr);
+			EXPECT_EQ(var->name_id, ids[i]);
+			EXPECT_EQ(var->var_pointer, i / 2);
+		}
+	}
+
+	EXPECT_EQ(expr_push_variable(&expr, ids[0], NULL), S_FAIL);
+
+	expression_dtor(&expr);
+}
+
+TEST(Parser, ParserDeepNesting) {
+	const char *filename = "parser_deep.pg";
+
+	// Sequences make the tree as deep as they are long
+	std::string text = "func main() {\n\tx := 0;\n";
+	for (int i = 0; i < 100000; i++) {
+		text += "\tx = x + 1;\n";
+	}
+	text += "\tprint(x);\n}\n";
+	parser_write_file(filename, text);
+
+	struct expression expr = {0};
+	ASSERT_EQ(expression_parse_file(filename, &expr), S_OK);
+	ASSERT_EQ(expression_store(&expr, "parser_deep.ast"), S_OK);
+
+	struct expression loaded = {0};
+	ASSERT_EQ(expression_load(&loaded, "parser_deep.ast"), S_OK);
+	EXPECT_EQ(parser_stored(&loaded, "parser_deep.ast"), parser_stored(&expr, "parser_deep.ast"));
+	expression_dtor(&loaded);
+	expression_dtor(&expr);
+
+	// Nesting is bounded by memory, not by the call stack
+	std::string nested(100000, '(');
+	parser_write_file(filename, "func main() { print(" + nested + "1" +
+			  std::string(100000, ')') + "); }\n");
+	ASSERT_EQ(expression_parse_file(filename, &expr), S_OK);
+	ASSERT_EQ(expression_store(&expr, "parser_deep.ast"), S_OK);
+	expression_dtor(&expr);
+
+	text = "func main() {\n";
+	for (int i = 0; i < 100000; i++) {
+		text += "if (1) { while (0) ";
+	}
+	text += "print(1);";
+	for (int i = 0; i < 100000; i++) {
+		text += " } else ;";
+	}
+	text += "\n}\n";
+	parser_write_file(filename, text);
+	ASSERT_EQ(expression_parse_file(filename, &expr), S_OK);
+	ASSERT_EQ(expression_store(&expr, "parser_deep.ast"), S_OK);
+
+	ASSERT_EQ(expression_load(&loaded, "parser_deep.ast"), S_OK);
+	EXPECT_EQ(parser_stored(&loaded, "parser_deep.ast"), parser_stored(&expr, "parser_deep.ast"));
+	expression_dtor(&loaded);
+	expression_dtor(&expr);
+
+	unlink("parser_deep.ast");
+
+	unlink(filename);
+}
+
+TEST(Parser, ParserSequences) {
+	const char *rawText = "func f(a, b, c) { return (a); }\n"
+			      "func main() { x := 1; y := 2; print(f(x, y, 3)); }\n";
+
+	struct expression expr = {0};
+	ASSERT_EQ(expression_parse_str(rawText, &expr), S_OK);
+
+	// Functions, statements and arguments are flat lists
+	struct tree_node *root = expr.tree.root;
+	ASSERT_TRUE(EXPR_TNODE_IS_SEQUENCE(root));
+	ASSERT_EQ(root->n_children, 2u);
+
+	struct tree_node *main_body = root->children[1]->right;
+	ASSERT_TRUE(EXPR_TNODE_IS_SEQUENCE(main_body));
+	EXPECT_EQ(main_body->n_children, 3u);
+
+	struct tree_node *f_args = root->children[0]->left->right;
+	ASSERT_TRUE(EXPR_TNODE_IS_SEQUENCE(f_args));
+	EXPECT_EQ(f_args->n_children, 3u);
+
+	std::string stored = parser_stored(&expr, "parser_sequences.ast");
+	EXPECT_NE(stored.find("[, (\"a\" nil nil) (\"b\" nil nil) (\"c\" nil nil)]"),
+		  std::string::npos);
+
+	ASSERT_EQ(expression_store(&expr, "parser_sequences.ast"), S_OK);
+	struct expression loaded = {0};
+	ASSERT_EQ(expression_load(&loaded, "parser_sequences.ast"), S_OK);
+	EXPECT_EQ(parser_stored(&loaded, "parser_sequences.ast"), stored);
+
+	expression_dtor(&loaded);
+	expression_dtor(&expr);
+}
+
+TEST(Parser, ParserTextFormat) {
+	const char *text = " [;\n(= (\"x\"  nil nil)\t(- (-9223372036854775808 nil nil) (+ nil nil)))"
+			   " (print (42 nil nil) nil) ]";
+
+	struct expression expr = {0};
+	ASSERT_EQ(expression_ctor(&expr), S_OK);
+	ASSERT_EQ(expression_read_text(&expr, text, strlen(text)), S_OK);
+	EXPECT_EQ(parser_stored(&expr, "parser_text.ast"),
+		  "[; (= (\"x\" nil nil) (- (-9223372036854775808 nil nil) (+ nil nil))) "
+		  "(print (42 nil nil) nil)]");
+	expression_dtor(&expr);
+
+	for (const char *bad : {"", "(1 nil)", "(1 nil nil nil)", "(1 nil nil]", "[; (1 nil nil))",
+				"(\"1x\" nil nil)", "(9223372036854775808 nil nil)", "(foo nil nil)"}) {
+		ASSERT_EQ(expression_ctor(&expr), S_OK);
+		EXPECT_EQ(expression_read_text(&expr, bad, strlen(bad)), S_FAIL) << bad;
+		expression_dtor(&expr);
+	}
+}
+
+TEST(Parser, ParserBinaryFormat) {
+	const char *rawText = "func f(a, b) { return (a - b * 3); }\n"
+			      "func main() { x := input(); if (x > 9223372036854775807) { print(f(x, 2)); } }\n";
+
+	struct expression expr = {0};
+	ASSERT_EQ(expression_parse_str(rawText, &expr), S_OK);
+	ASSERT_EQ(expression_store_binary(&expr, "parser_binary.ast"), S_OK);
+	std::string text = parser_stored(&expr, "parser_binary_text.ast");
+	expression_dtor(&expr);
+
+	enum expression_format format = EXPRESSION_FORMAT_TEXT;
+	ASSERT_EQ(expression_file_format("parser_binary.ast", &format), S_OK);
+	EXPECT_EQ(format, EXPRESSION_FORMAT_BINARY);
+
+	char *stored = NULL;
+	size_t stored_len = 0;
+	ASSERT_EQ(read_file("parser_binary.ast", &stored, &stored_len), S_OK);
+	EXPECT_LT(stored_len, text.size());
+
+	ASSERT_EQ(expression_load_binary(&expr, "parser_binary.ast"), S_OK);
+	EXPECT_EQ(parser_stored(&expr, "parser_binary_text.ast"), text);
+	expression_dtor(&expr);
+
+	// Every truncation of the file is rejected
+	for (size_t len = 0; len < stored_len; len++) {
+		parser_write_file("parser_binary.ast", std::string(stored, len));
+		EXPECT_EQ(expression_load_binary(&expr, "parser_binary.ast"), S_FAIL) << len;
+	}
+
+	free(stored);
+	unlink("parser_binary.ast");
+}
+
+TEST(Parser, ParserImageFormat) {
+	const char *rawText = "func f(a, b) { return (a - b * 3); }\n"
+			      "func main() { x := input(); if (x > 9223372036854775807) { print(f(x, 2)); } }\n";
+
+	struct expression expr = {0};
+	ASSERT_EQ(expression_parse_str(rawText, &expr), S_OK);
+	ASSERT_EQ(expression_store_image(&expr, "parser_image.ast"), S_OK);
+	std::string text = parser_stored(&expr, "parser_image_text.ast");
+	expression_dtor(&expr);
+
+	enum expression_format format = EXPRESSION_FORMAT_TEXT;
+	ASSERT_EQ(expression_file_format("parser_image.ast", &format), S_OK);
+	EXPECT_EQ(format, EXPRESSION_FORMAT_IMAGE);
+
+	struct expression_image image = {};
+	ASSERT_EQ(expression_image_map(&image, "parser_image.ast"), S_OK);
+
+	// main is the second function of the root sequence
+	const struct expression_image_node *root = expr_image_root(&image);
+	ASSERT_TRUE(root && EXPR_INODE_IS_SEQUENCE(root));
+	ASSERT_EQ(expr_image_n_children(root), 2u);
+	const struct expression_image_node *main_func = expr_image_child(&image, root, 1);
+	EXPECT_EQ(expr_image_op(main_func)->idx, EXPR_IDX_MAIN);
+	const struct expression_image_node *f_decl = expr_image_left(&image, expr_image_child(&image, root, 0));
+	const struct expression_image_node *f_name = expr_image_left(&image, f_decl);
+	ASSERT_TRUE(f_name && EXPR_INODE_IS_VARIABLE(f_name));
+	EXPECT_STREQ(expr_image_name(&image, f_name->arg), "f");
+
+	ASSERT_EQ(expression_image_to_tree(&image, &expr), S_OK);
+	EXPECT_EQ(parser_stored(&expr, "parser_image_text.ast"), text);
+	expression_dtor(&expr);
+
+	std::string stored(image.base, image.size);
+	expression_image_dtor(&image);
+
+	// A truncated image or one of another version is not mapped
+	parser_write_file("parser_image.ast", stored.substr(0, stored.size() - 1));
+	EXPECT_EQ(expression_image_map(&image, "parser_image.ast"), S_FAIL);
+
+	stored[4]++;
+	parser_write_file("parser_image.ast", stored);
+	EXPECT_EQ(expression_image_map(&image, "parser_image.ast"), S_FAIL);
+	stored[4]--;
+
+	unlink("parser_image.ast");
+}
+
+/*
+ * Image nodes are only checked as they are reached: a broken node maps,
+ * its link leads to the invalid node and loading it fails.
+ */
+static void parser_image_expect_invalid(const std::string &stored, size_t node_off,
+					size_t field_off, uint32_t value) {
+	std::string broken = stored;
+	memcpy(&broken[node_off + field_off], &value, sizeof(value));
+
+	struct expression_image image = {};
+	image.base = broken.data();
+	image.size = broken.size();
+
+	const struct expression_image_node *root = expr_image_root(&image);
+	ASSERT_TRUE(root);
+	const struct expression_image_node *func = EXPR_INODE_IS_INVALID(root) ? root :
+						   expr_image_child(&image, root, 0);
+	EXPECT_TRUE(EXPR_INODE_IS_INVALID(func));
+
+	struct expression expr = {0};
+	EXPECT_EQ(expression_image_to_tree(&image, &expr), S_FAIL);
+}
+
+TEST(Parser, ParserImageInvalidNodes) {
+	struct expression expr = {0};
+	ASSERT_EQ(expression_parse_str("func f(a) { return (a); }\n"
+				       "func main() { print(f(1)); }\n", &expr), S_OK);
+
+	struct expression_image image = {};
+	ASSERT_EQ(expression_image_build(&expr, &image), S_OK);
+	std::string stored(image.base, image.size);
+	expression_image_dtor(&image);
+	expression_dtor(&expr);
+
+	// The root sequence and the first function, which follows it
+	size_t root_off = sizeof(struct expression_image_header);
+	size_t func_off = root_off + sizeof(struct expression_image_node);
+
+	parser_image_expect_invalid(stored, func_off, offsetof(struct expression_image_node, arg),
+				    (uint32_t)EXPR_IMAGE_N_OPERATORS);
+	parser_image_expect_invalid(stored, func_off, offsetof(struct expression_image_node, flags),
+				    0x40);
+	parser_image_expect_invalid(stored, root_off, offsetof(struct expression_image_node, n_children),
+				    UINT32_MAX);
+
+	// Children out of the image, or before their parent
+	int32_t links = 0;
+	memcpy(&links, &stored[root_off + offsetof(struct expression_image_node, children)],
+	       sizeof(links));
+	size_t first_link = root_off + (size_t)links;
+	parser_image_expect_invalid(stored, first_link, 0, (uint32_t)stored.size());
+	parser_image_expect_invalid(stored, first_link, 0, (uint32_t)-16);
+	parser_image_expect_invalid(stored, first_link, 0, 3);
+}
+
+TEST(Parser, ParserFlatTree) {
+	const char *rawText = "func f(a, b) { return (a - b * 3); }\n"
+			      "func main() { x := input(); while (x > 0) { print(f(x, 2)); x = x - 1; } }\n";
+
+	struct expression expr = {0};
+	ASSERT_EQ(expression_parse_str(rawText, &expr), S_OK);
+	std::string text = parser_stored(&expr, "parser_flat.ast");
+
+	struct flat_tree_codec codec = {};
+	expression_flat_codec(&expr, &codec);
+
+	struct flat_tree flat = {};
+	flat_tree_ctor(&flat);
+	ASSERT_EQ(flat_tree_from_tree(&flat, expr.tree.root, &codec), DS_OK);
+
+	// Preorder: the root comes first, main is the second function
+	struct flat_cursor root = flat_tree_root(&flat);
+	EXPECT_EQ(root.idx, 0u);
+	ASSERT_TRUE(flat_cursor_is_sequence(root));
+	ASSERT_EQ(flat_cursor_n_children(root), 2u);
+	struct flat_cursor main_func = flat_cursor_child(root, 1);
+	tree_dtype main_value = flat_cursor_value(main_func);
+	EXPECT_EQ(((const struct expression_operator *)main_value.ptr)->idx, EXPR_IDX_MAIN);
+	EXPECT_EQ(flat_cursor_child(root, 0).idx, 1u);
+
+	// Operators are stored by index, variables by name id
+	EXPECT_EQ(flat.payloads[main_func.idx], EXPR_IDX_MAIN);
+	for (uint32_t i = 0; i < flat.n_nodes; i++) {
+		tree_dtype value = flat_cursor_value(flat_cursor_at(root, i));
+		if ((value.flags & EXPRESSION_F_OPERATOR) == EXPRESSION_F_VARIABLE) {
+			EXPECT_EQ(flat.payloads[i], (int64_t)value.name_id);
+			EXPECT_STREQ(value.varname, intern_name(&expr.names, value.name_id));
+		}
+	}
+
+	struct flat_tree copy = {};
+	flat_tree_ctor(&copy);
+	ASSERT_EQ(flat_tree_copy(&copy, &flat), DS_OK);
+	flat_tree_dtor(&flat);
+
+	struct tree_node *root_node = NULL;
+	ASSERT_EQ(flat_tree_to_tree(&copy, &expr.tree, &root_node), DS_OK);
+	flat_tree_dtor(&copy);
+
+	tree_subtree_dtor(&expr.tree, expr.tree.root);
+	expr.tree.root = root_node;
+	EXPECT_EQ(parser_stored(&expr, "parser_flat.ast"), text);
+
+	expression_dtor(&expr);
+}
+
+TEST(Parser, ParserHashcons) {
+	struct expression expr = {0};
+	ASSERT_EQ(expression_ctor(&expr), S_OK);
+
+	uint32_t x_id = 0;
+	ASSERT_EQ(intern_string(&expr.names, "x", 1, &x_id), S_OK);
+	const char *x_name = intern_name(&expr.names, x_id);
+
+	// Without hash-consing every node is new
+	struct tree_node *number = expr_cons_number_tnode(&expr, 3);
+	EXPECT_NE(expr_cons_number_tnode(&expr, 3), number);
+
+	ASSERT_EQ(expression_use_hashcons(&expr), S_OK);
+
+	struct tree_node *diff[2] = {};
+	for (size_t i = 0; i < 2; i++) {
+		diff[i] = expr_cons_operator_tnode(&expr, &expr_operator_subtraction,
+						   expr_cons_variable_tnode(&expr, x_name, x_id),
+						   expr_cons_number_tnode(&expr, 3));
+		ASSERT_TRUE(diff[i]);
+	}
+	EXPECT_EQ(diff[0], diff[1]);
+	EXPECT_EQ(diff[0]->left, expr_cons_variable_tnode(&expr, x_name, x_id));
+
+	// Operands in the other order and other operators are other nodes
+	EXPECT_NE(expr_cons_operator_tnode(&expr, &expr_operator_subtraction,
+					   diff[0]->right, diff[0]->left), diff[0]);
+	EXPECT_NE(expr_cons_operator_tnode(&expr, &expr_operator_addition,
+					   diff[0]->left, diff[0]->right), diff[0]);
+
+	// Tables grow without losing nodes
+	std::vector<struct tree_node *> numbers;
+	for (int64_t i = 0; i < 5000; i++) {
+		numbers.push_back(expr_cons_number_tnode(&expr, i));
+	}
+	for (int64_t i = 0; i < 5000; i++) {
+		EXPECT_EQ(expr_cons_number_tnode(&expr, i), numbers[(size_t)i]);
+	}
+	EXPECT_EQ(expr_cons_operator_tnode(&expr, &expr_operator_subtraction,
+					   diff[0]->left, diff[0]->right), diff[0]);
+
+	expr.tree.root = expr_cons_operator_tnode(&expr, &expr_operator_multiplication,
+						  diff[0], diff[1]);
+	EXPECT_EQ(parser_stored(&expr, "parser_hashcons.ast"),
+		  "(* (- (\"x\" nil nil) (3 nil nil)) (- (\"x\" nil nil) (3 nil nil)))");
+
+	expression_dtor(&expr);
+}
+
+struct stream_counts {
+	struct expression_stream_writer *writer;
+	size_t depth;
+	size_t max_depth;
+	size_t n_leaves;
+	size_t n_nil;
+};
+
+static int stream_count_enter(void *ctx, const tree_dtype *value) {
+	struct stream_counts *counts = (struct stream_counts *)ctx;
+	if (++counts->depth > counts->max_depth) {
+		counts->max_depth = counts->depth;
+	}
+	return expression_stream_write_enter(counts->writer, value);
+}
+
+static int stream_count_leaf(void *ctx, const tree_dtype *value) {
+	struct stream_counts *counts = (struct stream_counts *)ctx;
+	counts->n_leaves++;
+	counts->n_nil += !value;
+	return expression_stream_write_leaf(counts->writer, value);
+}
+
+static int stream_count_exit(void *ctx, const tree_dtype *value) {
+	struct stream_counts *counts = (struct stream_counts *)ctx;
+	counts->depth--;
+	return expression_stream_write_exit(counts->writer, value);
+}
+
+static int parser_stream_copy(const char *in_filename, const char *out_filename,
+			      struct stream_counts *counts) {
+	FILE *in = fopen(in_filename, "r");
+	FILE *out = fopen(out_filename, "w");
+	EXPECT_TRUE(in && out);
+
+	struct expression_stream_writer writer = {};
+	EXPECT_EQ(expression_stream_writer_ctor(&writer, out), S_OK);
+
+	*counts = {};
+	counts->writer = &writer;
+	struct expression_stream_events events = {
+		counts, stream_count_enter, stream_count_leaf, stream_count_exit,
+	};
+
+	int ret = expression_stream_read(in, NULL, &events);
+	if (expression_stream_writer_dtor(&writer)) {
+		ret = S_FAIL;
+	}
+
+	fclose(in);
+	fclose(out);
+
+	return ret;
+}
+
+TEST(Parser, ParserStream) {
+	std::string program = "func f(a, b) { return (a - b * 3); }\n";
+	for (int i = 0; i < 500; i++) {
+		program += "func g" + std::to_string(i) + "(x) { while (x > 0) { print(f(x, " +
+			   std::to_string(i) + ")); x = x - 1; } return (input()); }\n";
+	}
+	program += "func main() { print(f(input(), 2)); }\n";
+
+	struct expression expr = {0};
+	ASSERT_EQ(expression_parse_str(program.c_str(), &expr), S_OK);
+	std::string text = parser_stored(&expr, "parser_stream_text.ast");
+	expression_dtor(&expr);
+
+	// Longer than the chunks of the reader
+	ASSERT_GT(text.size(), 64u * 1024);
+	parser_write_file("parser_stream.ast", text);
+
+	struct stream_counts counts = {};
+	ASSERT_EQ(parser_stream_copy("parser_stream.ast", "parser_stream_copy.ast", &counts), S_OK);
+	EXPECT_EQ(counts.depth, 0u);
+	EXPECT_GT(counts.max_depth, 4u);
+	EXPECT_GT(counts.n_nil, 0u);
+
+	char *copy = NULL;
+	size_t copy_len = 0;
+	ASSERT_EQ(read_file("parser_stream_copy.ast", &copy, &copy_len), S_OK);
+	EXPECT_EQ(std::string(copy, copy_len), text);
+	free(copy);
+
+	// Unbalanced text is rejected
+	parser_write_file("parser_stream.ast", text.substr(0, text.size() - 1));
+	EXPECT_EQ(parser_stream_copy("parser_stream.ast", "parser_stream_copy.ast", &counts), S_FAIL);
+
+	parser_write_file("parser_stream.ast", "(+ (1 nil nil) (2 nil nil) (3 nil nil))");
+	EXPECT_EQ(parser_stream_copy("parser_stream.ast", "parser_stream_copy.ast", &counts), S_FAIL);
+
+	unlink("parser_stream.ast");
+	unlink("parser_stream_copy.ast");
+}
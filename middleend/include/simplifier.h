@@ -2,14 +2,42 @@
 #define SIMPLIFIER_H
 
 #include "expression.h"
+#include "expression_image.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-struct tree_node *tnode_simplify(struct expression *expr, struct tree_node *node);
+/**
+ * Folds constants of the image node into a new subtree allocated for
+ * expr->tree, consed if expr uses hash-consing. Names of variables are
+ * taken from expr, which has the name ids of the image. NULL if the image
+ * is invalid.
+ */
+struct tree_node *tnode_simplify(struct expression *expr,
+				 const struct expression_image *image,
+				 const struct expression_image_node *node);
+
+/**
+ * Simplifies the tree of expr, laid out as an image first.
+ */
 int expression_simplify(struct expression *expr, struct expression *simplified);
 
+/**
+ * Walks the image where it lies, a mapped file is simplified without
+ * loading it.
+ */
+int expression_simplify_image(const struct expression_image *image,
+			      struct expression *simplified);
+
+/**
+ * expression_simplify_image() into a hash-consed tree: a subexpression
+ * that repeats is stored once. This costs a table lookup per node and
+ * pays off on repetitive code only.
+ */
+int expression_simplify_image_consed(const struct expression_image *image,
+				     struct expression *simplified);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,33 +1,75 @@
 #include <stdio.h>
+#include <string.h>
 #include "expression.h"
 #include "simplifier.h"
 
+/*
+ * Images are simplified where they are mapped, other formats are loaded
+ * and laid out as an image.
+ */
+static int load_input(const char *input_file, enum expression_format format,
+		      struct expression_image *image) {
+	if (format == EXPRESSION_FORMAT_IMAGE) {
+		return expression_image_map(image, input_file);
+	}
+
+	struct expression input_expr = {0};
+	if (format == EXPRESSION_FORMAT_BINARY ? expression_load_binary(&input_expr, input_file) :
+						 expression_load(&input_expr, input_file)) {
+		return S_FAIL;
+	}
+
+	int ret = expression_image_build(&input_expr, image);
+	expression_dtor(&input_expr);
+
+	return ret;
+}
+
+static int store_output(struct expression *expr, const char *output_file,
+			enum expression_format format) {
+	switch (format) {
+	case EXPRESSION_FORMAT_BINARY:
+		return expression_store_binary(expr, output_file);
+	case EXPRESSION_FORMAT_IMAGE:
+		return expression_store_image(expr, output_file);
+	case EXPRESSION_FORMAT_TEXT:
+	default:
+		return expression_store(expr, output_file);
+	}
+}
+
 int main(int argc, char *argv[]) {
-	if (argc != 3) {
-		eprintf("Usage: %s <input_file> <output_file>\n", argv[0]);
+	// -c stores repeated subexpressions of the simplified tree once
+	int hashcons = argc == 4 && !strcmp(argv[1], "-c");
+	if (argc != 3 + hashcons) {
+		eprintf("Usage: %s [-c] <input_file> <output_file>\n", argv[0]);
 		return 1;
 	}
 
-	const char *input_file = argv[1];
-	const char *output_file = argv[2];
+	const char *input_file = argv[1 + hashcons];
+	const char *output_file = argv[2 + hashcons];
 
-	struct expression input_expr = {0};
+	struct expression_image input_image = {0};
 	struct expression simplified_expr = {0};
 
-	if (expression_load(&input_expr, input_file)) {
+	// The output is written in the format of the input
+	enum expression_format format = EXPRESSION_FORMAT_TEXT;
+	if (expression_file_format(input_file, &format) ||
+		load_input(input_file, format, &input_image)) {
 		log_error("Failed to load expression from file %s", input_file);
 		return 1;
 	}
 
-	if (expression_simplify(&input_expr, &simplified_expr)) {
+	if (hashcons ? expression_simplify_image_consed(&input_image, &simplified_expr) :
+		       expression_simplify_image(&input_image, &simplified_expr)) {
 		log_error("Failed to simplify expression");
-		expression_dtor(&input_expr);
+		expression_image_dtor(&input_image);
 		return 1;
 	}
 
-	if (expression_store(&simplified_expr, output_file)) {
+	if (store_output(&simplified_expr, output_file, format)) {
 		log_error("Failed to store simplified expression to file %s", output_file);
-		expression_dtor(&input_expr);
+		expression_image_dtor(&input_image);
 		expression_dtor(&simplified_expr);
 		return 1;
 	}
@@ -51,7 +93,7 @@ int main(int argc, char *argv[]) {
 	fclose(dump_file);
 	*/
 
-	expression_dtor(&input_expr);
+	expression_image_dtor(&input_image);
 	expression_dtor(&simplified_expr);
 
 	return 0;
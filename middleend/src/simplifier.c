@@ -3,6 +3,8 @@
 #include <string.h>
 #include "tree.h"
 #include "expression.h"
+#include "expression_image.h"
+#include "simplifier.h"
 
 static int64_t fastpow(int64_t num, int64_t deg) {
 	if (num == 1) {
@@ -26,104 +28,83 @@ static int64_t fastpow(int64_t num, int64_t deg) {
 	return nnum;
 }
 
-struct tree_node *tnode_simplify(struct expression *expr, struct tree_node *node) {
-
-	if (!node) {
-		return NULL;
-	}
-
-	if (EXPR_TNODE_IS_NUMBER(node) || EXPR_TNODE_IS_VARIABLE(node)) {
-		return expr_copy_tnode(expr, node);
-	}
-
-	struct expression_operator *op = node->value.ptr;
+/*
+ * Folds an operator of two numbers, NULL if it cannot be folded.
+ */
+static struct tree_node *tnode_fold(struct expression *expr,
+				    const struct expression_operator *op,
+				    struct tree_node *lnode, struct tree_node *rnode) {
+	assert (expr);
+	assert (op);
+	assert (lnode);
+	assert (rnode);
 
-	struct tree_node *lnode = NULL, *rnode = NULL;
-	if (node->left) {
-		lnode = tnode_simplify(expr, node->left);
-		if (!lnode) {
+	switch ((int)op->idx) {
+		case EXPR_IDX_MULTIPLY:
+			return expr_cons_number_tnode(expr,
+				lnode->value.snum * rnode->value.snum);
+		case EXPR_IDX_PLUS:
+			return expr_cons_number_tnode(expr,
+				lnode->value.snum + rnode->value.snum);
+		case EXPR_IDX_MINUS:
+			return expr_cons_number_tnode(expr,
+				lnode->value.snum - rnode->value.snum);
+		case EXPR_IDX_DIVIDE:
+			if (rnode->value.snum == 0) {
+				eprintf("WARNING: Possible division by zero.\n");
+				return NULL;
+			}
+			return expr_cons_number_tnode(expr,
+				lnode->value.snum / rnode->value.snum);
+		case EXPR_IDX_POW:
+			return expr_cons_number_tnode(expr, fastpow(
+				lnode->value.snum, rnode->value.snum));
+		case EXPR_IDX_LESS_CMP:
+			return expr_cons_number_tnode(expr,
+				lnode->value.snum < rnode->value.snum);
+		case EXPR_IDX_GREATER_CMP:
+			return expr_cons_number_tnode(expr,
+				lnode->value.snum > rnode->value.snum);
+		case EXPR_IDX_EQUALS_CMP:
+			return expr_cons_number_tnode(expr,
+				lnode->value.snum == rnode->value.snum);
+		case EXPR_IDX_LESS_EQ_CMP:
+			return expr_cons_number_tnode(expr,
+				lnode->value.snum <= rnode->value.snum);
+		case EXPR_IDX_GREATER_EQ_CMP:
+			return expr_cons_number_tnode(expr,
+				lnode->value.snum >= rnode->value.snum);
+		case EXPR_IDX_NOT_EQUALS_CMP:
+			return expr_cons_number_tnode(expr,
+				lnode->value.snum != rnode->value.snum);
+		default:
 			return NULL;
-		}
 	}
-	if (node->right) {
-		rnode = tnode_simplify(expr, node->right);
-	
-		if (!rnode) {
-			if (lnode) tnode_recursive_dtor(lnode, NULL);
+}
 
-			return NULL;
-		}
-	}
+static struct tree_node *tnode_simplify_operator(struct expression *expr,
+						 const struct expression_operator *op,
+						 struct tree_node *lnode,
+						 struct tree_node *rnode) {
+	assert (expr);
+	assert (op);
 
 	if (lnode && rnode &&
 		EXPR_TNODE_IS_NUMBER(lnode) && EXPR_TNODE_IS_NUMBER(rnode)) {
-		struct tree_node *nnode = NULL;
-
-		switch ((int)op->idx) {
-			case EXPR_IDX_MULTIPLY:
-				nnode = expr_create_number_tnode(
-					lnode->value.snum * rnode->value.snum);
-				break;
-			case EXPR_IDX_PLUS:
-				nnode = expr_create_number_tnode(
-					lnode->value.snum + rnode->value.snum);
-				break;
-			case EXPR_IDX_MINUS:
-				nnode = expr_create_number_tnode(
-					lnode->value.snum - rnode->value.snum);
-				break;
-			case EXPR_IDX_DIVIDE:
-				if (rnode->value.snum == 0) {
-					eprintf("WARNING: Possible division by zero.\n");
-					break;
-				}
-				nnode = expr_create_number_tnode(
-					lnode->value.snum / rnode->value.snum);
-				break;
-			case EXPR_IDX_POW:
-				nnode = expr_create_number_tnode(fastpow(
-					lnode->value.snum, rnode->value.snum));
-				break;
-			case EXPR_IDX_LESS_CMP:
-				nnode = expr_create_number_tnode(
-					lnode->value.snum < rnode->value.snum);
-				break;
-			case EXPR_IDX_GREATER_CMP:
-				nnode = expr_create_number_tnode(
-					lnode->value.snum > rnode->value.snum);
-				break;
-			case EXPR_IDX_EQUALS_CMP:
-				nnode = expr_create_number_tnode(
-					lnode->value.snum == rnode->value.snum);
-				break;
-			case EXPR_IDX_LESS_EQ_CMP:
-				nnode = expr_create_number_tnode(
-					lnode->value.snum <= rnode->value.snum);
-				break;
-			case EXPR_IDX_GREATER_EQ_CMP:
-				nnode = expr_create_number_tnode(
-					lnode->value.snum >= rnode->value.snum);
-				break;
-			case EXPR_IDX_NOT_EQUALS_CMP:
-				nnode = expr_create_number_tnode(
-					lnode->value.snum != rnode->value.snum);
-				break;
-			default:
-				break;
-		}
+		struct tree_node *nnode = tnode_fold(expr, op, lnode, rnode);
 
 		if (nnode) {
-			if (lnode) tnode_recursive_dtor(lnode, NULL);
-			if (rnode) tnode_recursive_dtor(rnode, NULL);
+			tree_subtree_dtor(&expr->tree, lnode);
+			tree_subtree_dtor(&expr->tree, rnode);
 
 			return nnode;
 		}
 	}
-	
-	struct tree_node *new_node = expr_create_operator_tnode(op, lnode, rnode);
+
+	struct tree_node *new_node = expr_cons_operator_tnode(expr, op, lnode, rnode);
 	if (!new_node) {
-		if (lnode) tnode_recursive_dtor(lnode, NULL);
-		if (rnode) tnode_recursive_dtor(rnode, NULL);
+		if (lnode) tree_subtree_dtor(&expr->tree, lnode);
+		if (rnode) tree_subtree_dtor(&expr->tree, rnode);
 
 		return NULL;
 	}
@@ -131,17 +112,181 @@ struct tree_node *tnode_simplify(struct expression *expr, struct tree_node *node
 	return new_node;
 }
 
-int expression_simplify(struct expression *expr, struct expression *simplified) {
+/*
+ * Takes the simplified children of the sequence node off results, the last
+ * child is on top.
+ */
+static struct tree_node *tnode_simplify_sequence(struct expression *expr,
+						 const struct expression_image *image,
+						 const struct expression_image_node *node,
+						 struct tree_stack *results) {
 	assert (expr);
+	assert (image);
+	assert (node);
+	assert (results);
+
+	size_t n_children = expr_image_n_children(node);
+	struct tree_node *new_node = expr_create_sequence_tnode(expr, expr_image_op(node),
+								NULL, n_children);
+
+	for (size_t i = n_children; i-- > 0;) {
+		if (!expr_image_child(image, node, i)) {
+			continue;
+		}
+
+		struct tree_node **child = tree_stack_pop(results);
+		if (new_node) {
+			new_node->children[i] = *child;
+		} else {
+			tree_subtree_dtor(&expr->tree, *child);
+		}
+	}
+
+	return new_node;
+}
+
+/*
+ * Variables take their names from expr. Invalid nodes of the image give
+ * NULL.
+ */
+static struct tree_node *tnode_simplify_leaf(struct expression *expr,
+					     const struct expression_image_node *node) {
+	assert (expr);
+	assert (node);
+
+	if (EXPR_INODE_IS_INVALID(node)) {
+		return NULL;
+	}
+
+	if (EXPR_INODE_IS_NUMBER(node)) {
+		return expr_cons_number_tnode(expr, node->snum);
+	}
+
+	return expr_cons_variable_tnode(expr, intern_name(&expr->names, node->arg), node->arg);
+}
+
+struct simplify_frame {
+	const struct expression_image_node *node;
+	// Children are simplified, their results are on top of the results
+	int children_done;
+};
+
+/*
+ * Postorder over an explicit stack: simplified children are kept on a
+ * stack of results until their operator is simplified.
+ */
+struct tree_node *tnode_simplify(struct expression *expr,
+				 const struct expression_image *image,
+				 const struct expression_image_node *node) {
+	assert (expr);
+	assert (image);
+
+	if (!node) {
+		return NULL;
+	}
+
+	struct tree_stack stack = {0};
+	struct tree_stack results = {0};
+	tree_stack_ctor(&stack, sizeof(struct simplify_frame));
+	tree_stack_ctor(&results, sizeof(struct tree_node *));
+
+	struct simplify_frame *frame = tree_stack_push(&stack);
+	int ret = frame ? S_OK : S_FAIL;
+	if (frame) {
+		*frame = (struct simplify_frame) {.node = node, .children_done = 0};
+	}
+
+	while (!ret && (frame = tree_stack_top(&stack))) {
+		const struct expression_image_node *cur = frame->node;
+		struct tree_node *simplified = NULL;
+
+		if (!EXPR_INODE_IS_OPERATOR(cur)) {
+			tree_stack_pop(&stack);
+			simplified = tnode_simplify_leaf(expr, cur);
+		} else if (!frame->children_done) {
+			frame->children_done = 1;
+
+			// The first child is simplified first
+			int is_sequence = EXPR_INODE_IS_SEQUENCE(cur);
+			size_t n_children = is_sequence ? expr_image_n_children(cur) : 2;
+			for (size_t i = n_children; i-- > 0 && !ret;) {
+				const struct expression_image_node *child_node =
+					is_sequence ? expr_image_child(image, cur, i) :
+					i ? expr_image_right(image, cur) : expr_image_left(image, cur);
+				if (!child_node) {
+					continue;
+				}
+
+				struct simplify_frame *child = tree_stack_push(&stack);
+				if (!child) {
+					ret = S_FAIL;
+					break;
+				}
+				*child = (struct simplify_frame) {.node = child_node};
+			}
+			continue;
+		} else if (EXPR_INODE_IS_SEQUENCE(cur)) {
+			tree_stack_pop(&stack);
+
+			simplified = tnode_simplify_sequence(expr, image, cur, &results);
+		} else {
+			tree_stack_pop(&stack);
+
+			struct tree_node **rnode = expr_image_right(image, cur) ? tree_stack_pop(&results) : NULL;
+			struct tree_node *right = rnode ? *rnode : NULL;
+			struct tree_node **lnode = expr_image_left(image, cur) ? tree_stack_pop(&results) : NULL;
+			struct tree_node *left = lnode ? *lnode : NULL;
+
+			simplified = tnode_simplify_operator(expr, expr_image_op(cur), left, right);
+		}
+
+		struct tree_node **result = simplified ? tree_stack_push(&results) : NULL;
+		if (!result) {
+			if (simplified) tree_subtree_dtor(&expr->tree, simplified);
+			ret = S_FAIL;
+			break;
+		}
+		*result = simplified;
+	}
+
+	struct tree_node *simplified_root = NULL;
+	if (!ret) {
+		assert (results.len == 1);
+		simplified_root = *(struct tree_node **)tree_stack_pop(&results);
+	}
+
+	struct tree_node **result = NULL;
+	while ((result = tree_stack_pop(&results))) {
+		tree_subtree_dtor(&expr->tree, *result);
+	}
+
+	tree_stack_dtor(&stack);
+	tree_stack_dtor(&results);
+
+	return simplified_root;
+}
+
+static int simplify_image(const struct expression_image *image,
+			  struct expression *simplified, int hashcons) {
+	assert (image);
 	assert (simplified);
 
-	struct tree_node *simplified_root = tnode_simplify(expr, expr->tree.root);
-	if (!simplified_root && expr->tree.root) {
+	if (expression_ctor(simplified)) {
 		return S_FAIL;
 	}
 
-	if (expression_ctor(simplified)) {
-		tnode_recursive_dtor(simplified_root, NULL);
+	if ((hashcons && expression_use_hashcons(simplified)) ||
+		expression_image_intern_names(image, &simplified->names)) {
+		expression_dtor(simplified);
+		return S_FAIL;
+	}
+
+	const struct expression_image_node *root = expr_image_root(image);
+
+	// The simplified nodes are allocated in the arena of simplified
+	struct tree_node *simplified_root = tnode_simplify(simplified, image, root);
+	if (!simplified_root && root) {
+		expression_dtor(simplified);
 		return S_FAIL;
 	}
 
@@ -149,3 +294,29 @@ int expression_simplify(struct expression *expr, struct expression *simplified)
 
 	return S_OK;
 }
+
+int expression_simplify_image(const struct expression_image *image,
+			      struct expression *simplified) {
+	return simplify_image(image, simplified, 0);
+}
+
+int expression_simplify_image_consed(const struct expression_image *image,
+				     struct expression *simplified) {
+	return simplify_image(image, simplified, 1);
+}
+
+int expression_simplify(struct expression *expr, struct expression *simplified) {
+	assert (expr);
+	assert (simplified);
+
+	struct expression_image image = {0};
+	if (expression_image_build(expr, &image)) {
+		return S_FAIL;
+	}
+
+	int ret = expression_simplify_image(&image, simplified);
+
+	expression_image_dtor(&image);
+
+	return ret;
+}
@@ -3,33 +3,160 @@
 
 #include "pvector.h"
 #include "tree.h"
+#include "intern.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 struct expression_variable {
-	char *var_name;
+	const char *var_name;
+	uint32_t name_id;
 	size_t var_pointer;
 };
 
 struct expression {
 	struct tree tree;
+	// Owns the strings of all variable names
+	struct intern_table names;
 	// vector of expression_variable
 	struct pvector variables;
+	/*
+	 * Index of variables by name id: open addressing, stores the index
+	 * + 1; 0 marks an empty slot. Allocated by the first push.
+	 */
+	uint32_t *var_slots;
+	size_t n_var_slots;
+	/*
+	 * Hash-consed nodes, see expression_use_hashcons(): open addressing,
+	 * NULL marks an empty slot. Off while n_cons_slots is 0.
+	 */
+	struct tree_node **cons_slots;
+	size_t n_cons_slots;
+	size_t n_consed;
 };
 
 int expression_ctor(struct expression *expr);
 int expression_dtor(struct expression *expr);
 
+/**
+ * Variables are looked up by name id in O(1). Pointers returned by both
+ * stay valid until the next push.
+ */
 struct expression_variable *expr_find_variable(struct expression *expr,
-						      const char *varname);
-int expr_push_variable(struct expression *expr, const char *varname,
+						      uint32_t name_id);
+int expr_push_variable(struct expression *expr, uint32_t name_id,
 			       struct expression_variable **nvar);
 
+/**
+ * Frees the variables and their index.
+ */
+void expr_variables_dtor(struct expression *expr);
+
 int expression_load(struct expression *expr, const char *filename);
 int expression_store(struct expression *expr, const char *filename);
 
+/**
+ * Writes the tree of expr as .ast text, the text is formatted in memory
+ * and written with fwrite() in large blocks.
+ */
+int expression_write_text(struct expression *expr, FILE *file);
+
+/**
+ * Reads the .ast text [text, text + len) into the tree of the constructed
+ * expr in a single pass. Nodes read before an error stay in the arena.
+ */
+int expression_read_text(struct expression *expr, const char *text, size_t len);
+
+/*
+ * Streaming .ast text: a tree as events in preorder, with no tree built.
+ * Operators are entered, their children follow, then they are exited;
+ * numbers and variables are leaves and have no children. An absent child is a leaf with a NULL
+ * value. Memory is proportional to the depth of the tree.
+ *
+ * Values passed to the events are valid during the call only. A nonzero
+ * return of an event stops reading.
+ */
+struct expression_stream_events {
+	void *ctx;
+	// Sequences have TREE_F_SEQUENCE set in value->flags
+	int (*enter)(void *ctx, const tree_dtype *value);
+	int (*leaf)(void *ctx, const tree_dtype *value);
+	// value is the one of the matching enter
+	int (*exit)(void *ctx, const tree_dtype *value);
+};
+
+/**
+ * Reads .ast text from file in chunks and emits its events. Variables get
+ * name ids of names if it is set, otherwise INTERN_ID_NONE.
+ */
+int expression_stream_read(FILE *file, struct intern_table *names,
+			   const struct expression_stream_events *events);
+
+// Buffered output of the text codec
+struct expr_text_writer {
+	FILE *file;
+	char *buf;
+	size_t len;
+	int error;
+};
+
+struct expression_stream_writer {
+	struct expr_text_writer out;
+
+	// Nodes entered and not exited
+	struct tree_stack open;
+};
+
+int expression_stream_writer_ctor(struct expression_stream_writer *writer, FILE *file);
+
+/**
+ * Flushes the text, S_FAIL if a write failed or a node was left open.
+ */
+int expression_stream_writer_dtor(struct expression_stream_writer *writer);
+
+/*
+ * Events of the writer, ctx is the writer: the events of
+ * expression_stream_read() write the same text back.
+ */
+int expression_stream_write_enter(void *writer, const tree_dtype *value);
+int expression_stream_write_leaf(void *writer, const tree_dtype *value);
+int expression_stream_write_exit(void *writer, const tree_dtype *value);
+
+/*
+ * Binary .ast, versioned by the byte after the magic:
+ *
+ *	magic, version
+ *	varint n_names, then per name a varint length and its bytes; the
+ *	index of a name is the payload of its variables
+ *	varint n_nodes
+ *	varint bitmap size, then the bitmap: a bit per child slot of every
+ *	node in preorder (left and right, or each child of a sequence),
+ *	least significant first, set for present children
+ *	nodes in preorder: a tag byte and its payload
+ *
+ * Tags are 0 for numbers (zigzag varint), 1 for variables (varint name
+ * index) and 2 + operator index for operators; sequences set 0x80 in the
+ * operator tag and are followed by a varint number of children.
+ */
+#define EXPRESSION_BINARY_MAGIC "\x7f" "AST"
+#define EXPRESSION_BINARY_VERSION (1)
+
+enum expression_format {
+	EXPRESSION_FORMAT_TEXT,
+	EXPRESSION_FORMAT_BINARY,
+	// See expression_image.h
+	EXPRESSION_FORMAT_IMAGE,
+};
+
+int expression_load_binary(struct expression *expr, const char *filename);
+int expression_store_binary(struct expression *expr, const char *filename);
+
+/**
+ * Format of a .ast file by its magic number, text if it has none.
+ */
+int expression_file_format(const char *filename, enum expression_format *format);
+
 
 // Update the operators array with derivative functions
 // extern const struct expression_operator expression_operators[];
@@ -125,8 +252,8 @@ DECLARE_EXPERSSION_OP(EXPR_IDX_GREATER_EQ_CMP,	greater_eq_cmp,	">=", 4, EXPR_OP_
 DECLARE_EXPERSSION_OP(EXPR_IDX_LESS_EQ_CMP,	less_eq_cmp,	"<=", 4, EXPR_OP_T_BINARY);
 DECLARE_EXPERSSION_OP(EXPR_IDX_SHL,		shl,		"<<", 4, EXPR_OP_T_BINARY);
 DECLARE_EXPERSSION_OP(EXPR_IDX_SHR,		shr,		">>", 4, EXPR_OP_T_BINARY);
-DECLARE_EXPERSSION_OP(EXPR_IDX_BITAND,		bitand,		"&",  3, EXPR_OP_T_BINARY);
-DECLARE_EXPERSSION_OP(EXPR_IDX_BITOR,		bitor,		"|",  3, EXPR_OP_T_BINARY);
+DECLARE_EXPERSSION_OP(EXPR_IDX_BITAND,		bitand,		"&",  4, EXPR_OP_T_BINARY);
+DECLARE_EXPERSSION_OP(EXPR_IDX_BITOR,		bitor,		"|",  4, EXPR_OP_T_BINARY);
 DECLARE_EXPERSSION_OP(EXPR_IDX_PLUS,		addition,	"+",  3, EXPR_OP_T_BINARY);
 DECLARE_EXPERSSION_OP(EXPR_IDX_MINUS,		subtraction,	"-",  3, EXPR_OP_T_BINARY);
 DECLARE_EXPERSSION_OP(EXPR_IDX_MULTIPLY,	multiplication, "*",  2, EXPR_OP_T_BINARY);
@@ -179,6 +306,12 @@ static const struct expression_operator *const expression_operators[] = {
 
 #undef REGISTER_EXPRESSION_OP
 
+// Operators are shared and read only, they are stored through cptr
+static inline void expr_value_set_operator(tree_dtype *value,
+					   const struct expression_operator *op) {
+	value->cptr = op;
+}
+
 /**
  * implements value_deserializer
  */
@@ -189,19 +322,70 @@ DSError_t expression_deserializer(tree_dtype *value, char *str, void *ctx);
  */
 DSError_t expression_serializer(tree_dtype value, FILE *out_stream, void *ctx);
 
-struct tree_node *expr_create_number_tnode(int64_t snum);
-struct tree_node *expr_create_variable_tnode(const char *varname);
-struct tree_node *expr_create_operator_tnode(const struct expression_operator *op, 
-                                              struct tree_node *left, 
-                                              struct tree_node *right);
+/*
+ * Nodes are allocated for expr->tree, from its arena. Subtrees not attached
+ * to the tree are released with tree_subtree_dtor(&expr->tree, ...).
+ */
+struct tree_node *expr_create_number_tnode(struct expression *expr, int64_t snum);
+struct tree_node *expr_create_variable_tnode(struct expression *expr,
+					     const char *varname, uint32_t name_id);
+struct tree_node *expr_create_operator_tnode(struct expression *expr,
+					     const struct expression_operator *op,
+					     struct tree_node *left,
+					     struct tree_node *right);
+/*
+ * Statement lists (';') and argument lists (',') of two or more elements
+ * are sequence nodes: an operator node holding its elements in an array.
+ * The sequence starts with a copy of children, or with n_children NULL
+ * elements if children is NULL.
+ */
+struct tree_node *expr_create_sequence_tnode(struct expression *expr,
+					     const struct expression_operator *op,
+					     struct tree_node *const *children,
+					     size_t n_children);
+int expr_sequence_push(struct expression *expr, struct tree_node *seq,
+		       struct tree_node *child);
+
+/**
+ * Deep copy of original allocated for expr->tree.
+ */
 struct tree_node *expr_copy_tnode(struct expression *expr, struct tree_node *original);
 
+/**
+ * Makes expr_cons_*() return the node made before for the same value and
+ * children, so that a repeated subtree is stored once and equal consed
+ * subtrees are the same pointer. The tree of expr becomes a DAG: consed
+ * nodes are owned by its arena and must not be changed.
+ */
+int expression_use_hashcons(struct expression *expr);
+
+/*
+ * Hash-consed expr_create_*_tnode(), the children of an operator must be
+ * consed themselves. Without expression_use_hashcons() every call makes a
+ * new node. Sequences are not consed, they are grown in place.
+ */
+struct tree_node *expr_cons_number_tnode(struct expression *expr, int64_t snum);
+struct tree_node *expr_cons_variable_tnode(struct expression *expr,
+					   const char *varname, uint32_t name_id);
+struct tree_node *expr_cons_operator_tnode(struct expression *expr,
+					   const struct expression_operator *op,
+					   struct tree_node *left,
+					   struct tree_node *right);
+
+/**
+ * Flat tree codec of the nodes of expr: operators are packed as their
+ * index in expression_operators[], variables as their name id.
+ */
+void expression_flat_codec(struct expression *expr, struct flat_tree_codec *codec);
+
 #define EXPR_TNODE_IS_NUMBER(node) ((node->value.flags & EXPRESSION_F_OPERATOR) \
 						== EXPRESSION_F_NUMBER)
 #define EXPR_TNODE_IS_VARIABLE(node) ((node->value.flags & EXPRESSION_F_OPERATOR) \
 						== EXPRESSION_F_VARIABLE)
 #define EXPR_TNODE_IS_OPERATOR(node) ((node->value.flags & EXPRESSION_F_OPERATOR) \
 						== EXPRESSION_F_OPERATOR)
+#define EXPR_TNODE_IS_SEQUENCE(node) (EXPR_TNODE_IS_OPERATOR(node) && \
+						TNODE_IS_SEQUENCE(node))
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,237 @@
+#ifndef EXPRESSION_IMAGE_H
+#define EXPRESSION_IMAGE_H
+
+#include <assert.h>
+
+#include "expression.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * AST image: a tree laid out so that it is walked where it lies, in a
+ * mapped file or a buffer, without a node being allocated or parsed.
+ *
+ *	header
+ *	nodes, fixed records in preorder
+ *	child offset arrays of the sequences
+ *	offsets of the names, then the NUL-terminated names
+ *
+ * Nodes are linked by byte offsets relative to the node, so the image is
+ * position independent. Offsets are 32-bit, images are below 2 GiB.
+ */
+
+#define EXPRESSION_IMAGE_MAGIC "\x7f" "ASI"
+#define EXPRESSION_IMAGE_VERSION (1)
+
+struct expression_image_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t n_nodes;
+	uint32_t n_names;
+	// Offsets from the start of the image, root is 0 for an empty tree
+	uint32_t root;
+	uint32_t names;
+	uint64_t size;
+};
+
+struct expression_image_node {
+	// EXPRESSION_F_* and TREE_F_SEQUENCE
+	uint32_t flags;
+	// Operator index, name id of variables
+	uint32_t arg;
+
+	union {
+		// Offsets of the children from the node, 0 for none
+		struct {
+			int32_t left;
+			int32_t right;
+		};
+		// TREE_F_SEQUENCE nodes: offset of an int32_t array of child offsets
+		struct {
+			uint32_t n_children;
+			int32_t children;
+		};
+		int64_t snum;
+	};
+};
+
+struct expression_image {
+	const char *base;
+	size_t size;
+	// Mapping of the file or an owned buffer that base points to
+	void *map;
+	char *buf;
+};
+
+/**
+ * Lays the tree of expr out as an image in memory.
+ */
+int expression_image_build(struct expression *expr, struct expression_image *image);
+int expression_store_image(struct expression *expr, const char *filename);
+
+/**
+ * Maps the image file read-only. The header and the names are checked,
+ * the nodes are checked by the accessors when they are reached: this
+ * takes the same time for any tree size.
+ */
+int expression_image_map(struct expression_image *image, const char *filename);
+void expression_image_dtor(struct expression_image *image);
+
+/**
+ * Interns the names of the image into the empty table names, name ids
+ * of the image stay the same.
+ */
+int expression_image_intern_names(const struct expression_image *image,
+				  struct intern_table *names);
+
+/**
+ * Loads the image into the tree of the unconstructed expr.
+ */
+int expression_image_to_tree(const struct expression_image *image,
+			     struct expression *expr);
+
+/*
+ * Read-only accessors. Mapping checks the header only, nodes are checked
+ * as they are reached: a link to a node that is out of the node records,
+ * points backwards, or holds an unknown kind, operator, name or children
+ * array leads to expression_image_invalid_node. Its flags match no kind,
+ * walks report it as an invalid tree. Nodes returned otherwise are safe
+ * to read with the accessors below.
+ */
+
+#define EXPR_IMAGE_N_OPERATORS (sizeof(expression_operators) / sizeof(*expression_operators) - 1)
+
+extern const struct expression_image_node expression_image_invalid_node;
+
+#define EXPR_INODE_IS_INVALID(node) ((node) == &expression_image_invalid_node)
+
+#define EXPR_INODE_IS_NUMBER(node) (((node)->flags & EXPRESSION_F_OPERATOR) \
+						== EXPRESSION_F_NUMBER)
+#define EXPR_INODE_IS_VARIABLE(node) (((node)->flags & EXPRESSION_F_OPERATOR) \
+						== EXPRESSION_F_VARIABLE)
+#define EXPR_INODE_IS_OPERATOR(node) (((node)->flags & EXPRESSION_F_OPERATOR) \
+						== EXPRESSION_F_OPERATOR)
+#define EXPR_INODE_IS_SEQUENCE(node) (EXPR_INODE_IS_OPERATOR(node) && \
+						((node)->flags & TREE_F_SEQUENCE))
+
+static inline const struct expression_image_header *
+expr_image_header(const struct expression_image *image) {
+	return (const struct expression_image_header *)image->base;
+}
+
+static inline uint32_t expr_image_n_names(const struct expression_image *image) {
+	return expr_image_header(image)->n_names;
+}
+
+/*
+ * The node offset bytes from from, NULL for 0. Links only point forward,
+ * children are placed after their parents, so a walk always ends.
+ */
+static inline const struct expression_image_node *
+expr_image_at(const struct expression_image *image, const void *from, int32_t offset) {
+	if (!offset) {
+		return NULL;
+	}
+
+	const struct expression_image_header *header = expr_image_header(image);
+	const struct expression_image_node *invalid = &expression_image_invalid_node;
+
+	size_t nodes = sizeof(*header);
+	size_t nodes_end = nodes + (size_t)header->n_nodes * sizeof(struct expression_image_node);
+	size_t from_off = (size_t)((const char *)from - image->base);
+
+	if (offset < 0 || (size_t)offset > nodes_end - from_off) {
+		return invalid;
+	}
+
+	size_t node_off = from_off + (size_t)offset;
+	if (node_off < nodes || node_off >= nodes_end ||
+		(node_off - nodes) % sizeof(struct expression_image_node)) {
+		return invalid;
+	}
+
+	const struct expression_image_node *node =
+		(const struct expression_image_node *)(image->base + node_off);
+
+	switch (node->flags) {
+	case EXPRESSION_F_NUMBER:
+		return node;
+	case EXPRESSION_F_VARIABLE:
+		return node->arg < header->n_names ? node : invalid;
+	case EXPRESSION_F_OPERATOR:
+		return node->arg < EXPR_IMAGE_N_OPERATORS ? node : invalid;
+	case EXPRESSION_F_OPERATOR | TREE_F_SEQUENCE: {
+		if (node->arg >= EXPR_IMAGE_N_OPERATORS || node->children < 0 ||
+			(size_t)node->children > image->size - node_off) {
+			return invalid;
+		}
+
+		size_t children_off = node_off + (size_t)node->children;
+		if (children_off % sizeof(int32_t) ||
+			node->n_children > (image->size - children_off) / sizeof(int32_t)) {
+			return invalid;
+		}
+
+		return node;
+	}
+	default:
+		return invalid;
+	}
+}
+
+static inline const struct expression_image_node *
+expr_image_root(const struct expression_image *image) {
+	return expr_image_at(image, image->base, (int32_t)expr_image_header(image)->root);
+}
+
+static inline const char *expr_image_name(const struct expression_image *image,
+					  uint32_t name_id) {
+	const struct expression_image_header *header = expr_image_header(image);
+	assert (name_id < header->n_names);
+
+	const uint32_t *names = (const uint32_t *)(image->base + header->names);
+	return image->base + names[name_id];
+}
+
+static inline const struct expression_operator *
+expr_image_op(const struct expression_image_node *node) {
+	assert (EXPR_INODE_IS_OPERATOR(node));
+	return expression_operators[node->arg];
+}
+
+static inline const struct expression_image_node *
+expr_image_left(const struct expression_image *image,
+		const struct expression_image_node *node) {
+	assert (!(node->flags & TREE_F_SEQUENCE));
+	return EXPR_INODE_IS_OPERATOR(node) ? expr_image_at(image, node, node->left) : NULL;
+}
+
+static inline const struct expression_image_node *
+expr_image_right(const struct expression_image *image,
+		 const struct expression_image_node *node) {
+	assert (!(node->flags & TREE_F_SEQUENCE));
+	return EXPR_INODE_IS_OPERATOR(node) ? expr_image_at(image, node, node->right) : NULL;
+}
+
+static inline size_t expr_image_n_children(const struct expression_image_node *node) {
+	assert (node->flags & TREE_F_SEQUENCE);
+	return node->n_children;
+}
+
+static inline const struct expression_image_node *
+expr_image_child(const struct expression_image *image,
+		 const struct expression_image_node *node, size_t idx) {
+	assert (node->flags & TREE_F_SEQUENCE);
+	assert (idx < node->n_children);
+
+	const int32_t *children = (const int32_t *)((const char *)node + node->children);
+	return expr_image_at(image, node, children[idx]);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* EXPRESSION_IMAGE_H */
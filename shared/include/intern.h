@@ -0,0 +1,68 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Identifier interning: every distinct name gets a dense 32-bit id in
+ * order of its first appearance. Name strings are stored once and never
+ * move, so pointers returned by intern_name() stay valid until
+ * intern_dtor().
+ */
+
+#define INTERN_ID_NONE (UINT32_MAX)
+
+struct intern_chunk;
+
+struct intern_table {
+	// id -> NUL-terminated name
+	const char **names;
+	uint32_t *name_lens;
+	uint32_t *name_hashes;
+	size_t n_names;
+	size_t names_cap;
+
+	// Open addressing, stores id + 1; 0 marks an empty slot
+	uint32_t *slots;
+	size_t n_slots;
+
+	struct intern_chunk *chunks;
+};
+
+int intern_ctor(struct intern_table *tbl);
+int intern_dtor(struct intern_table *tbl);
+
+/**
+ * Clones src into the unconstructed dst. Ids are preserved.
+ */
+int intern_clone(struct intern_table *dst, const struct intern_table *src);
+
+/**
+ * Returns the id of str[0..len), adding it if it is new.
+ */
+int intern_string(struct intern_table *tbl, const char *str, size_t len,
+		  uint32_t *id);
+
+/**
+ * Returns the id of str[0..len) or INTERN_ID_NONE.
+ */
+uint32_t intern_find(const struct intern_table *tbl, const char *str, size_t len);
+
+static inline const char *intern_name(const struct intern_table *tbl, uint32_t id) {
+	if (id >= tbl->n_names) {
+		return NULL;
+	}
+
+	return tbl->names[id];
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* INTERN_H */
@@ -0,0 +1,85 @@
+#ifndef LANG_NAMES_H
+#define LANG_NAMES_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "expression.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Reserved words of the source language and operator names of the .ast
+ * format share one perfect-hash table. Every operator of
+ * expression_operators[] is a name, reserved words are listed in
+ * LANG_KEYWORDS_LIST below. The table is generated from both by
+ * tools/gen_lang_names.c when the shared library is built.
+ */
+
+enum lang_name_flags {
+	LANG_NAME_F_KEYWORD	= 0x1,	// reserved word of the .pg source
+	LANG_NAME_F_OPERATOR	= 0x2,	// operator name in the .ast text
+};
+
+struct lang_name {
+	const char *name;
+	uint8_t len;
+	uint8_t flags;
+	uint8_t op_idx;		// enum expression_op_indexes
+};
+
+/*
+ * LANG_KEYWORD_OP(op_idx): the operator name is a reserved word as well.
+ * LANG_KEYWORD(name, op_idx): a reserved word spelled unlike its operator.
+ */
+#define LANG_KEYWORDS_LIST(LANG_KEYWORD_OP, LANG_KEYWORD)		\
+	LANG_KEYWORD_OP(EXPR_IDX_PRINT)					\
+	LANG_KEYWORD_OP(EXPR_IDX_INPUT)					\
+	LANG_KEYWORD_OP(EXPR_IDX_IF)					\
+	LANG_KEYWORD_OP(EXPR_IDX_ELSE)					\
+	LANG_KEYWORD_OP(EXPR_IDX_SQRT)					\
+	LANG_KEYWORD_OP(EXPR_IDX_FUNC)					\
+	LANG_KEYWORD_OP(EXPR_IDX_RETURN)				\
+	LANG_KEYWORD_OP(EXPR_IDX_WHILE)					\
+	LANG_KEYWORD_OP(EXPR_IDX_SCRHT)					\
+	LANG_KEYWORD_OP(EXPR_IDX_SCRWT)					\
+	LANG_KEYWORD_OP(EXPR_IDX_DRAW)					\
+	LANG_KEYWORD("memload",	EXPR_IDX_MEM_READ)
+
+#define LANG_NAMES_N_OPERATORS (sizeof(expression_operators) / sizeof(*expression_operators) - 1)
+
+#define LANG_NAMES_N_SLOTS (64)
+
+/**
+ * FNV-1a seeded with the generated LANG_NAMES_HASH_SEED. Low bits of plain
+ * FNV depend only on low bits of the input, so the high half is folded in
+ * before the slot is taken.
+ */
+static inline uint32_t lang_name_hash(const char *str, size_t len, uint32_t seed) {
+	uint32_t hsh = seed;
+
+	for (size_t i = 0; i < len; i++) {
+		hsh ^= (uint8_t)str[i];
+		hsh *= 16777619u;
+	}
+
+	hsh ^= hsh >> 16;
+	hsh *= 0x85ebca6bu;
+	hsh ^= hsh >> 13;
+
+	return hsh;
+}
+
+/**
+ * Exact-length lookup of str[0..len). Returns NULL if it is not a
+ * language name.
+ */
+const struct lang_name *lang_name_lookup(const char *str, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LANG_NAMES_H */
@@ -1,6 +1,7 @@
 #ifndef TREE_H
 #define TREE_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "data_structure.h"
@@ -11,14 +12,20 @@ extern "C" {
 
 typedef struct {
 	int flags;
+	// Interned id of varname (see intern.h)
+	uint32_t name_id;
 
 	union {
 		void *ptr;
+		const void *cptr;
 		const char *varname;
 		int64_t snum;
 	};
 } tree_dtype;
 
+// value.flags bit of nodes holding an array of children instead of left and right
+#define TREE_F_SEQUENCE (0x100)
+
 typedef DSError_t (*value_deserializer)(tree_dtype *value, char *str, void *ctx);
 typedef DSError_t (*value_serializer)(tree_dtype value, FILE *out_stream, void *ctx);
 
@@ -28,26 +35,137 @@ struct tree_node {
 			struct tree_node *left;
 			struct tree_node *right;
 		};
+		// TREE_F_SEQUENCE nodes
+		struct {
+			struct tree_node **children;
+			size_t n_children;
+		};
 	};
 	
 	tree_dtype value;
 };
 
+#define TNODE_IS_SEQUENCE(node) (((node)->value.flags & TREE_F_SEQUENCE) != 0)
+
 typedef void (*tree_node_value_dtor)(struct tree_node *node);
 
+struct tree_arena_chunk;
+
+/*
+ * Nodes are bump-allocated from chunks of growing size and are never
+ * freed one by one, the whole arena is released at once.
+ */
+struct tree_arena {
+	struct tree_arena_chunk *chunks;
+	// Unused nodes of the newest chunk
+	struct tree_node *free_begin;
+	struct tree_node *free_end;
+};
+
 struct tree {
 	struct tree_node *root;
 	tree_node_value_dtor tree_node_dtor;
+	// Owned by the tree if set, otherwise every node is its own allocation
+	struct tree_arena *arena;
 };
 
 DSError_t tree_ctor(struct tree *tree);
 DSError_t tree_set_node_value_dtor(struct tree *tree, tree_node_value_dtor vdtor);
 DSError_t tree_dtor(struct tree *tree);
 
+/**
+ * Makes the nodes allocated by tree_node_ctor() come from an arena owned
+ * by the tree. tree_dtor() releases the arena in O(chunks).
+ */
+DSError_t tree_use_arena(struct tree *tree);
+
+/**
+ * Allocates a zeroed node for the tree, from its arena if it has one.
+ */
+struct tree_node *tree_node_ctor(struct tree *tree);
+
+/**
+ * Frees a subtree that is not attached to the tree. Nodes of an arena are
+ * only released with the arena.
+ */
+void tree_subtree_dtor(struct tree *tree, struct tree_node *node);
+
+/**
+ * Allocates a sequence node for the tree with n_children children set to
+ * NULL. The children array comes from the arena of the tree if it has one.
+ */
+struct tree_node *tree_sequence_ctor(struct tree *tree, size_t n_children);
+
+/**
+ * Appends child to a sequence node of the tree, the children array may
+ * move.
+ */
+DSError_t tree_sequence_push(struct tree *tree, struct tree_node *seq,
+			     struct tree_node *child);
+
+void tree_arena_ctor(struct tree_arena *arena);
+void tree_arena_dtor(struct tree_arena *arena);
+struct tree_node *tree_arena_node(struct tree_arena *arena);
+
+/**
+ * Zeroed memory of size bytes aligned like nodes, released with the arena.
+ */
+void *tree_arena_alloc(struct tree_arena *arena, size_t size);
+
+/**
+ * Moves the chunks of src to dst, nodes of src stay where they are and
+ * src is left empty.
+ */
+void tree_arena_merge(struct tree_arena *dst, struct tree_arena *src);
+
+/*
+ * Explicit stack of the iterative traversals: tree depth is bounded by
+ * memory, not by the call stack. Frames are frame_size bytes; pointers to
+ * them stay valid until the next push.
+ */
+struct tree_stack {
+	char *frames;
+	size_t frame_size;
+	size_t len;
+	size_t cap;
+};
+
+void tree_stack_ctor(struct tree_stack *stack, size_t frame_size);
+void tree_stack_dtor(struct tree_stack *stack);
+
+/**
+ * Returns the new top frame, NULL on allocation failure.
+ */
+void *tree_stack_push(struct tree_stack *stack);
+
+static inline void *tree_stack_top(struct tree_stack *stack) {
+	if (!stack->len) {
+		return NULL;
+	}
+
+	return stack->frames + (stack->len - 1) * stack->frame_size;
+}
+
+static inline void *tree_stack_pop(struct tree_stack *stack) {
+	if (!stack->len) {
+		return NULL;
+	}
+
+	return stack->frames + --stack->len * stack->frame_size;
+}
+
 struct tree_node *tnode_ctor(void);
 void tnode_dtor(struct tree_node *node, tree_node_value_dtor vdtor);
+/**
+ * Frees the subtree without recursion, the subtree is rotated into a list
+ * on the way. Only the children of sequences are kept on a stack.
+ */
 void tnode_recursive_dtor(struct tree_node *node, tree_node_value_dtor vdtor);
 
+/*
+ * Text form of a subtree: "(value left right)", "nil" for a missing node,
+ * and "[value child ...]" for a sequence.
+ */
 DSError_t tree_store(struct tree *tree, const char *filename,
 		     value_serializer serializer, void *serializer_ctx);
 DSError_t tree_serialize_node(struct tree_node *node, FILE *file,
@@ -55,7 +173,8 @@ DSError_t tree_serialize_node(struct tree_node *node, FILE *file,
 
 DSError_t tree_load(struct tree *tree, const char *filename,
 		    value_deserializer deserializer, void *deserializer_ctx);
-DSError_t tree_deserialize_node(struct tree_node **node, char *buffer, size_t *pos,
+DSError_t tree_deserialize_node(struct tree *tree, struct tree_node **node,
+				char *buffer, size_t *pos,
 				value_deserializer deserializer, void *deserializer_ctx);
 
 struct tree_dump_params {
@@ -70,6 +189,129 @@ DSError_t tree_dump(struct tree *tree,
 
 DSError_t tree_graph_dump_dot(struct tree *tree, FILE *dot_file, value_serializer serializer);
 
+/*
+ * Flat tree: nodes in arrays addressed by 32-bit indices, one array per
+ * field. Nodes are in preorder, so a subtree takes consecutive indices
+ * from its root on. Sequences keep their children in seq_children, from
+ * left[idx] on, right[idx] of them. A whole tree is copied by copying
+ * the arrays.
+ */
+
+#define FLAT_TREE_NONE (UINT32_MAX)
+
+/*
+ * Converts values to the payloads of a flat tree and back, so that the
+ * payloads hold no pointers. Without pack and unpack value.snum is kept
+ * as it is.
+ */
+struct flat_tree_codec {
+	int64_t (*pack)(const tree_dtype *value, void *ctx);
+	void (*unpack)(tree_dtype *value, void *ctx);
+	void *ctx;
+};
+
+struct flat_tree {
+	uint32_t root;
+	uint32_t n_nodes;
+
+	// value.flags and value.name_id of the nodes
+	int *flags;
+	uint32_t *name_ids;
+	// value.snum as packed by codec
+	int64_t *payloads;
+	// Indices of the children or FLAT_TREE_NONE
+	uint32_t *left;
+	uint32_t *right;
+
+	uint32_t *seq_children;
+	uint32_t n_seq_children;
+
+	struct flat_tree_codec codec;
+};
+
+void flat_tree_ctor(struct flat_tree *flat);
+void flat_tree_dtor(struct flat_tree *flat);
+
+/**
+ * Lays the subtree of root out in the constructed, empty flat. Values
+ * are packed with codec, which the flat keeps; NULL copies them as they
+ * are.
+ */
+DSError_t flat_tree_from_tree(struct flat_tree *flat, const struct tree_node *root,
+			      const struct flat_tree_codec *codec);
+
+/**
+ * Allocates the nodes of flat for tree, *root is its root or NULL.
+ */
+DSError_t flat_tree_to_tree(const struct flat_tree *flat, struct tree *tree,
+			    struct tree_node **root);
+
+/**
+ * Copies src into the constructed, empty dst, one memcpy() per array.
+ */
+DSError_t flat_tree_copy(struct flat_tree *dst, const struct flat_tree *src);
+
+/*
+ * Cursors: a node of a flat tree, or nil. Accessors are not checked.
+ */
+
+struct flat_cursor {
+	const struct flat_tree *flat;
+	uint32_t idx;
+};
+
+static inline struct flat_cursor flat_tree_root(const struct flat_tree *flat) {
+	struct flat_cursor cursor = {flat, flat->root};
+	return cursor;
+}
+
+static inline int flat_cursor_is_nil(struct flat_cursor cursor) {
+	return cursor.idx == FLAT_TREE_NONE;
+}
+
+static inline int flat_cursor_flags(struct flat_cursor cursor) {
+	return cursor.flat->flags[cursor.idx];
+}
+
+static inline tree_dtype flat_cursor_value(struct flat_cursor cursor) {
+	tree_dtype value;
+	value.flags = cursor.flat->flags[cursor.idx];
+	value.name_id = cursor.flat->name_ids[cursor.idx];
+	value.snum = cursor.flat->payloads[cursor.idx];
+
+	if (cursor.flat->codec.unpack) {
+		cursor.flat->codec.unpack(&value, cursor.flat->codec.ctx);
+	}
+
+	return value;
+}
+
+static inline int flat_cursor_is_sequence(struct flat_cursor cursor) {
+	return (flat_cursor_flags(cursor) & TREE_F_SEQUENCE) != 0;
+}
+
+static inline struct flat_cursor flat_cursor_at(struct flat_cursor cursor, uint32_t idx) {
+	cursor.idx = idx;
+	return cursor;
+}
+
+static inline struct flat_cursor flat_cursor_left(struct flat_cursor cursor) {
+	return flat_cursor_at(cursor, cursor.flat->left[cursor.idx]);
+}
+
+static inline struct flat_cursor flat_cursor_right(struct flat_cursor cursor) {
+	return flat_cursor_at(cursor, cursor.flat->right[cursor.idx]);
+}
+
+static inline uint32_t flat_cursor_n_children(struct flat_cursor cursor) {
+	return cursor.flat->right[cursor.idx];
+}
+
+static inline struct flat_cursor flat_cursor_child(struct flat_cursor cursor, uint32_t child) {
+	uint32_t first = cursor.flat->left[cursor.idx];
+	return flat_cursor_at(cursor, cursor.flat->seq_children[first + child]);
+}
+
 #ifdef __cplusplus
 }
 #endif
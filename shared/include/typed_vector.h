@@ -0,0 +1,50 @@
+#ifndef TYPED_VECTOR_H
+#define TYPED_VECTOR_H
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "types.h"
+#include "pvector.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Unchecked element access for loops whose bounds are already known.
+ * _DEBUG builds check the index and the element size and abort on a
+ * mismatch, release builds compile to an indexed load.
+ */
+
+#ifdef _DEBUG
+#define VECTOR_CHECK(cond)							\
+do {										\
+	if (!(cond)) {								\
+		log_error("Vector access check failed: %s", #cond);		\
+		abort();							\
+	}									\
+} while (0)
+#else
+#define VECTOR_CHECK(cond) do {} while (0)
+#endif
+
+#define VECTOR_BOUNDS_CHECK(idx, len) VECTOR_CHECK((idx) < (len))
+
+static inline void *pvector_at(const struct pvector *pv, size_t idx, size_t el_size) {
+	VECTOR_BOUNDS_CHECK(idx, pv->len);
+	VECTOR_CHECK(el_size == pv->el_size);
+
+	return (char *)pv->arr + idx * el_size;
+}
+
+/**
+ * Pointer to element idx of a pvector of type, valid until the next push.
+ */
+#define PVECTOR_AT(pv, type, idx) ((type *)pvector_at((pv), (idx), sizeof(type)))
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TYPED_VECTOR_H */
@@ -4,14 +4,10 @@
 #include <unistd.h>
 #include <ctype.h>
 #include "tree.h"
+#include "typed_vector.h"
 
 #include "expression.h"
-
-static void pv_free_variable(void *el) {
-	struct expression_variable *var = el;
-	free(var->var_name);
-	var->var_name = NULL;
-}
+#include "lang_names.h"
 
 int expression_ctor(struct expression *expr) {
 	assert (expr);
@@ -20,16 +16,25 @@ int expression_ctor(struct expression *expr) {
 		return S_FAIL;
 	}
 
-	if (pvector_init(&expr->variables, sizeof(struct expression_variable))) {
+	if (tree_use_arena(&expr->tree)) {
+		return S_FAIL;
+	}
+
+	if (intern_ctor(&expr->names)) {
 		tree_dtor(&expr->tree);
 		return S_FAIL;
 	}
 
-	if (pvector_set_element_destructor(&expr->variables, pv_free_variable)) {
+	if (pvector_init(&expr->variables, sizeof(struct expression_variable))) {
 		tree_dtor(&expr->tree);
-		pvector_destroy(&expr->variables);
+		intern_dtor(&expr->names);
 		return S_FAIL;
 	}
+	expr->var_slots = NULL;
+	expr->n_var_slots = 0;
+	expr->cons_slots = NULL;
+	expr->n_cons_slots = 0;
+	expr->n_consed = 0;
 
 	return S_OK;
 }
@@ -38,67 +43,131 @@ int expression_dtor(struct expression *expr) {
 	assert (expr);
 
 	tree_dtor(&expr->tree);
-	pvector_destroy(&expr->variables);
+	expr_variables_dtor(expr);
+	intern_dtor(&expr->names);
+
+	free(expr->cons_slots);
+	expr->cons_slots = NULL;
+	expr->n_cons_slots = 0;
+	expr->n_consed = 0;
 
 	return S_OK;
 }
 
-struct expression_variable *expr_find_variable(struct expression *expr,
-						      const char *varname) {
+#define EXPR_VAR_INITIAL_SLOTS (64)
+
+static size_t expr_var_slot(const struct expression *expr, uint32_t name_id) {
 	assert (expr);
-	assert (varname);
+	assert (expr->n_var_slots);
 
-	for (size_t i = 0; i < expr->variables.len; i++) {
-      		struct expression_variable *var = NULL;
-		if (pvector_get(&expr->variables, i, (void **)&var)) {
-			log_error("pvector_get error (normally unreachable)");
-			return NULL;
+	size_t mask = expr->n_var_slots - 1;
+	// Name ids are dense, spread them over the table
+	size_t slot = (name_id * 2654435761u) & mask;
+
+	for (;; slot = (slot + 1) & mask) {
+		uint32_t slot_val = expr->var_slots[slot];
+		if (!slot_val) {
+			return slot;
 		}
 
-		if (!strcmp(varname, var->var_name)) {
-			return var;
+		struct expression_variable *var =
+			PVECTOR_AT(&expr->variables, struct expression_variable, slot_val - 1);
+		if (var->name_id == name_id) {
+			return slot;
 		}
 	}
+}
+
+static int expr_var_slots_grow(struct expression *expr) {
+	assert (expr);
+
+	size_t new_n_slots = expr->n_var_slots ? 2 * expr->n_var_slots :
+						 EXPR_VAR_INITIAL_SLOTS;
+	uint32_t *new_slots = calloc(new_n_slots, sizeof(*new_slots));
+	if (!new_slots) {
+		return S_FAIL;
+	}
+
+	free(expr->var_slots);
+	expr->var_slots = new_slots;
+	expr->n_var_slots = new_n_slots;
+
+	for (size_t i = 0; i < expr->variables.len; i++) {
+		struct expression_variable *var =
+			PVECTOR_AT(&expr->variables, struct expression_variable, i);
+		expr->var_slots[expr_var_slot(expr, var->name_id)] = (uint32_t)i + 1;
+	}
 
-	return NULL;
+	return S_OK;
 }
 
-int expr_push_variable(struct expression *expr, const char *varname,
+void expr_variables_dtor(struct expression *expr) {
+	assert (expr);
+
+	pvector_destroy(&expr->variables);
+	free(expr->var_slots);
+	expr->var_slots = NULL;
+	expr->n_var_slots = 0;
+}
+
+struct expression_variable *expr_find_variable(struct expression *expr,
+						      uint32_t name_id) {
+	assert (expr);
+
+	if (!expr->n_var_slots) {
+		return NULL;
+	}
+
+	uint32_t slot_val = expr->var_slots[expr_var_slot(expr, name_id)];
+	if (!slot_val) {
+		return NULL;
+	}
+
+	return PVECTOR_AT(&expr->variables, struct expression_variable, slot_val - 1);
+}
+
+int expr_push_variable(struct expression *expr, uint32_t name_id,
 			       struct expression_variable **nvar) {
 	assert (expr);
-	assert (varname);
 
-	if (expr_find_variable(expr, varname)) {
+	const char *varname = intern_name(&expr->names, name_id);
+	if (!varname) {
+		log_error("Unknown name id: %u", name_id);
+		return S_FAIL;
+	}
+
+	if (expr_find_variable(expr, name_id)) {
 		log_error("Already declared variable: %s", varname);
 		return S_FAIL;
 	}
 
 	size_t var_idx = expr->variables.len;
+	if (var_idx >= UINT32_MAX - 1) {
+		log_error("Too many variables");
+		return S_FAIL;
+	}
+
+	// Keep the load factor of slots at most 1/2
+	if (2 * (var_idx + 1) > expr->n_var_slots && expr_var_slots_grow(expr)) {
+		log_error("Allocation error");
+		return S_FAIL;
+	}
 
 	struct expression_variable var = {
-		.var_name = strdup(varname),
+		.var_name = varname,
+		.name_id = name_id,
 		.var_pointer = var_idx,
 	};
 
-	if (!var.var_name) {
-		log_error("strdup: Allocation error");
-		return S_FAIL;
-	}
-
 	if (pvector_push_back(&expr->variables, &var)) {
 		log_error("pvector_push_back: Allocation error");
-		free(var.var_name);
 		return S_FAIL;
 	}
 
-	struct expression_variable *rvar = NULL;
-	if (pvector_get(&expr->variables, var_idx, (void **)&rvar)) {
-		log_error("pvector_get error (normally unreachable)");
-		return S_FAIL;
-	}
+	expr->var_slots[expr_var_slot(expr, name_id)] = (uint32_t)var_idx + 1;
 
 	if (nvar) {
-		*nvar = rvar;
+		*nvar = PVECTOR_AT(&expr->variables, struct expression_variable, var_idx);
 	}
 
 	return S_OK;
@@ -108,12 +177,21 @@ int expression_load(struct expression *expr, const char *filename) {
 	assert (expr);
 	assert (filename);
 
-	expression_ctor(expr);
+	if (expression_ctor(expr)) {
+		return S_FAIL;
+	}
 
-	if (tree_load(&expr->tree, filename, expression_deserializer, expr)) {
+	char *text = NULL;
+	size_t text_len = 0;
+	if (read_file(filename, &text, &text_len) ||
+		expression_read_text(expr, text, text_len)) {
+		free(text);
+		expression_dtor(expr);
 		return S_FAIL;
 	}
 
+	free(text);
+
 	return S_OK;
 }
 
@@ -121,11 +199,17 @@ int expression_store(struct expression *expr, const char *filename) {
 	assert (expr);
 	assert (filename);
 
-	if (tree_store(&expr->tree, filename, expression_serializer, expr)) {
+	FILE *file = fopen(filename, "w");
+	if (!file) {
 		return S_FAIL;
 	}
 
-	return S_OK;
+	int ret = expression_write_text(expr, file);
+	if (fclose(file)) {
+		ret = S_FAIL;
+	}
+
+	return ret;
 }
 
 static int expr_parse_var(const char *text, const char **text_end_ptr) {
@@ -169,19 +253,15 @@ DSError_t expression_deserializer(tree_dtype *value, char *str, void *ctx) {
 			return DS_OK;
 		}
 
-		const struct expression_operator *const *derop_ptr = expression_operators;
-		while (*derop_ptr != NULL) {
-			if (!strcmp(str, (*derop_ptr)->name)) {
-				value->ptr = (void *)(*derop_ptr);
-				value->flags = EXPRESSION_F_OPERATOR;
-
-				return DS_OK;
-			}
-
-			derop_ptr++;
+		const struct lang_name *lname = lang_name_lookup(str, strlen(str));
+		if (!lname || !(lname->flags & LANG_NAME_F_OPERATOR)) {
+			return DS_INVALID_ARG;
 		}
 
-		return DS_INVALID_ARG;
+		expr_value_set_operator(value, expression_operators[lname->op_idx]);
+		value->flags = EXPRESSION_F_OPERATOR;
+
+		return DS_OK;
 	} else {
 		const char *var_endpt = NULL;
 
@@ -191,18 +271,21 @@ DSError_t expression_deserializer(tree_dtype *value, char *str, void *ctx) {
 			return DS_INVALID_ARG;
 		}
 
-		*(char *)var_endpt = '\0';
-		
-		struct expression_variable *var = expr_find_variable(expr, str);
+		uint32_t name_id = 0;
+		if (intern_string(&expr->names, str, (size_t)(var_endpt - str),
+				  &name_id)) {
+			return DS_ALLOCATION;
+		}
+
+		struct expression_variable *var = expr_find_variable(expr, name_id);
 		if (!var) {
-			if (expr_push_variable(expr, str, &var)) {
+			if (expr_push_variable(expr, name_id, &var)) {
 				return DS_ALLOCATION;
 			}
 		}
 
-		*(char *)var_endpt = '"';
-
 		value->varname = var->var_name;
+		value->name_id = name_id;
 		value->flags = EXPRESSION_F_VARIABLE;
 		return DS_OK;
 	}
@@ -238,8 +321,10 @@ DSError_t expression_serializer(tree_dtype value, FILE *out_stream, void *ctx) {
 	return DS_INVALID_ARG;
 }
 
-struct tree_node *expr_create_number_tnode(int64_t snum) {
-	struct tree_node *node = tnode_ctor();
+struct tree_node *expr_create_number_tnode(struct expression *expr, int64_t snum) {
+	assert (expr);
+
+	struct tree_node *node = tree_node_ctor(&expr->tree);
 
 	if (!node)
 		return NULL;
@@ -252,13 +337,17 @@ struct tree_node *expr_create_number_tnode(int64_t snum) {
 	return node;
 }
 
-struct tree_node *expr_create_variable_tnode(const char *varname) {
-	struct tree_node *node = tnode_ctor();
+struct tree_node *expr_create_variable_tnode(struct expression *expr,
+					       const char *varname, uint32_t name_id) {
+	assert (expr);
+
+	struct tree_node *node = tree_node_ctor(&expr->tree);
 
 	if (!node)
 		return NULL;
 
 	node->value.varname = varname;
+	node->value.name_id = name_id;
 	node->value.flags = EXPRESSION_F_VARIABLE;
 	node->left = NULL;
 	node->right = NULL;
@@ -266,14 +355,17 @@ struct tree_node *expr_create_variable_tnode(const char *varname) {
 	return node;
 }
 
-struct tree_node *expr_create_operator_tnode(const struct expression_operator *op, 
-                                              struct tree_node *left, 
-                                              struct tree_node *right) {
-	struct tree_node *node = tnode_ctor();
+struct tree_node *expr_create_operator_tnode(struct expression *expr,
+					      const struct expression_operator *op,
+					      struct tree_node *left,
+					      struct tree_node *right) {
+	assert (expr);
+
+	struct tree_node *node = tree_node_ctor(&expr->tree);
 	if (!node)
 		return NULL;
 
-	node->value.ptr = (void*)op;
+	expr_value_set_operator(&node->value, op);
 	node->value.flags = EXPRESSION_F_OPERATOR;
 	node->left = left;
 	node->right = right;
@@ -281,32 +373,326 @@ struct tree_node *expr_create_operator_tnode(const struct expression_operator *o
 	return node;
 }
 
+struct tree_node *expr_create_sequence_tnode(struct expression *expr,
+					     const struct expression_operator *op,
+					     struct tree_node *const *children,
+					     size_t n_children) {
+	assert (expr);
+	assert (op);
+
+	struct tree_node *node = tree_sequence_ctor(&expr->tree, n_children);
+	if (!node)
+		return NULL;
+
+	expr_value_set_operator(&node->value, op);
+	node->value.flags = EXPRESSION_F_OPERATOR | TREE_F_SEQUENCE;
+	if (children && n_children) {
+		memcpy(node->children, children, n_children * sizeof(*children));
+	}
+
+	return node;
+}
+
+int expr_sequence_push(struct expression *expr, struct tree_node *seq,
+		       struct tree_node *child) {
+	assert (expr);
+	assert (seq);
+
+	return tree_sequence_push(&expr->tree, seq, child) ? S_FAIL : S_OK;
+}
+
+struct expr_copy_frame {
+	struct tree_node *original;
+	struct tree_node **slot;
+};
+
 struct tree_node *expr_copy_tnode(struct expression *expr, struct tree_node *original) {
+	assert (expr);
 	assert (original);
 
-	struct tree_node *copy = tnode_ctor();
-	if (!copy)
+	struct tree_node *copy = NULL;
+
+	struct tree_stack stack = {0};
+	tree_stack_ctor(&stack, sizeof(struct expr_copy_frame));
+
+	struct expr_copy_frame *frame = tree_stack_push(&stack);
+	if (!frame) {
 		return NULL;
+	}
+	*frame = (struct expr_copy_frame) {.original = original, .slot = &copy};
+
+	int ret = S_OK;
+	while (!ret && (frame = tree_stack_pop(&stack))) {
+		struct tree_node *node_original = frame->original;
+		struct tree_node **slot = frame->slot;
+
+		struct tree_node *node = TNODE_IS_SEQUENCE(node_original) ?
+			tree_sequence_ctor(&expr->tree, node_original->n_children) :
+			tree_node_ctor(&expr->tree);
+		if (!node) {
+			ret = S_FAIL;
+			break;
+		}
 
-	copy->value = original->value;
+		node->value = node_original->value;
+		*slot = node;
+
+		if (TNODE_IS_SEQUENCE(node_original)) {
+			// Slots of the copy do not move, its array is not grown
+			for (size_t i = node_original->n_children; i-- > 0 && !ret;) {
+				if (!node_original->children[i]) {
+					continue;
+				}
+
+				if (!(frame = tree_stack_push(&stack))) {
+					ret = S_FAIL;
+					break;
+				}
+				*frame = (struct expr_copy_frame) {node_original->children[i],
+								   &node->children[i]};
+			}
+			continue;
+		}
 
-	if (original->left) {
-		copy->left = expr_copy_tnode(expr, original->left);
+		if (node_original->right) {
+			if (!(frame = tree_stack_push(&stack))) {
+				ret = S_FAIL;
+				break;
+			}
+			*frame = (struct expr_copy_frame) {node_original->right, &node->right};
+		}
 
-		if (!copy->left) {
-			tnode_recursive_dtor(copy, NULL);
-			return NULL;
+		if (node_original->left) {
+			if (!(frame = tree_stack_push(&stack))) {
+				ret = S_FAIL;
+				break;
+			}
+			*frame = (struct expr_copy_frame) {node_original->left, &node->left};
+		}
+	}
+
+	tree_stack_dtor(&stack);
+
+	// The nodes copied so far all hang off copy
+	if (ret) {
+		tree_subtree_dtor(&expr->tree, copy);
+		return NULL;
+	}
+
+	return copy;
+}
+
+#define EXPR_CONS_INITIAL_SLOTS (1024)
+
+/*
+ * Key of a consed node: its value and the identity of its children, which
+ * are consed already.
+ */
+static uint64_t expr_cons_hash(int flags, int64_t payload,
+			       const struct tree_node *left, const struct tree_node *right) {
+	uint64_t hsh = (uint64_t)flags * 0x9e3779b97f4a7c15u;
+
+	hsh = (hsh ^ (uint64_t)payload) * 0xff51afd7ed558ccdu;
+	hsh = (hsh ^ (uint64_t)(uintptr_t)left) * 0xc4ceb9fe1a85ec53u;
+	hsh = (hsh ^ (uint64_t)(uintptr_t)right) * 0xff51afd7ed558ccdu;
+
+	return hsh ^ (hsh >> 32);
+}
+
+/*
+ * Variables are keyed by name id, the name pointer follows from it.
+ */
+static inline int64_t expr_cons_payload(const tree_dtype *value) {
+	if ((value->flags & EXPRESSION_F_OPERATOR) == EXPRESSION_F_VARIABLE) {
+		return value->name_id;
+	}
+
+	return value->snum;
+}
+
+static size_t expr_cons_probe(const struct expression *expr, int flags, int64_t payload,
+			      const struct tree_node *left, const struct tree_node *right) {
+	assert (expr);
+	assert (expr->n_cons_slots);
+
+	size_t mask = expr->n_cons_slots - 1;
+	size_t slot = expr_cons_hash(flags, payload, left, right) & mask;
+
+	for (;; slot = (slot + 1) & mask) {
+		const struct tree_node *node = expr->cons_slots[slot];
+		if (!node) {
+			return slot;
+		}
+
+		if (node->value.flags == flags && expr_cons_payload(&node->value) == payload &&
+			node->left == left && node->right == right) {
+			return slot;
+		}
+	}
+}
+
+static int expr_cons_grow(struct expression *expr) {
+	assert (expr);
+
+	size_t old_n_slots = expr->n_cons_slots;
+	struct tree_node **old_slots = expr->cons_slots;
+
+	size_t new_n_slots = old_n_slots ? 2 * old_n_slots : EXPR_CONS_INITIAL_SLOTS;
+	struct tree_node **new_slots = calloc(new_n_slots, sizeof(*new_slots));
+	if (!new_slots) {
+		return S_FAIL;
+	}
+
+	expr->cons_slots = new_slots;
+	expr->n_cons_slots = new_n_slots;
+
+	for (size_t i = 0; i < old_n_slots; i++) {
+		struct tree_node *node = old_slots[i];
+		if (!node) {
+			continue;
 		}
+
+		expr->cons_slots[expr_cons_probe(expr, node->value.flags,
+						 expr_cons_payload(&node->value),
+						 node->left, node->right)] = node;
+	}
+
+	free(old_slots);
+
+	return S_OK;
+}
+
+int expression_use_hashcons(struct expression *expr) {
+	assert (expr);
+
+	// Shared nodes cannot be freed one by one
+	if (!expr->tree.arena) {
+		return S_FAIL;
+	}
+
+	if (expr->n_cons_slots) {
+		return S_OK;
 	}
 
-	if (original->right) {
-		copy->right = expr_copy_tnode(expr, original->right);
+	return expr_cons_grow(expr);
+}
+
+/*
+ * Returns the consed node of value and children, or makes it with
+ * tree_node_ctor() and remembers it.
+ */
+static struct tree_node *expr_cons_tnode(struct expression *expr, tree_dtype value,
+					 struct tree_node *left, struct tree_node *right) {
+	assert (expr);
+	assert (expr->n_cons_slots);
+
+	int64_t payload = expr_cons_payload(&value);
+	size_t slot = expr_cons_probe(expr, value.flags, payload, left, right);
+	if (expr->cons_slots[slot]) {
+		return expr->cons_slots[slot];
+	}
 
-		if (!copy->right) {
-			tnode_recursive_dtor(copy, NULL);
+	// Keep the load factor of slots at most 1/2
+	if (2 * (expr->n_consed + 1) > expr->n_cons_slots) {
+		if (expr_cons_grow(expr)) {
 			return NULL;
 		}
+
+		slot = expr_cons_probe(expr, value.flags, payload, left, right);
 	}
 
-	return copy;
+	struct tree_node *node = tree_node_ctor(&expr->tree);
+	if (!node) {
+		return NULL;
+	}
+
+	node->value = value;
+	node->left = left;
+	node->right = right;
+
+	expr->cons_slots[slot] = node;
+	expr->n_consed++;
+
+	return node;
+}
+
+struct tree_node *expr_cons_number_tnode(struct expression *expr, int64_t snum) {
+	assert (expr);
+
+	if (!expr->n_cons_slots) {
+		return expr_create_number_tnode(expr, snum);
+	}
+
+	tree_dtype value = {.flags = EXPRESSION_F_NUMBER, .snum = snum};
+	return expr_cons_tnode(expr, value, NULL, NULL);
+}
+
+struct tree_node *expr_cons_variable_tnode(struct expression *expr,
+					   const char *varname, uint32_t name_id) {
+	assert (expr);
+
+	if (!expr->n_cons_slots) {
+		return expr_create_variable_tnode(expr, varname, name_id);
+	}
+
+	tree_dtype value = {.flags = EXPRESSION_F_VARIABLE, .name_id = name_id,
+			    .varname = varname};
+	return expr_cons_tnode(expr, value, NULL, NULL);
+}
+
+struct tree_node *expr_cons_operator_tnode(struct expression *expr,
+					   const struct expression_operator *op,
+					   struct tree_node *left,
+					   struct tree_node *right) {
+	assert (expr);
+	assert (op);
+
+	if (!expr->n_cons_slots) {
+		return expr_create_operator_tnode(expr, op, left, right);
+	}
+
+	tree_dtype value = {.flags = EXPRESSION_F_OPERATOR};
+	expr_value_set_operator(&value, op);
+	return expr_cons_tnode(expr, value, left, right);
+}
+
+static int64_t expr_flat_pack(const tree_dtype *value, void *ctx) {
+	(void)ctx;
+
+	switch (value->flags & EXPRESSION_F_OPERATOR) {
+	case EXPRESSION_F_OPERATOR:
+		return ((const struct expression_operator *)value->ptr)->idx;
+	case EXPRESSION_F_VARIABLE:
+		return value->name_id;
+	default:
+		return value->snum;
+	}
+}
+
+static void expr_flat_unpack(tree_dtype *value, void *ctx) {
+	const struct expression *expr = ctx;
+
+	switch (value->flags & EXPRESSION_F_OPERATOR) {
+	case EXPRESSION_F_OPERATOR:
+		assert ((uint64_t)value->snum <
+			sizeof(expression_operators) / sizeof(*expression_operators));
+		expr_value_set_operator(value, expression_operators[value->snum]);
+		break;
+	case EXPRESSION_F_VARIABLE:
+		value->varname = intern_name(&expr->names, value->name_id);
+		break;
+	default:
+		break;
+	}
+}
+
+void expression_flat_codec(struct expression *expr, struct flat_tree_codec *codec) {
+	assert (expr);
+	assert (codec);
+
+	*codec = (struct flat_tree_codec) {
+		.pack = expr_flat_pack,
+		.unpack = expr_flat_unpack,
+		.ctx = expr,
+	};
 }
@@ -0,0 +1,604 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tree.h"
+
+#include "expression.h"
+#include "expression_image.h"
+
+#define EXPR_BINARY_INITIAL_BUF (4096)
+
+#define EXPR_BINARY_N_OPERATORS (sizeof(expression_operators) / sizeof(*expression_operators) - 1)
+
+enum expr_binary_tag {
+	EXPR_BINARY_TAG_NUMBER,
+	EXPR_BINARY_TAG_VARIABLE,
+	// Plus the operator index
+	EXPR_BINARY_TAG_OPERATOR,
+	// Set in the operator tag of sequences
+	EXPR_BINARY_TAG_SEQUENCE = 0x80,
+};
+
+/*
+ * Writing side: the node stream and the bitmap are encoded in memory and
+ * written after the header.
+ */
+
+struct expr_binary_buf {
+	uint8_t *data;
+	size_t len;
+	size_t cap;
+};
+
+static int expr_binary_reserve(struct expr_binary_buf *buf, size_t size) {
+	assert (buf);
+
+	if (buf->cap - buf->len >= size) {
+		return S_OK;
+	}
+
+	size_t new_cap = buf->cap ? buf->cap : EXPR_BINARY_INITIAL_BUF;
+	while (new_cap - buf->len < size) {
+		new_cap *= 2;
+	}
+
+	uint8_t *new_data = realloc(buf->data, new_cap);
+	if (!new_data) {
+		return S_FAIL;
+	}
+
+	buf->data = new_data;
+	buf->cap = new_cap;
+
+	return S_OK;
+}
+
+static int expr_binary_write(struct expr_binary_buf *buf, const void *data, size_t size) {
+	assert (buf);
+	assert (data || !size);
+
+	if (expr_binary_reserve(buf, size)) {
+		return S_FAIL;
+	}
+
+	if (size) {
+		memcpy(buf->data + buf->len, data, size);
+	}
+	buf->len += size;
+
+	return S_OK;
+}
+
+static int expr_binary_write_byte(struct expr_binary_buf *buf, uint8_t byte) {
+	return expr_binary_write(buf, &byte, sizeof(byte));
+}
+
+static int expr_binary_write_varint(struct expr_binary_buf *buf, uint64_t value) {
+	assert (buf);
+
+	uint8_t bytes[10] = {0};
+	size_t len = 0;
+
+	do {
+		bytes[len] = value & 0x7f;
+		value >>= 7;
+		if (value) {
+			bytes[len] |= 0x80;
+		}
+		len++;
+	} while (value);
+
+	return expr_binary_write(buf, bytes, len);
+}
+
+struct expr_binary_bits {
+	struct expr_binary_buf buf;
+	size_t n_bits;
+};
+
+static int expr_binary_write_bit(struct expr_binary_bits *bits, int bit) {
+	assert (bits);
+
+	if (bits->n_bits % 8 == 0 && expr_binary_write_byte(&bits->buf, 0)) {
+		return S_FAIL;
+	}
+
+	if (bit) {
+		bits->buf.data[bits->n_bits / 8] |= (uint8_t)(1u << (bits->n_bits % 8));
+	}
+	bits->n_bits++;
+
+	return S_OK;
+}
+
+static int expr_binary_encode_node(struct expr_binary_buf *nodes,
+				   const struct tree_node *node) {
+	assert (nodes);
+	assert (node);
+
+	if (EXPR_TNODE_IS_NUMBER(node)) {
+		uint64_t snum = (uint64_t)node->value.snum;
+		// zigzag
+		return (expr_binary_write_byte(nodes, EXPR_BINARY_TAG_NUMBER) ||
+			expr_binary_write_varint(nodes, (snum << 1) ^
+						 (uint64_t)(node->value.snum >> 63)));
+	}
+
+	if (EXPR_TNODE_IS_VARIABLE(node)) {
+		return (expr_binary_write_byte(nodes, EXPR_BINARY_TAG_VARIABLE) ||
+			expr_binary_write_varint(nodes, node->value.name_id));
+	}
+
+	if (!EXPR_TNODE_IS_OPERATOR(node)) {
+		return S_FAIL;
+	}
+
+	const struct expression_operator *op = node->value.ptr;
+	uint8_t tag = (uint8_t)(EXPR_BINARY_TAG_OPERATOR + op->idx);
+
+	if (TNODE_IS_SEQUENCE(node)) {
+		return (expr_binary_write_byte(nodes, tag | EXPR_BINARY_TAG_SEQUENCE) ||
+			expr_binary_write_varint(nodes, node->n_children));
+	}
+
+	return expr_binary_write_byte(nodes, tag);
+}
+
+/*
+ * Preorder over an explicit stack, every node writes its tag and the
+ * presence bits of its children.
+ */
+static int expr_binary_encode(struct expr_binary_buf *nodes, struct expr_binary_bits *bits,
+			      struct tree_node *root, size_t *n_nodes) {
+	assert (nodes);
+	assert (bits);
+	assert (n_nodes);
+
+	*n_nodes = 0;
+	if (!root) {
+		return S_OK;
+	}
+
+	struct tree_stack stack = {0};
+	tree_stack_ctor(&stack, sizeof(struct tree_node *));
+
+	struct tree_node **top = tree_stack_push(&stack);
+	if (!top) {
+		return S_FAIL;
+	}
+	*top = root;
+
+	int ret = S_OK;
+	while (!ret && (top = tree_stack_pop(&stack))) {
+		struct tree_node *cur = *top;
+
+		if ((ret = expr_binary_encode_node(nodes, cur))) {
+			break;
+		}
+		(*n_nodes)++;
+
+		int is_sequence = TNODE_IS_SEQUENCE(cur);
+		size_t n_children = is_sequence ? cur->n_children : 2;
+
+		for (size_t i = 0; i < n_children && !ret; i++) {
+			struct tree_node *child = is_sequence ? cur->children[i] :
+						  i ? cur->right : cur->left;
+			ret = expr_binary_write_bit(bits, child != NULL);
+		}
+
+		// The first child is encoded first
+		for (size_t i = n_children; i-- > 0 && !ret;) {
+			struct tree_node *child = is_sequence ? cur->children[i] :
+						  i ? cur->right : cur->left;
+			if (!child) {
+				continue;
+			}
+
+			if (!(top = tree_stack_push(&stack))) {
+				ret = S_FAIL;
+				break;
+			}
+			*top = child;
+		}
+	}
+
+	tree_stack_dtor(&stack);
+
+	return ret;
+}
+
+static int expr_binary_encode_all(struct expr_binary_buf *out, struct expression *expr) {
+	assert (out);
+	assert (expr);
+
+	if (expr_binary_write(out, EXPRESSION_BINARY_MAGIC, sizeof(EXPRESSION_BINARY_MAGIC) - 1) ||
+		expr_binary_write_byte(out, EXPRESSION_BINARY_VERSION) ||
+		expr_binary_write_varint(out, expr->names.n_names)) {
+		return S_FAIL;
+	}
+
+	// Index of a name in the file is its id in expr
+	for (size_t i = 0; i < expr->names.n_names; i++) {
+		if (expr_binary_write_varint(out, expr->names.name_lens[i]) ||
+			expr_binary_write(out, expr->names.names[i], expr->names.name_lens[i])) {
+			return S_FAIL;
+		}
+	}
+
+	struct expr_binary_buf nodes = {0};
+	struct expr_binary_bits bits = {0};
+	size_t n_nodes = 0;
+
+	int ret = S_OK;
+	if (expr_binary_encode(&nodes, &bits, expr->tree.root, &n_nodes) ||
+		expr_binary_write_varint(out, n_nodes) ||
+		expr_binary_write_varint(out, bits.buf.len) ||
+		expr_binary_write(out, bits.buf.data, bits.buf.len) ||
+		expr_binary_write(out, nodes.data, nodes.len)) {
+		ret = S_FAIL;
+	}
+
+	free(nodes.data);
+	free(bits.buf.data);
+
+	return ret;
+}
+
+int expression_store_binary(struct expression *expr, const char *filename) {
+	assert (expr);
+	assert (filename);
+
+	struct expr_binary_buf out = {0};
+	if (expr_binary_encode_all(&out, expr)) {
+		free(out.data);
+		return S_FAIL;
+	}
+
+	FILE *file = fopen(filename, "wb");
+	if (!file) {
+		free(out.data);
+		return S_FAIL;
+	}
+
+	int ret = fwrite(out.data, 1, out.len, file) == out.len ? S_OK : S_FAIL;
+	if (fclose(file)) {
+		ret = S_FAIL;
+	}
+
+	free(out.data);
+
+	return ret;
+}
+
+/*
+ * Reading side: every read checks the bounds, a truncated or corrupted
+ * file fails the load instead of reading past the buffer.
+ */
+
+struct expr_binary_reader {
+	const uint8_t *cur;
+	const uint8_t *end;
+};
+
+static int expr_binary_read_varint(struct expr_binary_reader *reader, uint64_t *value) {
+	assert (reader);
+	assert (value);
+
+	uint64_t result = 0;
+	for (unsigned shift = 0; shift < 64; shift += 7) {
+		if (reader->cur == reader->end) {
+			return S_FAIL;
+		}
+
+		uint8_t byte = *reader->cur++;
+		result |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			*value = result;
+			return S_OK;
+		}
+	}
+
+	return S_FAIL;
+}
+
+/*
+ * A varint that counts items of at least a byte each in the rest of the
+ * file.
+ */
+static int expr_binary_read_size(struct expr_binary_reader *reader, size_t *size) {
+	assert (reader);
+	assert (size);
+
+	uint64_t value = 0;
+	if (expr_binary_read_varint(reader, &value) ||
+		value > (uint64_t)(reader->end - reader->cur)) {
+		return S_FAIL;
+	}
+
+	*size = (size_t)value;
+
+	return S_OK;
+}
+
+struct expr_binary_decoder {
+	struct expression *expr;
+	struct expr_binary_reader nodes;
+
+	// Name index of the file -> name id of expr
+	uint32_t *name_ids;
+	size_t n_names;
+
+	const uint8_t *bits;
+	size_t n_bits;
+	size_t bit_pos;
+};
+
+static int expr_binary_read_names(struct expr_binary_decoder *decoder,
+				  struct expr_binary_reader *reader) {
+	assert (decoder);
+	assert (reader);
+
+	size_t n_names = 0;
+	if (expr_binary_read_size(reader, &n_names)) {
+		return S_FAIL;
+	}
+
+	decoder->name_ids = calloc(n_names ? n_names : 1, sizeof(*decoder->name_ids));
+	if (!decoder->name_ids) {
+		return S_FAIL;
+	}
+	decoder->n_names = n_names;
+
+	for (size_t i = 0; i < n_names; i++) {
+		size_t len = 0;
+		if (expr_binary_read_size(reader, &len) ||
+			intern_string(&decoder->expr->names, (const char *)reader->cur, len,
+				      &decoder->name_ids[i])) {
+			return S_FAIL;
+		}
+		reader->cur += len;
+	}
+
+	return S_OK;
+}
+
+static int expr_binary_read_bit(struct expr_binary_decoder *decoder, int *bit) {
+	assert (decoder);
+	assert (bit);
+
+	if (decoder->bit_pos == decoder->n_bits) {
+		return S_FAIL;
+	}
+
+	size_t pos = decoder->bit_pos++;
+	*bit = (decoder->bits[pos / 8] >> (pos % 8)) & 1;
+
+	return S_OK;
+}
+
+/*
+ * Decodes a node without its children into *node.
+ */
+static int expr_binary_decode_node(struct expr_binary_decoder *decoder,
+				   struct tree_node **node) {
+	assert (decoder);
+	assert (node);
+
+	struct expr_binary_reader *reader = &decoder->nodes;
+	struct expression *expr = decoder->expr;
+
+	if (reader->cur == reader->end) {
+		return S_FAIL;
+	}
+
+	uint8_t tag = *reader->cur++;
+	uint64_t value = 0;
+
+	switch (tag) {
+	case EXPR_BINARY_TAG_NUMBER:
+		if (expr_binary_read_varint(reader, &value)) {
+			return S_FAIL;
+		}
+		// zigzag
+		*node = expr_create_number_tnode(expr, (int64_t)(value >> 1) ^ -(int64_t)(value & 1));
+		return *node ? S_OK : S_FAIL;
+	case EXPR_BINARY_TAG_VARIABLE: {
+		if (expr_binary_read_varint(reader, &value) || value >= decoder->n_names) {
+			return S_FAIL;
+		}
+
+		uint32_t name_id = decoder->name_ids[value];
+		struct expression_variable *var = expr_find_variable(expr, name_id);
+		if (!var && expr_push_variable(expr, name_id, &var)) {
+			return S_FAIL;
+		}
+
+		*node = expr_create_variable_tnode(expr, var->var_name, name_id);
+		return *node ? S_OK : S_FAIL;
+	}
+	default:
+		break;
+	}
+
+	size_t op_idx = (size_t)(tag & ~EXPR_BINARY_TAG_SEQUENCE) - EXPR_BINARY_TAG_OPERATOR;
+	if (op_idx >= EXPR_BINARY_N_OPERATORS) {
+		return S_FAIL;
+	}
+	const struct expression_operator *op = expression_operators[op_idx];
+
+	if (!(tag & EXPR_BINARY_TAG_SEQUENCE)) {
+		*node = expr_create_operator_tnode(expr, op, NULL, NULL);
+		return *node ? S_OK : S_FAIL;
+	}
+
+	// Every child takes at least a presence bit
+	if (expr_binary_read_varint(reader, &value) ||
+		value > decoder->n_bits - decoder->bit_pos) {
+		return S_FAIL;
+	}
+
+	*node = expr_create_sequence_tnode(expr, op, NULL, (size_t)value);
+
+	return *node ? S_OK : S_FAIL;
+}
+
+/*
+ * Preorder over an explicit stack of the slots to fill, like the writer.
+ */
+static int expr_binary_decode(struct expr_binary_decoder *decoder, size_t n_nodes) {
+	assert (decoder);
+
+	struct expression *expr = decoder->expr;
+	expr->tree.root = NULL;
+
+	if (!n_nodes) {
+		return S_OK;
+	}
+
+	struct tree_stack stack = {0};
+	tree_stack_ctor(&stack, sizeof(struct tree_node **));
+
+	struct tree_node ***slot = tree_stack_push(&stack);
+	if (!slot) {
+		return S_FAIL;
+	}
+	*slot = &expr->tree.root;
+
+	size_t n_decoded = 0;
+	int ret = S_OK;
+	while (!ret && (slot = tree_stack_pop(&stack))) {
+		struct tree_node **cur = *slot;
+		if (n_decoded++ == n_nodes || (ret = expr_binary_decode_node(decoder, cur))) {
+			ret = S_FAIL;
+			break;
+		}
+
+		struct tree_node *decoded = *cur;
+		int is_sequence = TNODE_IS_SEQUENCE(decoded);
+		size_t n_children = is_sequence ? decoded->n_children : 2;
+
+		// Presence bits in child order, slots pushed in reverse
+		size_t first_child = stack.len;
+		for (size_t i = 0; i < n_children && !ret; i++) {
+			int present = 0;
+			if ((ret = expr_binary_read_bit(decoder, &present))) {
+				break;
+			}
+
+			if (!present) {
+				continue;
+			}
+
+			if (!(slot = tree_stack_push(&stack))) {
+				ret = S_FAIL;
+				break;
+			}
+			*slot = is_sequence ? &decoded->children[i] :
+				i ? &decoded->right : &decoded->left;
+		}
+
+		struct tree_node ***children = (struct tree_node ***)stack.frames;
+		for (size_t lo = first_child, hi = stack.len; !ret && lo + 1 < hi; lo++, hi--) {
+			struct tree_node **tmp = children[lo];
+			children[lo] = children[hi - 1];
+			children[hi - 1] = tmp;
+		}
+	}
+
+	tree_stack_dtor(&stack);
+
+	if (!ret && n_decoded != n_nodes) {
+		ret = S_FAIL;
+	}
+
+	return ret;
+}
+
+int expression_load_binary(struct expression *expr, const char *filename) {
+	assert (expr);
+	assert (filename);
+
+	if (expression_ctor(expr)) {
+		return S_FAIL;
+	}
+
+	char *data = NULL;
+	size_t data_len = 0;
+	if (read_file(filename, &data, &data_len)) {
+		expression_dtor(expr);
+		return S_FAIL;
+	}
+
+	struct expr_binary_reader reader = {
+		.cur = (const uint8_t *)data,
+		.end = (const uint8_t *)data + data_len,
+	};
+	struct expr_binary_decoder decoder = {.expr = expr};
+
+	// The magic and the version byte
+	size_t header_size = sizeof(EXPRESSION_BINARY_MAGIC);
+	size_t n_nodes = 0;
+	size_t bitmap_size = 0;
+
+	int ret = S_OK;
+	if (data_len < header_size ||
+		memcmp(data, EXPRESSION_BINARY_MAGIC, header_size - 1) ||
+		(uint8_t)data[header_size - 1] != EXPRESSION_BINARY_VERSION) {
+		ret = S_FAIL;
+	} else {
+		reader.cur += header_size;
+
+		if (expr_binary_read_names(&decoder, &reader) ||
+			expr_binary_read_size(&reader, &n_nodes) ||
+			expr_binary_read_size(&reader, &bitmap_size)) {
+			ret = S_FAIL;
+		}
+	}
+
+	if (!ret) {
+		decoder.bits = reader.cur;
+		decoder.n_bits = bitmap_size * 8;
+		decoder.nodes = (struct expr_binary_reader) {
+			.cur = reader.cur + bitmap_size,
+			.end = reader.end,
+		};
+
+		if (expr_binary_decode(&decoder, n_nodes) ||
+			decoder.nodes.cur != decoder.nodes.end) {
+			ret = S_FAIL;
+		}
+	}
+
+	free(decoder.name_ids);
+	free(data);
+
+	if (ret) {
+		expression_dtor(expr);
+	}
+
+	return ret;
+}
+
+int expression_file_format(const char *filename, enum expression_format *format) {
+	assert (filename);
+	assert (format);
+
+	FILE *file = fopen(filename, "rb");
+	if (!file) {
+		return S_FAIL;
+	}
+
+	size_t magic_len = sizeof(EXPRESSION_BINARY_MAGIC) - 1;
+	char magic[8] = {0};
+	size_t n_read = fread(magic, 1, magic_len, file);
+	fclose(file);
+
+	*format = EXPRESSION_FORMAT_TEXT;
+	if (n_read == magic_len && !memcmp(magic, EXPRESSION_BINARY_MAGIC, magic_len)) {
+		*format = EXPRESSION_FORMAT_BINARY;
+	} else if (n_read == magic_len && !memcmp(magic, EXPRESSION_IMAGE_MAGIC, magic_len)) {
+		*format = EXPRESSION_FORMAT_IMAGE;
+	}
+
+	return S_OK;
+}
@@ -0,0 +1,500 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tree.h"
+
+#include "expression_image.h"
+
+#define EXPR_IMAGE_MAX_SIZE ((size_t)INT32_MAX)
+
+// Where links that fail the checks of expr_image_at() lead
+const struct expression_image_node expression_image_invalid_node = {0};
+
+struct expr_image_layout {
+	size_t n_nodes;
+	// Children of all sequences
+	size_t n_children;
+
+	size_t nodes;
+	size_t children;
+	size_t names;
+	size_t size;
+};
+
+static inline size_t expr_image_tnode_n_children(const struct tree_node *node) {
+	return TNODE_IS_SEQUENCE(node) ? node->n_children : 2;
+}
+
+static inline struct tree_node *expr_image_tnode_child(const struct tree_node *node,
+						       size_t idx) {
+	if (TNODE_IS_SEQUENCE(node)) {
+		return node->children[idx];
+	}
+
+	return idx ? node->right : node->left;
+}
+
+static int expr_image_count(struct expression *expr, struct expr_image_layout *layout) {
+	assert (expr);
+	assert (layout);
+
+	if (!expr->tree.root) {
+		return S_OK;
+	}
+
+	struct tree_stack stack = {0};
+	tree_stack_ctor(&stack, sizeof(struct tree_node *));
+
+	struct tree_node **top = tree_stack_push(&stack);
+	if (!top) {
+		return S_FAIL;
+	}
+	*top = expr->tree.root;
+
+	int ret = S_OK;
+	while ((top = tree_stack_pop(&stack))) {
+		struct tree_node *cur = *top;
+
+		layout->n_nodes++;
+		if (TNODE_IS_SEQUENCE(cur)) {
+			layout->n_children += cur->n_children;
+		}
+
+		// The payload of leaves takes the place of the children
+		if (!EXPR_TNODE_IS_OPERATOR(cur) && (cur->left || cur->right)) {
+			ret = S_FAIL;
+			break;
+		}
+
+		size_t n_children = expr_image_tnode_n_children(cur);
+		for (size_t i = 0; i < n_children; i++) {
+			struct tree_node *child = expr_image_tnode_child(cur, i);
+			if (!child) {
+				continue;
+			}
+
+			if (!(top = tree_stack_push(&stack))) {
+				ret = S_FAIL;
+				break;
+			}
+			*top = child;
+		}
+
+		if (ret) {
+			break;
+		}
+	}
+
+	tree_stack_dtor(&stack);
+
+	return ret;
+}
+
+static int expr_image_plan(struct expression *expr, struct expr_image_layout *layout) {
+	assert (expr);
+	assert (layout);
+
+	*layout = (struct expr_image_layout) {0};
+	if (expr_image_count(expr, layout)) {
+		return S_FAIL;
+	}
+
+	layout->nodes = sizeof(struct expression_image_header);
+	layout->children = layout->nodes + layout->n_nodes * sizeof(struct expression_image_node);
+	layout->names = layout->children + layout->n_children * sizeof(int32_t);
+	layout->size = layout->names + expr->names.n_names * sizeof(uint32_t);
+
+	for (size_t i = 0; i < expr->names.n_names; i++) {
+		layout->size += expr->names.name_lens[i] + 1;
+	}
+
+	return layout->size <= EXPR_IMAGE_MAX_SIZE ? S_OK : S_FAIL;
+}
+
+static void expr_image_put_node(struct expression_image_node *out,
+				const struct tree_node *node) {
+	assert (out);
+	assert (node);
+
+	out->flags = (uint32_t)node->value.flags;
+
+	if (EXPR_TNODE_IS_NUMBER(node)) {
+		out->snum = node->value.snum;
+	} else if (EXPR_TNODE_IS_VARIABLE(node)) {
+		out->arg = node->value.name_id;
+	} else {
+		out->arg = ((const struct expression_operator *)node->value.ptr)->idx;
+	}
+}
+
+struct expr_image_frame {
+	const struct tree_node *node;
+	// Offsets of the int32_t to set to the node and of the node it is relative to
+	size_t link;
+	size_t parent;
+};
+
+/*
+ * Preorder over an explicit stack: nodes are placed in the order they are
+ * visited, the link to a node is set when it is placed.
+ */
+static int expr_image_put_nodes(struct expression *expr, char *base,
+				const struct expr_image_layout *layout) {
+	assert (expr);
+	assert (base);
+	assert (layout);
+
+	if (!expr->tree.root) {
+		return S_OK;
+	}
+
+	struct tree_stack stack = {0};
+	tree_stack_ctor(&stack, sizeof(struct expr_image_frame));
+
+	struct expr_image_frame *frame = tree_stack_push(&stack);
+	if (!frame) {
+		return S_FAIL;
+	}
+	*frame = (struct expr_image_frame) {
+		.node = expr->tree.root,
+		.link = offsetof(struct expression_image_header, root),
+		.parent = 0,
+	};
+
+	size_t next_node = layout->nodes;
+	size_t next_children = layout->children;
+
+	int ret = S_OK;
+	while (!ret && (frame = tree_stack_pop(&stack))) {
+		struct expr_image_frame cur = *frame;
+
+		size_t node_off = next_node;
+		next_node += sizeof(struct expression_image_node);
+
+		int32_t link = (int32_t)(node_off - cur.parent);
+		memcpy(base + cur.link, &link, sizeof(link));
+
+		struct expression_image_node *out = (struct expression_image_node *)(base + node_off);
+		expr_image_put_node(out, cur.node);
+
+		int is_sequence = TNODE_IS_SEQUENCE(cur.node);
+		size_t n_children = expr_image_tnode_n_children(cur.node);
+		size_t links = node_off + offsetof(struct expression_image_node, left);
+
+		if (is_sequence) {
+			out->n_children = (uint32_t)n_children;
+			out->children = (int32_t)(next_children - node_off);
+			links = next_children;
+			next_children += n_children * sizeof(int32_t);
+		}
+
+		// The first child is placed first
+		for (size_t i = n_children; i-- > 0;) {
+			const struct tree_node *child = expr_image_tnode_child(cur.node, i);
+			if (!child) {
+				continue;
+			}
+
+			if (!(frame = tree_stack_push(&stack))) {
+				ret = S_FAIL;
+				break;
+			}
+			*frame = (struct expr_image_frame) {
+				.node = child,
+				.link = links + i * sizeof(int32_t),
+				.parent = node_off,
+			};
+		}
+	}
+
+	tree_stack_dtor(&stack);
+
+	return ret;
+}
+
+int expression_image_build(struct expression *expr, struct expression_image *image) {
+	assert (expr);
+	assert (image);
+
+	*image = (struct expression_image) {0};
+
+	struct expr_image_layout layout = {0};
+	if (expr_image_plan(expr, &layout)) {
+		return S_FAIL;
+	}
+
+	char *base = calloc(1, layout.size);
+	if (!base) {
+		return S_FAIL;
+	}
+
+	struct expression_image_header *header = (struct expression_image_header *)base;
+	memcpy(header->magic, EXPRESSION_IMAGE_MAGIC, sizeof(header->magic));
+	header->version = EXPRESSION_IMAGE_VERSION;
+	header->n_nodes = (uint32_t)layout.n_nodes;
+	header->n_names = (uint32_t)expr->names.n_names;
+	header->names = (uint32_t)layout.names;
+	header->size = layout.size;
+
+	// Name ids of expr are the indices of the names
+	uint32_t *names = (uint32_t *)(base + layout.names);
+	size_t name_off = layout.names + expr->names.n_names * sizeof(uint32_t);
+	for (size_t i = 0; i < expr->names.n_names; i++) {
+		names[i] = (uint32_t)name_off;
+		memcpy(base + name_off, expr->names.names[i], expr->names.name_lens[i]);
+		name_off += expr->names.name_lens[i] + 1;
+	}
+
+	if (expr_image_put_nodes(expr, base, &layout)) {
+		free(base);
+		return S_FAIL;
+	}
+
+	image->base = base;
+	image->size = layout.size;
+	image->buf = base;
+
+	return S_OK;
+}
+
+int expression_store_image(struct expression *expr, const char *filename) {
+	assert (expr);
+	assert (filename);
+
+	struct expression_image image = {0};
+	if (expression_image_build(expr, &image)) {
+		return S_FAIL;
+	}
+
+	FILE *file = fopen(filename, "wb");
+	if (!file) {
+		expression_image_dtor(&image);
+		return S_FAIL;
+	}
+
+	int ret = fwrite(image.base, 1, image.size, file) == image.size ? S_OK : S_FAIL;
+	if (fclose(file)) {
+		ret = S_FAIL;
+	}
+
+	expression_image_dtor(&image);
+
+	return ret;
+}
+
+/*
+ * The header and the name table, which every pass reads, are checked.
+ * Nodes are only read when they are walked.
+ */
+static int expr_image_check(const char *base, size_t size) {
+	assert (base);
+
+	const struct expression_image_header *header = (const struct expression_image_header *)base;
+	if (size < sizeof(*header) || memcmp(header->magic, EXPRESSION_IMAGE_MAGIC,
+					     sizeof(header->magic)) ||
+		header->version != EXPRESSION_IMAGE_VERSION || header->size != size) {
+		return S_FAIL;
+	}
+
+	size_t nodes_end = sizeof(*header) +
+			   (size_t)header->n_nodes * sizeof(struct expression_image_node);
+	if (nodes_end > size || (header->root && (header->root != sizeof(*header) ||
+						  !header->n_nodes))) {
+		return S_FAIL;
+	}
+
+	if (header->names < nodes_end || header->names > size ||
+		header->names % sizeof(uint32_t) ||
+		header->n_names > (size - header->names) / sizeof(uint32_t)) {
+		return S_FAIL;
+	}
+
+	const uint32_t *names = (const uint32_t *)(base + header->names);
+	for (size_t i = 0; i < header->n_names; i++) {
+		if (names[i] >= size || !memchr(base + names[i], '\0', size - names[i])) {
+			return S_FAIL;
+		}
+	}
+
+	return S_OK;
+}
+
+int expression_image_map(struct expression_image *image, const char *filename) {
+	assert (image);
+	assert (filename);
+
+	*image = (struct expression_image) {0};
+
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		return S_FAIL;
+	}
+
+	struct stat file_stat = {0};
+	if (fstat(fd, &file_stat) || !S_ISREG(file_stat.st_mode) ||
+		(size_t)file_stat.st_size < sizeof(struct expression_image_header)) {
+		close(fd);
+		return S_FAIL;
+	}
+
+	size_t size = (size_t)file_stat.st_size;
+	void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		return S_FAIL;
+	}
+
+	if (expr_image_check(map, size)) {
+		munmap(map, size);
+		return S_FAIL;
+	}
+
+	image->base = map;
+	image->size = size;
+	image->map = map;
+
+	return S_OK;
+}
+
+void expression_image_dtor(struct expression_image *image) {
+	assert (image);
+
+	if (image->map) {
+		munmap(image->map, image->size);
+	}
+	free(image->buf);
+
+	*image = (struct expression_image) {0};
+}
+
+int expression_image_intern_names(const struct expression_image *image,
+				  struct intern_table *names) {
+	assert (image);
+	assert (names);
+
+	for (uint32_t i = 0; i < expr_image_n_names(image); i++) {
+		const char *name = expr_image_name(image, i);
+		uint32_t name_id = 0;
+
+		if (intern_string(names, name, strlen(name), &name_id) || name_id != i) {
+			return S_FAIL;
+		}
+	}
+
+	return S_OK;
+}
+
+static struct tree_node *expr_image_tnode(struct expression *expr,
+					  const struct expression_image_node *node) {
+	assert (expr);
+	assert (node);
+
+	if (EXPR_INODE_IS_NUMBER(node)) {
+		return expr_create_number_tnode(expr, node->snum);
+	}
+
+	if (EXPR_INODE_IS_VARIABLE(node)) {
+		if (node->arg >= expr->names.n_names) {
+			return NULL;
+		}
+
+		struct expression_variable *var = expr_find_variable(expr, node->arg);
+		if (!var && expr_push_variable(expr, node->arg, &var)) {
+			return NULL;
+		}
+
+		return expr_create_variable_tnode(expr, var->var_name, node->arg);
+	}
+
+	if (!EXPR_INODE_IS_OPERATOR(node) || node->arg >= EXPR_IMAGE_N_OPERATORS) {
+		return NULL;
+	}
+
+	if (node->flags & TREE_F_SEQUENCE) {
+		return expr_create_sequence_tnode(expr, expr_image_op(node), NULL, node->n_children);
+	}
+
+	return expr_create_operator_tnode(expr, expr_image_op(node), NULL, NULL);
+}
+
+struct expr_image_load_frame {
+	const struct expression_image_node *node;
+	struct tree_node **slot;
+};
+
+int expression_image_to_tree(const struct expression_image *image,
+			     struct expression *expr) {
+	assert (image);
+	assert (expr);
+
+	if (expression_ctor(expr)) {
+		return S_FAIL;
+	}
+
+	if (expression_image_intern_names(image, &expr->names)) {
+		expression_dtor(expr);
+		return S_FAIL;
+	}
+
+	const struct expression_image_node *root = expr_image_root(image);
+	if (!root) {
+		return S_OK;
+	}
+
+	struct tree_stack stack = {0};
+	tree_stack_ctor(&stack, sizeof(struct expr_image_load_frame));
+
+	struct expr_image_load_frame *frame = tree_stack_push(&stack);
+	int ret = frame ? S_OK : S_FAIL;
+	if (frame) {
+		*frame = (struct expr_image_load_frame) {.node = root, .slot = &expr->tree.root};
+	}
+
+	while (!ret && (frame = tree_stack_pop(&stack))) {
+		struct expr_image_load_frame cur = *frame;
+
+		struct tree_node *node = expr_image_tnode(expr, cur.node);
+		if (!node) {
+			ret = S_FAIL;
+			break;
+		}
+		*cur.slot = node;
+
+		if (!EXPR_INODE_IS_OPERATOR(cur.node)) {
+			continue;
+		}
+
+		int is_sequence = TNODE_IS_SEQUENCE(node);
+		size_t n_children = is_sequence ? node->n_children : 2;
+		for (size_t i = n_children; i-- > 0;) {
+			const struct expression_image_node *child =
+				is_sequence ? expr_image_child(image, cur.node, i) :
+				i ? expr_image_right(image, cur.node) : expr_image_left(image, cur.node);
+			if (!child) {
+				continue;
+			}
+
+			if (!(frame = tree_stack_push(&stack))) {
+				ret = S_FAIL;
+				break;
+			}
+			*frame = (struct expr_image_load_frame) {
+				.node = child,
+				.slot = is_sequence ? &node->children[i] : i ? &node->right : &node->left,
+			};
+		}
+	}
+
+	tree_stack_dtor(&stack);
+
+	if (ret) {
+		expression_dtor(expr);
+	}
+
+	return ret;
+}
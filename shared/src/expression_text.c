@@ -0,0 +1,825 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tree.h"
+
+#include "expression.h"
+#include "lang_names.h"
+
+/*
+ * The .ast text codec of expressions: the same text as tree_store() and
+ * tree_load() with expression_serializer() and expression_deserializer(),
+ * without a call per value. The writer formats into a buffer flushed with
+ * fwrite(), the reader scans the text once.
+ */
+
+#define EXPR_TEXT_BUF_SIZE (64 * 1024)
+// Longest value but a variable name: INT64_MIN
+#define EXPR_TEXT_MAX_VALUE (24)
+
+static void expr_text_flush(struct expr_text_writer *writer) {
+	assert (writer);
+
+	if (writer->len && fwrite(writer->buf, 1, writer->len, writer->file) != writer->len) {
+		writer->error = 1;
+	}
+
+	writer->len = 0;
+}
+
+static inline char *expr_text_reserve(struct expr_text_writer *writer, size_t size) {
+	assert (writer);
+	assert (size <= EXPR_TEXT_BUF_SIZE);
+
+	if (EXPR_TEXT_BUF_SIZE - writer->len < size) {
+		expr_text_flush(writer);
+	}
+
+	return writer->buf + writer->len;
+}
+
+static void expr_text_put(struct expr_text_writer *writer, const char *str, size_t len) {
+	assert (writer);
+	assert (str);
+
+	if (len > EXPR_TEXT_BUF_SIZE) {
+		expr_text_flush(writer);
+		if (fwrite(str, 1, len, writer->file) != len) {
+			writer->error = 1;
+		}
+		return;
+	}
+
+	memcpy(expr_text_reserve(writer, len), str, len);
+	writer->len += len;
+}
+
+static inline void expr_text_putc(struct expr_text_writer *writer, char c) {
+	*expr_text_reserve(writer, 1) = c;
+	writer->len++;
+}
+
+/*
+ * Formats snum like "%ld" into out, returns the length.
+ */
+static size_t expr_text_format_number(char *out, int64_t snum) {
+	assert (out);
+
+	char digits[EXPR_TEXT_MAX_VALUE] = {0};
+	size_t n_digits = 0;
+	uint64_t magnitude = snum < 0 ? -(uint64_t)snum : (uint64_t)snum;
+
+	do {
+		digits[n_digits++] = (char)('0' + magnitude % 10);
+		magnitude /= 10;
+	} while (magnitude);
+
+	size_t len = 0;
+	if (snum < 0) {
+		out[len++] = '-';
+	}
+
+	while (n_digits) {
+		out[len++] = digits[--n_digits];
+	}
+
+	return len;
+}
+
+static int expr_text_put_value(struct expr_text_writer *writer, const tree_dtype *value) {
+	assert (writer);
+	assert (value);
+
+	switch (value->flags & EXPRESSION_F_OPERATOR) {
+	case EXPRESSION_F_NUMBER: {
+		char *out = expr_text_reserve(writer, EXPR_TEXT_MAX_VALUE);
+		writer->len += expr_text_format_number(out, value->snum);
+		return S_OK;
+	}
+	case EXPRESSION_F_VARIABLE:
+		expr_text_putc(writer, '"');
+		expr_text_put(writer, value->varname, strlen(value->varname));
+		expr_text_putc(writer, '"');
+		return S_OK;
+	case EXPRESSION_F_OPERATOR: {
+		const struct expression_operator *op = value->ptr;
+		expr_text_put(writer, op->name, strlen(op->name));
+		return S_OK;
+	}
+	default:
+		return S_FAIL;
+	}
+}
+
+struct expr_text_frame {
+	struct tree_node *node;
+	// Children written so far
+	size_t n_written;
+};
+
+/*
+ * Writes "nil", a whole leaf, or the opening of a node with children,
+ * which is pushed to have them written.
+ */
+static int expr_text_put_node(struct expr_text_writer *writer,
+			      struct tree_stack *stack, struct tree_node *node) {
+	assert (writer);
+	assert (stack);
+
+	if (!node) {
+		expr_text_put(writer, "nil", 3);
+		return S_OK;
+	}
+
+	int is_sequence = TNODE_IS_SEQUENCE(node);
+
+	expr_text_putc(writer, is_sequence ? '[' : '(');
+	if (expr_text_put_value(writer, &node->value)) {
+		return S_FAIL;
+	}
+	expr_text_putc(writer, ' ');
+
+	if (!is_sequence && !node->left && !node->right) {
+		expr_text_put(writer, "nil nil)", 8);
+		return S_OK;
+	}
+
+	struct expr_text_frame *frame = tree_stack_push(stack);
+	if (!frame) {
+		return S_FAIL;
+	}
+	*frame = (struct expr_text_frame) {.node = node, .n_written = 0};
+
+	return S_OK;
+}
+
+int expression_write_text(struct expression *expr, FILE *file) {
+	assert (expr);
+	assert (file);
+
+	struct expr_text_writer writer = {
+		.file = file,
+		.buf = malloc(EXPR_TEXT_BUF_SIZE),
+	};
+	if (!writer.buf) {
+		return S_FAIL;
+	}
+
+	struct tree_stack stack = {0};
+	tree_stack_ctor(&stack, sizeof(struct expr_text_frame));
+
+	int ret = expr_text_put_node(&writer, &stack, expr->tree.root);
+
+	struct expr_text_frame *frame = NULL;
+	while (!ret && (frame = tree_stack_top(&stack))) {
+		struct tree_node *cur = frame->node;
+		int is_sequence = TNODE_IS_SEQUENCE(cur);
+		size_t n_children = is_sequence ? cur->n_children : 2;
+
+		if (frame->n_written == n_children) {
+			tree_stack_pop(&stack);
+			expr_text_putc(&writer, is_sequence ? ']' : ')');
+			continue;
+		}
+
+		size_t child = frame->n_written++;
+		if (child) {
+			expr_text_putc(&writer, ' ');
+		}
+
+		ret = expr_text_put_node(&writer, &stack, is_sequence ? cur->children[child] :
+							  child ? cur->right : cur->left);
+	}
+
+	tree_stack_dtor(&stack);
+
+	expr_text_flush(&writer);
+	free(writer.buf);
+
+	return ret || writer.error ? S_FAIL : S_OK;
+}
+
+struct expr_text_reader {
+	const char *cur;
+	const char *end;
+};
+
+static inline int expr_text_is_space(char c) {
+	// isspace() of the "C" locale
+	return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static inline int expr_text_is_delimiter(char c) {
+	return expr_text_is_space(c) || c == '(' || c == ')' || c == '[' || c == ']';
+}
+
+static inline int expr_text_is_alpha(char c) {
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static inline int expr_text_is_digit(char c) {
+	return c >= '0' && c <= '9';
+}
+
+static inline void expr_text_skip_spaces(struct expr_text_reader *reader) {
+	while (reader->cur != reader->end && expr_text_is_space(*reader->cur)) {
+		reader->cur++;
+	}
+}
+
+/*
+ * Whole token [str, str + len) as a base 10 number, S_FAIL if it is not
+ * one or does not fit.
+ */
+static int expr_text_parse_number(const char *str, size_t len, int64_t *snum) {
+	assert (str);
+	assert (snum);
+
+	size_t pos = 0;
+	int negative = 0;
+	if (len && (str[0] == '-' || str[0] == '+')) {
+		negative = str[0] == '-';
+		pos++;
+	}
+
+	if (pos == len) {
+		return S_FAIL;
+	}
+
+	uint64_t limit = negative ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX;
+	uint64_t magnitude = 0;
+	for (; pos < len; pos++) {
+		if (!expr_text_is_digit(str[pos])) {
+			return S_FAIL;
+		}
+
+		uint64_t digit = (uint64_t)(str[pos] - '0');
+		if (magnitude > (limit - digit) / 10) {
+			return S_FAIL;
+		}
+		magnitude = magnitude * 10 + digit;
+	}
+
+	*snum = negative ? (int64_t)(0 - magnitude) : (int64_t)magnitude;
+
+	return S_OK;
+}
+
+/*
+ * Reads the value after an opening bracket and makes its node.
+ */
+static struct tree_node *expr_text_read_value(struct expression *expr,
+					      struct expr_text_reader *reader,
+					      int is_sequence) {
+	assert (expr);
+	assert (reader);
+
+	expr_text_skip_spaces(reader);
+
+	const char *token = reader->cur;
+
+	if (token != reader->end && *token == '"') {
+		const char *name = token + 1;
+		const char *name_end = name;
+
+		if (name_end == reader->end || !expr_text_is_alpha(*name_end)) {
+			return NULL;
+		}
+		while (name_end != reader->end &&
+			(expr_text_is_alpha(*name_end) || expr_text_is_digit(*name_end))) {
+			name_end++;
+		}
+		if (name_end == reader->end || *name_end != '"' || is_sequence) {
+			return NULL;
+		}
+		reader->cur = name_end + 1;
+
+		uint32_t name_id = 0;
+		if (intern_string(&expr->names, name, (size_t)(name_end - name), &name_id)) {
+			return NULL;
+		}
+
+		struct expression_variable *var = expr_find_variable(expr, name_id);
+		if (!var && expr_push_variable(expr, name_id, &var)) {
+			return NULL;
+		}
+
+		return expr_create_variable_tnode(expr, var->var_name, name_id);
+	}
+
+	while (reader->cur != reader->end && !expr_text_is_delimiter(*reader->cur)) {
+		reader->cur++;
+	}
+	size_t token_len = (size_t)(reader->cur - token);
+
+	int64_t snum = 0;
+	if (!expr_text_parse_number(token, token_len, &snum)) {
+		return is_sequence ? NULL : expr_create_number_tnode(expr, snum);
+	}
+
+	const struct lang_name *lname = lang_name_lookup(token, token_len);
+	if (!lname || !(lname->flags & LANG_NAME_F_OPERATOR)) {
+		return NULL;
+	}
+
+	const struct expression_operator *op = expression_operators[lname->op_idx];
+	if (is_sequence) {
+		return expr_create_sequence_tnode(expr, op, NULL, 0);
+	}
+
+	return expr_create_operator_tnode(expr, op, NULL, NULL);
+}
+
+struct expr_text_open_node {
+	struct tree_node *node;
+	// Children read so far, of left and right for nodes that are not sequences
+	size_t n_read;
+};
+
+/*
+ * Hands the node read last to the node it is a child of, or makes it the
+ * root once there is none.
+ */
+static int expr_text_attach(struct expression *expr, struct tree_stack *open,
+			    struct tree_node *node) {
+	assert (expr);
+	assert (open);
+
+	struct expr_text_open_node *parent = tree_stack_top(open);
+	if (!parent) {
+		expr->tree.root = node;
+		return S_OK;
+	}
+
+	struct tree_node *parent_node = parent->node;
+	if (TNODE_IS_SEQUENCE(parent_node)) {
+		return expr_sequence_push(expr, parent_node, node);
+	}
+
+	switch (parent->n_read++) {
+	case 0:
+		parent_node->left = node;
+		return S_OK;
+	case 1:
+		parent_node->right = node;
+		return S_OK;
+	default:
+		return S_FAIL;
+	}
+}
+
+int expression_read_text(struct expression *expr, const char *text, size_t len) {
+	assert (expr);
+	assert (text || !len);
+
+	struct expr_text_reader reader = {.cur = text, .end = text + len};
+
+	struct tree_stack open = {0};
+	tree_stack_ctor(&open, sizeof(struct expr_text_open_node));
+
+	int ret = S_OK;
+	do {
+		expr_text_skip_spaces(&reader);
+		if (reader.cur == reader.end) {
+			ret = S_FAIL;
+			break;
+		}
+
+		char c = *reader.cur++;
+		struct expr_text_open_node *top = NULL;
+
+		switch (c) {
+		case '(':
+		case '[': {
+			struct tree_node *node = expr_text_read_value(expr, &reader, c == '[');
+			if (!node || expr_text_attach(expr, &open, node) ||
+				!(top = tree_stack_push(&open))) {
+				ret = S_FAIL;
+				break;
+			}
+
+			*top = (struct expr_text_open_node) {.node = node, .n_read = 0};
+			break;
+		}
+		case ')':
+		case ']':
+			top = tree_stack_pop(&open);
+			if (!top || TNODE_IS_SEQUENCE(top->node) != (c == ']') ||
+				(c == ')' && top->n_read != 2)) {
+				ret = S_FAIL;
+			}
+			break;
+		case 'n':
+			if (reader.end - reader.cur < 2 || memcmp(reader.cur, "il", 2)) {
+				ret = S_FAIL;
+				break;
+			}
+
+			reader.cur += 2;
+			ret = expr_text_attach(expr, &open, NULL);
+			break;
+		default:
+			ret = S_FAIL;
+			break;
+		}
+	// The text after the root is not read
+	} while (!ret && open.len);
+
+	tree_stack_dtor(&open);
+
+	return ret;
+}
+
+/*
+ * Streaming reader: the text is read in chunks into buf, a token is
+ * scanned once the text from it on is in buf or the file ends.
+ */
+
+// Longest token of the streamed text, names included
+#define EXPR_STREAM_MAX_TOKEN (4096)
+
+struct expr_stream_reader {
+	FILE *file;
+	char *buf;
+	const char *cur;
+	const char *end;
+	int at_eof;
+	int error;
+
+	struct intern_table *names;
+	// NUL-terminated name of the variable read last
+	char name[EXPR_STREAM_MAX_TOKEN + 1];
+};
+
+/*
+ * Makes at least size bytes from cur on be in buf, fewer at the end of the
+ * file.
+ */
+static void expr_stream_fill(struct expr_stream_reader *reader, size_t size) {
+	assert (reader);
+	assert (size <= EXPR_TEXT_BUF_SIZE);
+
+	size_t left = (size_t)(reader->end - reader->cur);
+	if (left >= size || reader->at_eof) {
+		return;
+	}
+
+	memmove(reader->buf, reader->cur, left);
+	reader->cur = reader->buf;
+	reader->end = reader->buf + left;
+
+	while (!reader->at_eof && (size_t)(reader->end - reader->cur) < size) {
+		size_t n_read = fread(reader->buf + left, 1, EXPR_TEXT_BUF_SIZE - left, reader->file);
+		if (n_read < EXPR_TEXT_BUF_SIZE - left) {
+			reader->at_eof = 1;
+			reader->error = ferror(reader->file) != 0;
+		}
+
+		left += n_read;
+		reader->end = reader->buf + left;
+	}
+}
+
+/*
+ * Returns the next character that is not a space, 0 at the end.
+ */
+static char expr_stream_peek(struct expr_stream_reader *reader) {
+	assert (reader);
+
+	for (;;) {
+		while (reader->cur != reader->end && expr_text_is_space(*reader->cur)) {
+			reader->cur++;
+		}
+
+		if (reader->cur != reader->end) {
+			return *reader->cur;
+		}
+
+		if (reader->at_eof) {
+			return 0;
+		}
+		expr_stream_fill(reader, EXPR_STREAM_MAX_TOKEN);
+	}
+}
+
+/*
+ * Reads the value after an opening bracket.
+ */
+static int expr_stream_read_value(struct expr_stream_reader *reader, tree_dtype *value) {
+	assert (reader);
+	assert (value);
+
+	expr_stream_peek(reader);
+	// One more byte than the longest token to see where it ends
+	expr_stream_fill(reader, EXPR_STREAM_MAX_TOKEN + 2);
+
+	const char *token = reader->cur;
+	const char *token_end = token;
+
+	if (token != reader->end && *token == '"') {
+		const char *name = token + 1;
+		const char *name_end = name;
+
+		if (name_end == reader->end || !expr_text_is_alpha(*name_end)) {
+			return S_FAIL;
+		}
+		while (name_end != reader->end &&
+			(expr_text_is_alpha(*name_end) || expr_text_is_digit(*name_end))) {
+			name_end++;
+		}
+		if (name_end == reader->end || *name_end != '"' ||
+			name_end - name > EXPR_STREAM_MAX_TOKEN) {
+			return S_FAIL;
+		}
+		reader->cur = name_end + 1;
+
+		size_t name_len = (size_t)(name_end - name);
+		memcpy(reader->name, name, name_len);
+		reader->name[name_len] = '\0';
+
+		*value = (tree_dtype) {.flags = EXPRESSION_F_VARIABLE, .name_id = INTERN_ID_NONE};
+		value->varname = reader->name;
+
+		if (reader->names &&
+			intern_string(reader->names, reader->name, name_len, &value->name_id)) {
+			return S_FAIL;
+		}
+
+		return S_OK;
+	}
+
+	while (token_end != reader->end && !expr_text_is_delimiter(*token_end)) {
+		token_end++;
+	}
+	size_t token_len = (size_t)(token_end - token);
+	if (token_len > EXPR_STREAM_MAX_TOKEN) {
+		return S_FAIL;
+	}
+	reader->cur = token_end;
+
+	int64_t snum = 0;
+	if (!expr_text_parse_number(token, token_len, &snum)) {
+		*value = (tree_dtype) {.flags = EXPRESSION_F_NUMBER};
+		value->snum = snum;
+		return S_OK;
+	}
+
+	const struct lang_name *lname = lang_name_lookup(token, token_len);
+	if (!lname || !(lname->flags & LANG_NAME_F_OPERATOR)) {
+		return S_FAIL;
+	}
+
+	*value = (tree_dtype) {.flags = EXPRESSION_F_OPERATOR};
+	expr_value_set_operator(value, expression_operators[lname->op_idx]);
+
+	return S_OK;
+}
+
+static int expr_stream_expect(struct expr_stream_reader *reader, const char *word) {
+	assert (reader);
+	assert (word);
+
+	size_t len = strlen(word);
+	if (!expr_stream_peek(reader)) {
+		return S_FAIL;
+	}
+	expr_stream_fill(reader, len);
+
+	if ((size_t)(reader->end - reader->cur) < len || memcmp(reader->cur, word, len)) {
+		return S_FAIL;
+	}
+	reader->cur += len;
+
+	return S_OK;
+}
+
+struct expr_stream_open_node {
+	tree_dtype value;
+	// Children read so far, of left and right for nodes that are not sequences
+	size_t n_read;
+};
+
+int expression_stream_read(FILE *file, struct intern_table *names,
+			   const struct expression_stream_events *events) {
+	assert (file);
+	assert (events);
+
+	struct expr_stream_reader *reader = calloc(1, sizeof(*reader));
+	char *buf = malloc(EXPR_TEXT_BUF_SIZE);
+	if (!reader || !buf) {
+		free(reader);
+		free(buf);
+		return S_FAIL;
+	}
+	reader->file = file;
+	reader->buf = buf;
+	reader->cur = buf;
+	reader->end = buf;
+	reader->names = names;
+
+	struct tree_stack open = {0};
+	tree_stack_ctor(&open, sizeof(struct expr_stream_open_node));
+
+	int ret = S_OK;
+	do {
+		char c = expr_stream_peek(reader);
+		struct expr_stream_open_node *top = tree_stack_top(&open);
+
+		// A child of a node that is not a sequence comes in place of left or right
+		if (top && !(top->value.flags & TREE_F_SEQUENCE) && c != ')' &&
+			top->n_read++ == 2) {
+			ret = S_FAIL;
+			break;
+		}
+
+		switch (c) {
+		case '(':
+		case '[': {
+			reader->cur++;
+
+			tree_dtype value = {0};
+			if (expr_stream_read_value(reader, &value)) {
+				ret = S_FAIL;
+				break;
+			}
+
+			int is_operator = (value.flags & EXPRESSION_F_OPERATOR) == EXPRESSION_F_OPERATOR;
+			if (c == '[') {
+				if (!is_operator) {
+					ret = S_FAIL;
+					break;
+				}
+				value.flags |= TREE_F_SEQUENCE;
+			}
+
+			if (!is_operator) {
+				// Leaves have no children
+				ret = expr_stream_expect(reader, "nil") || expr_stream_expect(reader, "nil") ||
+				      expr_stream_expect(reader, ")") ? S_FAIL :
+				      events->leaf(events->ctx, &value) ? S_FAIL : S_OK;
+				break;
+			}
+
+			if (events->enter(events->ctx, &value) || !(top = tree_stack_push(&open))) {
+				ret = S_FAIL;
+				break;
+			}
+			*top = (struct expr_stream_open_node) {.value = value, .n_read = 0};
+			break;
+		}
+		case ')':
+		case ']':
+			reader->cur++;
+			top = tree_stack_pop(&open);
+			if (!top || ((top->value.flags & TREE_F_SEQUENCE) != 0) != (c == ']') ||
+				(c == ')' && top->n_read != 2) ||
+				events->exit(events->ctx, &top->value)) {
+				ret = S_FAIL;
+			}
+			break;
+		case 'n':
+			ret = expr_stream_expect(reader, "nil") || events->leaf(events->ctx, NULL) ?
+				S_FAIL : S_OK;
+			break;
+		default:
+			ret = S_FAIL;
+			break;
+		}
+	// The text after the root is not read
+	} while (!ret && open.len);
+
+	if (reader->error) {
+		ret = S_FAIL;
+	}
+
+	tree_stack_dtor(&open);
+	free(reader->buf);
+	free(reader);
+
+	return ret;
+}
+
+struct expr_stream_write_frame {
+	int is_sequence;
+	size_t n_written;
+};
+
+int expression_stream_writer_ctor(struct expression_stream_writer *writer, FILE *file) {
+	assert (writer);
+	assert (file);
+
+	*writer = (struct expression_stream_writer) {
+		.out = {.file = file, .buf = malloc(EXPR_TEXT_BUF_SIZE)},
+	};
+	if (!writer->out.buf) {
+		return S_FAIL;
+	}
+
+	tree_stack_ctor(&writer->open, sizeof(struct expr_stream_write_frame));
+
+	return S_OK;
+}
+
+int expression_stream_writer_dtor(struct expression_stream_writer *writer) {
+	assert (writer);
+
+	int ret = writer->open.len ? S_FAIL : S_OK;
+
+	expr_text_flush(&writer->out);
+	if (writer->out.error) {
+		ret = S_FAIL;
+	}
+
+	free(writer->out.buf);
+	writer->out.buf = NULL;
+	tree_stack_dtor(&writer->open);
+
+	return ret;
+}
+
+/*
+ * Separates a node from the child of its parent written before, a node
+ * that is not a sequence takes two children.
+ */
+static int expr_stream_write_child(struct expression_stream_writer *writer) {
+	assert (writer);
+
+	struct expr_stream_write_frame *parent = tree_stack_top(&writer->open);
+	if (!parent) {
+		return S_OK;
+	}
+
+	if (!parent->is_sequence && parent->n_written == 2) {
+		return S_FAIL;
+	}
+
+	if (parent->n_written++) {
+		expr_text_putc(&writer->out, ' ');
+	}
+
+	return S_OK;
+}
+
+int expression_stream_write_enter(void *writer_ptr, const tree_dtype *value) {
+	assert (writer_ptr);
+	assert (value);
+
+	struct expression_stream_writer *writer = writer_ptr;
+	if (expr_stream_write_child(writer)) {
+		return S_FAIL;
+	}
+
+	int is_sequence = (value->flags & TREE_F_SEQUENCE) != 0;
+
+	expr_text_putc(&writer->out, is_sequence ? '[' : '(');
+	if (expr_text_put_value(&writer->out, value)) {
+		return S_FAIL;
+	}
+	expr_text_putc(&writer->out, ' ');
+
+	struct expr_stream_write_frame *frame = tree_stack_push(&writer->open);
+	if (!frame) {
+		return S_FAIL;
+	}
+	*frame = (struct expr_stream_write_frame) {.is_sequence = is_sequence, .n_written = 0};
+
+	return S_OK;
+}
+
+int expression_stream_write_leaf(void *writer_ptr, const tree_dtype *value) {
+	assert (writer_ptr);
+
+	struct expression_stream_writer *writer = writer_ptr;
+	if (expr_stream_write_child(writer)) {
+		return S_FAIL;
+	}
+
+	if (!value) {
+		expr_text_put(&writer->out, "nil", 3);
+		return S_OK;
+	}
+
+	expr_text_putc(&writer->out, '(');
+	if (expr_text_put_value(&writer->out, value)) {
+		return S_FAIL;
+	}
+	expr_text_put(&writer->out, " nil nil)", 9);
+
+	return S_OK;
+}
+
+int expression_stream_write_exit(void *writer_ptr, const tree_dtype *value) {
+	assert (writer_ptr);
+	(void)value;
+
+	struct expression_stream_writer *writer = writer_ptr;
+
+	struct expr_stream_write_frame *frame = tree_stack_pop(&writer->open);
+	if (!frame || (!frame->is_sequence && frame->n_written != 2)) {
+		return S_FAIL;
+	}
+
+	expr_text_putc(&writer->out, frame->is_sequence ? ']' : ')');
+
+	return writer->out.error ? S_FAIL : S_OK;
+}
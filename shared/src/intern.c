@@ -0,0 +1,256 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "intern.h"
+
+#define INTERN_INITIAL_NAMES	(64)
+#define INTERN_CHUNK_SIZE	(4096)
+
+struct intern_chunk {
+	struct intern_chunk *next;
+	size_t used;
+	size_t size;
+	char data[];
+};
+
+static uint32_t intern_hash(const char *str, size_t len) {
+	uint32_t hsh = 2166136261u;
+
+	for (size_t i = 0; i < len; i++) {
+		hsh ^= (uint8_t)str[i];
+		hsh *= 16777619u;
+	}
+
+	return hsh ^ (hsh >> 16);
+}
+
+int intern_ctor(struct intern_table *tbl) {
+	assert (tbl);
+
+	*tbl = (struct intern_table){0};
+
+	tbl->names = calloc(INTERN_INITIAL_NAMES, sizeof(*tbl->names));
+	tbl->name_lens = calloc(INTERN_INITIAL_NAMES, sizeof(*tbl->name_lens));
+	tbl->name_hashes = calloc(INTERN_INITIAL_NAMES, sizeof(*tbl->name_hashes));
+	tbl->slots = calloc(INTERN_INITIAL_NAMES * 2, sizeof(*tbl->slots));
+
+	if (!tbl->names || !tbl->name_lens || !tbl->name_hashes || !tbl->slots) {
+		log_error("calloc: Allocation error");
+		intern_dtor(tbl);
+		return S_FAIL;
+	}
+
+	tbl->names_cap = INTERN_INITIAL_NAMES;
+	tbl->n_slots = INTERN_INITIAL_NAMES * 2;
+
+	return S_OK;
+}
+
+int intern_dtor(struct intern_table *tbl) {
+	assert (tbl);
+
+	struct intern_chunk *chunk = tbl->chunks;
+	while (chunk) {
+		struct intern_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+
+	free(tbl->names);
+	free(tbl->name_lens);
+	free(tbl->name_hashes);
+	free(tbl->slots);
+
+	*tbl = (struct intern_table){0};
+
+	return S_OK;
+}
+
+static const char *intern_store_name(struct intern_table *tbl,
+				     const char *str, size_t len) {
+	assert (tbl);
+	assert (str);
+
+	struct intern_chunk *chunk = tbl->chunks;
+
+	if (!chunk || chunk->size - chunk->used < len + 1) {
+		size_t chunk_size = INTERN_CHUNK_SIZE;
+		if (chunk_size < len + 1) {
+			chunk_size = len + 1;
+		}
+
+		chunk = calloc(1, sizeof(*chunk) + chunk_size);
+		if (!chunk) {
+			log_error("calloc: Allocation error");
+			return NULL;
+		}
+
+		chunk->size = chunk_size;
+		chunk->next = tbl->chunks;
+		tbl->chunks = chunk;
+	}
+
+	char *name = chunk->data + chunk->used;
+	memcpy(name, str, len);
+	name[len] = '\0';
+
+	chunk->used += len + 1;
+
+	return name;
+}
+
+static size_t intern_probe(const struct intern_table *tbl,
+			   const char *str, size_t len, uint32_t hsh) {
+	assert (tbl);
+	assert (str);
+
+	size_t mask = tbl->n_slots - 1;
+
+	for (size_t slot = hsh & mask; ; slot = (slot + 1) & mask) {
+		uint32_t slot_val = tbl->slots[slot];
+		if (!slot_val) {
+			return slot;
+		}
+
+		uint32_t id = slot_val - 1;
+		if (tbl->name_hashes[id] == hsh && tbl->name_lens[id] == len &&
+			!memcmp(tbl->names[id], str, len)) {
+			return slot;
+		}
+	}
+}
+
+static int intern_grow(struct intern_table *tbl) {
+	assert (tbl);
+
+	size_t new_cap = tbl->names_cap * 2;
+
+	const char **new_names = realloc(tbl->names, new_cap * sizeof(*new_names));
+	if (!new_names) {
+		goto alloc_error;
+	}
+	tbl->names = new_names;
+
+	uint32_t *new_lens = realloc(tbl->name_lens, new_cap * sizeof(*new_lens));
+	if (!new_lens) {
+		goto alloc_error;
+	}
+	tbl->name_lens = new_lens;
+
+	uint32_t *new_hashes = realloc(tbl->name_hashes, new_cap * sizeof(*new_hashes));
+	if (!new_hashes) {
+		goto alloc_error;
+	}
+	tbl->name_hashes = new_hashes;
+
+	tbl->names_cap = new_cap;
+
+	uint32_t *new_slots = calloc(new_cap * 2, sizeof(*new_slots));
+	if (!new_slots) {
+		goto alloc_error;
+	}
+
+	free(tbl->slots);
+	tbl->slots = new_slots;
+	tbl->n_slots = new_cap * 2;
+
+	for (size_t id = 0; id < tbl->n_names; id++) {
+		size_t slot = tbl->name_hashes[id] & (tbl->n_slots - 1);
+		while (tbl->slots[slot]) {
+			slot = (slot + 1) & (tbl->n_slots - 1);
+		}
+
+		tbl->slots[slot] = (uint32_t)id + 1;
+	}
+
+	return S_OK;
+
+alloc_error:
+	log_error("realloc: Allocation error");
+	return S_FAIL;
+}
+
+int intern_string(struct intern_table *tbl, const char *str, size_t len,
+		  uint32_t *id) {
+	assert (tbl);
+	assert (str);
+	assert (id);
+
+	uint32_t hsh = intern_hash(str, len);
+	size_t slot = intern_probe(tbl, str, len, hsh);
+
+	if (tbl->slots[slot]) {
+		*id = tbl->slots[slot] - 1;
+		return S_OK;
+	}
+
+	if (len >= UINT32_MAX || tbl->n_names >= INTERN_ID_NONE) {
+		log_error("Too many or too long names");
+		return S_FAIL;
+	}
+
+	// Keep the load factor of slots at most 1/2
+	if (tbl->n_names == tbl->names_cap) {
+		if (intern_grow(tbl)) {
+			return S_FAIL;
+		}
+
+		slot = intern_probe(tbl, str, len, hsh);
+	}
+
+	const char *name = intern_store_name(tbl, str, len);
+	if (!name) {
+		return S_FAIL;
+	}
+
+	uint32_t new_id = (uint32_t)tbl->n_names;
+
+	tbl->names[new_id] = name;
+	tbl->name_lens[new_id] = (uint32_t)len;
+	tbl->name_hashes[new_id] = hsh;
+	tbl->slots[slot] = new_id + 1;
+	tbl->n_names++;
+
+	*id = new_id;
+
+	return S_OK;
+}
+
+uint32_t intern_find(const struct intern_table *tbl, const char *str, size_t len) {
+	assert (tbl);
+	assert (str);
+
+	if (!tbl->n_slots) {
+		return INTERN_ID_NONE;
+	}
+
+	size_t slot = intern_probe(tbl, str, len, intern_hash(str, len));
+	if (!tbl->slots[slot]) {
+		return INTERN_ID_NONE;
+	}
+
+	return tbl->slots[slot] - 1;
+}
+
+int intern_clone(struct intern_table *dst, const struct intern_table *src) {
+	assert (dst);
+	assert (src);
+
+	if (intern_ctor(dst)) {
+		return S_FAIL;
+	}
+
+	for (size_t id = 0; id < src->n_names; id++) {
+		uint32_t new_id = 0;
+		if (intern_string(dst, src->names[id], src->name_lens[id], &new_id)) {
+			intern_dtor(dst);
+			return S_FAIL;
+		}
+
+		assert (new_id == id);
+	}
+
+	return S_OK;
+}
@@ -0,0 +1,27 @@
+#include <assert.h>
+#include <string.h>
+
+#include "lang_names.h"
+#include "lang_names_table.h"
+
+_Static_assert(LANG_NAMES_TABLE_N_OPERATORS == LANG_NAMES_N_OPERATORS,
+	       "src/lang_names_table.h is stale, run make -C shared lang_names_table");
+
+const struct lang_name *lang_name_lookup(const char *str, size_t len) {
+	assert (str);
+
+	uint32_t slot = lang_name_hash(str, len, LANG_NAMES_HASH_SEED)
+				& (LANG_NAMES_N_SLOTS - 1);
+
+	int name_idx = lang_names_slots[slot];
+	if (name_idx < 0) {
+		return NULL;
+	}
+
+	const struct lang_name *lname = &lang_names[name_idx];
+	if (lname->len != len || memcmp(lname->name, str, len)) {
+		return NULL;
+	}
+
+	return lname;
+}
@@ -0,0 +1,49 @@
+/* Generated by tools/gen_lang_names.c, do not edit. */
+
+#define LANG_NAMES_HASH_SEED (0x811e6446u)
+#define LANG_NAMES_TABLE_N_OPERATORS (34)
+
+static const struct lang_name lang_names[] = {
+	{.name = "+", .len = 1, .flags = 0x2, .op_idx = 0},
+	{.name = "-", .len = 1, .flags = 0x2, .op_idx = 1},
+	{.name = "*", .len = 1, .flags = 0x2, .op_idx = 2},
+	{.name = "/", .len = 1, .flags = 0x2, .op_idx = 3},
+	{.name = "^", .len = 1, .flags = 0x2, .op_idx = 4},
+	{.name = "=", .len = 1, .flags = 0x2, .op_idx = 5},
+	{.name = "==", .len = 2, .flags = 0x2, .op_idx = 6},
+	{.name = ";", .len = 1, .flags = 0x2, .op_idx = 7},
+	{.name = ":=", .len = 2, .flags = 0x2, .op_idx = 8},
+	{.name = ",", .len = 1, .flags = 0x2, .op_idx = 9},
+	{.name = ">", .len = 1, .flags = 0x2, .op_idx = 10},
+	{.name = "<", .len = 1, .flags = 0x2, .op_idx = 11},
+	{.name = "!=", .len = 2, .flags = 0x2, .op_idx = 12},
+	{.name = ">=", .len = 2, .flags = 0x2, .op_idx = 13},
+	{.name = "<=", .len = 2, .flags = 0x2, .op_idx = 14},
+	{.name = "print", .len = 5, .flags = 0x3, .op_idx = 15},
+	{.name = "input", .len = 5, .flags = 0x3, .op_idx = 16},
+	{.name = "if", .len = 2, .flags = 0x3, .op_idx = 17},
+	{.name = "else", .len = 4, .flags = 0x3, .op_idx = 18},
+	{.name = "sqrt", .len = 4, .flags = 0x3, .op_idx = 19},
+	{.name = "func", .len = 4, .flags = 0x3, .op_idx = 20},
+	{.name = "main", .len = 4, .flags = 0x2, .op_idx = 21},
+	{.name = "call", .len = 4, .flags = 0x2, .op_idx = 22},
+	{.name = "return", .len = 6, .flags = 0x3, .op_idx = 23},
+	{.name = "while", .len = 5, .flags = 0x3, .op_idx = 24},
+	{.name = "scrht", .len = 5, .flags = 0x3, .op_idx = 25},
+	{.name = "scrwt", .len = 5, .flags = 0x3, .op_idx = 26},
+	{.name = "draw", .len = 4, .flags = 0x3, .op_idx = 27},
+	{.name = "<<", .len = 2, .flags = 0x2, .op_idx = 28},
+	{.name = ">>", .len = 2, .flags = 0x2, .op_idx = 29},
+	{.name = "<-", .len = 2, .flags = 0x2, .op_idx = 30},
+	{.name = "mem_load", .len = 8, .flags = 0x2, .op_idx = 31},
+	{.name = "&", .len = 1, .flags = 0x2, .op_idx = 32},
+	{.name = "|", .len = 1, .flags = 0x2, .op_idx = 33},
+	{.name = "memload", .len = 7, .flags = 0x1, .op_idx = 31},
+};
+
+static const int8_t lang_names_slots[LANG_NAMES_N_SLOTS] = {
+	-1, 24, 2, -1, -1, -1, 3, 0, -1, 11, -1, -1, -1, 13, -1, 7,
+	17, 21, 28, 9, -1, -1, 27, -1, -1, -1, 33, -1, 1, 23, 34, 4,
+	19, 29, -1, 32, -1, 5, 16, 10, -1, -1, -1, 15, 14, 18, -1, -1,
+	-1, 20, -1, 6, 22, -1, -1, 8, 31, -1, -1, 26, 30, 12, -1, 25,
+};
@@ -10,10 +10,25 @@
 #include "tree.h"
 #include "data_structure.h"
 
+#define TREE_ARENA_FIRST_CHUNK (256)
+#define TREE_ARENA_MAX_CHUNK (64 * 1024)
+
+#define TREE_STACK_INITIAL_FRAMES (64)
+
+#define TREE_SEQUENCE_MIN_CHILDREN (4)
+
+struct tree_arena_chunk {
+	struct tree_arena_chunk *next;
+	size_t n_nodes;
+	struct tree_node nodes[];
+};
+
 DSError_t tree_ctor(struct tree *tree) {
 	assert (tree);
 
 	tree->root = NULL;
+	tree->tree_node_dtor = NULL;
+	tree->arena = NULL;
 	
 	return DS_OK;
 }
@@ -25,16 +40,328 @@ DSError_t tree_set_node_value_dtor(struct tree *tree,
 	return DS_OK;
 }
 
+/*
+ * Visits every node of the subtree once without recursion: left children
+ * are rotated up until the node has none, then it is handed to visit and
+ * the walk goes right. The subtree is left as a list linked by right.
+ * Sequences have no left and right to rotate, their children wait on a
+ * stack and are walked after the list.
+ */
+static void tnode_rotate_walk(struct tree_node *node,
+			      void (*visit)(struct tree_node *node, void *ctx),
+			      void *ctx) {
+	assert (visit);
+
+	struct tree_stack pending = {0};
+	tree_stack_ctor(&pending, sizeof(struct tree_node *));
+
+	for (;;) {
+		if (!node) {
+			struct tree_node **next = tree_stack_pop(&pending);
+			if (!next) {
+				break;
+			}
+
+			node = *next;
+			continue;
+		}
+
+		if (TNODE_IS_SEQUENCE(node)) {
+			for (size_t i = 0; i < node->n_children; i++) {
+				struct tree_node **child = NULL;
+				// Not walked if the stack cannot grow
+				if (node->children[i] && (child = tree_stack_push(&pending))) {
+					*child = node->children[i];
+				}
+			}
+
+			visit(node, ctx);
+			node = NULL;
+			continue;
+		}
+
+		struct tree_node *left = node->left;
+		if (left && TNODE_IS_SEQUENCE(left)) {
+			struct tree_node **child = tree_stack_push(&pending);
+			if (child) {
+				*child = left;
+			}
+
+			node->left = NULL;
+			continue;
+		}
+
+		if (left) {
+			node->left = left->right;
+			left->right = node;
+			node = left;
+			continue;
+		}
+
+		struct tree_node *right = node->right;
+		visit(node, ctx);
+		node = right;
+	}
+
+	tree_stack_dtor(&pending);
+}
+
+static void tnode_visit_value_dtor(struct tree_node *node, void *ctx) {
+	tree_node_value_dtor vdtor = *(tree_node_value_dtor *)ctx;
+
+	vdtor(node);
+}
+
+static void tnode_recursive_value_dtor(struct tree_node *node,
+				       tree_node_value_dtor vdtor) {
+	tnode_rotate_walk(node, tnode_visit_value_dtor, &vdtor);
+}
+
 DSError_t tree_dtor(struct tree *tree) {
 	assert (tree);
 
-	tnode_recursive_dtor(tree->root, tree->tree_node_dtor);
+	if (tree->arena) {
+		if (tree->tree_node_dtor) {
+			tnode_recursive_value_dtor(tree->root, tree->tree_node_dtor);
+		}
+
+		tree_arena_dtor(tree->arena);
+		free(tree->arena);
+		tree->arena = NULL;
+	} else {
+		tnode_recursive_dtor(tree->root, tree->tree_node_dtor);
+	}
+
 	tree->root = NULL;
 	tree->tree_node_dtor = NULL;
 
 	return DS_OK;
 }
 
+DSError_t tree_use_arena(struct tree *tree) {
+	assert (tree);
+	assert (!tree->root);
+
+	if (tree->arena) {
+		return DS_OK;
+	}
+
+	tree->arena = calloc(1, sizeof(*tree->arena));
+	if (!tree->arena) {
+		return DS_ALLOCATION;
+	}
+
+	tree_arena_ctor(tree->arena);
+
+	return DS_OK;
+}
+
+struct tree_node *tree_node_ctor(struct tree *tree) {
+	assert (tree);
+
+	if (tree->arena) {
+		return tree_arena_node(tree->arena);
+	}
+
+	return tnode_ctor();
+}
+
+void tree_subtree_dtor(struct tree *tree, struct tree_node *node) {
+	assert (tree);
+
+	if (tree->arena) {
+		return;
+	}
+
+	tnode_recursive_dtor(node, NULL);
+}
+
+void tree_arena_ctor(struct tree_arena *arena) {
+	assert (arena);
+
+	arena->chunks = NULL;
+	arena->free_begin = NULL;
+	arena->free_end = NULL;
+}
+
+void tree_arena_dtor(struct tree_arena *arena) {
+	assert (arena);
+
+	struct tree_arena_chunk *chunk = arena->chunks;
+	while (chunk) {
+		struct tree_arena_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+
+	tree_arena_ctor(arena);
+}
+
+/*
+ * Starts a chunk of at least min_nodes nodes, the free nodes left in the
+ * previous one are not used anymore.
+ */
+static int tree_arena_grow(struct tree_arena *arena, size_t min_nodes) {
+	assert (arena);
+
+	size_t n_nodes = arena->chunks ? arena->chunks->n_nodes * 2 :
+					 TREE_ARENA_FIRST_CHUNK;
+	if (n_nodes > TREE_ARENA_MAX_CHUNK) {
+		n_nodes = TREE_ARENA_MAX_CHUNK;
+	}
+	if (n_nodes < min_nodes) {
+		n_nodes = min_nodes;
+	}
+
+	// calloc() keeps the nodes zeroed, they are never reused
+	struct tree_arena_chunk *chunk = calloc(1, sizeof(*chunk) +
+				n_nodes * sizeof(struct tree_node));
+	if (!chunk) {
+		return -1;
+	}
+
+	chunk->n_nodes = n_nodes;
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+
+	arena->free_begin = chunk->nodes;
+	arena->free_end = chunk->nodes + n_nodes;
+
+	return 0;
+}
+
+struct tree_node *tree_arena_node(struct tree_arena *arena) {
+	assert (arena);
+
+	if (arena->free_begin == arena->free_end && tree_arena_grow(arena, 1)) {
+		return NULL;
+	}
+
+	return arena->free_begin++;
+}
+
+void *tree_arena_alloc(struct tree_arena *arena, size_t size) {
+	assert (arena);
+
+	size_t n_nodes = (size + sizeof(struct tree_node) - 1) / sizeof(struct tree_node);
+
+	if ((size_t)(arena->free_end - arena->free_begin) < n_nodes &&
+		tree_arena_grow(arena, n_nodes)) {
+		return NULL;
+	}
+
+	void *memory = arena->free_begin;
+	arena->free_begin += n_nodes;
+
+	return memory;
+}
+
+/*
+ * Children arrays hold a power of two of at least
+ * TREE_SEQUENCE_MIN_CHILDREN slots, so the capacity follows from the
+ * number of children.
+ */
+static size_t tree_sequence_capacity(size_t n_children) {
+	if (!n_children) {
+		return 0;
+	}
+
+	size_t capacity = TREE_SEQUENCE_MIN_CHILDREN;
+	while (capacity < n_children) {
+		capacity *= 2;
+	}
+
+	return capacity;
+}
+
+static struct tree_node **tree_children_ctor(struct tree *tree, size_t capacity) {
+	assert (tree);
+
+	if (tree->arena) {
+		return tree_arena_alloc(tree->arena, capacity * sizeof(struct tree_node *));
+	}
+
+	return calloc(capacity, sizeof(struct tree_node *));
+}
+
+struct tree_node *tree_sequence_ctor(struct tree *tree, size_t n_children) {
+	assert (tree);
+
+	struct tree_node *node = tree_node_ctor(tree);
+	if (!node) {
+		return NULL;
+	}
+
+	node->value.flags = TREE_F_SEQUENCE;
+	node->children = NULL;
+	node->n_children = n_children;
+
+	if (n_children) {
+		node->children = tree_children_ctor(tree, tree_sequence_capacity(n_children));
+		if (!node->children) {
+			node->n_children = 0;
+			tree_subtree_dtor(tree, node);
+			return NULL;
+		}
+	}
+
+	return node;
+}
+
+DSError_t tree_sequence_push(struct tree *tree, struct tree_node *seq,
+			     struct tree_node *child) {
+	assert (tree);
+	assert (seq);
+	assert (TNODE_IS_SEQUENCE(seq));
+
+	size_t n_children = seq->n_children;
+
+	if (n_children == tree_sequence_capacity(n_children)) {
+		size_t new_capacity = tree_sequence_capacity(n_children + 1);
+		struct tree_node **children = NULL;
+
+		if (tree->arena) {
+			// The old array stays in the arena, at most as large as the new one
+			children = tree_arena_alloc(tree->arena, new_capacity * sizeof(*children));
+			if (children && n_children) {
+				memcpy(children, seq->children, n_children * sizeof(*children));
+			}
+		} else {
+			children = realloc(seq->children, new_capacity * sizeof(*children));
+		}
+
+		if (!children) {
+			return DS_ALLOCATION;
+		}
+
+		seq->children = children;
+	}
+
+	seq->children[seq->n_children++] = child;
+
+	return DS_OK;
+}
+
+void tree_arena_merge(struct tree_arena *dst, struct tree_arena *src) {
+	assert (dst);
+	assert (src);
+
+	if (!src->chunks) {
+		return;
+	}
+
+	// The free nodes of dst stay in its newest chunk
+	struct tree_arena_chunk *last = src->chunks;
+	while (last->next) {
+		last = last->next;
+	}
+
+	last->next = dst->chunks;
+	dst->chunks = src->chunks;
+
+	tree_arena_ctor(src);
+}
+
 struct tree_node *tnode_ctor(void) {
 	return (struct tree_node *)
 		calloc(1, sizeof(struct tree_node));
@@ -46,27 +373,60 @@ void tnode_dtor(struct tree_node *node, tree_node_value_dtor vdtor) {
 	if (vdtor != NULL) {
 		vdtor(node);
 	}
+	if (TNODE_IS_SEQUENCE(node)) {
+		free(node->children);
+	}
 	free(node);
 }
 
-void tnode_recursive_dtor(struct tree_node *node, tree_node_value_dtor vdtor) {
+static void tnode_visit_dtor(struct tree_node *node, void *ctx) {
+	tree_node_value_dtor vdtor = *(tree_node_value_dtor *)ctx;
 
-	if (!node) {
-		return;
-	}
-
-	if (node->left) {
-		tnode_recursive_dtor(node->left, vdtor);
+	if (!TNODE_IS_SEQUENCE(node)) {
 		node->left = NULL;
-	}
-	if (node->right) {
-		tnode_recursive_dtor(node->right, vdtor);
 		node->right = NULL;
 	}
-	
 	tnode_dtor(node, vdtor);
 }
 
+void tnode_recursive_dtor(struct tree_node *node, tree_node_value_dtor vdtor) {
+	tnode_rotate_walk(node, tnode_visit_dtor, &vdtor);
+}
+
+void tree_stack_ctor(struct tree_stack *stack, size_t frame_size) {
+	assert (stack);
+	assert (frame_size);
+
+	stack->frames = NULL;
+	stack->frame_size = frame_size;
+	stack->len = 0;
+	stack->cap = 0;
+}
+
+void tree_stack_dtor(struct tree_stack *stack) {
+	assert (stack);
+
+	free(stack->frames);
+	tree_stack_ctor(stack, stack->frame_size);
+}
+
+void *tree_stack_push(struct tree_stack *stack) {
+	assert (stack);
+
+	if (stack->len == stack->cap) {
+		size_t new_cap = stack->cap ? 2 * stack->cap : TREE_STACK_INITIAL_FRAMES;
+		char *new_frames = realloc(stack->frames, new_cap * stack->frame_size);
+		if (!new_frames) {
+			return NULL;
+		}
+
+		stack->frames = new_frames;
+		stack->cap = new_cap;
+	}
+
+	return stack->frames + stack->len++ * stack->frame_size;
+}
+
 DSError_t tree_store(struct tree *tree, const char *filename,
 		     value_serializer serializer, void *serializer_ctx) {
 	assert (tree);
@@ -83,48 +443,113 @@ DSError_t tree_store(struct tree *tree, const char *filename,
 	return result;
 }
 
-DSError_t tree_serialize_node(struct tree_node *node, FILE *file,
-			      value_serializer serializer, void *serializer_ctx) {
+enum tree_serialize_state {
+	TREE_SERIALIZE_OPEN,
+	TREE_SERIALIZE_RIGHT,
+	TREE_SERIALIZE_CLOSE,
+	TREE_SERIALIZE_CHILDREN,
+};
+
+struct tree_serialize_frame {
+	struct tree_node *node;
+	enum tree_serialize_state state;
+	// Next child of a sequence
+	size_t child;
+};
+
+static DSError_t tree_serialize_push(struct tree_stack *stack, struct tree_node *node,
+				     FILE *file) {
+	assert (stack);
 	assert (file);
 
-	DSError_t ret = DS_OK;
-
 	if (!node) {
-		if (fprintf(file, "nil") < 0) {
-			return DS_ALLOCATION;
-		}
-
-		return DS_OK;
+		return fprintf(file, "nil") < 0 ? DS_ALLOCATION : DS_OK;
 	}
 
-	if (fprintf(file, "(") < 0)
+	struct tree_serialize_frame *frame = tree_stack_push(stack);
+	if (!frame) {
 		return DS_ALLOCATION;
+	}
 
-	if ((ret = serializer(node->value, file, serializer_ctx)) != DS_OK)
-		return ret;
+	frame->node = node;
+	frame->state = TREE_SERIALIZE_OPEN;
+	frame->child = 0;
 
-	if (fprintf(file, " ") < 0)
-		return DS_ALLOCATION;
-
-	if ((ret = tree_serialize_node(node->left, file, serializer, serializer_ctx))
-								!= DS_OK) {
-		return ret;
-	}
+	return DS_OK;
+}
 
-	if (fputc(' ', file) == EOF) {
-		return DS_ALLOCATION;
-	}
+DSError_t tree_serialize_node(struct tree_node *node, FILE *file,
+			      value_serializer serializer, void *serializer_ctx) {
+	assert (file);
 
-	if ((ret = tree_serialize_node(node->right, file, serializer, serializer_ctx))
-								!= DS_OK) {
-		return ret;
+	struct tree_stack stack = {0};
+	tree_stack_ctor(&stack, sizeof(struct tree_serialize_frame));
+
+	DSError_t ret = tree_serialize_push(&stack, node, file);
+
+	while (!ret && stack.len) {
+		struct tree_serialize_frame *frame = tree_stack_top(&stack);
+		struct tree_node *cur = frame->node;
+		int is_sequence = TNODE_IS_SEQUENCE(cur);
+
+		switch (frame->state) {
+		case TREE_SERIALIZE_OPEN:
+			frame->state = is_sequence ? TREE_SERIALIZE_CHILDREN :
+						     TREE_SERIALIZE_RIGHT;
+
+			if (fputc(is_sequence ? '[' : '(', file) == EOF) {
+				ret = DS_ALLOCATION;
+			} else if ((ret = serializer(cur->value, file, serializer_ctx))) {
+				break;
+			} else if (fputc(' ', file) == EOF) {
+				ret = DS_ALLOCATION;
+			} else if (!is_sequence) {
+				ret = tree_serialize_push(&stack, cur->left, file);
+			}
+			break;
+		case TREE_SERIALIZE_RIGHT:
+			frame->state = TREE_SERIALIZE_CLOSE;
+
+			if (fputc(' ', file) == EOF) {
+				ret = DS_ALLOCATION;
+			} else {
+				ret = tree_serialize_push(&stack, cur->right, file);
+			}
+			break;
+		case TREE_SERIALIZE_CLOSE:
+			tree_stack_pop(&stack);
+
+			if (fputc(')', file) == EOF) {
+				ret = DS_ALLOCATION;
+			}
+			break;
+		case TREE_SERIALIZE_CHILDREN: {
+			if (frame->child == cur->n_children) {
+				tree_stack_pop(&stack);
+
+				if (fputc(']', file) == EOF) {
+					ret = DS_ALLOCATION;
+				}
+				break;
+			}
+
+			size_t child = frame->child++;
+			if (child && fputc(' ', file) == EOF) {
+				ret = DS_ALLOCATION;
+			} else {
+				ret = tree_serialize_push(&stack, cur->children[child], file);
+			}
+			break;
+		}
+		default:
+			assert (0 && "unreachable");
+			break;
+		}
 	}
 
-	if (fputc(')', file) == EOF) {
-		return DS_ALLOCATION;
-	}
+	tree_stack_dtor(&stack);
 
-	return DS_OK;
+	return ret;
 }
 
 DSError_t tree_load(struct tree *tree, const char *filename,
@@ -156,14 +581,10 @@ DSError_t tree_load(struct tree *tree, const char *filename,
 
 	buffer[read_size] = '\0';
 
-	DSError_t result = tree_ctor(tree);
-	if (result != DS_OK) {
-		free(buffer);
-		return result;
-	}
+	tree->root = NULL;
 
 	size_t pos = 0;
-	result = tree_deserialize_node(&tree->root, buffer, &pos,
+	DSError_t result = tree_deserialize_node(tree, &tree->root, buffer, &pos,
 					deserializer, deserializer_ctx);
 	if (result != DS_OK) {
 		free(buffer);
@@ -176,43 +597,54 @@ DSError_t tree_load(struct tree *tree, const char *filename,
 	return DS_OK;
 }
 
-DSError_t tree_deserialize_node(struct tree_node **node, char *buffer, size_t *pos,
-				value_deserializer deserializer, void *deserializer_ctx) {
-	assert (node);
-	assert (buffer);
-	assert (pos);
-	assert (deserializer);
+struct tree_deserialize_frame {
+	// Slot the next node goes to, NULL if the ')' of a node is next
+	struct tree_node **slot;
+	// Sequence whose children are read up to ']', slot is NULL then
+	struct tree_node *seq;
+};
 
+static void tree_skip_spaces(const char *buffer, size_t *pos) {
 	while (isspace(buffer[*pos])) {
 		(*pos)++;
 	}
+}
+
+/*
+ * Reads "nil", "(value" or "[value" into *slot, the children and the
+ * closing bracket are left to the caller.
+ */
+static DSError_t tree_deserialize_value(struct tree *tree, struct tree_node **slot,
+					char *buffer, size_t *pos, int *is_nil,
+					value_deserializer deserializer,
+					void *deserializer_ctx) {
+	tree_skip_spaces(buffer, pos);
 
 	if (strncmp(buffer + *pos, "nil", 3) == 0) {
-		*node = NULL;
+		*slot = NULL;
 		*pos += 3;
+		*is_nil = 1;
 		return DS_OK;
 	}
+	*is_nil = 0;
 
-	if (buffer[*pos] != '(') {
+	if (buffer[*pos] != '(' && buffer[*pos] != '[') {
 		eprintf("a\n");
 		return DS_INVALID_ARG;
 	}
 
-	(*pos)++;
+	int is_sequence = buffer[*pos] == '[';
 
-	while (isspace(buffer[*pos])) {
-		(*pos)++;
-	}
-
-	int look_for_quotes = 0;
-	if (buffer[*pos] == '"') {
-		look_for_quotes = 1;
-	}
+	(*pos)++;
+	tree_skip_spaces(buffer, pos);
 
 	char *value_start = buffer + *pos;
 	char *value_end = NULL;
-	if (look_for_quotes) {
-		value_end = strchr(value_start + 1, '"') + 1;
+	if (*value_start == '"') {
+		value_end = strchr(value_start + 1, '"');
+		if (value_end) {
+			value_end++;
+		}
 	} else {
 		value_end = value_start;
 		while (!isspace(*value_end) && *value_end != '\0') {
@@ -227,52 +659,133 @@ DSError_t tree_deserialize_node(struct tree_node **node, char *buffer, size_t *p
 	*value_end = '\0';
 	*pos = (size_t)(value_end - buffer + 1);
 
-	*node = tnode_ctor();
-	if (!*node) {
+	struct tree_node *node = is_sequence ? tree_sequence_ctor(tree, 0) :
+					       tree_node_ctor(tree);
+	if (!node) {
 		*value_end = shadow_sym;
 		eprintf("c\n");
 		return DS_INVALID_ARG;
 	}
 
-	DSError_t ret = DS_OK;
-	if ((ret = deserializer(&((*node)->value), value_start, deserializer_ctx)) != DS_OK) {
+	DSError_t ret = deserializer(&node->value, value_start, deserializer_ctx);
+	if (ret != DS_OK) {
 		eprintf("%s\n", value_start);
 		*value_end = shadow_sym;
-		tnode_recursive_dtor(*node, NULL);
-		*node = NULL;
+		tree_subtree_dtor(tree, node);
 		return ret;
 	}
 
-	if ((ret = tree_deserialize_node(&(*node)->left, buffer, pos,
-				  deserializer, deserializer_ctx)) != DS_OK) {
-		*value_end = shadow_sym;
-		tnode_recursive_dtor(*node, NULL);
-		*node = NULL;
-		return ret;
+	if (is_sequence) {
+		node->value.flags |= TREE_F_SEQUENCE;
 	}
 
-	if ((ret = tree_deserialize_node(&(*node)->right, buffer, pos,
-				  deserializer, deserializer_ctx)) != DS_OK) {
-		*value_end = shadow_sym;
-		tnode_recursive_dtor(*node, NULL);
-		*node = NULL;
-		return ret;
+	*slot = node;
+
+	return DS_OK;
+}
+
+static DSError_t tree_deserialize_push(struct tree_stack *stack, struct tree_node **slot,
+				       struct tree_node *seq) {
+	assert (stack);
+
+	struct tree_deserialize_frame *frame = tree_stack_push(stack);
+	if (!frame) {
+		return DS_ALLOCATION;
 	}
 
-	while (isspace(buffer[*pos])) {
-		(*pos)++;
+	frame->slot = slot;
+	frame->seq = seq;
+
+	return DS_OK;
+}
+
+DSError_t tree_deserialize_node(struct tree *tree, struct tree_node **node,
+				char *buffer, size_t *pos,
+				value_deserializer deserializer, void *deserializer_ctx) {
+	assert (tree);
+	assert (node);
+	assert (buffer);
+	assert (pos);
+	assert (deserializer);
+
+	*node = NULL;
+
+	struct tree_stack stack = {0};
+	tree_stack_ctor(&stack, sizeof(struct tree_deserialize_frame));
+
+	DSError_t ret = tree_deserialize_push(&stack, node, NULL);
+
+	struct tree_deserialize_frame *frame = NULL;
+	while (!ret && (frame = tree_stack_top(&stack))) {
+		struct tree_node **slot = frame->slot;
+		struct tree_node *seq = frame->seq;
+		struct tree_node *child = NULL;
+
+		if (seq) {
+			tree_skip_spaces(buffer, pos);
+
+			if (buffer[*pos] == ']') {
+				tree_stack_pop(&stack);
+				(*pos)++;
+				continue;
+			}
+
+			// Read aside, the children array moves as it grows
+			slot = &child;
+		} else {
+			tree_stack_pop(&stack);
+		}
+
+		if (!slot) {
+			tree_skip_spaces(buffer, pos);
+
+			if (buffer[*pos] != ')') {
+				ret = DS_INVALID_ARG;
+				break;
+			}
+
+			(*pos)++;
+			continue;
+		}
+
+		int is_nil = 0;
+		if ((ret = tree_deserialize_value(tree, slot, buffer, pos, &is_nil,
+						  deserializer, deserializer_ctx))) {
+			break;
+		}
+
+		if (seq && (ret = tree_sequence_push(tree, seq, child))) {
+			tree_subtree_dtor(tree, child);
+			break;
+		}
+
+		if (is_nil) {
+			continue;
+		}
+
+		struct tree_node *read = *slot;
+		if (TNODE_IS_SEQUENCE(read)) {
+			ret = tree_deserialize_push(&stack, NULL, read);
+			continue;
+		}
+
+		// Popped in reverse: left, right, then ')'
+		if ((ret = tree_deserialize_push(&stack, NULL, NULL)) ||
+			(ret = tree_deserialize_push(&stack, &read->right, NULL)) ||
+			(ret = tree_deserialize_push(&stack, &read->left, NULL))) {
+			break;
+		}
 	}
 
-	if (buffer[*pos] != ')') {
-		*value_end = shadow_sym;
-		tnode_recursive_dtor(*node, NULL);
+	tree_stack_dtor(&stack);
+
+	// Every node read so far hangs off *node
+	if (ret) {
+		tree_subtree_dtor(tree, *node);
 		*node = NULL;
-		return ret;
 	}
 
-	(*pos)++;
-
-	return DS_OK;
+	return ret;
 }
 
 static DSError_t dump_draw_dot(struct tree *tree, const char *drawing_filename,
@@ -426,6 +939,32 @@ static DSError_t tree_dump_node(struct tree_node *node, size_t *node_idx,
 		DOT_PRINTF("snum: %ld, ptr: %p", node->value.snum, node->value.ptr);
 	}
 
+	if (TNODE_IS_SEQUENCE(node)) {
+		DOT_PRINTF("</TD></TR>"
+			"<TR><TD>flags=0x%x</TD></TR>"
+			"<TR><TD BGCOLOR=\"#%06x\"><FONT  COLOR=\"#%06x\">self=%p</FONT></TD></TR>"
+			"<TR><TD>children=%zu</TD></TR>"
+			"</TABLE>>, fillcolor=\"%s\", shape=Mrecord];\n",
+			(unsigned int)(node->value.flags),
+			tree_pointer_hash(node), inverse_color(tree_pointer_hash(node)), node,
+			node->n_children, box_color
+		);
+
+		(*node_idx)++;
+
+		for (size_t i = 0; i < node->n_children; i++) {
+			if (!node->children[i]) {
+				continue;
+			}
+
+			DOT_PRINTF("node%zu -> node%zu [color=green];", cnode_idx, *node_idx);
+
+			_CT_CHECKED(tree_dump_node(node->children[i], node_idx, dot_file, serializer));
+		}
+
+		goto _CT_EXIT_POINT;
+	}
+
 	DOT_PRINTF("</TD></TR>"
 		"<TR><TD>flags=0x%x</TD></TR>"
 		"<TR><TD BGCOLOR=\"#%06x\"><FONT  COLOR=\"#%06x\">self=%p</FONT></TD></TR>"
@@ -485,3 +1024,291 @@ DSError_t tree_graph_dump_dot(struct tree *tree, FILE *dot_file, value_serialize
     
 	return DS_OK;
 }
+
+void flat_tree_ctor(struct flat_tree *flat) {
+	assert (flat);
+
+	*flat = (struct flat_tree) {.root = FLAT_TREE_NONE};
+}
+
+void flat_tree_dtor(struct flat_tree *flat) {
+	assert (flat);
+
+	free(flat->flags);
+	free(flat->name_ids);
+	free(flat->payloads);
+	free(flat->left);
+	free(flat->right);
+	free(flat->seq_children);
+
+	flat_tree_ctor(flat);
+}
+
+static DSError_t flat_tree_alloc(struct flat_tree *flat, size_t n_nodes, size_t n_seq_children) {
+	assert (flat);
+
+	if (n_nodes >= FLAT_TREE_NONE || n_seq_children >= FLAT_TREE_NONE) {
+		return DS_INVALID_SIZE;
+	}
+
+	// At least one element, malloc(0) may return NULL
+	flat->flags = malloc((n_nodes + 1) * sizeof(*flat->flags));
+	flat->name_ids = malloc((n_nodes + 1) * sizeof(*flat->name_ids));
+	flat->payloads = malloc((n_nodes + 1) * sizeof(*flat->payloads));
+	flat->left = malloc((n_nodes + 1) * sizeof(*flat->left));
+	flat->right = malloc((n_nodes + 1) * sizeof(*flat->right));
+	flat->seq_children = malloc((n_seq_children + 1) * sizeof(*flat->seq_children));
+
+	if (!flat->flags || !flat->name_ids || !flat->payloads ||
+		!flat->left || !flat->right || !flat->seq_children) {
+		flat_tree_dtor(flat);
+		return DS_ALLOCATION;
+	}
+
+	flat->n_nodes = (uint32_t)n_nodes;
+	flat->n_seq_children = (uint32_t)n_seq_children;
+
+	return DS_OK;
+}
+
+static inline const struct tree_node *tnode_child(const struct tree_node *node, size_t idx) {
+	if (TNODE_IS_SEQUENCE(node)) {
+		return node->children[idx];
+	}
+
+	return idx ? node->right : node->left;
+}
+
+static DSError_t flat_tree_count(const struct tree_node *root, size_t *n_nodes,
+				 size_t *n_seq_children) {
+	assert (n_nodes);
+	assert (n_seq_children);
+
+	*n_nodes = 0;
+	*n_seq_children = 0;
+	if (!root) {
+		return DS_OK;
+	}
+
+	struct tree_stack stack = {0};
+	tree_stack_ctor(&stack, sizeof(const struct tree_node *));
+
+	const struct tree_node **top = tree_stack_push(&stack);
+	if (!top) {
+		return DS_ALLOCATION;
+	}
+	*top = root;
+
+	DSError_t ret = DS_OK;
+	while (!ret && (top = tree_stack_pop(&stack))) {
+		const struct tree_node *cur = *top;
+		size_t n_children = TNODE_IS_SEQUENCE(cur) ? cur->n_children : 2;
+
+		(*n_nodes)++;
+		if (TNODE_IS_SEQUENCE(cur)) {
+			*n_seq_children += cur->n_children;
+		}
+
+		for (size_t i = 0; i < n_children; i++) {
+			const struct tree_node *child = tnode_child(cur, i);
+			if (!child) {
+				continue;
+			}
+
+			if (!(top = tree_stack_push(&stack))) {
+				ret = DS_ALLOCATION;
+				break;
+			}
+			*top = child;
+		}
+	}
+
+	tree_stack_dtor(&stack);
+
+	return ret;
+}
+
+struct flat_tree_layout_frame {
+	const struct tree_node *node;
+	// Index to set to the index of the node
+	uint32_t *slot;
+};
+
+/*
+ * Preorder over an explicit stack, nodes are numbered as they are
+ * visited.
+ */
+DSError_t flat_tree_from_tree(struct flat_tree *flat, const struct tree_node *root,
+			      const struct flat_tree_codec *codec) {
+	assert (flat);
+	assert (!flat->n_nodes);
+
+	if (codec) {
+		flat->codec = *codec;
+	}
+
+	size_t n_nodes = 0;
+	size_t n_seq_children = 0;
+	DSError_t ret = flat_tree_count(root, &n_nodes, &n_seq_children);
+	if (ret || (ret = flat_tree_alloc(flat, n_nodes, n_seq_children)) || !root) {
+		return ret;
+	}
+
+	struct tree_stack stack = {0};
+	tree_stack_ctor(&stack, sizeof(struct flat_tree_layout_frame));
+
+	struct flat_tree_layout_frame *frame = tree_stack_push(&stack);
+	if (!frame) {
+		flat_tree_dtor(flat);
+		return DS_ALLOCATION;
+	}
+	*frame = (struct flat_tree_layout_frame) {.node = root, .slot = &flat->root};
+
+	uint32_t next_node = 0;
+	uint32_t next_seq_child = 0;
+
+	while (!ret && (frame = tree_stack_pop(&stack))) {
+		struct flat_tree_layout_frame cur = *frame;
+		uint32_t idx = next_node++;
+
+		*cur.slot = idx;
+		flat->flags[idx] = cur.node->value.flags;
+		flat->name_ids[idx] = cur.node->value.name_id;
+		flat->payloads[idx] = flat->codec.pack ?
+			flat->codec.pack(&cur.node->value, flat->codec.ctx) : cur.node->value.snum;
+
+		uint32_t *slots = NULL;
+		size_t n_children = 2;
+
+		if (TNODE_IS_SEQUENCE(cur.node)) {
+			n_children = cur.node->n_children;
+			flat->left[idx] = next_seq_child;
+			flat->right[idx] = (uint32_t)n_children;
+
+			slots = flat->seq_children + next_seq_child;
+			next_seq_child += (uint32_t)n_children;
+		} else {
+			flat->left[idx] = FLAT_TREE_NONE;
+			flat->right[idx] = FLAT_TREE_NONE;
+		}
+
+		// The first child is numbered first
+		for (size_t i = n_children; i-- > 0;) {
+			uint32_t *slot = slots ? &slots[i] : i ? &flat->right[idx] : &flat->left[idx];
+			const struct tree_node *child = tnode_child(cur.node, i);
+
+			*slot = FLAT_TREE_NONE;
+			if (!child) {
+				continue;
+			}
+
+			if (!(frame = tree_stack_push(&stack))) {
+				ret = DS_ALLOCATION;
+				break;
+			}
+			*frame = (struct flat_tree_layout_frame) {.node = child, .slot = slot};
+		}
+	}
+
+	tree_stack_dtor(&stack);
+
+	if (ret) {
+		flat_tree_dtor(flat);
+	}
+
+	return ret;
+}
+
+struct flat_tree_load_frame {
+	uint32_t idx;
+	struct tree_node **slot;
+};
+
+DSError_t flat_tree_to_tree(const struct flat_tree *flat, struct tree *tree,
+			    struct tree_node **root) {
+	assert (flat);
+	assert (tree);
+	assert (root);
+
+	*root = NULL;
+	if (flat->root == FLAT_TREE_NONE) {
+		return DS_OK;
+	}
+
+	struct tree_stack stack = {0};
+	tree_stack_ctor(&stack, sizeof(struct flat_tree_load_frame));
+
+	struct flat_tree_load_frame *frame = tree_stack_push(&stack);
+	if (!frame) {
+		return DS_ALLOCATION;
+	}
+	*frame = (struct flat_tree_load_frame) {.idx = flat->root, .slot = root};
+
+	DSError_t ret = DS_OK;
+	while (!ret && (frame = tree_stack_pop(&stack))) {
+		struct flat_tree_load_frame cur = *frame;
+		struct flat_cursor cursor = flat_cursor_at(flat_tree_root(flat), cur.idx);
+		int is_sequence = flat_cursor_is_sequence(cursor);
+		size_t n_children = is_sequence ? flat_cursor_n_children(cursor) : 2;
+
+		struct tree_node *node = is_sequence ? tree_sequence_ctor(tree, n_children) :
+						       tree_node_ctor(tree);
+		if (!node) {
+			ret = DS_ALLOCATION;
+			break;
+		}
+		node->value = flat_cursor_value(cursor);
+		*cur.slot = node;
+
+		for (size_t i = n_children; i-- > 0;) {
+			struct flat_cursor child = is_sequence ?
+				flat_cursor_child(cursor, (uint32_t)i) :
+				i ? flat_cursor_right(cursor) : flat_cursor_left(cursor);
+			if (flat_cursor_is_nil(child)) {
+				continue;
+			}
+
+			if (!(frame = tree_stack_push(&stack))) {
+				ret = DS_ALLOCATION;
+				break;
+			}
+			*frame = (struct flat_tree_load_frame) {
+				.idx = child.idx,
+				.slot = is_sequence ? &node->children[i] : i ? &node->right : &node->left,
+			};
+		}
+	}
+
+	tree_stack_dtor(&stack);
+
+	if (ret && *root) {
+		tree_subtree_dtor(tree, *root);
+		*root = NULL;
+	}
+
+	return ret;
+}
+
+DSError_t flat_tree_copy(struct flat_tree *dst, const struct flat_tree *src) {
+	assert (dst);
+	assert (src);
+	assert (!dst->n_nodes);
+
+	DSError_t ret = flat_tree_alloc(dst, src->n_nodes, src->n_seq_children);
+	if (ret) {
+		return ret;
+	}
+
+	size_t n_nodes = src->n_nodes;
+	memcpy(dst->flags, src->flags, n_nodes * sizeof(*src->flags));
+	memcpy(dst->name_ids, src->name_ids, n_nodes * sizeof(*src->name_ids));
+	memcpy(dst->payloads, src->payloads, n_nodes * sizeof(*src->payloads));
+	memcpy(dst->left, src->left, n_nodes * sizeof(*src->left));
+	memcpy(dst->right, src->right, n_nodes * sizeof(*src->right));
+	memcpy(dst->seq_children, src->seq_children,
+	       src->n_seq_children * sizeof(*src->seq_children));
+	dst->root = src->root;
+	dst->codec = src->codec;
+
+	return DS_OK;
+}
@@ -0,0 +1,124 @@
+/*
+ * Generates src/lang_names_table.h: lays out the names of
+ * expression_operators[] and LANG_KEYWORDS_LIST and searches for an FNV
+ * seed under which every name lands in its own slot.
+ *
+ * Usage: gen_lang_names > src/lang_names_table.h
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "lang_names.h"
+
+#define GEN_MAX_NAMES (LANG_NAMES_N_SLOTS)
+
+static struct lang_name gen_names[GEN_MAX_NAMES];
+static size_t gen_n_names = 0;
+
+static int gen_add_name(const char *name, uint8_t flags, uint8_t op_idx) {
+	for (size_t i = 0; i < gen_n_names; i++) {
+		if (!strcmp(gen_names[i].name, name)) {
+			gen_names[i].flags |= flags;
+			return gen_names[i].op_idx == op_idx ? 0 : 1;
+		}
+	}
+
+	if (gen_n_names == GEN_MAX_NAMES) {
+		return 1;
+	}
+
+	gen_names[gen_n_names++] = (struct lang_name) {
+		.name = name,
+		.len = (uint8_t)strlen(name),
+		.flags = flags,
+		.op_idx = op_idx,
+	};
+
+	return 0;
+}
+
+static int gen_collect_names(void) {
+	for (size_t i = 0; i < LANG_NAMES_N_OPERATORS; i++) {
+		if (gen_add_name(expression_operators[i]->name, LANG_NAME_F_OPERATOR,
+				 (uint8_t)i)) {
+			return 1;
+		}
+	}
+
+#define GEN_KEYWORD_OP(op_idx_)						\
+	if (gen_add_name(expression_operators[op_idx_]->name,		\
+			 LANG_NAME_F_KEYWORD, op_idx_)) {			\
+		return 1;						\
+	}
+#define GEN_KEYWORD(name_, op_idx_)					\
+	if (gen_add_name(name_, LANG_NAME_F_KEYWORD, op_idx_)) {	\
+		return 1;						\
+	}
+
+	LANG_KEYWORDS_LIST(GEN_KEYWORD_OP, GEN_KEYWORD)
+
+#undef GEN_KEYWORD
+#undef GEN_KEYWORD_OP
+
+	return 0;
+}
+
+static void gen_print_table(uint32_t seed, const int *slots) {
+	printf("/* Generated by tools/gen_lang_names.c, do not edit. */\n\n");
+	printf("#define LANG_NAMES_HASH_SEED (0x%08xu)\n", seed);
+	printf("#define LANG_NAMES_TABLE_N_OPERATORS (%zu)\n\n", LANG_NAMES_N_OPERATORS);
+
+	printf("static const struct lang_name lang_names[] = {\n");
+	for (size_t i = 0; i < gen_n_names; i++) {
+		printf("\t{.name = \"%s\", .len = %u, .flags = 0x%x, .op_idx = %u},\n",
+		       gen_names[i].name, gen_names[i].len, gen_names[i].flags,
+		       gen_names[i].op_idx);
+	}
+	printf("};\n\n");
+
+	printf("static const int8_t lang_names_slots[LANG_NAMES_N_SLOTS] = {");
+	for (size_t i = 0; i < LANG_NAMES_N_SLOTS; i++) {
+		printf("%s%d,", i % 16 ? " " : "\n\t", slots[i]);
+	}
+	printf("\n};\n");
+}
+
+int main(void) {
+	if (gen_collect_names()) {
+		fprintf(stderr, "Conflicting or too many language names\n");
+		return 1;
+	}
+
+	int slots[LANG_NAMES_N_SLOTS] = {0};
+
+	for (uint32_t seed = 2166136261u; seed != 0; seed++) {
+		for (size_t i = 0; i < LANG_NAMES_N_SLOTS; i++) {
+			slots[i] = -1;
+		}
+
+		size_t name_idx = 0;
+		for (; name_idx < gen_n_names; name_idx++) {
+			uint32_t slot = lang_name_hash(gen_names[name_idx].name,
+						       gen_names[name_idx].len, seed)
+						& (LANG_NAMES_N_SLOTS - 1);
+
+			if (slots[slot] != -1) {
+				break;
+			}
+
+			slots[slot] = (int)name_idx;
+		}
+
+		if (name_idx != gen_n_names) {
+			continue;
+		}
+
+		gen_print_table(seed, slots);
+
+		return 0;
+	}
+
+	fprintf(stderr, "No perfect seed found, increase LANG_NAMES_N_SLOTS\n");
+
+	return 1;
+}